@@ -11,6 +11,7 @@
 #include <gromox/util.hpp>
 #include "attachment_object.hpp"
 #include "common_util.hpp"
+#include "exmdb_client.hpp"
 #include "folder_object.hpp"
 #include "message_object.hpp"
 #include "rop_processor.hpp"
@@ -18,6 +19,36 @@
 
 using namespace gromox;
 
+/* Attachment data at least this large is read in ranges (see b_ranged) */
+static constexpr uint32_t STREAM_RANGED_MIN = 256 << 10;
+
+/**
+ * Whether the read-only stream on @proptag of @at can read from the
+ * instance as needed instead of copying everything at open. Sets the
+ * length on success.
+ */
+static bool stream_try_ranged(stream_object &so, const attachment_object &at,
+    uint32_t proptag)
+{
+	if (so.open_flags != MAPI_READONLY ||
+	    (proptag != PR_ATTACH_DATA_BIN && proptag != PR_ATTACH_DATA_OBJ))
+		return false;
+	/* Someone else's unsaved writes are only visible through get_properties */
+	for (auto other : at.stream_list)
+		if (other->get_proptag() == proptag)
+			return false;
+	BINARY bin{};
+	uint64_t total = 0;
+	if (!exmdb_client::read_attachment_instance_range(at.pparent->plogon->get_dir(),
+	    at.get_instance_id(), proptag, 0, 0, &bin, &total) ||
+	    total == UINT64_MAX || total < STREAM_RANGED_MIN ||
+	    total >= g_max_mail_len)
+		return false;
+	so.content_bin.cb = total;
+	so.b_ranged = true;
+	return true;
+}
+
 std::unique_ptr<stream_object> stream_object::create(void *pparent,
     ems_objtype object_type, uint32_t open_flags, uint32_t proptag, uint32_t max_length)
 {
@@ -46,6 +77,8 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 		break;
 	}
 	case ems_objtype::attach: {
+		if (stream_try_ranged(*pstream, *static_cast<attachment_object *>(pparent), proptag))
+			return pstream;
 		const proptag_t proptag_buff[] = {proptag, PR_ATTACH_SIZE};
 		const PROPTAG_ARRAY proptags = {std::size(proptag_buff), deconst(proptag_buff)};
 		if (!static_cast<attachment_object *>(pparent)->get_properties(0, &proptags, &propvals))
@@ -122,13 +155,42 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 	}
 }
 
+/**
+ * Fill @buf with [@offset, @offset+@len) of a ranged stream. The server may
+ * hand out less than asked for per call.
+ */
+bool stream_object::read_range(uint32_t offset, uint32_t len, void *buf)
+{
+	auto at = static_cast<attachment_object *>(pparent);
+	auto dst = static_cast<uint8_t *>(buf);
+	while (len > 0) {
+		BINARY bin{};
+		uint64_t total = 0;
+		if (!exmdb_client::read_attachment_instance_range(at->pparent->plogon->get_dir(),
+		    at->get_instance_id(), proptag, offset, len, &bin, &total) ||
+		    bin.cb == 0)
+			return false;
+		auto z = std::min(bin.cb, len);
+		memcpy(dst, bin.pv, z);
+		dst += z;
+		offset += z;
+		len -= z;
+	}
+	return true;
+}
+
 uint32_t stream_object::read(void *pbuff, uint32_t buf_len)
 {
 	auto pstream = this;
 	if (pstream->content_bin.cb <= pstream->seek_ptr)
 		return 0;
 	auto length = std::min(buf_len, pstream->content_bin.cb - pstream->seek_ptr);
-	memcpy(pbuff, pstream->content_bin.pb + pstream->seek_ptr, length);
+	if (pstream->b_ranged) {
+		if (!read_range(pstream->seek_ptr, length, pbuff))
+			return 0;
+	} else {
+		memcpy(pbuff, pstream->content_bin.pb + pstream->seek_ptr, length);
+	}
 	pstream->seek_ptr += length;
 	return length;
 }
@@ -170,6 +232,9 @@ const void *stream_object::get_content() const
 	void *pcontent;
 	uint32_t length;
 	
+	if (pstream->b_ranged)
+		/* only ever read through read()/copy() */
+		return nullptr;
 	switch (PROP_TYPE(pstream->proptag)) {
 	case PT_BINARY:
 		return &pstream->content_bin;
@@ -255,10 +320,16 @@ BOOL stream_object::copy(stream_object *pstream_src, uint32_t *plength)
 	if (pstream_dst->seek_ptr + *plength > pstream_dst->content_bin.cb &&
 	    !pstream_dst->set_length(pstream_dst->seek_ptr + *plength))
 		return FALSE;
-	memcpy(pstream_dst->content_bin.pb +
-		pstream_dst->seek_ptr,
-		pstream_src->content_bin.pb +
-		pstream_src->seek_ptr, *plength);
+	if (pstream_src->b_ranged) {
+		if (!pstream_src->read_range(pstream_src->seek_ptr, *plength,
+		    pstream_dst->content_bin.pb + pstream_dst->seek_ptr))
+			return FALSE;
+	} else {
+		memcpy(pstream_dst->content_bin.pb +
+			pstream_dst->seek_ptr,
+			pstream_src->content_bin.pb +
+			pstream_src->seek_ptr, *plength);
+	}
 	pstream_dst->seek_ptr += *plength;
 	pstream_src->seek_ptr += *plength;
 	return TRUE;
@@ -14,7 +14,7 @@ struct stream_object {
 	public:
 	~stream_object();
 	static std::unique_ptr<stream_object> create(void *parent, ems_objtype, uint32_t open_flags, uint32_t proptag, uint32_t max_length);
-	BOOL check() const { return content_bin.pb != nullptr ? TRUE : false; }
+	BOOL check() const { return content_bin.pb != nullptr || b_ranged ? TRUE : false; }
 	uint32_t get_max_length() const { return max_length; }
 	uint32_t read(void *buf, uint32_t len);
 	std::pair<uint16_t, ec_error_t> write(void *buf, uint16_t len);
@@ -28,6 +28,7 @@ struct stream_object {
 	uint32_t get_seek_position() const { return seek_ptr; }
 	BOOL copy(stream_object *src, uint32_t *len);
 	BOOL commit();
+	bool read_range(uint32_t offset, uint32_t len, void *buf);
 
 	void *pparent = nullptr;
 	ems_objtype object_type = ems_objtype::none;
@@ -35,5 +36,10 @@ struct stream_object {
 	uint32_t proptag = 0, seek_ptr = 0;
 	BINARY content_bin{};
 	BOOL b_touched = false;
+	/*
+	 * Read-only attachment data is not copied in at open; reads fetch
+	 * ranges from the instance instead, and content_bin.cb holds the size.
+	 */
+	bool b_ranged = false;
 	uint32_t max_length = 0;
 };
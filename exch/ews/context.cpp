@@ -1749,10 +1749,27 @@ EWSContext::MCONT_PTR EWSContext::toContent(const std::string& dir, const sFolde
 	BINARY *ckey = nullptr, *pclbin = nullptr;
 
 	if(persist) {
-		if(!exmdb.allocate_message_id(dir.c_str(), parent.folderId, &messageId))
-			throw DispatchError(E3118);
-		if(!exmdb.allocate_cn(dir.c_str(), &changeNumber))
-			throw DispatchError(E3119);
+		if(exmdb.batch_rpc != nullptr) {
+			gromox::exmdb_batch batch(dir.c_str());
+			auto qmid = std::make_unique<exreq_allocate_message_id>();
+			qmid->call_id = exmdb_callid::allocate_message_id;
+			qmid->folder_id = parent.folderId;
+			auto imid = batch.add<exresp_allocate_message_id>(std::move(qmid));
+			auto qcn = std::make_unique<exreq_allocate_cn>();
+			qcn->call_id = exmdb_callid::allocate_cn;
+			auto icn = batch.add<exresp_allocate_cn>(std::move(qcn));
+			if(!batch.flush(exmdb.batch_rpc) || !batch.ok(imid))
+				throw DispatchError(E3118);
+			if(!batch.ok(icn))
+				throw DispatchError(E3119);
+			messageId = batch.get<exresp_allocate_message_id>(imid)->message_id;
+			changeNumber = batch.get<exresp_allocate_cn>(icn)->cn;
+		} else {
+			if(!exmdb.allocate_message_id(dir.c_str(), parent.folderId, &messageId))
+				throw DispatchError(E3118);
+			if(!exmdb.allocate_cn(dir.c_str(), &changeNumber))
+				throw DispatchError(E3119);
+		}
 
 		bool isPublic = parent.location == parent.PUBLIC;
 		uint32_t accountId = getAccountId(*parent.target, isPublic);
@@ -437,6 +437,8 @@ EWSPlugin::_exmdb::_exmdb()
 	query_service2("exmdb_client_register_proc", register_proc);
 	 if(register_proc == nullptr)
 		throw std::runtime_error("[ews]: failed to get the \"exmdb_client_register_proc\" service\n");
+	/* Optional; without it, callers make the calls one by one */
+	query_service2("exmdb_client_batch", batch_rpc);
 }
 
 static constexpr cfg_directive x500_defaults[] = {
@@ -10,6 +10,7 @@
 #include <variant>
 #include <vector>
 #include <gromox/element_data.hpp>
+#include <gromox/exmdb_client.hpp>
 #include <gromox/ext_buffer.hpp>
 #include <gromox/hpm_common.h>
 #include <gromox/http.hpp>
@@ -106,6 +107,7 @@ public:
 	#undef IDLOUT
 		bool get_message_property(const char*, const char*, cpid_t, uint64_t, uint32_t, void **ppval) const;
 		void (*register_proc)(void*);
+		gromox::exmdb_batch::exec_t batch_rpc = nullptr; ///< executor for gromox::exmdb_batch::flush (may be absent)
 	} exmdb;
 
 	struct ExmdbInstance {
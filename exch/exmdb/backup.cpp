@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Online backup of a mailbox as a ustar stream.
+ *
+ * A backup session opens its own read-only connection to exchange.sqlite3 and
+ * keeps one read transaction open for its whole lifetime. In WAL mode that
+ * pins a snapshot: writers carry on unhindered, and sqlite3_backup_step,
+ * which reuses the open transaction, never sees a change and thus never
+ * restarts. The list of referenced cid/ files is taken from the same
+ * snapshot. Nothing here takes db_base::giant_lock.
+ *
+ * Each backup_read RPC advances the session by a bounded amount of work: a
+ * few hundred pages into a temporary copy next to the database, then the tar
+ * member for that copy, then one member per content file, then the trailer.
+ * With a rate given, a call does about a quarter second's worth of it; the
+ * pacing itself is left to the client, so no RPC worker is held up.
+ *
+ * Sessions that the client abandons are reaped by the expiry thread; their
+ * temporary copies, and any left over by a previous process, are also
+ * removed when the mailbox is loaded.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/stat.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/fileio.h>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+using bk_clock = std::chrono::steady_clock;
+
+namespace {
+
+enum class bk_phase { pages, member, cids, trailer, done };
+
+struct bk_session {
+	~bk_session();
+	bool open(uint64_t id);
+	bool fill(std::string &out, size_t budget, size_t &work);
+
+	std::string dir, tmp_path;
+	db_handle src, dst;
+	sqlite3_backup *bk = nullptr;
+	size_t pgsize = 4096;
+	std::vector<std::string> cids;
+	size_t cid_pos = 0;
+	unsigned int cid_type = 0;
+	bool cid_found = false;
+	bk_phase phase = bk_phase::pages;
+	wrapfd fd;
+	uint64_t remain = 0;
+	bk_clock::time_point last_use; /* protected by g_bk_lock */
+	std::mutex lock;
+};
+
+}
+
+/* Sessions that were not continued for this long are dropped */
+static constexpr auto bk_idle_limit = std::chrono::minutes(10);
+static constexpr size_t bk_chunk_min = 64 << 10, bk_chunk_max = 1 << 20;
+static std::mutex g_bk_lock;
+static std::unordered_map<uint64_t, std::shared_ptr<bk_session>> g_bk_sessions;
+static uint64_t g_bk_serial;
+
+bk_session::~bk_session()
+{
+	if (bk != nullptr)
+		sqlite3_backup_finish(bk);
+	dst.reset();
+	if (!tmp_path.empty())
+		unlink(tmp_path.c_str());
+}
+
+static void bk_octal(char *field, size_t fsize, uint64_t v)
+{
+	snprintf(field, fsize, "%0*llo", static_cast<int>(fsize - 1),
+	         static_cast<unsigned long long>(v));
+}
+
+/**
+ * Append a ustar header for a regular file. Sizes that do not fit the 11
+ * octal digits (8 GiB and up) use the GNU/POSIX base-256 form.
+ */
+static bool bk_tar_header(std::string &out, const std::string &name,
+    uint64_t size, time_t mtime)
+{
+	char h[512]{};
+	if (name.size() <= 100) {
+		memcpy(&h[0], name.data(), name.size());
+	} else {
+		auto p = name.rfind('/', 155);
+		if (p == name.npos || name.size() - p - 1 > 100)
+			return false;
+		memcpy(&h[345], name.data(), p);
+		memcpy(&h[0], &name[p+1], name.size() - p - 1);
+	}
+	bk_octal(&h[100], 8, 0640);
+	bk_octal(&h[108], 8, 0);
+	bk_octal(&h[116], 8, 0);
+	if (size < (1ULL << 33)) {
+		bk_octal(&h[124], 12, size);
+	} else {
+		h[124] = '\x80';
+		for (unsigned int i = 0; i < 8; ++i)
+			h[135-i] = static_cast<char>(size >> (8 * i));
+	}
+	bk_octal(&h[136], 12, std::max(mtime, static_cast<time_t>(0)));
+	memset(&h[148], ' ', 8);
+	h[156] = '0';
+	memcpy(&h[257], "ustar", 6);
+	memcpy(&h[263], "00", 2);
+	unsigned int sum = 0;
+	for (auto c : h)
+		sum += static_cast<uint8_t>(c);
+	snprintf(&h[148], 7, "%06o", sum);
+	out.append(h, sizeof(h));
+	return true;
+}
+
+bool bk_session::open(uint64_t id)
+{
+	auto path = fmt::format("{}/exmdb/exchange.sqlite3", dir);
+	sqlite3 *db = nullptr;
+	auto ret = sqlite3_open_v2(path.c_str(), &db,
+	           SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+	src.reset(db);
+	if (ret != SQLITE_OK) {
+		mlog(LV_ERR, "E-2928: sqlite3_open %s: %s", path.c_str(), sqlite3_errstr(ret));
+		return false;
+	}
+	sqlite3_busy_timeout(db, int(g_sqlite_busy_timeout_ns / 1000000));
+	/* The first read after BEGIN establishes the snapshot */
+	if (gx_sql_exec(db, "BEGIN") != SQLITE_OK ||
+	    !purg_discover_cids(db, dir.c_str(), cids))
+		return false;
+	std::sort(cids.begin(), cids.end());
+	cids.erase(std::unique(cids.begin(), cids.end()), cids.end());
+	auto stm = gx_sql_prep(db, "PRAGMA page_size");
+	if (stm != nullptr && stm.step() == SQLITE_ROW)
+		pgsize = std::max(stm.col_int64(0), static_cast<int64_t>(512));
+	stm.finalize();
+
+	tmp_path = fmt::format("{}/exmdb/backup-{}.sqlite3.tmp", dir, id);
+	unlink(tmp_path.c_str());
+	db = nullptr;
+	ret = sqlite3_open_v2(tmp_path.c_str(), &db, SQLITE_OPEN_READWRITE |
+	      SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr);
+	dst.reset(db);
+	if (ret != SQLITE_OK) {
+		mlog(LV_ERR, "E-2929: sqlite3_open %s: %s", tmp_path.c_str(), sqlite3_errstr(ret));
+		return false;
+	}
+	gx_sql_exec(db, "PRAGMA journal_mode=OFF");
+	gx_sql_exec(db, "PRAGMA synchronous=OFF");
+	bk = sqlite3_backup_init(db, "main", src.get(), "main");
+	if (bk == nullptr) {
+		mlog(LV_ERR, "E-2930: sqlite3_backup_init %s: %s", dir.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	mlog(LV_NOTICE, "exmdb: backup of %s started (%zu content files)",
+	     dir.c_str(), cids.size());
+	return true;
+}
+
+/**
+ * Advance the session until about @budget bytes have been produced into @out
+ * or read/written on the server side (@work).
+ */
+bool bk_session::fill(std::string &out, size_t budget, size_t &work)
+{
+	while (out.size() < budget && work < budget) {
+		switch (phase) {
+		case bk_phase::pages: {
+			auto npg = std::max(static_cast<size_t>(1), (budget - work) / pgsize);
+			auto ret = sqlite3_backup_step(bk, std::min(npg, static_cast<size_t>(INT_MAX)));
+			work += npg * pgsize;
+			if (ret == SQLITE_OK)
+				break;
+			if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
+				/* Try again on the next call */
+				return true;
+			if (ret != SQLITE_DONE) {
+				mlog(LV_ERR, "E-2931: sqlite3_backup_step %s: %s",
+				     dir.c_str(), sqlite3_errstr(ret));
+				return false;
+			}
+			ret = sqlite3_backup_finish(bk);
+			bk = nullptr;
+			dst.reset();
+			if (ret != SQLITE_OK) {
+				mlog(LV_ERR, "E-2932: sqlite3_backup_finish %s: %s",
+				     dir.c_str(), sqlite3_errstr(ret));
+				return false;
+			}
+			/* Let checkpoints pass the snapshot again */
+			src.reset();
+			fd = wrapfd(::open(tmp_path.c_str(), O_RDONLY));
+			struct stat sb;
+			if (fd.get() < 0 || fstat(fd.get(), &sb) != 0) {
+				mlog(LV_ERR, "E-2933: %s: %s", tmp_path.c_str(), strerror(errno));
+				return false;
+			}
+			unlink(tmp_path.c_str());
+			tmp_path.clear();
+			if (!bk_tar_header(out, "exmdb/exchange.sqlite3", sb.st_size, time(nullptr)))
+				return false;
+			remain = sb.st_size;
+			phase = bk_phase::member;
+			break;
+		}
+		case bk_phase::member: {
+			auto z = std::min(remain, static_cast<uint64_t>(budget - out.size()));
+			auto pos = out.size();
+			out.resize(pos + z);
+			auto ret = z > 0 ? read(fd.get(), &out[pos], z) : 0;
+			if (ret < 0) {
+				mlog(LV_ERR, "E-2934: backup read %s: %s", dir.c_str(), strerror(errno));
+				return false;
+			} else if (ret == 0 && z > 0) {
+				/* Truncated underneath us; keep the archive well-formed */
+				mlog(LV_WARN, "W-2935: backup of %s: file shrank during read", dir.c_str());
+				ret = z;
+			} else {
+				out.resize(pos + ret);
+			}
+			remain -= ret;
+			work += ret;
+			if (remain == 0) {
+				out.append((512 - out.size() % 512) % 512, '\0');
+				fd.close_rd();
+				phase = bk_phase::cids;
+			}
+			break;
+		}
+		case bk_phase::cids: {
+			if (cid_pos >= cids.size()) {
+				phase = bk_phase::trailer;
+				break;
+			}
+			/* Any of the plain, .v1z and .zst variants may exist */
+			auto path = cu_cid_path(dir.c_str(), cids[cid_pos].c_str(), cid_type);
+			if (path.empty())
+				return false;
+			wrapfd cfd(::open(path.c_str(), O_RDONLY));
+			auto err = errno;
+			if (cfd.get() >= 0)
+				cid_found = true;
+			if (++cid_type > 2) {
+				/* e.g. purged after the snapshot was taken */
+				if (!cid_found)
+					mlog(LV_WARN, "W-2936: backup of %s: content file %s is gone",
+					     dir.c_str(), cids[cid_pos].c_str());
+				cid_type = 0;
+				cid_found = false;
+				++cid_pos;
+			}
+			if (cfd.get() < 0) {
+				if (err != ENOENT)
+					mlog(LV_WARN, "W-2939: backup skips %s: %s", path.c_str(), strerror(err));
+				break;
+			}
+			struct stat sb;
+			if (fstat(cfd.get(), &sb) != 0 || !S_ISREG(sb.st_mode)) {
+				mlog(LV_WARN, "W-2939: backup skips %s: not a regular file", path.c_str());
+				break;
+			}
+			if (!bk_tar_header(out, path.substr(dir.size() + 1), sb.st_size, sb.st_mtime)) {
+				mlog(LV_WARN, "W-2937: backup skips %s: name too long", path.c_str());
+				break;
+			}
+			fd = std::move(cfd);
+			remain = sb.st_size;
+			phase = bk_phase::member;
+			break;
+		}
+		case bk_phase::trailer:
+			out.append(1024, '\0');
+			phase = bk_phase::done;
+			return true;
+		case bk_phase::done:
+			return true;
+		}
+	}
+	return true;
+}
+
+/* Drop sessions that were not continued for bk_idle_limit */
+void bk_reap()
+{
+	std::vector<std::shared_ptr<bk_session>> expired;
+	auto now = bk_clock::now();
+	{
+		std::lock_guard lk(g_bk_lock);
+		std::erase_if(g_bk_sessions, [&](const auto &e) {
+			if (now - e.second->last_use <= bk_idle_limit)
+				return false;
+			expired.push_back(e.second);
+			return true;
+		});
+	}
+	for (const auto &bs : expired)
+		mlog(LV_NOTICE, "exmdb: backup of %s abandoned", bs->dir.c_str());
+	/* Destructors (file removal) run outside g_bk_lock */
+}
+
+/**
+ * Remove temporary copies in @dir that belong to no live session, e.g.
+ * after a crash or restart.
+ */
+void bk_clean_tmp(const char *dir)
+{
+	auto edir = fmt::format("{}/exmdb", dir);
+	std::unique_ptr<DIR, file_deleter> dh(opendir(edir.c_str()));
+	if (dh == nullptr)
+		return;
+	std::lock_guard lk(g_bk_lock);
+	struct dirent *de;
+	while ((de = readdir(dh.get())) != nullptr) {
+		unsigned long long id = 0;
+		int end = 0;
+		if (sscanf(de->d_name, "backup-%llu.sqlite3.tmp%n", &id, &end) != 1 ||
+		    de->d_name[end] != '\0')
+			continue;
+		auto i = g_bk_sessions.find(id);
+		if (i != g_bk_sessions.end() && i->second->dir == dir)
+			continue;
+		if (unlinkat(dirfd(dh.get()), de->d_name, 0) == 0)
+			mlog(LV_INFO, "I-2976: removed stale %s/%s", edir.c_str(), de->d_name);
+	}
+}
+
+BOOL exmdb_server::backup_read(const char *dir, uint64_t session, uint64_t rate,
+    uint64_t *next_session, std::string *data) try
+{
+	data->clear();
+	*next_session = 0;
+	auto now = bk_clock::now();
+	std::shared_ptr<bk_session> bs;
+	bool fresh = session == 0;
+	{
+		std::lock_guard lk(g_bk_lock);
+		if (session == 0) {
+			session = ++g_bk_serial;
+			bs = std::make_shared<bk_session>();
+			bs->dir = dir;
+			g_bk_sessions.emplace(session, bs);
+		} else {
+			auto i = g_bk_sessions.find(session);
+			if (i != g_bk_sessions.end() && i->second->dir == dir)
+				bs = i->second;
+		}
+		if (bs != nullptr)
+			bs->last_use = now;
+	}
+	if (bs == nullptr) {
+		mlog(LV_ERR, "E-2938: backup session %llu for %s is unknown or expired",
+		     static_cast<unsigned long long>(session), dir);
+		return false;
+	}
+	auto drop = [&]() {
+		std::lock_guard lk(g_bk_lock);
+		g_bk_sessions.erase(session);
+	};
+	std::unique_lock sl(bs->lock);
+	if (fresh && !bs->open(session)) {
+		sl.unlock();
+		drop();
+		return false;
+	}
+	auto budget = rate == 0 ? bk_chunk_max :
+	              std::clamp(static_cast<size_t>(std::min(rate / 4, static_cast<uint64_t>(SIZE_MAX))),
+	              bk_chunk_min, bk_chunk_max);
+	size_t work = 0;
+	if (!bs->fill(*data, budget, work)) {
+		sl.unlock();
+		drop();
+		return false;
+	}
+	if (bs->phase == bk_phase::done) {
+		mlog(LV_NOTICE, "exmdb: backup of %s complete", dir);
+		sl.unlock();
+		drop();
+		return TRUE;
+	}
+	*next_session = session;
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2927: ENOMEM");
+	return false;
+}
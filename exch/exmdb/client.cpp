@@ -9,6 +9,7 @@
 #include <gromox/exmdb_provider_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
+#include "parser.hpp"
 
 using namespace gromox;
 
@@ -58,3 +59,22 @@ BOOL exmdb_client_relay_delivery(const char *dir, const char *from_address,
 	*presult = r.result;
 	return TRUE;
 }
+
+/*
+ * exmdb_batch executor for plugins in the same process: stores served by
+ * this exmdb_provider are handled directly, others go over the network.
+ */
+BOOL exmdb_client_local_batch(const exreq *q0, exresp *r0)
+{
+	if (q0->call_id != exmdb_callid::batch || r0->call_id != exmdb_callid::batch)
+		return false;
+	BOOL b_private;
+	if (!exmdb_client_is_local(q0->dir, &b_private))
+		return exmdb_client_do_rpc(q0, r0);
+	exmdb_server::build_env(EM_LOCAL | (b_private ? EM_PRIVATE : 0), q0->dir);
+	/* Sub-requests (and their idsets) stay owned by the caller */
+	auto ret = exmdb_parser_batch(*static_cast<const exreq_batch *>(q0),
+	           *static_cast<exresp_batch *>(r0), false);
+	exmdb_server::free_env();
+	return ret;
+}
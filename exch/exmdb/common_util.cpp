@@ -969,8 +969,6 @@ static uint64_t common_util_get_folder_message_size(
 BOOL common_util_get_folder_type(sqlite3 *psqlite, uint64_t folder_id,
     uint32_t *pfolder_type, const char *dir)
 {
-	char sql_string[128];
-	
 	if (!exmdb_server::is_private()) {
 		*pfolder_type = folder_id == PUBLIC_FID_ROOT ? FOLDER_ROOT : FOLDER_GENERIC;
 		return TRUE;
@@ -979,11 +977,11 @@ BOOL common_util_get_folder_type(sqlite3 *psqlite, uint64_t folder_id,
 		*pfolder_type = FOLDER_ROOT;
 		return TRUE;
 	}
-	snprintf(sql_string, std::size(sql_string), "SELECT is_search "
-	         "FROM folders WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	auto pstmt = gx_sql_prep(psqlite, "SELECT is_search "
+	             "FROM folders WHERE folder_id=?");
 	if (pstmt == nullptr)
 		return FALSE;
+	pstmt.bind_int64(1, folder_id);
 	if (pstmt.step() != SQLITE_ROW)
 		/*
 		 * Could be if db_engine_proc_dynamic_event was just
@@ -998,12 +996,12 @@ BOOL common_util_get_folder_type(sqlite3 *psqlite, uint64_t folder_id,
 static BOOL common_util_check_folder_rules(
 	sqlite3 *psqlite, uint64_t folder_id)
 {
-	char sql_string[128];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT count(*) FROM "
-	          "rules WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	return pstmt != nullptr && pstmt.step() == SQLITE_ROW &&
+	auto pstmt = gx_sql_prep(psqlite, "SELECT count(*) FROM "
+	             "rules WHERE folder_id=?");
+	if (pstmt == nullptr)
+		return false;
+	pstmt.bind_int64(1, folder_id);
+	return pstmt.step() == SQLITE_ROW &&
 	       sqlite3_column_int64(pstmt, 0) > 0 ? TRUE : false;
 }
 
@@ -1034,12 +1032,12 @@ static uint32_t common_util_get_folder_flags(
 static uint64_t common_util_get_message_size(
 	sqlite3 *psqlite, uint64_t message_id)
 {
-	char sql_string[128];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT message_size FROM "
-	          "messages WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	return pstmt == nullptr || pstmt.step() != SQLITE_ROW ? 0 :
+	auto pstmt = gx_sql_prep(psqlite, "SELECT message_size FROM "
+	             "messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return 0;
+	pstmt.bind_int64(1, message_id);
+	return pstmt.step() != SQLITE_ROW ? 0 :
 	       sqlite3_column_int64(pstmt, 0);
 }
 
@@ -1047,12 +1045,13 @@ uint64_t common_util_get_folder_parent_fid(
 	sqlite3 *psqlite, uint64_t folder_id)
 {
 	uint64_t parent_fid;
-	char sql_string[128];
 	
-	snprintf(sql_string, std::size(sql_string), "SELECT parent_id FROM "
-	          "folders WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	auto pstmt = gx_sql_prep(psqlite, "SELECT parent_id FROM "
+	             "folders WHERE folder_id=?");
+	if (pstmt == nullptr)
+		return 0;
+	pstmt.bind_int64(1, folder_id);
+	if (pstmt.step() != SQLITE_ROW)
 		return 0;
 	parent_fid = sqlite3_column_int64(pstmt, 0);
 	return parent_fid != 0 ? parent_fid : folder_id;
@@ -1062,12 +1061,13 @@ static uint64_t common_util_get_folder_changenum(
 	sqlite3 *psqlite, uint64_t folder_id)
 {
 	uint64_t change_num;
-	char sql_string[128];
 	
-	snprintf(sql_string, std::size(sql_string), "SELECT change_number FROM "
-	          "folders WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	auto pstmt = gx_sql_prep(psqlite, "SELECT change_number FROM "
+	             "folders WHERE folder_id=?");
+	if (pstmt == nullptr)
+		return 0;
+	pstmt.bind_int64(1, folder_id);
+	if (pstmt.step() != SQLITE_ROW)
 		return 0;
 	change_num = sqlite3_column_int64(pstmt, 0);
 	return rop_util_make_eid_ex(1, change_num);
@@ -1192,12 +1192,12 @@ static BINARY *cu_mid_to_entryid(sqlite3 *psqlite, uint64_t message_id)
 BOOL common_util_check_message_associated(
 	sqlite3 *psqlite, uint64_t message_id)
 {
-	char sql_string[128];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT is_associated FROM "
-	          "messages WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	return pstmt != nullptr && pstmt.step() == SQLITE_ROW &&
+	auto pstmt = gx_sql_prep(psqlite, "SELECT is_associated FROM "
+	             "messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return false;
+	pstmt.bind_int64(1, message_id);
+	return pstmt.step() == SQLITE_ROW &&
 	       sqlite3_column_int64(pstmt, 0) != 0 ? TRUE : false;
 }
 
@@ -1221,37 +1221,36 @@ static BOOL common_util_check_message_named_properties(
 static BOOL common_util_check_message_has_attachments(
 	sqlite3 *psqlite, uint64_t message_id)
 {
-	char sql_string[128];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT count(*) FROM "
-	          "attachments WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	return pstmt != nullptr && pstmt.step() == SQLITE_ROW &&
+	auto pstmt = gx_sql_prep(psqlite, "SELECT count(*) FROM "
+	             "attachments WHERE message_id=?");
+	if (pstmt == nullptr)
+		return false;
+	pstmt.bind_int64(1, message_id);
+	return pstmt.step() == SQLITE_ROW &&
 	       sqlite3_column_int64(pstmt, 0) != 0 ? TRUE : false;
 }
 
 static BOOL common_util_check_message_read(
 	sqlite3 *psqlite, uint64_t message_id)
 {
-	char sql_string[128];
-	
 	if (!exmdb_server::is_private()) {
 		auto username = exmdb_pf_read_per_user ? exmdb_server::get_public_username() : "";
 		if (username == nullptr)
 			return FALSE;
-		snprintf(sql_string, std::size(sql_string), "SELECT message_id"
-				" FROM read_states WHERE username=? AND "
-				"message_id=%llu", LLU{message_id});
-		auto pstmt = gx_sql_prep(psqlite, sql_string);
+		auto pstmt = gx_sql_prep(psqlite, "SELECT message_id"
+		             " FROM read_states WHERE username=? AND message_id=?");
 		if (pstmt == nullptr)
 			return FALSE;
 		sqlite3_bind_text(pstmt, 1, username, -1, SQLITE_STATIC);
+		pstmt.bind_int64(2, message_id);
 		return pstmt.step() == SQLITE_ROW ? TRUE : false;
 	}
-	snprintf(sql_string, std::size(sql_string), "SELECT read_state FROM "
-	          "messages WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	return pstmt != nullptr && pstmt.step() == SQLITE_ROW &&
+	auto pstmt = gx_sql_prep(psqlite, "SELECT read_state FROM "
+	             "messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return false;
+	pstmt.bind_int64(1, message_id);
+	return pstmt.step() == SQLITE_ROW &&
 	       sqlite3_column_int64(pstmt, 0) != 0 ? TRUE : false;
 }
 
@@ -1259,12 +1258,13 @@ static uint64_t common_util_get_message_changenum(
 	sqlite3 *psqlite, uint64_t message_id)
 {
 	uint64_t change_num;
-	char sql_string[128];
 	
-	snprintf(sql_string, std::size(sql_string), "SELECT change_number FROM "
-	          "messages WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	auto pstmt = gx_sql_prep(psqlite, "SELECT change_number FROM "
+	             "messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return 0;
+	pstmt.bind_int64(1, message_id);
+	if (pstmt.step() != SQLITE_ROW)
 		return 0;
 	change_num = sqlite3_column_int64(pstmt, 0);
 	return rop_util_make_eid_ex(1, change_num);
@@ -4079,13 +4079,11 @@ BOOL cu_is_descendant_folder(sqlite3 *psqlite,
 BOOL common_util_get_message_parent_folder(sqlite3 *psqlite,
 	uint64_t message_id, uint64_t *pfolder_id)
 {
-	char sql_string[256];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT parent_fid FROM"
-	          " messages WHERE message_id=%llu", LLU{message_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	auto pstmt = gx_sql_prep(psqlite, "SELECT parent_fid FROM"
+	             " messages WHERE message_id=?");
 	if (pstmt == nullptr)
 		return FALSE;	
+	pstmt.bind_int64(1, message_id);
 	*pfolder_id = pstmt.step() != SQLITE_ROW ? 0 :
 	              sqlite3_column_int64(pstmt, 0);
 	return TRUE;
@@ -2,6 +2,8 @@
 // SPDX-FileCopyrightText: 2021-2024 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <climits>
@@ -12,6 +14,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <future>
 #include <list>
 #include <mutex>
@@ -19,6 +22,7 @@
 #include <pthread.h>
 #include <semaphore>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
@@ -35,6 +39,7 @@
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
 #include <gromox/ext_buffer.hpp>
+#include <gromox/fileio.h>
 #include <gromox/mapidefs.h>
 #include <gromox/process.hpp>
 #include <gromox/proptag_array.hpp>
@@ -52,10 +57,6 @@ using LLD = long long;
 using LLU = unsigned long long;
 using namespace gromox;
 
-struct db_close {
-	void operator()(sqlite3 *x) const;
-};
-
 namespace {
 
 struct POPULATING_NODE {
@@ -68,6 +69,7 @@ struct POPULATING_NODE {
 	cpid_t cpid = CP_ACP;
 	BOOL b_recursive = false;
 	RESTRICTION *prestriction = nullptr;
+	std::shared_ptr<const res_plan> plan;
 	LONGLONG_ARRAY folder_ids{};
 };
 
@@ -89,27 +91,92 @@ struct ROWDEL_NODE {
 	BOOL b_read;
 };
 
+/*
+ * Shared state of one search folder population: the candidate messages,
+ * handed out in chunks of SF_CHUNK, and the matches awaiting their write.
+ */
+struct sf_work {
+	std::vector<uint64_t> mids;
+	std::atomic<size_t> next{0};
+	std::atomic<bool> failed{false}, closed{false};
+	std::mutex lock, flush_lock;
+	std::vector<uint64_t> pending; /* under lock */
+};
+
+/* One slice of the mailbox table, selected by hashing the directory */
+struct db_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, db_base> map; /* under lock */
+};
+
+/* An idle mailbox that may be dropped ahead of cache_interval */
+struct evict_cand {
+	db_shard *shard = nullptr;
+	std::string dir;
+	time_point last_activity;
+	size_t mem = 0;
+};
+
 }
 
 static size_t g_table_size; /* hash table size */
 static unsigned int g_threads_num;
 static gromox::atomic_bool g_notify_stop; /* stop signal for scanning thread */
-static pthread_t g_scan_tid;
+static pthread_t g_scan_tid, g_maint_tid;
 static gromox::time_duration g_cache_interval; /* maximum living interval in table */
 static std::vector<pthread_t> g_thread_ids;
-static std::mutex g_list_lock, g_hash_lock, g_cond_mutex;
+static std::mutex g_list_lock, g_cond_mutex;
 static std::condition_variable g_waken_cond;
-static std::unordered_map<std::string, db_base> g_hash_table;
+/*
+ * The mailbox table is sharded so that lookups for different directories do
+ * not serialize on one lock, and expiry only ever holds one shard at a time.
+ */
+static constexpr size_t DB_SHARDS = 64;
+static std::array<db_shard, DB_SHARDS> g_hash_shards;
+static std::atomic<size_t> g_hash_count; /* sum of all shard sizes */
+/* Statistics for db_engine_report */
+static std::atomic<size_t> g_cache_mem; /* as of the last sweep */
+static std::atomic<uint64_t> g_expired_count, g_evicted_count, g_refused_count;
 /* List of queued searchcriteria, and list of searchcriteria evaluated right now */
 static std::list<POPULATING_NODE> g_populating_list, g_populating_list_active;
 static std::optional<std::counting_semaphore<1>> g_autoupg_limiter;
+/* Messages per evaluation work unit / matches per search_result write */
+static constexpr size_t SF_CHUNK = 64, SF_FLUSH_BATCH = 64;
+static thread_local db_conn_pin *t_db_pin;
 unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 unsigned long long g_exmdb_search_pacing_time = 2000000000;
 unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+unsigned int g_exmdb_search_parallel = 1;
 unsigned int g_exmdb_pvt_folder_softdel, g_exmdb_max_sqlite_spares;
 unsigned long long g_sqlite_busy_timeout_ns;
+unsigned long long g_exmdb_cache_budget;
+unsigned int g_exmdb_stmt_cache;
+bool g_exmdb_group_commit;
+unsigned long long g_exmdb_group_commit_window;
+unsigned long long g_exmdb_maint_interval, g_exmdb_maint_idle = 300;
+unsigned long long g_exmdb_maint_slice = 50000000, g_exmdb_maint_io_rate;
+unsigned long long g_exmdb_maint_softdel_age, g_exmdb_maint_vacuum_max;
+unsigned long long g_exmdb_maint_tombstone_age;
+unsigned int g_exmdb_maint_cpu = 10;
+unsigned long long g_exmdb_mmap_size;
+thread_local bool t_db_maint; /* set on the maintenance thread */
+static std::atomic<uint64_t> g_gcommit_commits, g_gcommit_syncs;
+/* Mailboxes whose WAL is due for a group commit fsync, and the flusher */
+static struct {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<std::pair<db_base *, std::string>> queue;
+	bool stop = false;
+	pthread_t tid{};
+} g_gflush;
 
 static bool remove_from_hash(const db_base &, time_point);
+static size_t db_evict_lru(size_t nent, size_t nbytes);
+
+static db_shard &db_shard_of(std::string_view path)
+{
+	return g_hash_shards[std::hash<std::string_view>{}(path) % DB_SHARDS];
+}
 static void dbeng_notify_cttbl_modify_row(db_conn *, uint64_t folder_id, uint64_t message_id, db_base &) __attribute__((nonnull(1)));
 
 static void db_engine_load_dynamic_list(db_base *dbase, sqlite3* psqlite) try
@@ -142,6 +209,7 @@ static void db_engine_load_dynamic_list(db_base *dbase, sqlite3* psqlite) try
 		pdynamic->prestriction = tmp_restriction.dup();
 		if (pdynamic->prestriction == nullptr)
 			break;
+		pdynamic->plan = res_plan::compile(pdynamic->prestriction);
 		if (!common_util_load_search_scopes(psqlite,
 		    pdynamic->folder_id, &tmp_fids))
 			continue;
@@ -153,8 +221,10 @@ static void db_engine_load_dynamic_list(db_base *dbase, sqlite3* psqlite) try
 					sizeof(uint64_t)*tmp_fids.count);
 		dbase->dynamic_list.push_back(std::move(dn));
 	}
+	dbase->dyn_index.dirty = true;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2137: ENOMEM");
+	dbase->dyn_index.dirty = true;
 }
 
 static int db_engine_autoupgrade(sqlite3 *db, const char *filedesc)
@@ -209,33 +279,67 @@ db_conn_ptr db_engine_get_db(const char *path)
 	
 	if (*path == '\0')
 		return std::nullopt;
-	std::unique_lock hhold(g_hash_lock);
-	auto it = g_hash_table.find(path);
-	if (it != g_hash_table.end()) {
+	auto pin = t_db_pin;
+	if (pin != nullptr && !pin->lent && pin->conn.has_value() &&
+	    pin->dir == path)
+		return db_conn_ptr(std::in_place, *pin);
+	auto &shard = db_shard_of(path);
+	std::unique_lock hhold(shard.lock);
+	auto it = shard.map.find(path);
+	if (it != shard.map.end()) {
 		pdb = &it->second;
+		/* reference is taken under the shard lock; expiry checks it */
 		db_conn_ptr conn(*pdb);
 		hhold.unlock();
 		if (!conn->open(path))
 			return std::nullopt;
 		return conn;
 	}
-	if (g_hash_table.size() >= g_table_size) {
+	if (g_hash_count.fetch_add(1) >= g_table_size) {
+		--g_hash_count;
+		/*
+		 * Make room by dropping idle mailboxes; a few at once so that
+		 * the next misses do not each have to scan the table.
+		 */
 		hhold.unlock();
-		mlog(LV_ERR, "E-1297: Reached the maximum number of concurrently active users/mailboxes (exmdb_provider.cfg:table_size=%zu)", g_table_size);
-		return std::nullopt;
+		db_evict_lru(std::max(g_table_size / 64, static_cast<size_t>(1)), 0);
+		hhold.lock();
+		it = shard.map.find(path);
+		if (it != shard.map.end()) {
+			pdb = &it->second;
+			db_conn_ptr conn(*pdb);
+			hhold.unlock();
+			if (!conn->open(path))
+				return std::nullopt;
+			return conn;
+		}
+		if (g_hash_count.fetch_add(1) >= g_table_size) {
+			--g_hash_count;
+			++g_refused_count;
+			hhold.unlock();
+			mlog(LV_ERR, "E-1297: Reached the maximum number of concurrently active users/mailboxes (exmdb_provider.cfg:table_size=%zu)", g_table_size);
+			return std::nullopt;
+		}
 	}
 	try {
-		auto xp = g_hash_table.try_emplace(path);
+		auto xp = shard.map.try_emplace(path);
 		pdb = &xp.first->second;
 	} catch (const std::bad_alloc &) {
+		--g_hash_count;
 		hhold.unlock();
 		mlog(LV_ERR, "E-1296: ENOMEM");
 		return std::nullopt;
 	}
 
 	/*
-	 * Release central map lock (g_hash_lock) early to unblock map read
-	 * access looking for DBs of other dirs.
+	 * Take our reference while still under the shard lock: open() drops
+	 * the construction reference, and sweep/eviction must not see a zero
+	 * count (and erase the entry) before the conn below exists.
+	 */
+	db_conn_ptr conn(*pdb);
+	/*
+	 * Release the shard lock early to unblock map read access looking
+	 * for DBs of other dirs.
 	 */
 	hhold.unlock();
 	try {
@@ -246,7 +350,6 @@ db_conn_ptr db_engine_get_db(const char *path)
 	}
 
 	/* Wait for another thread's costly postconstruct_init (or any EXRPC) to finish. */
-	db_conn_ptr conn(*pdb);
 	if (!conn->open(path)) {
 		return std::nullopt;
 	}
@@ -259,6 +362,7 @@ BOOL db_engine_vacuum(const char *path)
 	if (!db)
 		return false;
 	mlog(LV_INFO, "I-2067: Vacuuming %s (exchange.sqlite3)", path);
+	gx_sql_cache_flush(db->psqlite);
 	if (gx_sql_exec(db->psqlite, "VACUUM") != SQLITE_OK)
 		return false;
 	mlog(LV_INFO, "I-2102: Vacuuming %s ended", path);
@@ -270,15 +374,18 @@ BOOL db_engine_unload_db(const char *path)
 	int i;
 	
 	for (i=0; i<20; i++) {
-		std::unique_lock hhold(g_hash_lock);
-		auto it = g_hash_table.find(path);
-		if (it == g_hash_table.end())
+		auto &shard = db_shard_of(path);
+		std::unique_lock hhold(shard.lock);
+		auto it = shard.map.find(path);
+		if (it == shard.map.end())
 			return TRUE;
 		auto now = tp_now();
 		auto &dbase = it->second;
 		std::unique_lock dhold(dbase.giant_lock);
 		if (remove_from_hash(dbase, now + g_cache_interval)) {
-			g_hash_table.erase(it);
+			dhold.unlock();
+			shard.map.erase(it);
+			--g_hash_count;
 			return TRUE;
 		}
 		dhold.unlock();
@@ -290,7 +397,8 @@ BOOL db_engine_unload_db(const char *path)
 
 dynamic_node::dynamic_node(dynamic_node &&o) noexcept :
 	folder_id(o.folder_id), search_flags(o.search_flags),
-	prestriction(o.prestriction), folder_ids(o.folder_ids)
+	prestriction(o.prestriction), plan(std::move(o.plan)),
+	folder_ids(o.folder_ids)
 {
 	o.prestriction = nullptr;
 	o.folder_ids = {};
@@ -309,6 +417,7 @@ dynamic_node &dynamic_node::operator=(dynamic_node &&o) noexcept
 	folder_id = o.folder_id;
 	search_flags = o.search_flags;
 	std::swap(prestriction, o.prestriction);
+	std::swap(plan, o.plan);
 	folder_ids.count = o.folder_ids.count;
 	o.folder_ids.count = 0;
 	std::swap(folder_ids.pll, o.folder_ids.pll);
@@ -316,10 +425,10 @@ dynamic_node &dynamic_node::operator=(dynamic_node &&o) noexcept
 }
 
 table_node::table_node(const table_node &o, clone_t) :
-	table_id(o.table_id), table_flags(o.table_flags), cpid(o.cpid),
+	table_id(o.table_id), table_flags(o.table_flags), sql_id(o.sql_id), cpid(o.cpid),
 	type(o.type), cloned(true), remote_id(o.remote_id), username(o.username),
 	folder_id(o.folder_id), handle_guid(o.handle_guid),
-	prestriction(o.prestriction), psorts(o.psorts),
+	prestriction(o.prestriction), plan(o.plan), psorts(o.psorts),
 	instance_tag(o.instance_tag), extremum_tag(o.extremum_tag),
 	header_id(o.header_id), b_search(o.b_search), b_hint(o.b_hint)
 {}
@@ -340,7 +449,7 @@ table_node::~table_node()
 
 db_base::db_base() :
 	reference(1), // is decremented when open() is run.
-	last_time(tp_now())
+	last_activity(tp_now())
 {
 	/* Prevent instantiation by db_conn until open() has completed. */
 	sqlite_lock.lock();
@@ -385,6 +494,12 @@ db_handle db_base::get_db(const char* dir, DB_TYPE type)
 	sqlite3_busy_timeout(db, int(g_sqlite_busy_timeout_ns / 1000000)); // ns -> ms
 	if(type == DB_EPH)
 		gx_sql_exec(db, "PRAGMA	synchronous=OFF"); /* completely disable disk synchronization for eph db */
+	else if (g_exmdb_group_commit)
+		/* COMMIT only appends to the WAL; db_base::group_sync does the fsync */
+		gx_sql_exec(db, "PRAGMA synchronous=NORMAL");
+	if (type == DB_MAIN && g_exmdb_mmap_size > 0)
+		gx_sql_exec(db, fmt::format("PRAGMA mmap_size={}", g_exmdb_mmap_size).c_str());
+	gx_sql_cache_attach(db, g_exmdb_stmt_cache);
 	return hdb;
 }
 
@@ -398,6 +513,59 @@ void db_base::get_dbs(const char* dir, sqlite3 *&main, sqlite3 *&eph)
 	eph  = get_db(dir, db_base::DB_EPH).release();
 }
 
+static size_t db_handle_mem(sqlite3 *db)
+{
+	static constexpr int ops[] = {
+		SQLITE_DBSTATUS_CACHE_USED, SQLITE_DBSTATUS_SCHEMA_USED,
+		SQLITE_DBSTATUS_STMT_USED,
+	};
+	size_t total = 0;
+	for (auto op : ops) {
+		int cur = 0, hi = 0;
+		if (sqlite3_db_status(db, op, &cur, &hi, 0) == SQLITE_OK && cur > 0)
+			total += cur;
+	}
+	return total;
+}
+
+/**
+ * Move the page cache hit/miss counts of a main handle that is being given
+ * back into the mailbox totals.
+ */
+void db_base::note_cache_stats(sqlite3 *db)
+{
+	int cur = 0, hi = 0;
+	if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hi, 1) == SQLITE_OK)
+		cache_hits += cur;
+	if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hi, 1) == SQLITE_OK)
+		cache_misses += cur;
+}
+
+/**
+ * Estimate the memory held by this mailbox: the cached sqlite handles
+ * (page cache, schema, statements) plus a nominal amount per open instance
+ * and table. The rows of tables themselves live in tables.sqlite3 and are
+ * covered by the handle figures.
+ */
+size_t db_base::mem_usage()
+{
+	static constexpr size_t instance_cost = 16384, table_cost = 4096;
+	size_t total = sizeof(*this);
+	std::unique_lock lock(sqlite_lock, std::try_to_lock);
+	if (lock.owns_lock()) {
+		for (const auto &h : mx_sqlite)
+			total += db_handle_mem(h.get());
+		for (const auto &h : mx_sqlite_eph)
+			total += db_handle_mem(h.get());
+	}
+	total += instance_list.size() * (sizeof(instance_node) + instance_cost);
+	total += tables.table_list.size() * (sizeof(table_node) + table_cost);
+	total += dynamic_list.size() * sizeof(dynamic_node);
+	total += dyn_index.ancestors.size() * 64;
+	total += nsub_list.size() * sizeof(nsub_node);
+	return total;
+}
+
 /**
  * @brief      Initialize and unlock database
  *
@@ -412,6 +580,7 @@ void db_base::get_dbs(const char* dir, sqlite3 *&main, sqlite3 *&eph)
 void db_base::open(const char* dir)
 {
 	auto unlock = make_scope_exit([this] { sqlite_lock.unlock(); --reference; }); /* unlock whenever we're done */
+	bk_clean_tmp(dir);
 	auto db_path = fmt::format("{}/tables.sqlite3", dir);
 	auto ret = ::unlink(db_path.c_str());
 	if (ret != 0 && errno != ENOENT)
@@ -423,11 +592,115 @@ void db_base::open(const char* dir)
 	ret = db_engine_autoupgrade(hdb.get(), dir);
 	if(ret != 0)
 		throw std::runtime_error(fmt::format("E-2105: autoupgrade {}: {}", dir, ret));
-	if (exmdb_server::is_private())
+	gx_sql_cache_flush(hdb.get());
+	b_private = exmdb_server::is_private();
+	if (b_private)
 		db_engine_load_dynamic_list(this, hdb.get());
+	fts_open(dir);
+	hotprops_open(hdb.get());
 	mx_sqlite.emplace_back(std::move(hdb));
 }
 
+/* fsync the write-ahead log file at @path */
+static bool dbeng_wal_sync(const std::string &path)
+{
+	wrapfd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd.get() < 0 || fdatasync(fd.get()) != 0) {
+		mlog(LV_ERR, "E-2926: WAL sync %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Wait until the commits made through @db are on disk (group commit).
+ *
+ * Every connection shares the mailbox's one WAL file, so a single fsync
+ * covers all commits made before it started. The first committer hands the
+ * mailbox to the gcommit flusher thread, which lingers for
+ * exmdb_group_commit_window so that more writers can line up, then syncs on
+ * behalf of everyone with a lower ticket. Writers arriving while a sync runs
+ * wait for the next round. Neither the window nor the fsync itself run on
+ * the RPC worker; it only waits for the outcome.
+ */
+void db_base::group_sync(sqlite3 *db)
+{
+	auto &g = gcommit;
+	std::unique_lock lk(g.lock);
+	auto ticket = ++g.committed;
+	++g_gcommit_commits;
+	if (!g.busy) {
+		auto path = sqlite3_db_filename(db, "main");
+		if (path == nullptr || *path == '\0')
+			return;
+		try {
+			std::string wal = std::string(path) + "-wal";
+			std::unique_lock fl(g_gflush.lock);
+			if (pthread_equal(g_gflush.tid, {}) || g_gflush.stop) {
+				/* No flusher (yet/anymore); no company to wait for either */
+				fl.unlock();
+				lk.unlock();
+				dbeng_wal_sync(wal);
+				++g_gcommit_syncs;
+				return;
+			}
+			g_gflush.queue.emplace_back(this, std::move(wal));
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2974: ENOMEM");
+			return;
+		}
+		g.busy = true;
+		g_gflush.cv.notify_one();
+	}
+	g.cv.wait(lk, [&]() { return g.synced >= ticket; });
+}
+
+/**
+ * The gcommit flusher. Mailboxes in the queue are kept alive by the
+ * references of their waiting writers; once their ticket is served, they
+ * must no longer be touched.
+ */
+static void *db_gflush_thread(void *)
+{
+	std::unique_lock ql(g_gflush.lock);
+	while (!g_gflush.stop || !g_gflush.queue.empty()) {
+		if (g_gflush.queue.empty()) {
+			g_gflush.cv.wait(ql);
+			continue;
+		}
+		ql.unlock();
+		if (g_exmdb_group_commit_window > 0)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(g_exmdb_group_commit_window));
+		ql.lock();
+		auto batch = std::move(g_gflush.queue);
+		g_gflush.queue.clear();
+		ql.unlock();
+		for (auto &[base, path] : batch) {
+			auto &g = base->gcommit;
+			std::unique_lock lk(g.lock);
+			auto target = g.committed;
+			lk.unlock();
+			dbeng_wal_sync(path);
+			++g_gcommit_syncs;
+			lk.lock();
+			g.synced = target;
+			g.busy = false;
+			/* Latecomers waited for this round to end; serve them next. */
+			if (g.committed > target) try {
+				std::lock_guard fl(g_gflush.lock);
+				g_gflush.queue.emplace_back(base, std::move(path));
+				g.busy = true;
+			} catch (const std::bad_alloc &) {
+				mlog(LV_ERR, "E-2974: ENOMEM");
+				g.synced = g.committed;
+			}
+			g.cv.notify_all();
+		}
+		ql.lock();
+	}
+	return nullptr;
+}
+
 void db_base::handle_spares(sqlite3 *main, sqlite3 *eph)
 {
 	static constexpr size_t unlimited = 0;
@@ -446,10 +719,14 @@ void db_base::handle_spares(sqlite3 *main, sqlite3 *eph)
 	} catch (const std::bad_alloc &) {
 	}
 	lock.unlock();
-	if (eph != nullptr)
+	if (eph != nullptr) {
+		gx_sql_cache_detach(eph);
 		sqlite3_close(eph);
-	if (main != nullptr)
+	}
+	if (main != nullptr) {
+		gx_sql_cache_detach(main);
 		sqlite3_close(main);
+	}
 }
 
 db_conn::db_conn(db_base &base) :
@@ -458,20 +735,45 @@ db_conn::db_conn(db_base &base) :
 	++base.reference;
 }
 
+db_conn::db_conn(db_conn_pin &pin) :
+	psqlite(pin.conn->psqlite), m_sqlite_eph(pin.conn->m_sqlite_eph),
+	m_base(pin.conn->m_base), m_pin(&pin)
+{
+	++m_base->reference;
+	pin.lent = true;
+}
+
 db_conn::db_conn(db_conn &&o) :
 	psqlite(std::move(o.psqlite)),
 	m_sqlite_eph(std::move(o.m_sqlite_eph)),
-	m_base(std::move(o.m_base))
+	m_base(std::move(o.m_base)), m_pin(o.m_pin), m_changes(o.m_changes)
 {
 	o.psqlite = o.m_sqlite_eph = nullptr;
 	o.m_base = nullptr;
+	o.m_pin = nullptr;
 }
 
 db_conn::~db_conn()
 {
 	if (m_base == nullptr)
 		return;
-	m_base->handle_spares(std::move(psqlite), std::move(m_sqlite_eph));
+	if (m_pin != nullptr) {
+		/* handles stay with the pin */
+		m_pin->lent = false;
+	} else {
+		/* Make this connection's commits durable before replying */
+		if (g_exmdb_group_commit && psqlite != nullptr &&
+		    sqlite3_total_changes(psqlite) != m_changes)
+			m_base->group_sync(psqlite);
+		if (psqlite != nullptr)
+			m_base->note_cache_stats(psqlite);
+		/* Idle spares do not fetch, so shrink them to their share now */
+		db_pcache_enforce(psqlite);
+		db_pcache_enforce(m_sqlite_eph);
+		m_base->handle_spares(std::move(psqlite), std::move(m_sqlite_eph));
+	}
+	if (!t_db_maint)
+		m_base->last_activity = tp_now();
 	--m_base->reference;
 }
 
@@ -482,9 +784,35 @@ db_conn &db_conn::operator=(db_conn &&o)
 	o.psqlite = o.m_sqlite_eph = nullptr;
 	m_base = std::move(o.m_base);
 	o.m_base = nullptr;
+	m_pin = o.m_pin;
+	o.m_pin = nullptr;
+	m_changes = o.m_changes;
 	return *this;
 }
 
+db_conn_pin::db_conn_pin(const char *d)
+{
+	if (t_db_pin != nullptr)
+		/* already within a pin; let that one do the work */
+		return;
+	conn = db_engine_get_db(d);
+	if (!conn.has_value())
+		return;
+	try {
+		dir = d;
+	} catch (const std::bad_alloc &) {
+		conn.reset();
+		return;
+	}
+	t_db_pin = this;
+}
+
+db_conn_pin::~db_conn_pin()
+{
+	if (t_db_pin == this)
+		t_db_pin = nullptr;
+}
+
 /**
  * Create a new database connection (handle)
  *
@@ -495,6 +823,8 @@ db_conn &db_conn::operator=(db_conn &&o)
 bool db_conn::open(const char *dir) try
 {
 	m_base->get_dbs(dir, psqlite, m_sqlite_eph);
+	if (psqlite != nullptr)
+		m_changes = sqlite3_total_changes(psqlite);
 	return psqlite && m_sqlite_eph;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1349: ENOMEM");
@@ -536,9 +866,17 @@ void db_base::drop_all()
 {
 	instance_list.clear();
 	dynamic_list.clear();
+	dyn_index.by_scope.clear();
+	dyn_index.ancestors.clear();
+	dyn_index.dirty = true;
 	tables.table_list.clear();
+	for (auto &m : tables.ct_index)
+		m.clear();
+	tables.ct_dirty = true;
 	mx_sqlite_eph.clear();
 	mx_sqlite.clear();
+	std::lock_guard lk(fts_lock);
+	fts_db.reset();
 }
 
 /**
@@ -552,11 +890,153 @@ static bool remove_from_hash(const db_base &pdb, time_point now)
 	if (pdb.nsub_list.size() > 0)
 		/* there is still a client wanting notifications */
 		return false;
-	if (pdb.reference != 0 || now - pdb.last_time <= g_cache_interval)
+	if (pdb.reference != 0 ||
+	    now - pdb.last_activity.load() <= g_cache_interval)
 		return false;
 	return true;
 }
 
+/**
+ * Check if the mailbox can be dropped ahead of cache_interval. Unlike
+ * remove_from_hash, this also leaves alone mailboxes with open instances,
+ * which are state that clients expect to find again.
+ */
+static bool db_evictable(const db_base &pdb)
+{
+	return pdb.reference == 0 && pdb.tables.table_list.empty() &&
+	       pdb.nsub_list.empty() && pdb.instance_list.empty();
+}
+
+/**
+ * Walk the mailbox table, drop expired entries, and gather the remaining
+ * idle ones as eviction candidates. Returns the estimated memory of what
+ * is left. Never waits for a lock: a busy shard or mailbox is skipped
+ * (and not counted) until the next round.
+ */
+static size_t db_sweep(time_point now, std::vector<evict_cand> *cand)
+{
+	size_t mem = 0;
+	for (auto &shard : g_hash_shards) {
+		std::unique_lock hhold(shard.lock, std::try_to_lock);
+		if (!hhold.owns_lock())
+			continue;
+		for (auto it = shard.map.begin(); it != shard.map.end(); ) {
+			auto &dbase = it->second;
+			/*
+			 * There must be no readers nor writers if we destroy it.
+			 * Hence another lock.
+			 */
+			std::unique_lock dhold(dbase.giant_lock, std::try_to_lock);
+			if (!dhold.owns_lock()) {
+				++it;
+				continue;
+			}
+			if (remove_from_hash(dbase, now)) {
+				dhold.unlock();
+				it = shard.map.erase(it);
+				--g_hash_count;
+				++g_expired_count;
+				continue;
+			}
+			auto m = dbase.mem_usage();
+			mem += m;
+			if (cand != nullptr && db_evictable(dbase)) try {
+				cand->push_back({&shard, it->first, dbase.last_activity.load(), m});
+			} catch (const std::bad_alloc &) {
+			}
+			++it;
+		}
+	}
+	return mem;
+}
+
+/**
+ * Drop the least recently used idle mailboxes from @cand until @nent
+ * entries and @nbytes of (estimated) memory have been released. Returns
+ * the number of bytes released.
+ */
+static size_t db_evict_lru(std::vector<evict_cand> &cand, size_t nent, size_t nbytes)
+{
+	std::sort(cand.begin(), cand.end(),
+		[](const evict_cand &a, const evict_cand &b) { return a.last_activity < b.last_activity; });
+	size_t freed = 0;
+	for (const auto &c : cand) {
+		if (nent == 0 && freed >= nbytes)
+			break;
+		std::unique_lock hhold(c.shard->lock, std::try_to_lock);
+		if (!hhold.owns_lock())
+			continue;
+		auto it = c.shard->map.find(c.dir);
+		if (it == c.shard->map.end())
+			continue;
+		auto &dbase = it->second;
+		std::unique_lock dhold(dbase.giant_lock, std::try_to_lock);
+		/* Someone used it after the sweep: no longer the LRU one. */
+		if (!dhold.owns_lock() || !db_evictable(dbase) ||
+		    dbase.last_activity.load() != c.last_activity)
+			continue;
+		dhold.unlock();
+		c.shard->map.erase(it);
+		--g_hash_count;
+		++g_evicted_count;
+		freed += c.mem;
+		if (nent > 0)
+			--nent;
+	}
+	return freed;
+}
+
+static size_t db_evict_lru(size_t nent, size_t nbytes) try
+{
+	std::vector<evict_cand> cand;
+	cand.reserve(g_hash_count);
+	db_sweep(tp_now(), &cand);
+	return db_evict_lru(cand, nent, nbytes);
+} catch (const std::bad_alloc &) {
+	return 0;
+}
+
+/**
+ * List the resident mailboxes that nobody has used since @cutoff. Busy
+ * shards are skipped; the caller asks again later anyway.
+ */
+/**
+ * Like db_engine_get_db, but only for mailboxes that are loaded right now.
+ * Never opens one, so it needs no RPC env and does not undo evictions.
+ */
+db_conn_ptr db_engine_peek_db(const char *path)
+{
+	if (*path == '\0')
+		return std::nullopt;
+	auto &shard = db_shard_of(path);
+	std::unique_lock hhold(shard.lock);
+	auto it = shard.map.find(path);
+	if (it == shard.map.end())
+		return std::nullopt;
+	db_conn_ptr conn(it->second);
+	hhold.unlock();
+	if (!conn->open(path))
+		return std::nullopt;
+	return conn;
+}
+
+std::vector<std::string> db_engine_idle_dirs(time_point cutoff) try
+{
+	std::vector<std::string> dirs;
+	for (auto &shard : g_hash_shards) {
+		std::unique_lock hhold(shard.lock, std::try_to_lock);
+		if (!hhold.owns_lock())
+			continue;
+		for (const auto &[dir, dbase] : shard.map)
+			if (dbase.reference == 0 && dbase.last_activity.load() < cutoff)
+				dirs.push_back(dir);
+	}
+	return dirs;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2940: ENOMEM");
+	return {};
+}
+
 static void *db_expiry_thread(void *param)
 {
 	int count;
@@ -564,30 +1044,48 @@ static void *db_expiry_thread(void *param)
 	count = 0;
 	while (!g_notify_stop) {
 		sleep(1);
-		if (count < 10) {
+		/*
+		 * With a memory budget, look every second so that pressure
+		 * is relieved before requests start to fail. Otherwise only
+		 * time-based expiry is needed, which is not urgent.
+		 */
+		if (g_exmdb_cache_budget == 0 && count < 10) {
 			count ++;
 			continue;
 		}
 		count = 0;
-		/* Exclusive ownership over the list is needed, obviously, since we modify it */
-		std::lock_guard hhold(g_hash_lock);
-		auto now_time = tp_now();
-		for (auto it = g_hash_table.begin(); it != g_hash_table.end(); ) {
-			auto &dbase = it->second;
-			/*
-			 * There must be no readers nor writers if we destroy it.
-			 * Hence another lock.
-			 */
-			std::unique_lock dhold(dbase.giant_lock);
-			if (remove_from_hash(dbase, now_time))
-				it = g_hash_table.erase(it);
-			else
-				++it;
-		}
+		bk_reap();
+		std::vector<evict_cand> cand;
+		auto mem = db_sweep(tp_now(), g_exmdb_cache_budget != 0 ? &cand : nullptr);
+		if (g_exmdb_cache_budget != 0 && mem > g_exmdb_cache_budget)
+			mem -= db_evict_lru(cand, 0, mem - g_exmdb_cache_budget);
+		g_cache_mem = mem;
 	}
 	return nullptr;
 }
 
+void db_engine_report()
+{
+	mlog(LV_INFO, "exmdb_provider: %zu mailboxes resident (table_size=%zu), "
+	        "~%zu MB in use (budget %llu MB)",
+	        g_hash_count.load(), g_table_size, g_cache_mem.load() >> 20,
+	        g_exmdb_cache_budget >> 20);
+	mlog(LV_INFO, "exmdb_provider: since start: %llu expired, %llu evicted, "
+	        "%llu refused for lack of room",
+	        LLU{g_expired_count.load()}, LLU{g_evicted_count.load()},
+	        LLU{g_refused_count.load()});
+	uint64_t hits = 0, misses = 0;
+	gx_sql_cache_stats(hits, misses);
+	mlog(LV_INFO, "exmdb_provider: statement cache: %llu hits, %llu misses "
+	        "(up to %u statements per handle)",
+	        LLU{hits}, LLU{misses}, g_exmdb_stmt_cache);
+	db_pcache_report();
+	if (g_exmdb_group_commit)
+		mlog(LV_INFO, "exmdb_provider: group commit: %llu writing connections, "
+		        "%llu WAL syncs", LLU{g_gcommit_commits.load()},
+		        LLU{g_gcommit_syncs.load()});
+}
+
 void dg_notify(db_conn::NOTIFQ &&notifq)
 {
 	for (auto &&[dg, idarr] : notifq) {
@@ -599,91 +1097,204 @@ void dg_notify(db_conn::NOTIFQ &&notifq)
 	notifq.clear();
 }
 
-static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
-    uint64_t search_fid, uint64_t scope_fid, const RESTRICTION *prestriction,
-    db_conn_ptr &pdb)
+/**
+ * Collect the messages of @scope_fid which need to be evaluated against
+ * @prestriction for search folder population.
+ */
+static bool db_engine_search_candidates(db_conn &db, uint64_t scope_fid,
+    const RESTRICTION *prestriction, const res_plan *plan,
+    std::vector<uint64_t> &mids) try
 {
 	char sql_string[128];
-	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read); // ends before writes take place
+	auto sql_transact = gx_sql_begin(db.psqlite, txn_mode::read);
 	if (!sql_transact)
 		return false;
 	snprintf(sql_string, std::size(sql_string), "SELECT is_search "
 	          "FROM folders WHERE folder_id=%llu", LLU{scope_fid});
-	auto pstmt = pdb->prep(sql_string);
+	auto pstmt = db.prep(sql_string);
 	if (pstmt == nullptr)
-		return FALSE;
+		return false;
 	if (pstmt.step() != SQLITE_ROW)
-		return TRUE;
+		return true;
 	if (sqlite3_column_int64(pstmt, 0) == 0)
 		snprintf(sql_string, std::size(sql_string), "SELECT message_id FROM"
-		          " messages WHERE parent_fid=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		          " messages WHERE parent_fid=%llu", LLU{scope_fid});
 	else
 		snprintf(sql_string, std::size(sql_string), "SELECT message_id FROM"
-		          " search_result WHERE folder_id=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		          " search_result WHERE folder_id=%llu", LLU{scope_fid});
 	pstmt.finalize();
-	pstmt = pdb->prep(sql_string);
+	if (plan != nullptr && !plan->prefilter().empty())
+		pstmt = db.prep(("SELECT x.message_id FROM (" +
+		        std::string(sql_string) + ") AS x WHERE " +
+		        plan->prefilter()).c_str());
+	else
+		pstmt = db.prep(sql_string);
 	if (pstmt == nullptr)
-		return FALSE;
-	auto pmessage_ids = eid_array_init();
-	if (pmessage_ids == nullptr)
-		return FALSE;
-	auto cl_0 = make_scope_exit([&]() { eid_array_free(pmessage_ids); });
-	while (pstmt.step() == SQLITE_ROW)
-		if (!eid_array_append(pmessage_ids,
-		    sqlite3_column_int64(pstmt, 0)))
-			return FALSE;
+		return false;
+	/* Full-text prefilter; candidates still undergo exact evaluation */
+	std::unordered_set<uint64_t> fts_cand;
+	bool use_fts = db.fts_candidates(prestriction, fts_cand);
+	while (pstmt.step() == SQLITE_ROW) {
+		uint64_t mid = sqlite3_column_int64(pstmt, 0);
+		if (use_fts && fts_cand.count(mid) == 0)
+			continue;
+		mids.push_back(mid);
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2915: ENOMEM");
+	return false;
+}
+
+/**
+ * Write out the matches found so far. Only one worker flushes at a time; if
+ * @wait is false and another worker is flushing (or there is not enough to
+ * make a batch), this returns immediately.
+ */
+static bool sf_flush(const POPULATING_NODE &srch, sf_work &work,
+    db_conn &db, bool wait) try
+{
+	std::unique_lock fhold(work.flush_lock, std::defer_lock);
+	if (wait)
+		fhold.lock();
+	else if (!fhold.try_lock())
+		return true;
+	std::vector<uint64_t> batch;
+	{
+		std::lock_guard lhold(work.lock);
+		if (!wait && work.pending.size() < SF_FLUSH_BATCH)
+			return true;
+		batch.swap(work.pending);
+	}
+	if (batch.empty() || work.closed)
+		return true;
+	char sql_string[128];
+	auto sql_transact = gx_sql_begin(db.psqlite, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	snprintf(sql_string, std::size(sql_string), "SELECT 1 FROM folders"
+	         " WHERE folder_id=%llu", LLU{srch.folder_id});
+	auto pstmt = db.prep(sql_string);
+	if (pstmt == nullptr)
+		return false;
+	if (pstmt.step() != SQLITE_ROW) {
+		/* Search folder is closed (deleted) already. */
+		work.closed = true;
+		return true;
+	}
+	pstmt = db.prep("REPLACE INTO search_result (folder_id, message_id) VALUES (?,?)");
+	if (pstmt == nullptr)
+		return false;
+	std::vector<uint64_t> added;
+	added.reserve(batch.size());
+	for (auto mid : batch) {
+		pstmt.bind_int64(1, srch.folder_id);
+		pstmt.bind_int64(2, mid);
+		/* message may have been hard-deleted in the meantime */
+		if (pstmt.step() == SQLITE_DONE)
+			added.push_back(mid);
+		pstmt.reset();
+	}
 	pstmt.finalize();
-	auto t_start = tp_now();
-	auto cl_1 = make_scope_exit([&]() {
-		auto t_end = tp_now();
-		auto t_diff = std::chrono::duration<double>(t_end - t_start).count();
-		if (pmessage_ids->count > 0 && t_diff >= 1)
-			mlog(LV_DEBUG, "db_eng_sf: %u messages in %.2f seconds",
-				pmessage_ids->count, t_diff);
-	});
-	sql_transact = xtransaction();
-	for (size_t i = 0, count = 0; i < pmessage_ids->count; ++i, ++count) {
+	if (sql_transact.commit() != SQLITE_OK)
+		return false;
+	/*
+	 * Update other search folders (seems like it is allowed to have a
+	 * search folder have a scope containing another search folder;
+	 * exmdb_provider only does a descendant check), and send the regular
+	 * notifications, one batch at a time.
+	 */
+	db_conn::NOTIFQ notifq;
+	auto dbase = db.lock_base_wr();
+	for (auto mid : added) {
+		db.proc_dynamic_event(srch.cpid, dynamic_event::new_msg,
+			srch.folder_id, mid, 0, *dbase, notifq);
+		db.notify_link_creation(srch.folder_id, mid, *dbase, notifq);
+	}
+	dg_notify(std::move(notifq));
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2916: ENOMEM");
+	return false;
+}
+
+/**
+ * Evaluate chunks of @work until none are left. Each worker runs with its
+ * own environment and its own read connection.
+ */
+static void sf_popul_worker(const POPULATING_NODE &srch, sf_work &work)
+{
+	exmdb_server::build_env(EM_PRIVATE, srch.dir.c_str());
+	auto cl_0 = make_scope_exit(exmdb_server::free_env);
+	auto pdb = db_engine_get_db(srch.dir.c_str());
+	if (!pdb) {
+		work.failed = true;
+		return;
+	}
+	std::vector<uint64_t> hits;
+	while (!g_notify_stop && !work.failed && !work.closed) {
+		size_t first = work.next.fetch_add(SF_CHUNK);
+		if (first >= work.mids.size())
+			break;
+		size_t last = std::min(first + SF_CHUNK, work.mids.size());
+		hits.clear();
+		{
+			auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
+			if (!sql_transact) {
+				work.failed = true;
+				break;
+			}
+			/* Candidates have already passed the plan's prefilter */
+			auto plan = srch.plan.get();
+			for (size_t i = first; i < last && !g_notify_stop; ++i)
+				if (plan != nullptr ?
+				    plan->eval(pdb->psqlite, srch.cpid, work.mids[i], true) :
+				    cu_eval_msg_restriction(pdb->psqlite, srch.cpid,
+				    work.mids[i], srch.prestriction))
+					hits.push_back(work.mids[i]);
+		}
 		if (g_notify_stop)
 			break;
-		auto sql_transact1 = gx_sql_begin(pdb->psqlite, txn_mode::write);
-		if (!sql_transact1)
-			return false;
-		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, pmessage_ids->pids[i], prestriction))
-			continue;
-		snprintf(sql_string, std::size(sql_string), "REPLACE INTO search_result "
-		         "(folder_id, message_id) VALUES (%llu, %llu)",
-		         LLU{search_fid}, LLU{pmessage_ids->pids[i]});
-		auto ret = pdb->exec(sql_string, SQLEXEC_SILENT_CONSTRAINT);
-		if (ret == SQLITE_CONSTRAINT)
-			/*
-			 * Search folder is closed (deleted) already, INSERT
-			 * does not succeed, and neither will subsequent queries.
-			 */
+		try {
+			std::lock_guard lhold(work.lock);
+			work.pending.insert(work.pending.end(), hits.begin(), hits.end());
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2917: ENOMEM");
+			work.failed = true;
 			break;
-		else if (ret != SQLITE_OK)
-			continue;
-		if (sql_transact1.commit() != SQLITE_OK)
-			return false;
-		/*
-		 * Update other search folders (seems like it is allowed to
-		 * have a search folder have a scope containing another search
-		 * folder; exmdb_provider only does a descendant check).
-		 */
-		db_conn::NOTIFQ notifq;
-		auto dbase = pdb->lock_base_wr();
-		pdb->proc_dynamic_event(cpid, dynamic_event::new_msg,
-			search_fid, pmessage_ids->pids[i], 0, *dbase, notifq);
-		/*
-		 * Regular notifications
-		 */
-		pdb->notify_link_creation(search_fid, pmessage_ids->pids[i], *dbase, notifq);
-		dg_notify(std::move(notifq));
-		dbase.reset();
+		}
+		if (!sf_flush(srch, work, *pdb, false))
+			work.failed = true;
 	}
-	return TRUE;
+	if (!g_notify_stop && !sf_flush(srch, work, *pdb, true))
+		work.failed = true;
+}
+
+/**
+ * Evaluate the candidate set of one search on up to exmdb_search_parallel
+ * threads (the calling thread included).
+ */
+static void db_engine_search_run(const POPULATING_NODE &srch, sf_work &work)
+{
+	auto t_start = tp_now();
+	size_t nchunks = (work.mids.size() + SF_CHUNK - 1) / SF_CHUNK;
+	size_t nthr = std::clamp(static_cast<size_t>(g_exmdb_search_parallel),
+	              static_cast<size_t>(1), std::max(nchunks, static_cast<size_t>(1)));
+	std::vector<std::thread> helpers;
+	try {
+		/* Threads inherit the niceness of the sfpop thread. */
+		for (size_t i = 1; i < nthr; ++i)
+			helpers.emplace_back(sf_popul_worker, std::cref(srch), std::ref(work));
+	} catch (const std::system_error &e) {
+		mlog(LV_WARN, "W-2918: db_eng_sf: could not spawn helper: %s", e.what());
+	}
+	sf_popul_worker(srch, work);
+	for (auto &t : helpers)
+		t.join();
+	auto t_diff = std::chrono::duration<double>(tp_now() - t_start).count();
+	if (work.mids.size() > 0 && t_diff >= 1)
+		mlog(LV_DEBUG, "db_eng_sf: %zu messages in %.2f seconds (%zu threads)",
+			work.mids.size(), t_diff, helpers.size() + 1);
 }
 
 static BOOL db_engine_load_folder_descendant(const char *dir,
@@ -792,13 +1403,22 @@ static void *sf_popul_thread(void *param)
 		auto pdb = db_engine_get_db(psearch->dir.c_str());
 		if (!pdb)
 			goto NEXT_SEARCH;
-		for (size_t i = 0; i < pfolder_ids->count; ++i) {
-			if (g_notify_stop)
-				break;
-			if (!db_engine_search_folder(psearch->dir.c_str(),
-			    psearch->cpid, psearch->folder_id,
-			    pfolder_ids->pids[i], psearch->prestriction, pdb))
-				break;
+		{
+			/*
+			 * Pool the messages of all scope folders so that one
+			 * big folder is split up just like many small ones.
+			 */
+			sf_work work;
+			for (size_t i = 0; i < pfolder_ids->count; ++i) {
+				if (g_notify_stop)
+					break;
+				if (!db_engine_search_candidates(*pdb,
+				    pfolder_ids->pids[i], psearch->prestriction,
+				    psearch->plan.get(), work.mids))
+					break;
+			}
+			if (!g_notify_stop)
+				db_engine_search_run(*psearch, work);
 		}
 		if (g_notify_stop)
 			break;
@@ -818,9 +1438,11 @@ static void *sf_popul_thread(void *param)
 			sleep(60);
 			goto NEXT_SEARCH;
 		}
+		/* reload_content_table rebuilds for all users of a shared table */
 		for (const auto &t : dbase->tables.table_list)
 			if (t.type == table_type::content &&
-			    psearch->folder_id == t.folder_id)
+			    psearch->folder_id == t.folder_id &&
+			    dbase->is_primary_table(t))
 				table_ids.push_back(t.table_id);
 		dbase.reset();
 		pdb.reset();
@@ -855,6 +1477,7 @@ int db_engine_run()
 	if (sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0) != SQLITE_OK)
 		mlog(LV_WARN, "exmdb_provider: failed to close"
 			" memory statistic for sqlite engine");
+	db_pcache_install();
 	if (SQLITE_OK != sqlite3_initialize()) {
 		mlog(LV_ERR, "exmdb_provider: Failed to initialize sqlite engine");
 		return -2;
@@ -867,6 +1490,23 @@ int db_engine_run()
 		return -4;
 	}
 	pthread_setname_np(g_scan_tid, "db_expiry");
+	ret = pthread_create4(&g_maint_tid, nullptr, db_maint_thread, &g_notify_stop);
+	if (ret != 0) {
+		mlog(LV_ERR, "E-2941: pthread_create: %s", strerror(ret));
+		db_engine_stop();
+		return -4;
+	}
+	pthread_setname_np(g_maint_tid, "db_maint");
+	if (g_exmdb_group_commit) {
+		g_gflush.stop = false;
+		ret = pthread_create4(&g_gflush.tid, nullptr, db_gflush_thread, nullptr);
+		if (ret != 0) {
+			mlog(LV_ERR, "E-2975: pthread_create: %s", strerror(ret));
+			db_engine_stop();
+			return -4;
+		}
+		pthread_setname_np(g_gflush.tid, "db_gcommit");
+	}
 	for (unsigned int i = 0; i < g_threads_num; ++i) {
 		pthread_t tid;
 		ret = pthread_create4(&tid, nullptr, sf_popul_thread, nullptr);
@@ -896,27 +1536,44 @@ void db_engine_stop()
 			pthread_kill(g_scan_tid, SIGALRM);
 			pthread_join(g_scan_tid, NULL);
 		}
+		if (!pthread_equal(g_maint_tid, {})) {
+			pthread_kill(g_maint_tid, SIGALRM);
+			pthread_join(g_maint_tid, nullptr);
+		}
+		if (!pthread_equal(g_gflush.tid, {})) {
+			/* Serves what is still queued before exiting */
+			{
+				std::lock_guard fl(g_gflush.lock);
+				g_gflush.stop = true;
+			}
+			g_gflush.cv.notify_one();
+			pthread_join(g_gflush.tid, nullptr);
+			g_gflush.tid = {};
+		}
 	}
 	g_thread_ids.clear();
 	{ /* silence cov-scan, take locks even in single-thread scenarios */
 		auto t_start = tp_now();
 		size_t conc = std::min(gx_concurrency(), g_threads_num);
 		std::vector<std::future<void>> futs;
-		auto iter = g_hash_table.begin();
-		for (size_t tid = 0; tid < conc; ++tid) {
-			if (iter == g_hash_table.end())
-				break;
-			futs.emplace_back(std::async([](size_t tid, decltype(g_hash_table)::iterator iter, size_t skip) -> void {
-				while (iter != g_hash_table.end()) {
-					iter->second.drop_all();
-					for (size_t i = 0; i < skip && iter != g_hash_table.end(); ++i)
-						++iter;
+		if (conc == 0)
+			conc = 1;
+		for (size_t tid = 0; tid < conc && tid < DB_SHARDS; ++tid) {
+			futs.emplace_back(std::async([](size_t first, size_t skip) -> void {
+				for (size_t i = first; i < DB_SHARDS; i += skip) {
+					auto &shard = g_hash_shards[i];
+					std::lock_guard hhold(shard.lock);
+					for (auto &e : shard.map)
+						e.second.drop_all();
 				}
-			}, tid, iter, conc));
-			++iter;
+			}, tid, conc));
 		}
 		futs.clear();
-		g_hash_table.clear();
+		for (auto &shard : g_hash_shards) {
+			std::lock_guard hhold(shard.lock);
+			shard.map.clear();
+		}
+		g_hash_count = 0;
 		mlog(LV_INFO, "Database shutdown took %llu ms",
 			LLU(std::chrono::duration_cast<std::chrono::milliseconds>(tp_now() - t_start).count()));
 	}
@@ -938,6 +1595,7 @@ BOOL db_engine_enqueue_populating_criteria(const char *dir, cpid_t cpid,
 	psearch->prestriction = prestriction->dup();
 	if (psearch->prestriction == nullptr)
 		return FALSE;
+	psearch->plan = res_plan::compile(psearch->prestriction);
 	psearch->folder_ids.pll = me_alloc<uint64_t>(pfolder_ids->count);
 	if (psearch->folder_ids.pll == nullptr)
 		return FALSE;
@@ -980,6 +1638,7 @@ void db_conn::update_dynamic(uint64_t folder_id, uint32_t search_flags,
 	dn.prestriction = prestriction->dup();
 	if (dn.prestriction == nullptr)
 		return;
+	dn.plan = res_plan::compile(dn.prestriction);
 	dn.folder_ids.count = pfolder_ids->count;
 	dn.folder_ids.pll   = me_alloc<uint64_t>(pfolder_ids->count);
 	if (dn.folder_ids.pll == nullptr)
@@ -991,6 +1650,7 @@ void db_conn::update_dynamic(uint64_t folder_id, uint32_t search_flags,
 		dbase.dynamic_list.push_back(std::move(dn));
 	else
 		*i = std::move(dn);
+	dbase.dyn_index.dirty = true;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2136: ENOMEM");
 }
@@ -999,6 +1659,80 @@ void db_conn::delete_dynamic(uint64_t folder_id, db_base *dbase)
 {
 	gromox::erase_first_if(dbase->dynamic_list,
 		[=](const dynamic_node &n) { return n.folder_id == folder_id; });
+	dbase->dyn_index.dirty = true;
+}
+
+/**
+ * Look up the dynamic searches which have @folder_id in their scope,
+ * rebuilding the registry first if dynamic_list has changed since.
+ */
+const std::vector<dyn_scope> *db_base::dynamic_scopes(uint64_t folder_id) try
+{
+	auto &x = dyn_index;
+	if (x.dirty) {
+		x.by_scope.clear();
+		for (size_t n = 0; n < dynamic_list.size(); ++n) {
+			const auto &fids = dynamic_list[n].folder_ids;
+			for (size_t i = 0; i < fids.count; ++i)
+				x.by_scope[fids.pll[i]].push_back({static_cast<uint32_t>(n), static_cast<uint32_t>(i)});
+		}
+		x.dirty = false;
+	}
+	auto it = x.by_scope.find(folder_id);
+	return it != x.by_scope.end() ? &it->second : nullptr;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2923: ENOMEM");
+	dyn_index.dirty = true;
+	return nullptr;
+}
+
+/**
+ * Return @folder_id followed by its ancestors (closest first, up to and
+ * including the root). Chains are cached; the cache is only valid as long
+ * as no folder gets reparented (see proc_dynamic_event/move_folder), and is
+ * not filled while a move is uncommitted.
+ */
+const std::vector<uint64_t> *db_base::folder_ancestors(sqlite3 *psqlite,
+    uint64_t folder_id) try
+{
+	auto &m = dyn_index.ancestors;
+	auto it = m.find(folder_id);
+	if (it != m.end())
+		return &it->second;
+	std::vector<uint64_t> chain{folder_id};
+	auto root = exmdb_server::is_private() ? PRIVATE_FID_ROOT : PUBLIC_FID_ROOT;
+	auto pstmt = gx_sql_prep(psqlite, "SELECT parent_id FROM folders WHERE folder_id=?");
+	if (pstmt == nullptr)
+		return nullptr;
+	/*
+	 * A chain that ends before the root (folder deleted meanwhile) is
+	 * kept as well; folder IDs are not reused.
+	 */
+	for (auto fid = folder_id; fid != root; ) {
+		pstmt.bind_int64(1, fid);
+		if (pstmt.step() != SQLITE_ROW)
+			break;
+		fid = pstmt.col_uint64(0);
+		pstmt.reset();
+		chain.push_back(fid);
+	}
+	if (dyn_index.frozen)
+		return &dyn_index.uncached.emplace_back(std::move(chain));
+	return &m.emplace(folder_id, std::move(chain)).first->second;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2924: ENOMEM");
+	return nullptr;
+}
+
+/* Equivalent of cu_is_descendant_folder(child, parent) on cached chains */
+static bool dbeng_is_descendant(db_base &dbase, sqlite3 *psqlite,
+    uint64_t child, uint64_t parent, BOOL *pb_included)
+{
+	auto chain = dbase.folder_ancestors(psqlite, child);
+	if (chain == nullptr)
+		return false;
+	*pb_included = std::find(chain->cbegin(), chain->cend(), parent) != chain->cend();
+	return true;
 }
 
 static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
@@ -1012,9 +1746,9 @@ static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
 	if (!(pdynamic->search_flags & RECURSIVE_SEARCH))
 		return;
 
-	if (!cu_is_descendant_folder(pdb->psqlite,
+	if (!dbeng_is_descendant(dbase, pdb->psqlite,
 	    id1, pdynamic->folder_ids.pll[i], &b_included) ||
-	    !cu_is_descendant_folder(pdb->psqlite,
+	    !dbeng_is_descendant(dbase, pdb->psqlite,
 	    id2, pdynamic->folder_ids.pll[i], &b_included1)) {
 		mlog(LV_DEBUG, "db_engine: fatal error in %s", __PRETTY_FUNCTION__);
 		return;
@@ -1047,7 +1781,7 @@ static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
 				mlog(LV_DEBUG, "db_engine: failed to delete from search_result");
 			continue;
 		}
-		if (!cu_eval_msg_restriction(pdb->psqlite,
+		if (!cu_eval_msg_plan(pdynamic->plan.get(), pdb->psqlite,
 		    cpid, message_id, pdynamic->prestriction))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
@@ -1061,26 +1795,14 @@ static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
 	}
 }
 
+/* Caller has established that @id1 is within the scope of @pdynamic. */
 static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
-    uint64_t id1, uint64_t id2, const dynamic_node *pdynamic, size_t i,
+    uint64_t id1, uint64_t id2, const dynamic_node *pdynamic,
     db_base &dbase, db_conn::NOTIFQ &notifq)
 {
 	BOOL b_exist;
-	BOOL b_included;
 	char sql_string[128];
 
-	if (pdynamic->search_flags & RECURSIVE_SEARCH) {
-		if (!cu_is_descendant_folder(pdb->psqlite,
-		    id1, pdynamic->folder_ids.pll[i], &b_included)) {
-			mlog(LV_DEBUG, "db_engine: fatal error in %s", __PRETTY_FUNCTION__);
-			return;
-		}
-		if (!b_included)
-			return;
-	} else {
-		if (id1 != pdynamic->folder_ids.pll[i])
-			return;
-	}
 	switch (event_type) {
 	case dynamic_event::new_msg:
 		if (!common_util_check_search_result(pdb->psqlite,
@@ -1090,7 +1812,7 @@ static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
 		}
 		if (b_exist)
 			return;
-		if (!cu_eval_msg_restriction(pdb->psqlite,
+		if (!cu_eval_msg_plan(pdynamic->plan.get(), pdb->psqlite,
 		    cpid, id2, pdynamic->prestriction))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
@@ -1127,8 +1849,8 @@ static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
 			mlog(LV_DEBUG, "db_engine: failed to check item in search_result");
 			return;
 		}
-		if (cu_eval_msg_restriction(
-			pdb->psqlite, cpid, id2, pdynamic->prestriction)) {
+		if (cu_eval_msg_plan(pdynamic->plan.get(),
+		    pdb->psqlite, cpid, id2, pdynamic->prestriction)) {
 			if (b_exist) {
 				dbeng_notify_cttbl_modify_row(
 					pdb, pdynamic->folder_id, id2, dbase);
@@ -1178,36 +1900,59 @@ static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
  * change).
  */
 void db_conn::proc_dynamic_event(cpid_t cpid, dynamic_event event_type,
-    uint64_t id1, uint64_t id2, uint64_t id3, db_base &dbase, NOTIFQ &notifq)
+    uint64_t id1, uint64_t id2, uint64_t id3, db_base &dbase, NOTIFQ &notifq) try
 {
 	auto pdb = this;
 	uint32_t folder_type;
 	
-	if (event_type == dynamic_event::move_folder &&
-	    !common_util_get_folder_type(pdb->psqlite, id3, &folder_type)) {
-		mlog(LV_DEBUG, "db_engine: fatal error in %s", __PRETTY_FUNCTION__);
-		return;
-	}
-	/* Iterate over all search folders (event sinks)... */
-	for (auto &dn : dbase.dynamic_list) {
-		auto pdynamic = &dn;
+	if (dynamic_event::move_folder == event_type) {
 		/*
-		 * Iterate over source folders (a.k.a. search scope; MS-OXCFOLD
-		 * v23.2 §1.1).
-		 *
-		 * [In conjunction with dynevt_1/2] if id1 is within the scope,
-		 * pdynamic gets the event.
+		 * id3 and everything below it has a new set of ancestors. The
+		 * caller thaws the cache once its transaction is over.
 		 */
-		for (size_t i = 0; i < pdynamic->folder_ids.count; ++i) {
-			if (dynamic_event::move_folder == event_type) {
-				dbeng_dynevt_1(pdb, cpid, id1, id2, id3,
-					folder_type, pdynamic, i, dbase, notifq);
-				continue;
-			}
-			dbeng_dynevt_2(pdb, cpid, event_type, id1, id2,
-				pdynamic, i, dbase, notifq);
+		dbase.dyn_index.ancestors.clear();
+		dbase.dyn_index.frozen = true;
+		if (!common_util_get_folder_type(pdb->psqlite, id3, &folder_type)) {
+			mlog(LV_DEBUG, "db_engine: fatal error in %s", __PRETTY_FUNCTION__);
+			return;
 		}
+		/*
+		 * Iterate over all search folders (event sinks) and their
+		 * source folders (a.k.a. search scope; MS-OXCFOLD v23.2
+		 * §1.1). Folder moves are rare enough to not bother with
+		 * the index.
+		 */
+		for (auto &dn : dbase.dynamic_list)
+			for (size_t i = 0; i < dn.folder_ids.count; ++i)
+				dbeng_dynevt_1(pdb, cpid, id1, id2, id3,
+					folder_type, &dn, i, dbase, notifq);
+		return;
+	}
+	/*
+	 * id1 is within a scope if it is the source folder itself, or, for
+	 * recursive searches, any of its ancestors is. Matches are visited in
+	 * dynamic_list/scope order, like a plain walk over all searches would.
+	 */
+	auto chain = dbase.folder_ancestors(pdb->psqlite, id1);
+	if (chain == nullptr) {
+		mlog(LV_DEBUG, "db_engine: fatal error in %s", __PRETTY_FUNCTION__);
+		return;
+	}
+	std::vector<dyn_scope> hits;
+	for (size_t k = 0; k < chain->size(); ++k) {
+		auto scopes = dbase.dynamic_scopes((*chain)[k]);
+		if (scopes == nullptr)
+			continue;
+		for (const auto &e : *scopes)
+			if (k == 0 || dbase.dynamic_list[e.node].search_flags & RECURSIVE_SEARCH)
+				hits.push_back(e);
 	}
+	std::sort(hits.begin(), hits.end());
+	for (const auto &e : hits)
+		dbeng_dynevt_2(pdb, cpid, event_type, id1, id2,
+			&dbase.dynamic_list[e.node], dbase, notifq);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2925: ENOMEM");
 }
 
 static int db_engine_compare_propval(
@@ -1429,6 +2174,55 @@ static inline void *pick_single_val(uint16_t type, void *mv, size_t j)
 	return mv;
 }
 
+/**
+ * Send a row notification computed for @ptable to every content table that
+ * shares its rows.
+ */
+static void cttbl_broadcast(const db_base &dbase, const table_node &ptable,
+    DB_NOTIFY_DATAGRAM &dg)
+{
+	for (const auto &t : dbase.tables.table_list) {
+		if (t.type != table_type::content || t.sql_id != ptable.sql_id)
+			continue;
+		dg.id_array[0] = t.table_id;
+		notification_agent_backward_notify(t.remote_id, &dg);
+	}
+	dg.id_array[0] = ptable.table_id;
+}
+
+/**
+ * Primary content tables of @folder_id, normal and FAI alike (for events
+ * where the row's presence in the table is checked anyway).
+ */
+static std::vector<table_node *> cttbl_of_folder(db_base &dbase, uint64_t folder_id)
+{
+	std::vector<table_node *> out;
+	ct_bucket spare;
+	for (bool fai : {false, true}) {
+		auto b = dbase.content_tables(folder_id, fai, spare);
+		if (b != nullptr)
+			for (const auto &e : b->tables)
+				out.push_back(e.table);
+	}
+	return out;
+}
+
+/**
+ * Header rows were possibly added to shared tables; hand the new header ID
+ * counter from each group's first table to the others.
+ */
+static void cttbl_sync_headers(db_base &dbase)
+{
+	auto &list = dbase.tables.table_list;
+	for (auto it = list.begin(); it != list.end(); ++it) {
+		if (it->type != table_type::content || !dbase.is_primary_table(*it))
+			continue;
+		for (auto jt = std::next(it); jt != list.end(); ++jt)
+			if (jt->type == table_type::content && jt->sql_id == it->sql_id)
+				jt->header_id = it->header_id;
+	}
+}
+
 static void dbeng_notify_cttbl_add_row(db_conn *pdb,
     uint64_t folder_id, uint64_t message_id, db_base &dbase) try
 {
@@ -1445,24 +2239,32 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 		return;	
 	std::unique_ptr<prepared_statements> optim;
 	BOOL b_fai = pvb_enabled(pvalue0) ? TRUE : false;
+	ct_bucket spare;
+	auto bucket = dbase.content_tables(folder_id, b_fai, spare);
+	if (bucket == nullptr)
+		return;
+	/* Result per distinct restriction: -1 not evaluated yet, else 0/1 */
+	std::vector<int8_t> slot_match(bucket->slots.size(), -1);
+	auto cl_0 = make_scope_exit([&]() { cttbl_sync_headers(dbase); });
 	auto sql_transact_eph = gx_sql_begin(pdb->m_sqlite_eph, txn_mode::write);
 	if (!sql_transact_eph) {
 		mlog(LV_ERR, "E-2063: failed to start transaction in cttbl_add_row");
 		return;
 	}
-	for (auto &tnode : dbase.tables.table_list) {
-		auto ptable = &tnode;
-		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
-			continue;
-		if (!!(ptable->table_flags & TABLE_FLAG_ASSOCIATED) == !b_fai)
-			continue;
+	for (const auto &ent : bucket->tables) {
+		auto ptable = ent.table;
 		if (dbase.tables.b_batch && ptable->b_hint)
 			continue;
-		if (ptable->prestriction != nullptr &&
-		    !cu_eval_msg_restriction(pdb->psqlite,
-		    ptable->cpid, message_id, ptable->prestriction))
-			continue;
+		if (ent.slot != ct_bucket::NO_SLOT) {
+			auto &m = slot_match[ent.slot];
+			if (m < 0) {
+				auto rep = bucket->slots[ent.slot];
+				m = cu_eval_msg_plan(rep->plan.get(), pdb->psqlite,
+				    rep->cpid, message_id, rep->prestriction);
+			}
+			if (m == 0)
+				continue;
+		}
 		if (dbase.tables.b_batch) {
 			ptable->b_hint = TRUE;
 			continue;
@@ -1487,7 +2289,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 		if (NULL == ptable->psorts) {
 			char sql_string[148];
 			snprintf(sql_string, std::size(sql_string), "SELECT "
-				"count(*) FROM t%u", ptable->table_id);
+				"count(*) FROM t%u", ptable->sql_id);
 			auto pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 				continue;
@@ -1499,11 +2301,11 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				inst_id = 0;
 				snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id,"
 					" row_type, depth, inst_num, idx) VALUES (%llu, 0, "
-					"%u, 0, 0, 1)", ptable->table_id, LLU{message_id},
+					"%u, 0, 0, 1)", ptable->sql_id, LLU{message_id},
 					CONTENT_ROW_MESSAGE);
 			} else {
 				snprintf(sql_string, std::size(sql_string), "SELECT row_id, inst_id "
-						"FROM t%u WHERE idx=%u", ptable->table_id, idx);
+						"FROM t%u WHERE idx=%u", ptable->sql_id, idx);
 				pstmt = pdb->eph_prep(sql_string);
 				if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 					continue;
@@ -1512,7 +2314,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				pstmt.finalize();
 				snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id, "
 					"row_type, depth, inst_num, idx) VALUES (%llu, %llu,"
-					" %u, 0, 0, %u)", ptable->table_id, LLU{message_id}, LLU{row_id},
+					" %u, 0, 0, %u)", ptable->sql_id, LLU{message_id}, LLU{row_id},
 					CONTENT_ROW_MESSAGE, idx + 1);
 			}
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
@@ -1530,8 +2332,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_added :
 			                          db_notify_type::cttbl_row_added;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			continue;
 		} else if (0 == ptable->psorts->ccategories) {
 			for (size_t i = 0; i < ptable->psorts->count; ++i) {
@@ -1543,7 +2344,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			}
 			char sql_string[148];
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id, inst_id,"
-				" idx FROM t%u ORDER BY idx ASC", ptable->table_id);
+				" idx FROM t%u ORDER BY idx ASC", ptable->sql_id);
 			auto pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr)
 				continue;
@@ -1576,7 +2377,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			if (0 == idx) {
 				snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id,"
 					" row_type, depth, inst_num, idx) VALUES (%llu, 0, "
-					"%u, 0, 0, 1)", ptable->table_id, LLU{message_id},
+					"%u, 0, 0, 1)", ptable->sql_id, LLU{message_id},
 					CONTENT_ROW_MESSAGE);
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
@@ -1584,7 +2385,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			} else if (!b_break) {
 				snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id, "
 					"row_type, depth, inst_num, idx) VALUES (%llu, %llu,"
-					" %u, 0, 0, %u)", ptable->table_id, LLU{message_id},
+					" %u, 0, 0, %u)", ptable->sql_id, LLU{message_id},
 					LLU{row_id1}, CONTENT_ROW_MESSAGE, idx + 1);
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
@@ -1595,28 +2396,28 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 					continue;
 				snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=-(idx+1)"
 					" WHERE idx>=%u;UPDATE t%u SET idx=-idx WHERE"
-					" idx<0", ptable->table_id, idx, ptable->table_id);
+					" idx<0", ptable->sql_id, idx, ptable->sql_id);
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
 				snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=NULL "
-					"WHERE row_id=%llu", ptable->table_id, LLU{row_id1});
+					"WHERE row_id=%llu", ptable->sql_id, LLU{row_id1});
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
 				if (row_id == 0)
 					snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id,"
 						" row_type, depth, inst_num, idx) VALUES (%llu, 0, "
-						"%u, 0, 0, 1)", ptable->table_id, LLU{message_id},
+						"%u, 0, 0, 1)", ptable->sql_id, LLU{message_id},
 						CONTENT_ROW_MESSAGE);
 				else
 					snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, prev_id, "
 						"row_type, depth, inst_num, idx) VALUES (%llu, %llu,"
-						" %u, 0, 0, %u)", ptable->table_id, LLU{message_id},
+						" %u, 0, 0, %u)", ptable->sql_id, LLU{message_id},
 						LLU{row_id}, CONTENT_ROW_MESSAGE, idx);
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
 				row_id = sqlite3_last_insert_rowid(pdb->m_sqlite_eph);
 				snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=%llu WHERE"
-				        " row_id=%llu", ptable->table_id, LLU{row_id}, LLU{row_id1});
+				        " row_id=%llu", ptable->sql_id, LLU{row_id}, LLU{row_id1});
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
 				if (sql_savepoint.commit() != SQLITE_OK)
@@ -1635,8 +2436,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_added :
 			                          db_notify_type::cttbl_row_added;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			continue;
 		}
 		if (NULL == pread_byte) {
@@ -1684,31 +2484,31 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			continue;
 		char sql_string[164];
 		snprintf(sql_string, std::size(sql_string), "SELECT row_id, inst_id, "
-		         "value FROM t%u WHERE prev_id=?", ptable->table_id);
+		         "value FROM t%u WHERE prev_id=?", ptable->sql_id);
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id, "
 		         "row_type, row_stat, parent_id, depth, count, unread,"
 		         " inst_num, value, extremum, prev_id) VALUES (?, ?, "
-		         "?, ?, ?, ?, ?, ?, ?, ?, ?)", ptable->table_id);
+		         "?, ?, ?, ?, ?, ?, ?, ?, ?)", ptable->sql_id);
 		auto pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-		         "prev_id=? WHERE row_id=?", ptable->table_id);
+		         "prev_id=? WHERE row_id=?", ptable->sql_id);
 		auto pstmt2 = pdb->eph_prep(sql_string);
 		if (pstmt2 == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM"
-		         " t%u WHERE row_id=?", ptable->table_id);
+		         " t%u WHERE row_id=?", ptable->sql_id);
 		auto stm_sel_tx = pdb->eph_prep(sql_string);
 		if (stm_sel_tx == nullptr)
 			continue;
 		xstmt stm_set_ex;
 		if (0 != ptable->extremum_tag) {
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-			         "extremum=? WHERE row_id=?", ptable->table_id);
+			         "extremum=? WHERE row_id=?", ptable->sql_id);
 			stm_set_ex = pdb->eph_prep(sql_string);
 			if (stm_set_ex == nullptr)
 				continue;
@@ -1820,7 +2620,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				snprintf(sql_string, std::size(sql_string), b_read ?
 				         "UPDATE t%u SET count=count+1 WHERE row_id=%llu" :
 				         "UPDATE t%u SET count=count+1, unread=unread+1 WHERE row_id=%llu",
-				         ptable->table_id, LLU{row_id});
+				         ptable->sql_id, LLU{row_id});
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					return;
 				db_engine_append_rowinfo_node(&notify_list, row_id);
@@ -1916,7 +2716,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				return;
 			sqlite3_reset(pstmt2);
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=%lld"
-			         " WHERE prev_id=%llu", ptable->table_id,
+			         " WHERE prev_id=%llu", ptable->sql_id,
 			         LLD{prev_id1}, LLU{row_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				return;
@@ -1932,16 +2732,16 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 		pstmt1.finalize();
 		pstmt2.finalize();
 		stm_set_ex.finalize();
-		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptable->table_id);
+		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptable->sql_id);
 		if (pdb->eph_exec(sql_string) != SQLITE_OK)
 			return;
 		snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_stat"
-		         " FROM t%u WHERE prev_id=?", ptable->table_id);
+		         " FROM t%u WHERE prev_id=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			return;
 		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-		         " idx=? WHERE row_id=?", ptable->table_id);
+		         " idx=? WHERE row_id=?", ptable->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return;
@@ -1961,13 +2761,12 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			datagram1.db_notify.type = ptable->b_search ?
 						   db_notify_type::srchtbl_changed :
 						   db_notify_type::cttbl_changed;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			cttbl_broadcast(dbase, *ptable, datagram1);
 			continue;
 		}
 
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM"
-			 " t%u WHERE idx=?", ptable->table_id);
+			 " t%u WHERE idx=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
@@ -2011,8 +2810,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram1.db_notify.type = ptable->b_search ?
 							   db_notify_type::srchtbl_row_modified :
 							   db_notify_type::cttbl_row_modified;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram1);
+				cttbl_broadcast(dbase, *ptable, datagram1);
 			} else if (stm_sel_tx.col_int64(4) == CONTENT_ROW_HEADER) {
 				padded_row1->row_message_id = stm_sel_tx.col_int64(3);
 				padded_row1->after_row_id = inst_id;
@@ -2021,8 +2819,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram1.db_notify.type = ptable->b_search ?
 				                           db_notify_type::srchtbl_row_added :
 				                           db_notify_type::cttbl_row_added;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram1);
+				cttbl_broadcast(dbase, *ptable, datagram1);
 			} else {
 				padded_row->row_instance = stm_sel_tx.col_int64(10);
 				padded_row->after_row_id = inst_id;
@@ -2031,8 +2828,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram.db_notify.type = ptable->b_search ?
 				                          db_notify_type::srchtbl_row_added :
 				                          db_notify_type::cttbl_row_added;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram);
+				cttbl_broadcast(dbase, *ptable, datagram);
 			}
 			stm_sel_tx.reset();
 		}
@@ -2113,6 +2909,7 @@ void db_conn::notify_message_creation(uint64_t folder_id,
 	auto pdb = this;
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	fts_update(message_id);
 	auto parrays = db_engine_classify_id_array(dbase,
 	               NF_OBJECT_CREATED, folder_id, 0);
 	if (parrays.size() > 0) {
@@ -2238,7 +3035,7 @@ static void dbeng_notify_hiertbl_add_row(db_conn *pdb,
 			if (depth == 0)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u"
-						" WHERE folder_id=?", ptable->table_id);
+						" WHERE folder_id=?", ptable->sql_id);
 			auto pstmt1 = pdb->eph_prep(sql_string);
 			if (pstmt1 == nullptr)
 				continue;
@@ -2267,12 +3064,12 @@ static void dbeng_notify_hiertbl_add_row(db_conn *pdb,
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=-(idx+1)"
 				" WHERE idx>%u;UPDATE t%u SET idx=-idx WHERE"
-				" idx<0", ptable->table_id, idx, ptable->table_id);
+				" idx<0", ptable->sql_id, idx, ptable->sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (idx, "
 				"folder_id, depth) VALUES (%u, %llu, %u)",
-				ptable->table_id, idx + 1, LLU{folder_id}, depth);
+				ptable->sql_id, idx + 1, LLU{folder_id}, depth);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			if (sql_savepoint.commit() != SQLITE_OK)
@@ -2289,7 +3086,7 @@ static void dbeng_notify_hiertbl_add_row(db_conn *pdb,
 			depth = 1;
  APPEND_END_OF_TABLE:
 			snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (folder_id,"
-				" depth) VALUES (%llu, %u)", ptable->table_id,
+				" depth) VALUES (%llu, %u)", ptable->sql_id,
 				LLU{folder_id}, depth);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
@@ -2305,7 +3102,7 @@ static void dbeng_notify_hiertbl_add_row(db_conn *pdb,
 				padded_row->after_folder_id = 0;
 			} else {
 				snprintf(sql_string, std::size(sql_string), "SELECT folder_id FROM "
-					"t%u WHERE idx=%u", ptable->table_id, idx - 1);
+					"t%u WHERE idx=%u", ptable->sql_id, idx - 1);
 				auto pstmt1 = pdb->eph_prep(sql_string);
 				if (pstmt1 == nullptr || pstmt1.step() != SQLITE_ROW)
 					continue;
@@ -2437,21 +3234,17 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		mlog(LV_ERR, "E-2162: failed to start transaction in cttbl_delete_row");
 		return;
 	}
-	for (auto &tnode : dbase.tables.table_list) {
-		auto ptable = &tnode;
-		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
-			continue;
+	for (auto ptable : cttbl_of_folder(dbase, folder_id)) {
 		if (dbase.tables.b_batch && ptable->b_hint)
 			continue;
 		if (ptable->instance_tag == 0)
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id "
 				"FROM t%u WHERE inst_id=%llu AND inst_num=0",
-				ptable->table_id, LLU{message_id});
+				ptable->sql_id, LLU{message_id});
 		else
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id"
 							" FROM t%u WHERE inst_id=%llu",
-							ptable->table_id, LLU{message_id});
+							ptable->sql_id, LLU{message_id});
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 			continue;
@@ -2478,7 +3271,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		if (NULL == ptable->psorts || 0 == ptable->psorts->ccategories) {
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id, idx,"
 					" prev_id FROM t%u WHERE inst_id=%llu AND "
-					"inst_num=0", ptable->table_id, LLU{message_id});
+					"inst_num=0", ptable->sql_id, LLU{message_id});
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 				continue;
@@ -2490,21 +3283,21 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			if (!sql_savepoint)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "DELETE FROM t%u WHERE "
-				"row_id=%llu", ptable->table_id, LLU{row_id});
+				"row_id=%llu", ptable->sql_id, LLU{row_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=%lld WHERE"
-					" idx=%u", ptable->table_id, LLD{prev_id}, idx + 1);
+					" idx=%u", ptable->sql_id, LLD{prev_id}, idx + 1);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=-(idx-1)"
 				" WHERE idx>%u;UPDATE t%u SET idx=-idx WHERE"
-				" idx<0", ptable->table_id, idx, ptable->table_id);
+				" idx<0", ptable->sql_id, idx, ptable->sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE sqlite_sequence SET seq="
 				"(SELECT count(*) FROM t%u) WHERE name='t%u'",
-				ptable->table_id, ptable->table_id);
+				ptable->sql_id, ptable->sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			if (sql_savepoint.commit() != SQLITE_OK)
@@ -2519,8 +3312,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_deleted :
 			                          db_notify_type::cttbl_row_deleted;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			continue;
 		}
 		b_index = FALSE;
@@ -2529,10 +3321,10 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		if (ptable->instance_tag == 0)
 			snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
 						" WHERE inst_id=%llu AND inst_num=0",
-						ptable->table_id, LLU{message_id});
+						ptable->sql_id, LLU{message_id});
 		else
 			snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u "
-						"WHERE inst_id=%llu", ptable->table_id,
+						"WHERE inst_id=%llu", ptable->sql_id,
 						LLU{message_id});
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
@@ -2560,29 +3352,29 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			if (!sql_savepoint)
 				continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM"
-			" t%u WHERE row_id=?", ptable->table_id);
+			" t%u WHERE row_id=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "DELETE FROM t%u "
-					"WHERE row_id=?", ptable->table_id);
+					"WHERE row_id=?", ptable->sql_id);
 		auto pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			continue;
 		xstmt pstmt2, stm_upd_previd, stm_sel_ex;
 		if (0 != ptable->extremum_tag) {
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-				"extremum=? WHERE row_id=?", ptable->table_id);
+				"extremum=? WHERE row_id=?", ptable->sql_id);
 			pstmt2 = pdb->eph_prep(sql_string);
 			if (pstmt2 == nullptr)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-				"prev_id=? WHERE row_id=?", ptable->table_id);
+				"prev_id=? WHERE row_id=?", ptable->sql_id);
 			stm_upd_previd = pdb->eph_prep(sql_string);
 			if (stm_upd_previd == nullptr)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id, inst_id, "
-				"extremum FROM t%u WHERE prev_id=?", ptable->table_id);
+				"extremum FROM t%u WHERE prev_id=?", ptable->sql_id);
 			stm_sel_ex = pdb->eph_prep(sql_string);
 			if (stm_sel_ex == nullptr)
 				continue;
@@ -2600,7 +3392,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 				break;
 			sqlite3_reset(pstmt1);
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=%lld"
-				" WHERE prev_id=%llu", ptable->table_id,
+				" WHERE prev_id=%llu", ptable->sql_id,
 				LLD{pdelnode->prev_id}, LLU{pdelnode->row_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				break;
@@ -2635,7 +3427,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			snprintf(sql_string, std::size(sql_string), pdelnode->b_read ?
 			         "UPDATE t%u SET count=count-1 WHERE row_id=%llu" :
 			         "UPDATE t%u SET count=count-1, unread=unread-1 WHERE row_id=%llu",
-			         ptable->table_id, LLU{pdelnode->parent_id});
+			         ptable->sql_id, LLU{pdelnode->parent_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				break;
 			prnode = cu_alloc<ROWINFO_NODE>();
@@ -2661,7 +3453,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			table_sort = ptable->psorts->psort[
 				ptable->psorts->ccategories].table_sort;
 			pvalue1 = db_engine_get_extremum_value(pdb, ptable->cpid,
-							ptable->table_id, ptable->extremum_tag,
+							ptable->sql_id, ptable->extremum_tag,
 							pdelnode->parent_id, table_sort);
 			if (db_engine_compare_propval(type, pvalue, pvalue1) == 0)
 				continue;
@@ -2725,7 +3517,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 				break;
 			stm_upd_previd.reset();
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET prev_id=%lld"
-					" WHERE prev_id=%llu", ptable->table_id,
+					" WHERE prev_id=%llu", ptable->sql_id,
 					LLD{prev_id1}, LLU{row_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				break;
@@ -2747,16 +3539,16 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		if (pnode1 != nullptr)
 			continue;
 		if (b_index) {
-			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptable->table_id);
+			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptable->sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_stat"
-					" FROM t%u WHERE prev_id=?", ptable->table_id);
+					" FROM t%u WHERE prev_id=?", ptable->sql_id);
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-				" idx=? WHERE row_id=?", ptable->table_id);
+				" idx=? WHERE row_id=?", ptable->sql_id);
 			pstmt1 = pdb->eph_prep(sql_string);
 			if (pstmt1 == nullptr)
 				continue;
@@ -2777,8 +3569,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram1.db_notify.type = ptable->b_search ?
 			                           db_notify_type::srchtbl_changed :
 			                           db_notify_type::cttbl_changed;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			cttbl_broadcast(dbase, *ptable, datagram1);
 			continue;
 		}
 		for (pnode1 = double_list_get_head(&tmp_list); NULL != pnode1;
@@ -2801,18 +3592,17 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_deleted :
 			                          db_notify_type::cttbl_row_deleted;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 		}
 		if (double_list_get_nodes_num(&notify_list) == 0)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM"
-		         " t%u WHERE idx=?", ptable->table_id);
+		         " t%u WHERE idx=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM "
-		         "t%u WHERE row_id=?", ptable->table_id);
+		         "t%u WHERE row_id=?", ptable->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			continue;
@@ -2849,8 +3639,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram1.db_notify.type = ptable->b_search ?
 			                           db_notify_type::srchtbl_row_modified :
 			                           db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			cttbl_broadcast(dbase, *ptable, datagram1);
 			sqlite3_reset(pstmt1);
 		}
 	}
@@ -2866,6 +3655,7 @@ void db_conn::notify_message_deletion(uint64_t folder_id, uint64_t message_id,
 	auto pdb = this;
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	fts_delete(message_id);
 	auto parrays = db_engine_classify_id_array(dbase,
 	               NF_OBJECT_DELETED, folder_id, message_id);
 	if (parrays.size() > 0) {
@@ -2948,24 +3738,24 @@ static void dbeng_notify_hiertbl_delete_row(db_conn *pdb,
 				continue;
 		}
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u "
-			"WHERE folder_id=%llu", ptable->table_id, LLU{folder_id});
+			"WHERE folder_id=%llu", ptable->sql_id, LLU{folder_id});
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 			continue;	
 		idx = sqlite3_column_int64(pstmt, 0);
 		pstmt.finalize();
 		snprintf(sql_string, std::size(sql_string), "DELETE FROM t%u WHERE "
-			"folder_id=%llu", ptable->table_id, LLU{folder_id});
+			"folder_id=%llu", ptable->sql_id, LLU{folder_id});
 		if (pdb->eph_exec(sql_string) != SQLITE_OK)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=-(idx-1)"
 			" WHERE idx>%u;UPDATE t%u SET idx=-idx WHERE"
-			" idx<0", ptable->table_id, idx, ptable->table_id);
+			" idx<0", ptable->sql_id, idx, ptable->sql_id);
 		if (pdb->eph_exec(sql_string) != SQLITE_OK)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "UPDATE sqlite_sequence SET seq="
 			"(SELECT count(*) FROM t%u) WHERE name='t%u'",
-			ptable->table_id, ptable->table_id);
+			ptable->sql_id, ptable->sql_id);
 		if (pdb->eph_exec(sql_string) != SQLITE_OK)
 			/* I guess ignore it? Autoincrement is just higher than expected. */;
 		if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
@@ -3048,19 +3838,15 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 		mlog(LV_ERR, "E-2164: failed to start transaction in cttbl_modify_row");
 		return;
 	}
-	for (const auto &tnode : dbase.tables.table_list) {
-		auto ptable = &tnode;
-		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
-			continue;
+	for (const table_node *ptable : cttbl_of_folder(dbase, folder_id)) {
 		if (ptable->instance_tag == 0)
 			snprintf(sql_string, std::size(sql_string), "SELECT count(*) "
 				"FROM t%u WHERE inst_id=%llu AND inst_num=0",
-				ptable->table_id, LLU{message_id});
+				ptable->sql_id, LLU{message_id});
 		else
 			snprintf(sql_string, std::size(sql_string), "SELECT count(*)"
 							" FROM t%u WHERE inst_id=%llu",
-							ptable->table_id, LLU{message_id});
+							ptable->sql_id, LLU{message_id});
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr || pstmt.step() != SQLITE_ROW ||
 		    sqlite3_column_int64(pstmt, 0) == 0)
@@ -3084,7 +3870,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			pmodified_row->row_instance = 0;
 			snprintf(sql_string, std::size(sql_string), "SELECT idx FROM "
 					"t%u WHERE inst_id=%llu AND inst_num=0",
-					ptable->table_id, LLU{message_id});
+					ptable->sql_id, LLU{message_id});
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 				continue;
@@ -3095,7 +3881,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 				pmodified_row->after_folder_id = 0;
 			} else {
 				snprintf(sql_string, std::size(sql_string), "SELECT inst_id FROM "
-					"t%u WHERE idx=%u", ptable->table_id, idx - 1);
+					"t%u WHERE idx=%u", ptable->sql_id, idx - 1);
 				pstmt = pdb->eph_prep(sql_string);
 				if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 					continue;
@@ -3110,8 +3896,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			continue;
 		} else if (0 == ptable->psorts->ccategories) {
 			size_t i;
@@ -3126,14 +3911,14 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 				continue;
 			snprintf(sql_string, std::size(sql_string), "SELECT idx FROM "
 					"t%u WHERE inst_id=%llu AND inst_num=0",
-					ptable->table_id, LLU{message_id});
+					ptable->sql_id, LLU{message_id});
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 				continue;
 			idx = sqlite3_column_int64(pstmt, 0);
 			pstmt.finalize();
 			snprintf(sql_string, std::size(sql_string), "SELECT inst_id"
-				" FROM t%u WHERE idx=?", ptable->table_id);
+				" FROM t%u WHERE idx=?", ptable->sql_id);
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr)
 				continue;
@@ -3204,8 +3989,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			continue;
 		}
 		{
@@ -3232,7 +4016,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			}
 			snprintf(sql_string, std::size(sql_string), "SELECT value, "
 			         "inst_num FROM t%u WHERE inst_id=%llu",
-			         ptable->table_id, LLU{message_id});
+			         ptable->sql_id, LLU{message_id});
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr)
 				continue;
@@ -3275,13 +4059,13 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 		if (i < ptable->psorts->count)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT parent_id, value "
-		         "FROM t%u WHERE row_id=?", ptable->table_id);
+		         "FROM t%u WHERE row_id=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT row_id, prev_id,"
 		         " extremum FROM t%u WHERE inst_id=%llu AND"
-		         " inst_num=?", ptable->table_id, LLU{message_id});
+		         " inst_num=?", ptable->sql_id, LLU{message_id});
 		auto pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			continue;
@@ -3333,7 +4117,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 				break;
 			if (0 != ptable->extremum_tag) {
 				snprintf(sql_string, std::size(sql_string), "SELECT extremum FROM t%u"
-				         " WHERE row_id=%llu", ptable->table_id, LLU{parent_id});
+				         " WHERE row_id=%llu", ptable->sql_id, LLU{parent_id});
 				auto pstmt2 = pdb->eph_prep(sql_string);
 				if (pstmt2 == nullptr || pstmt2.step() != SQLITE_ROW) {
 					b_error = TRUE;
@@ -3366,7 +4150,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 					inst_id = 0;
 				} else {
 					snprintf(sql_string, std::size(sql_string), "SELECT inst_id FROM"
-					         " t%u WHERE row_id=%lld", ptable->table_id, LLD{prev_id});
+					         " t%u WHERE row_id=%lld", ptable->sql_id, LLD{prev_id});
 					auto pstmt2 = pdb->eph_prep(sql_string);
 					if (pstmt2 == nullptr  || pstmt2.step() != SQLITE_ROW) {
 						b_error = TRUE;
@@ -3375,7 +4159,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 					inst_id = sqlite3_column_int64(pstmt2, 0);
 				}
 				snprintf(sql_string, std::size(sql_string), "SELECT inst_id FROM t%u"
-				         " WHERE prev_id=%llu", ptable->table_id, LLU{row_id1});
+				         " WHERE prev_id=%llu", ptable->sql_id, LLU{row_id1});
 				auto pstmt2 = pdb->eph_prep(sql_string);
 				if (pstmt2 == nullptr) {
 					b_error = TRUE;
@@ -3442,11 +4226,11 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			if (*static_cast<uint8_t *>(pvalue) == 0 && read_byte != 0) {
 				unread_delta = 1;
 				snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET extremum=0 "
-				         "WHERE row_id=%llu", ptable->table_id, LLU{row_id1});
+				         "WHERE row_id=%llu", ptable->sql_id, LLU{row_id1});
 			} else if (*static_cast<uint8_t *>(pvalue) != 0 && read_byte == 0) {
 				unread_delta = -1;
 				snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET extremum=1 "
-				         "WHERE row_id=%llu", ptable->table_id, LLU{row_id1});
+				         "WHERE row_id=%llu", ptable->sql_id, LLU{row_id1});
 			} else {
 				unread_delta = 0;
 			}
@@ -3468,10 +4252,10 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 					break;
 				if (unread_delta > 0)
 					snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET unread=unread+1"
-					         " WHERE row_id=%llu", ptable->table_id, LLU{row_id});
+					         " WHERE row_id=%llu", ptable->sql_id, LLU{row_id});
 				else
 					snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET unread=unread-1"
-					         " WHERE row_id=%llu", ptable->table_id, LLU{row_id});
+					         " WHERE row_id=%llu", ptable->sql_id, LLU{row_id});
 				if (pdb->eph_exec(sql_string) != SQLITE_OK) {
 					b_error = TRUE;
 					break;
@@ -3499,12 +4283,12 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 		if (b_error)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM"
-		         " t%u WHERE idx=?", ptable->table_id);
+		         " t%u WHERE idx=?", ptable->sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM "
-		         "t%u WHERE row_id=?", ptable->table_id);
+		         "t%u WHERE row_id=?", ptable->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			continue;
@@ -3560,16 +4344,20 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			cttbl_broadcast(dbase, *ptable, datagram);
 			sqlite3_reset(pstmt1);
 		}
 		continue;
 		}
  REFRESH_TABLE:
-		auto &stor = tmp_list.emplace_back(*ptable, table_node::clone_t{});
-		if (ptable->psorts->ccategories != 0)
-			stor.table_flags |= TABLE_FLAG_NONOTIFICATIONS;
+		/* Take along the other users of the rows (ptable comes first) */
+		for (const auto &t : dbase.tables.table_list) {
+			if (t.type != table_type::content || t.sql_id != ptable->sql_id)
+				continue;
+			auto &stor = tmp_list.emplace_back(t, table_node::clone_t{});
+			if (ptable->psorts->ccategories != 0)
+				stor.table_flags |= TABLE_FLAG_NONOTIFICATIONS;
+		}
 
 		/* Else, some methods will need to be written */
 		static_assert(!std::is_copy_constructible_v<table_node>);
@@ -3582,9 +4370,11 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 	if (tmp_list.empty())
 		return;
 	std::swap(dbase.tables.table_list, tmp_list);
+	dbase.tables.ct_dirty = true;
 	dbeng_notify_cttbl_delete_row(pdb, folder_id, message_id, dbase);
 	dbeng_notify_cttbl_add_row(pdb, folder_id, message_id, dbase);
 	std::swap(dbase.tables.table_list, tmp_list);
+	dbase.tables.ct_dirty = true;
 	for (const auto &tnode : tmp_list) {
 		auto ptable = &tnode;
 		datagram.id_array[0] = ptable->table_id; // reserved earlier
@@ -3614,6 +4404,7 @@ void db_conn::notify_message_modification(uint64_t folder_id, uint64_t message_i
 	auto pdb = this;
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	fts_update(message_id);
 	auto parrays = db_engine_classify_id_array(dbase,
 	               NF_OBJECT_MODIFIED, folder_id, message_id);
 	if (parrays.size() > 0) {
@@ -3671,7 +4462,7 @@ static void dbeng_notify_hiertbl_modify_row(const db_conn *pdb,
 				continue;
 		}
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u "
-		          "WHERE folder_id=%llu", ptable->table_id, LLU{folder_id});
+		          "WHERE folder_id=%llu", ptable->sql_id, LLU{folder_id});
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			continue;
@@ -3690,7 +4481,7 @@ static void dbeng_notify_hiertbl_modify_row(const db_conn *pdb,
 					datagram2.db_notify.pdata = padded_row;
 				}
 				snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (folder_id)"
-				        " VALUES (%llu)", ptable->table_id, LLU{folder_id});
+				        " VALUES (%llu)", ptable->sql_id, LLU{folder_id});
 				if (pdb->eph_exec(sql_string) != SQLITE_OK)
 					continue;
 				if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
@@ -3706,7 +4497,7 @@ static void dbeng_notify_hiertbl_modify_row(const db_conn *pdb,
 				} else {
 					snprintf(sql_string, std::size(sql_string), "SELECT "
 						"folder_id FROM t%u WHERE idx=%u",
-						ptable->table_id, idx - 1);
+						ptable->sql_id, idx - 1);
 					pstmt = pdb->eph_prep(sql_string);
 					if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 						continue;
@@ -3729,17 +4520,17 @@ static void dbeng_notify_hiertbl_modify_row(const db_conn *pdb,
 			if (!sql_savepoint)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "DELETE FROM t%u WHERE "
-			        "folder_id=%llu", ptable->table_id, LLU{folder_id});
+			        "folder_id=%llu", ptable->sql_id, LLU{folder_id});
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=-(idx-1)"
 				" WHERE idx>%u;UPDATE t%u SET idx=-idx WHERE"
-				" idx<0", ptable->table_id, idx, ptable->table_id);
+				" idx<0", ptable->sql_id, idx, ptable->sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
 			snprintf(sql_string, std::size(sql_string), "UPDATE sqlite_sequence SET seq="
 				"(SELECT count(*) FROM t%u) WHERE name='t%u'",
-				ptable->table_id, ptable->table_id);
+				ptable->sql_id, ptable->sql_id);
 			pdb->eph_exec(sql_string);
 			if (sql_savepoint.commit() != SQLITE_OK)
 				continue;
@@ -3781,7 +4572,7 @@ static void dbeng_notify_hiertbl_modify_row(const db_conn *pdb,
 			pmodified_row->after_folder_id = 0;
 		} else {
 			snprintf(sql_string, std::size(sql_string), "SELECT folder_id FROM "
-				"t%u WHERE idx=%u", ptable->table_id, idx - 1);
+				"t%u WHERE idx=%u", ptable->sql_id, idx - 1);
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 				continue;
@@ -3832,6 +4623,9 @@ void db_conn::notify_message_movecopy(BOOL b_copy, uint64_t folder_id,
 	auto pdb = this;
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	if (!b_copy && old_mid != message_id)
+		fts_delete(old_mid);
+	fts_update(message_id);
 
 	/* open-coded db_engine_classify_id_array(4-arg) */
 	ID_ARRAYS recv_list;
@@ -3987,5 +4781,6 @@ void db_close::operator()(sqlite3 *x) const
 	auto z = sqlite3_db_filename(x, nullptr);
 	if (z != nullptr)
 		mlog(LV_INFO, "I-1762: exmdb: closing %s", z);
+	gx_sql_cache_detach(x);
 	sqlite3_close_v2(x);
 }
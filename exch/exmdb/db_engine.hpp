@@ -1,6 +1,8 @@
 #pragma once
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <list>
 #include <map>
 #include <memory>
@@ -8,6 +10,9 @@
 #include <shared_mutex>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <gromox/clock.hpp>
 #include <gromox/database.h>
 #include <gromox/element_data.hpp>
@@ -25,6 +30,48 @@ enum class dynamic_event {
 	new_msg, modify_msg, del_msg, move_folder,
 };
 
+/* Where a content table sort key can be taken from without cu_get_property */
+enum class hot_src : uint8_t {
+	none, msgsize, dtime, mtime, subject, nsubject, sender,
+};
+
+/**
+ * A message restriction compiled for repeated evaluation. Subtrees that only
+ * test plain scalar properties become SQL over message_properties; the rest
+ * is flattened into a short-circuiting opcode program which fetches each
+ * referenced property at most once per message. The plan refers into the
+ * RESTRICTION it was compiled from, so it must not outlive it.
+ */
+class res_plan {
+	public:
+	static std::shared_ptr<const res_plan> compile(const RESTRICTION *);
+	/* @prefiltered: the row already passed prefilter() */
+	bool eval(sqlite3 *, cpid_t, uint64_t message_id, bool prefiltered = false) const;
+	/* Predicate over x.message_id for the pushed-down conjuncts, or "" */
+	const std::string &prefilter() const { return m_prefilter; }
+
+	enum class opc : uint8_t { cst, leaf, sql, interp, lnot, jf, jt };
+	struct insn {
+		opc op;
+		uint32_t arg;
+	};
+	struct leaf {
+		const RESTRICTION *res;
+		uint16_t slot, slot2;
+	};
+
+	private:
+	bool run(const std::vector<insn> &, sqlite3 *, cpid_t, uint64_t) const;
+
+	std::vector<insn> m_prog, m_rest;
+	std::vector<leaf> m_leaves;
+	std::vector<std::string> m_sql;
+	std::vector<uint32_t> m_tags; /* value slot -> proptag */
+	std::string m_prefilter;
+
+	friend struct res_compiler;
+};
+
 struct dynamic_node {
 	dynamic_node() = default;
 	dynamic_node(dynamic_node &&) noexcept;
@@ -34,6 +81,7 @@ struct dynamic_node {
 	uint64_t folder_id = 0; /* search folder ID */
 	uint32_t search_flags = 0;
 	RESTRICTION *prestriction = nullptr;
+	std::shared_ptr<const res_plan> plan; /* compiled prestriction */
 	LONGLONG_ARRAY folder_ids{}; /* source folder IDs */
 };
 
@@ -54,6 +102,11 @@ struct table_node {
 	NOMOVE(table_node);
 
 	uint32_t table_id = 0, table_flags = 0;
+	/*
+	 * tN in tables.sqlite3 that holds the rows. Content tables with the
+	 * same folder, flags, cpid, restriction and sort order share one.
+	 */
+	uint32_t sql_id = 0;
 	cpid_t cpid = CP_ACP;
 	enum table_type type = table_type::hierarchy;
 	bool cloned = false;
@@ -61,12 +114,43 @@ struct table_node {
 	uint64_t folder_id = 0;
 	GUID handle_guid{};
 	RESTRICTION *prestriction = nullptr;
+	std::shared_ptr<const res_plan> plan; /* compiled prestriction (content tables) */
 	SORTORDER_SET *psorts = nullptr;
 	uint32_t instance_tag = 0, extremum_tag = 0, header_id = 0;
 	BOOL b_search = false;
 	BOOL b_hint = false; /* is table touched in batch-mode */
 };
 
+/**
+ * One search scope entry of a dynamic search: dynamic_list[node] has
+ * folder_ids.pll[scope] as source folder.
+ */
+struct dyn_scope {
+	uint32_t node = 0, scope = 0;
+	inline bool operator<(const dyn_scope &o) const {
+		return node != o.node ? node < o.node : scope < o.scope;
+	}
+};
+
+/**
+ * Primary content tables of one (folder, FAI) pair. Tables whose restriction
+ * (and cpid) are identical share an evaluation slot, so a message event
+ * evaluates each distinct restriction once.
+ *
+ * @tables: table and its slot (NO_SLOT for tables without restriction)
+ * @slots:  representative table for each slot
+ */
+struct ct_bucket {
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+	struct entry {
+		table_node *table = nullptr;
+		uint32_t slot = NO_SLOT;
+	};
+	std::vector<entry> tables;
+	std::vector<const table_node *> slots;
+	std::vector<std::string> slot_keys;
+};
+
 struct nsub_node {
 	char *remote_id = nullptr;
 	uint32_t sub_id = 0;
@@ -101,7 +185,9 @@ struct prepared_statements {
 	gromox::xstmt msg_norm, msg_str, rcpt_norm, rcpt_str;
 };
 
-struct db_close;
+struct db_close {
+	void operator()(sqlite3 *) const;
+};
 using db_handle = std::unique_ptr<sqlite3, db_close>;
 
 /**
@@ -111,6 +197,15 @@ using db_handle = std::unique_ptr<sqlite3, db_close>;
  * @reference: client reference count, db_base can be destroyed when count is 0
  * @mx_sqlite: cached sqlite handles for exchange.sqlite3
  * @mx_sqlite_eph: cached sqlite handles for tables.sqlite3
+ * @fts_db: optional full-text sidecar (exmdb/fts.sqlite3), guarded by fts_lock
+ * @fts_rebuild: change tracking for a running fts rebuild, guarded by fts_lock
+ * @hotprops: message_hotprops mirror is present in exchange.sqlite3
+ * @gcommit: WAL sync sequencing for exmdb_group_commit
+ * @last_activity: last release of a db_conn other than by the maintenance
+ *                 thread; drives cache_interval expiry and LRU eviction
+ * @maint_done: when maintenance tasks last completed (db_maint_thread only)
+ * @b_private: store kind, as seen by the request that loaded it
+ * @cache_hits, @cache_misses: page cache counters of released main handles
  */
 struct db_base {
 	enum DB_TYPE : uint8_t {DB_MAIN = 0, DB_EPH = 1};
@@ -120,26 +215,82 @@ struct db_base {
 
 	mutable std::shared_mutex giant_lock;
 	std::atomic<int> reference;
-	gromox::time_point last_time{};
+	std::atomic<gromox::time_point> last_activity{};
+	struct {
+		gromox::time_point softdel{}, tombstones{}, datafiles{}, eids{};
+	} maint_done;
+	bool b_private = false;
+	std::atomic<uint64_t> cache_hits{0}, cache_misses{0};
 	/* memory database for holding rop table objects instance */
 	struct {
 		std::atomic<uint32_t> last_id = 0;
 		bool b_batch = false; /* message database is in batch-mode */
 		std::list<table_node> table_list;
+		/*
+		 * Content table registry by folder, [0] normal, [1] FAI.
+		 * Derived from table_list; whoever changes table_list (or
+		 * sql_id of a member) sets ct_dirty.
+		 */
+		std::unordered_map<uint64_t, ct_bucket> ct_index[2];
+		bool ct_dirty = true;
 	} tables;
 	std::vector<nsub_node> nsub_list;
 	std::vector<dynamic_node> dynamic_list; /* dynamic searches */
+	struct {
+		/*
+		 * Dynamic searches by source folder. Derived from dynamic_list;
+		 * whoever changes dynamic_list sets dirty.
+		 */
+		std::unordered_map<uint64_t, std::vector<dyn_scope>> by_scope;
+		/*
+		 * Folder and its ancestors up to the root, per event source
+		 * folder. Dropped whenever a folder is moved; until the move's
+		 * transaction has ended (frozen), chains go to uncached
+		 * instead, since they may reflect a hierarchy that gets rolled
+		 * back.
+		 */
+		std::unordered_map<uint64_t, std::vector<uint64_t>> ancestors;
+		std::deque<std::vector<uint64_t>> uncached;
+		bool dirty = true, frozen = false;
+	} dyn_index;
 	std::vector<instance_node> instance_list;
 
 	uint32_t next_instance_id() const;
 	instance_node *get_instance(uint32_t);
 	inline const instance_node *get_instance_c(uint32_t id) const { return const_cast<db_base *>(this)->get_instance(id); }
 	const table_node *find_table(uint32_t) const;
+	table_node *find_table(uint32_t);
+	bool is_primary_table(const table_node &) const;
+	const ct_bucket *content_tables(uint64_t folder_id, bool fai, ct_bucket &spare);
+	const std::vector<dyn_scope> *dynamic_scopes(uint64_t folder_id);
+	const std::vector<uint64_t> *folder_ancestors(sqlite3 *, uint64_t folder_id);
+	size_t sql_table_users(uint32_t sql_id) const;
 	void handle_spares(sqlite3 *, sqlite3 *);
 
 	void open(const char* dir);
 	void drop_all();
 	void get_dbs(const char *dir, sqlite3 *&main, sqlite3 *&eph);
+	size_t mem_usage();
+	void note_cache_stats(sqlite3 *);
+	void fts_open(const char *dir);
+	void hotprops_open(sqlite3 *);
+
+	mutable std::mutex fts_lock;
+	db_handle fts_db;
+	struct {
+		/* messages changed while a rebuild runs (guarded by fts_lock) */
+		std::unordered_set<uint64_t> pending;
+		bool active = false, lost = false;
+	} fts_rebuild;
+	std::atomic<bool> hotprops{false};
+	struct {
+		std::mutex lock;
+		std::condition_variable cv;
+		/* commits seen / commits known to be on disk */
+		uint64_t committed = 0, synced = 0;
+		bool busy = false;
+	} gcommit;
+	void group_sync(sqlite3 *);
 
 private:
 	db_handle get_db(const char *dir, DB_TYPE);
@@ -160,6 +311,7 @@ using db_base_rd_ptr = std::unique_ptr<const db_base, db_base_unlock_rd>;
 using db_base_wr_ptr = std::unique_ptr<db_base, db_base_unlock_wr>;
 
 class db_item_deleter;
+struct db_conn_pin;
 struct db_conn {
 	struct xless {
 		bool operator()(const char *a, const char *b) const {
@@ -172,6 +324,7 @@ struct db_conn {
 	using NOTIFQ = std::vector<std::pair<DB_NOTIFY_DATAGRAM, ID_ARRAYS>>;
 
 	db_conn(db_base &);
+	db_conn(db_conn_pin &);
 	~db_conn();
 	db_conn(db_conn &&);
 	db_conn &operator=(db_conn &&);
@@ -200,6 +353,11 @@ struct db_conn {
 	static void commit_batch_mode_release(std::optional<db_conn> &&pdb, db_base_wr_ptr &&base);
 	void cancel_batch_mode(db_base &);
 	std::unique_ptr<prepared_statements> begin_optim();
+	void fts_update(uint64_t msg_id);
+	void fts_delete(uint64_t msg_id);
+	bool fts_candidates(const RESTRICTION *, std::unordered_set<uint64_t> &) const;
+	bool fts_rebuild(const char *dir, bool b_private);
+	inline bool has_hotprops() const { return m_base->hotprops; }
 
 	gromox::xstmt prep(const char *q) const { return gromox::gx_sql_prep(psqlite, q); }
 	int exec(const char *q, unsigned int fl = 0) const { return gromox::gx_sql_exec(psqlite, q, fl); }
@@ -211,25 +369,71 @@ struct db_conn {
 
 	private:
 	db_base *m_base = nullptr;
+	db_conn_pin *m_pin = nullptr; /* handles are borrowed from here */
+	int m_changes = 0; /* sqlite3_total_changes at open, for group commit */
 };
 using db_conn_ptr = std::optional<db_conn>;
 
+/**
+ * While a pin is alive, db_engine_get_db() for the pinned directory on the
+ * same thread hands out the pin's sqlite handles rather than acquiring its
+ * own. Nested acquisitions (while the pinned handles are lent out) take the
+ * normal route. Used to run a batch of RPCs under one acquisition.
+ */
+struct db_conn_pin {
+	db_conn_pin(const char *dir);
+	~db_conn_pin();
+	NOMOVE(db_conn_pin);
+
+	db_conn_ptr conn;
+	std::string dir;
+	bool lent = false;
+};
+
 extern void db_engine_init(size_t table_size, int cache_interval, unsigned int threads_num);
 extern int db_engine_run();
 extern void db_engine_stop();
 
 extern db_conn_ptr db_engine_get_db(const char *dir);
+extern db_conn_ptr db_engine_peek_db(const char *dir);
 extern BOOL db_engine_vacuum(const char *path);
 BOOL db_engine_unload_db(const char *path);
 extern BOOL db_engine_enqueue_populating_criteria(const char *dir, cpid_t, uint64_t folder_id, BOOL recursive, const RESTRICTION *, const LONGLONG_ARRAY *folder_ids);
 extern bool db_engine_check_populating(const char *dir, uint64_t folder_id);
 extern void dg_notify(db_conn::NOTIFQ &&);
+extern void db_engine_report();
+extern bool cu_eval_msg_plan(const res_plan *, sqlite3 *, cpid_t, uint64_t message_id, const RESTRICTION *);
+extern hot_src hotprops_source(uint32_t proptag, bool have_table);
+extern std::string hotprops_wrap(const std::string &query, bool have_table);
+extern bool hotprops_bind(sqlite3_stmt *src, sqlite3_stmt *dst, int pos, hot_src);
+extern void *db_maint_thread(void *stop_flag);
+extern void db_pcache_install();
+extern void db_pcache_report();
+extern void db_pcache_enforce(sqlite3 *);
+extern std::vector<std::string> db_engine_idle_dirs(gromox::time_point cutoff);
+extern bool purg_discover_cids(sqlite3 *, const char *dir, std::vector<std::string> &);
+extern void bk_reap();
+extern void bk_clean_tmp(const char *dir);
 
 extern unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 extern unsigned long long g_exmdb_search_pacing_time, g_exmdb_lock_timeout;
 extern unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+extern unsigned int g_exmdb_search_parallel;
 extern unsigned int g_exmdb_pvt_folder_softdel;
 extern std::string g_exmdb_ics_log_file;
 /* Max number of cached DB connections per store, 0 = unlimited */
 extern unsigned int g_exmdb_max_sqlite_spares;
 extern unsigned long long g_sqlite_busy_timeout_ns;
+/* Memory budget for resident mailboxes (bytes), 0 = unlimited */
+extern unsigned long long g_exmdb_cache_budget;
+extern unsigned int g_exmdb_stmt_cache;
+extern bool g_exmdb_compile_res;
+extern bool g_exmdb_group_commit;
+extern unsigned long long g_exmdb_group_commit_window;
+extern unsigned long long g_exmdb_maint_interval, g_exmdb_maint_idle;
+extern unsigned long long g_exmdb_maint_slice, g_exmdb_maint_io_rate;
+extern unsigned long long g_exmdb_maint_softdel_age, g_exmdb_maint_vacuum_max;
+extern unsigned long long g_exmdb_maint_tombstone_age;
+extern unsigned int g_exmdb_maint_cpu;
+extern unsigned long long g_exmdb_page_cache_budget, g_exmdb_mmap_size;
+extern thread_local bool t_db_maint;
@@ -1653,6 +1653,18 @@ BOOL exmdb_server::movecopy_folder(const char *dir, cpid_t cpid, BOOL b_guest,
 
 	db_conn::NOTIFQ notifq;
 	auto dbase = pdb->lock_base_wr();
+	/*
+	 * Ancestor chains computed during the move were not cached; drop
+	 * what is there once the transaction has committed or rolled back.
+	 */
+	auto cl_0 = make_scope_exit([&]() {
+		auto &dx = dbase->dyn_index;
+		if (!dx.frozen)
+			return;
+		dx.ancestors.clear();
+		dx.uncached.clear();
+		dx.frozen = false;
+	});
 	if (!b_copy) {
 		snprintf(sql_string, std::size(sql_string), "UPDATE folders SET parent_id=%llu"
 		        " WHERE folder_id=%llu", LLU{dst_val}, LLU{src_val});
@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Optional full-text sidecar for a store (exmdb/fts.sqlite3).
+ *
+ * The sidecar holds a trigram FTS5 table over PR_SUBJECT and PR_BODY keyed
+ * by message_id. It is only ever created by the fts_rebuild RPC (gromox-mbop
+ * fts-rebuild); once present, it is kept current from the message
+ * notification hooks. Restriction evaluation uses it as a prefilter: the
+ * candidate set is a superset of the true matches (trigram matching is
+ * case-insensitive), and the exact C++ evaluation still runs on candidates.
+ *
+ * The hooks run inside the store transaction, which may yet be rolled back.
+ * msgstate therefore records the change number each row was indexed at, and
+ * any message whose change number differs (or which has no row) is always a
+ * candidate.
+ *
+ * Should an update of the sidecar fail, the sidecar is discarded instead of
+ * being left incomplete: restrictions then evaluate without it until the
+ * next successful rebuild.
+ */
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/restriction.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+using LLU = unsigned long long;
+
+static constexpr char fts_schema[] =
+"CREATE VIRTUAL TABLE msgtext USING fts5(subject, body, tokenize='trigram');"
+"CREATE TABLE msgstate (message_id INTEGER PRIMARY KEY, change_number INTEGER NOT NULL);";
+
+/* Messages indexed per environment during a rebuild (bounds cu_alloc use) */
+static constexpr unsigned int FTS_REBUILD_CHUNK = 256;
+
+static db_handle fts_open_file(const std::string &path, int flags)
+{
+	sqlite3 *db = nullptr;
+	auto ret = sqlite3_open_v2(path.c_str(), &db, flags | SQLITE_OPEN_NOMUTEX, nullptr);
+	db_handle hdb(db);
+	if (ret != SQLITE_OK) {
+		mlog(LV_ERR, "E-2908: sqlite3_open %s: %s", path.c_str(), sqlite3_errstr(ret));
+		return nullptr;
+	}
+	sqlite3_busy_timeout(db, 60000);
+	return hdb;
+}
+
+void db_base::fts_open(const char *dir)
+{
+	auto path = fmt::format("{}/exmdb/fts.sqlite3", dir);
+	if (access(path.c_str(), F_OK) != 0)
+		return;
+	auto hdb = fts_open_file(path, SQLITE_OPEN_READWRITE);
+	if (hdb == nullptr)
+		return;
+	auto stm = gx_sql_prep(hdb.get(), "SELECT 1 FROM msgstate LIMIT 0");
+	if (stm == nullptr) {
+		mlog(LV_ERR, "E-2909: %s is not usable, full-text search disabled", path.c_str());
+		return;
+	}
+	stm.finalize();
+	gx_sql_exec(hdb.get(), "PRAGMA journal_mode=WAL");
+	gx_sql_exec(hdb.get(), "PRAGMA synchronous=NORMAL");
+	std::lock_guard lk(fts_lock);
+	fts_db = std::move(hdb);
+}
+
+/**
+ * (Re-)index one message. Skipped if the indexed change number is current,
+ * so that readstate flips and similar do not re-read the body.
+ */
+static bool fts_index(sqlite3 *fts, sqlite3 *psqlite, uint64_t message_id,
+    uint64_t change_num)
+{
+	auto stm = gx_sql_prep(fts, "SELECT change_number FROM msgstate WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	if (stm.step() == SQLITE_ROW && stm.col_uint64(0) == change_num)
+		return true;
+	stm.finalize();
+	void *subject = nullptr, *body = nullptr;
+	if (!cu_get_property(MAPI_MESSAGE, message_id, CP_ACP, psqlite,
+	    PR_SUBJECT, &subject) ||
+	    !cu_get_property(MAPI_MESSAGE, message_id, CP_ACP, psqlite,
+	    PR_BODY, &body))
+		return false;
+	stm = gx_sql_prep(fts, "REPLACE INTO msgtext (rowid, subject, body) VALUES (?,?,?)");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	stm.bind_text(2, znul(static_cast<const char *>(subject)));
+	stm.bind_text(3, znul(static_cast<const char *>(body)));
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	stm = gx_sql_prep(fts, "REPLACE INTO msgstate (message_id, change_number) VALUES (?,?)");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	stm.bind_int64(2, change_num);
+	return stm.step() == SQLITE_DONE;
+}
+
+/**
+ * Stop using the sidecar of @dir and remove it, so that it does not come
+ * back on the next load either. Caller holds fts_lock.
+ */
+static void fts_discard(db_base &base, const char *dir)
+{
+	base.fts_db.reset();
+	auto path = fmt::format("{}/exmdb/fts.sqlite3", dir);
+	::unlink(path.c_str());
+	::unlink((path + "-wal").c_str());
+	::unlink((path + "-shm").c_str());
+}
+
+/* Remember @message_id for the catch-up of a running rebuild. Caller holds fts_lock. */
+static void fts_note(db_base &base, uint64_t message_id)
+{
+	if (!base.fts_rebuild.active)
+		return;
+	try {
+		base.fts_rebuild.pending.insert(message_id);
+	} catch (const std::bad_alloc &) {
+		base.fts_rebuild.lost = true;
+	}
+}
+
+void db_conn::fts_update(uint64_t message_id)
+{
+	std::lock_guard lk(m_base->fts_lock);
+	fts_note(*m_base, message_id);
+	auto fts = m_base->fts_db.get();
+	if (fts == nullptr)
+		return;
+	char sql_string[128];
+	snprintf(sql_string, std::size(sql_string), "SELECT change_number FROM"
+	         " messages WHERE message_id=%llu AND parent_fid IS NOT NULL",
+	         LLU{message_id});
+	auto stm = prep(sql_string);
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return;
+	if (fts_index(fts, psqlite, message_id, stm.col_uint64(0)))
+		return;
+	auto dir = exmdb_server::get_dir();
+	mlog(LV_WARN, "W-2910: fts: could not index message %llu in %s; "
+	        "full-text index disabled until the next fts-rebuild",
+	        LLU{message_id}, dir);
+	fts_discard(*m_base, dir);
+}
+
+void db_conn::fts_delete(uint64_t message_id)
+{
+	std::lock_guard lk(m_base->fts_lock);
+	fts_note(*m_base, message_id);
+	auto fts = m_base->fts_db.get();
+	if (fts == nullptr)
+		return;
+	/*
+	 * Soft-deleted messages can be restored without further notification,
+	 * so they stay indexed; only drop rows for messages that are gone.
+	 */
+	char sql_string[128];
+	snprintf(sql_string, std::size(sql_string), "SELECT 1 FROM messages"
+	         " WHERE message_id=%llu", LLU{message_id});
+	auto stm = prep(sql_string);
+	if (stm == nullptr || stm.step() != SQLITE_DONE)
+		return;
+	snprintf(sql_string, std::size(sql_string), "DELETE FROM msgtext"
+	         " WHERE rowid=%llu", LLU{message_id});
+	auto ret = gx_sql_exec(fts, sql_string);
+	if (ret == SQLITE_OK) {
+		snprintf(sql_string, std::size(sql_string), "DELETE FROM msgstate"
+		         " WHERE message_id=%llu", LLU{message_id});
+		ret = gx_sql_exec(fts, sql_string);
+	}
+	if (ret == SQLITE_OK)
+		return;
+	auto dir = exmdb_server::get_dir();
+	mlog(LV_WARN, "W-2910: fts: could not unindex message %llu in %s; "
+	        "full-text index disabled until the next fts-rebuild",
+	        LLU{message_id}, dir);
+	fts_discard(*m_base, dir);
+}
+
+/**
+ * Whether @rc can be answered (as a superset) by the trigram index, and if
+ * so, the column name.
+ */
+static const char *fts_column(const RESTRICTION_CONTENT &rc)
+{
+	if (!rc.comparable() || PROP_TYPE(rc.proptag) == PT_BINARY)
+		return nullptr;
+	switch (rc.fuzzy_level & 0xFFFF) {
+	case FL_FULLSTRING:
+	case FL_SUBSTRING:
+	case FL_PREFIX:
+		break;
+	default:
+		return nullptr;
+	}
+	auto s = static_cast<const char *>(rc.propval.pvalue);
+	if (s == nullptr)
+		return nullptr;
+	/* trigram needs at least three characters to use the index */
+	size_t nchars = 0;
+	bool ascii = true;
+	for (auto p = s; *p != '\0'; ++p) {
+		if ((*p & 0xC0) != 0x80)
+			++nchars;
+		if (static_cast<unsigned char>(*p) >= 0x80)
+			ascii = false;
+	}
+	if (nchars < 3)
+		return nullptr;
+	/* Index holds the Unicode text; 8-bit patterns are only safe if ASCII. */
+	if (PROP_TYPE(rc.propval.proptag) == PT_STRING8 && !ascii)
+		return nullptr;
+	if (PROP_ID(rc.proptag) == PROP_ID(PR_SUBJECT))
+		return "subject";
+	if (PROP_ID(rc.proptag) == PROP_ID(PR_BODY))
+		return "body";
+	return nullptr;
+}
+
+/**
+ * Returns true if @res could be mapped to a candidate set, which is then in
+ * @out. Returns false if the index cannot narrow @res down (the caller must
+ * then consider all messages).
+ */
+static bool fts_eval(sqlite3 *fts, const RESTRICTION &res,
+    std::unordered_set<uint64_t> &out)
+{
+	switch (res.rt) {
+	case RES_AND: {
+		bool have = false;
+		for (size_t i = 0; i < res.andor->count; ++i) {
+			std::unordered_set<uint64_t> sub;
+			if (!fts_eval(fts, res.andor->pres[i], sub))
+				continue;
+			if (!have) {
+				out = std::move(sub);
+				have = true;
+				continue;
+			}
+			std::erase_if(out, [&](uint64_t m) { return sub.count(m) == 0; });
+		}
+		return have;
+	}
+	case RES_OR:
+		out.clear();
+		for (size_t i = 0; i < res.andor->count; ++i) {
+			std::unordered_set<uint64_t> sub;
+			if (!fts_eval(fts, res.andor->pres[i], sub))
+				return false;
+			out.merge(sub);
+		}
+		return true;
+	case RES_CONTENT: {
+		auto col = fts_column(*res.cont);
+		if (col == nullptr)
+			return false;
+		std::string q = col;
+		q += " : \"";
+		for (auto p = static_cast<const char *>(res.cont->propval.pvalue); *p != '\0'; ++p) {
+			if (*p == '"')
+				q += '"';
+			q += *p;
+		}
+		q += '"';
+		auto stm = gx_sql_prep(fts, "SELECT rowid FROM msgtext WHERE msgtext MATCH ?");
+		if (stm == nullptr)
+			return false;
+		stm.bind_text(1, q);
+		out.clear();
+		int ret;
+		while ((ret = stm.step()) == SQLITE_ROW)
+			out.insert(stm.col_uint64(0));
+		return ret == SQLITE_DONE;
+	}
+	default:
+		return false;
+	}
+}
+
+/**
+ * Add to @out every message whose indexed change number does not match the
+ * store, i.e. whose row was written (or dropped) by a transaction that was
+ * rolled back afterwards. Both tables are walked in message_id order.
+ */
+static bool fts_add_stale(sqlite3 *fts, sqlite3 *psqlite,
+    std::unordered_set<uint64_t> &out)
+{
+	auto mst = gx_sql_prep(psqlite, "SELECT message_id, change_number FROM"
+	           " messages WHERE parent_fid IS NOT NULL ORDER BY message_id");
+	if (mst == nullptr)
+		return false;
+	auto ist = gx_sql_prep(fts, "SELECT message_id, change_number FROM"
+	           " msgstate ORDER BY message_id");
+	if (ist == nullptr)
+		return false;
+	bool have_idx = ist.step() == SQLITE_ROW;
+	int ret;
+	while ((ret = mst.step()) == SQLITE_ROW) {
+		auto mid = mst.col_uint64(0);
+		while (have_idx && ist.col_uint64(0) < mid)
+			have_idx = ist.step() == SQLITE_ROW;
+		if (!have_idx || ist.col_uint64(0) != mid ||
+		    ist.col_uint64(1) != mst.col_uint64(1))
+			out.insert(mid);
+	}
+	return ret == SQLITE_DONE;
+}
+
+/**
+ * Compute the set of message ids which can possibly satisfy @res. Returns
+ * false if there is no index or no part of @res can be pushed down to it.
+ */
+bool db_conn::fts_candidates(const RESTRICTION *res,
+    std::unordered_set<uint64_t> &out) const try
+{
+	if (res == nullptr)
+		return false;
+	std::lock_guard lk(m_base->fts_lock);
+	auto fts = m_base->fts_db.get();
+	if (fts == nullptr)
+		return false;
+	if (!fts_eval(fts, *res, out))
+		return false;
+	return fts_add_stale(fts, psqlite, out);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2911: ENOMEM");
+	return false;
+}
+
+/**
+ * Bring @message_id up to date in the new sidecar @fts after it changed
+ * during the rebuild.
+ */
+static bool fts_catch_up(sqlite3 *fts, sqlite3 *psqlite, uint64_t message_id)
+{
+	auto stm = gx_sql_prep(psqlite, "SELECT change_number, parent_fid IS NOT NULL"
+	           " FROM messages WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	auto ret = stm.step();
+	if (ret == SQLITE_ROW)
+		return stm.col_int64(1) == 0 ||
+		       fts_index(fts, psqlite, message_id, stm.col_uint64(0));
+	if (ret != SQLITE_DONE)
+		return false;
+	stm = gx_sql_prep(fts, "DELETE FROM msgtext WHERE rowid=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	stm = gx_sql_prep(fts, "DELETE FROM msgstate WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, message_id);
+	return stm.step() == SQLITE_DONE;
+}
+
+/**
+ * Build a fresh sidecar next to exchange.sqlite3 and swap it in. Runs in a
+ * separate thread (with its own db_conn) so that each chunk of messages can
+ * get its own environment.
+ *
+ * Each chunk is indexed under a short read lock; writers run in between and
+ * their messages are collected by the update hooks. Those are indexed once
+ * more at the end, under the read lock that also covers the swap.
+ */
+bool db_conn::fts_rebuild(const char *dir, bool b_private)
+{
+	auto path = fmt::format("{}/exmdb/fts.sqlite3", dir);
+	auto tmp_path = path + ".tmp";
+	{
+		std::lock_guard lk(m_base->fts_lock);
+		if (m_base->fts_rebuild.active) {
+			mlog(LV_ERR, "E-2972: fts: a rebuild for %s is already running", dir);
+			return false;
+		}
+		m_base->fts_rebuild.active = true;
+		m_base->fts_rebuild.lost = false;
+		m_base->fts_rebuild.pending.clear();
+	}
+	auto cl_0 = make_scope_exit([&]() {
+		std::lock_guard lk(m_base->fts_lock);
+		m_base->fts_rebuild.active = false;
+		m_base->fts_rebuild.pending.clear();
+	});
+	if (::unlink(tmp_path.c_str()) != 0 && errno != ENOENT) {
+		mlog(LV_ERR, "E-2912: unlink %s: %s", tmp_path.c_str(), strerror(errno));
+		return false;
+	}
+	auto hdb = fts_open_file(tmp_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	if (hdb == nullptr)
+		return false;
+	auto cl_1 = make_scope_exit([&]() { ::unlink(tmp_path.c_str()); });
+	if (gx_sql_exec(hdb.get(), fts_schema) != SQLITE_OK)
+		return false;
+
+	std::vector<std::pair<uint64_t, uint64_t>> msgs;
+	uint64_t cursor = 0;
+	size_t total = 0;
+	do {
+		exmdb_server::build_env(b_private ? EM_PRIVATE : 0, dir);
+		auto cl_2 = make_scope_exit(exmdb_server::free_env);
+		auto tx = gx_sql_begin(hdb.get(), txn_mode::write);
+		if (!tx)
+			return false;
+		msgs.clear();
+		{
+			auto dbase = lock_base_rd();
+			auto sql_transact = gx_sql_begin(psqlite, txn_mode::read);
+			if (!sql_transact)
+				return false;
+			auto stm = prep("SELECT message_id, change_number FROM messages"
+			           " WHERE parent_fid IS NOT NULL AND message_id>?"
+			           " ORDER BY message_id LIMIT ?");
+			if (stm == nullptr)
+				return false;
+			stm.bind_int64(1, cursor);
+			stm.bind_int64(2, FTS_REBUILD_CHUNK);
+			while (stm.step() == SQLITE_ROW)
+				msgs.emplace_back(stm.col_uint64(0), stm.col_uint64(1));
+			stm.finalize();
+			for (const auto &[mid, cn] : msgs) {
+				if (fts_index(hdb.get(), psqlite, mid, cn))
+					continue;
+				mlog(LV_ERR, "E-2913: fts: could not index message %llu in %s; rebuild aborted",
+				        LLU{mid}, dir);
+				return false;
+			}
+		}
+		if (tx.commit() != SQLITE_OK)
+			return false;
+		total += msgs.size();
+		if (!msgs.empty())
+			cursor = msgs.back().first;
+	} while (msgs.size() == FTS_REBUILD_CHUNK);
+	gx_sql_exec(hdb.get(), "INSERT INTO msgtext (msgtext) VALUES ('optimize')");
+
+	exmdb_server::build_env(b_private ? EM_PRIVATE : 0, dir);
+	auto cl_3 = make_scope_exit(exmdb_server::free_env);
+	auto dbase = lock_base_rd();
+	std::lock_guard lk(m_base->fts_lock);
+	if (m_base->fts_rebuild.lost) {
+		mlog(LV_ERR, "E-2973: fts: ENOMEM while tracking changes during the rebuild of %s", dir);
+		return false;
+	}
+	{
+		auto sql_transact = gx_sql_begin(psqlite, txn_mode::read);
+		auto tx = gx_sql_begin(hdb.get(), txn_mode::write);
+		if (!sql_transact || !tx)
+			return false;
+		for (auto mid : m_base->fts_rebuild.pending) {
+			if (fts_catch_up(hdb.get(), psqlite, mid))
+				continue;
+			mlog(LV_ERR, "E-2913: fts: could not index message %llu in %s; rebuild aborted",
+			        LLU{mid}, dir);
+			return false;
+		}
+		if (tx.commit() != SQLITE_OK)
+			return false;
+	}
+	m_base->fts_db.reset();
+	hdb.reset();
+	if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+		mlog(LV_ERR, "E-2914: rename %s: %s", tmp_path.c_str(), strerror(errno));
+		return false;
+	}
+	cl_1.release();
+	m_base->fts_db = fts_open_file(path, SQLITE_OPEN_READWRITE);
+	if (m_base->fts_db == nullptr)
+		return false;
+	gx_sql_exec(m_base->fts_db.get(), "PRAGMA journal_mode=WAL");
+	gx_sql_exec(m_base->fts_db.get(), "PRAGMA synchronous=NORMAL");
+	mlog(LV_NOTICE, "exmdb: fts index for %s rebuilt (%zu messages)", dir, total);
+	return true;
+}
+
+BOOL exmdb_server::fts_rebuild(const char *dir)
+{
+	bool ok = false, b_private = exmdb_server::is_private();
+	std::thread thr([&]() {
+		auto pdb = db_engine_get_db(dir);
+		ok = pdb && pdb->fts_rebuild(dir, b_private);
+	});
+	thr.join();
+	return ok ? TRUE : false;
+}
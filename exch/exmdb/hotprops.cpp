@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Optional typed mirror of frequently sorted message properties.
+ *
+ * message_hotprops holds one row per message with delivery time, last
+ * modification time, subject prefix, normalized subject and sender name in
+ * plain columns. It is created only by the hotprops_setup RPC (gromox-mbop
+ * hotprops-enable); SQLite triggers on message_properties then keep it in
+ * sync with every write path, and the foreign key drops rows along with their
+ * message. Content table loading fetches these sort keys with one primary key
+ * lookup per message instead of one message_properties lookup per column.
+ *
+ * The mirrored string columns only reflect the PT_UNICODE variants. Messages
+ * that ever had a PT_STRING8 variant written are marked (str8=1) and fall
+ * back to cu_get_property, which does the codepage conversion.
+ */
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+
+/* Column positions in the enumeration query built by hotprops_wrap */
+enum {
+	HC_SIZE = 1, HC_STR8, HC_DTIME, HC_MTIME, HC_PREFIX, HC_NSUBJ, HC_SENDER,
+};
+
+static std::string hotprops_schema()
+{
+	auto set_cols = [](const char *row, const char *val) {
+		return fmt::format("delivery_time=CASE WHEN {0}.proptag={2} THEN {1} ELSE delivery_time END, "
+		       "lastmod_time=CASE WHEN {0}.proptag={3} THEN {1} ELSE lastmod_time END, "
+		       "subject_prefix=CASE WHEN {0}.proptag={4} THEN {1} ELSE subject_prefix END, "
+		       "normalized_subject=CASE WHEN {0}.proptag={5} THEN {1} ELSE normalized_subject END, "
+		       "sender_name=CASE WHEN {0}.proptag={6} THEN {1} ELSE sender_name END",
+		       row, val, PR_MESSAGE_DELIVERY_TIME, PR_LAST_MODIFICATION_TIME,
+		       PR_SUBJECT_PREFIX, PR_NORMALIZED_SUBJECT, PR_SENDER_NAME);
+	};
+	/*
+	 * Not INSERT OR IGNORE: the conflict mode of the outer statement
+	 * (REPLACE INTO message_properties) would override it and wipe the row.
+	 */
+	static constexpr char add_row[] =
+		"INSERT INTO message_hotprops (message_id) SELECT new.message_id "
+		"WHERE NOT EXISTS (SELECT 1 FROM message_hotprops WHERE message_id=new.message_id);";
+	auto tags = fmt::format("{},{},{},{},{}", PR_MESSAGE_DELIVERY_TIME,
+	            PR_LAST_MODIFICATION_TIME, PR_SUBJECT_PREFIX,
+	            PR_NORMALIZED_SUBJECT, PR_SENDER_NAME);
+	auto tags_a = fmt::format("{},{},{}", PR_SUBJECT_PREFIX_A,
+	              PR_NORMALIZED_SUBJECT_A, PR_SENDER_NAME_A);
+	return "CREATE TABLE message_hotprops ("
+		"message_id INTEGER PRIMARY KEY,"
+		" delivery_time INTEGER DEFAULT NULL,"
+		" lastmod_time INTEGER DEFAULT NULL,"
+		" subject_prefix TEXT DEFAULT NULL,"
+		" normalized_subject TEXT DEFAULT NULL,"
+		" sender_name TEXT DEFAULT NULL,"
+		" str8 INTEGER NOT NULL DEFAULT 0,"
+		" FOREIGN KEY (message_id) REFERENCES messages (message_id)"
+		" ON DELETE CASCADE ON UPDATE CASCADE);" +
+		fmt::format("CREATE TRIGGER hotprops_ins AFTER INSERT ON message_properties "
+		"WHEN new.proptag IN ({0}) BEGIN {1} UPDATE message_hotprops SET {2} "
+		"WHERE message_id=new.message_id; END;", tags, add_row,
+		set_cols("new", "new.propval")) +
+		fmt::format("CREATE TRIGGER hotprops_upd AFTER UPDATE OF propval ON message_properties "
+		"WHEN new.proptag IN ({0}) BEGIN {1} UPDATE message_hotprops SET {2} "
+		"WHERE message_id=new.message_id; END;", tags, add_row,
+		set_cols("new", "new.propval")) +
+		fmt::format("CREATE TRIGGER hotprops_del AFTER DELETE ON message_properties "
+		"WHEN old.proptag IN ({0}) BEGIN UPDATE message_hotprops SET {1} "
+		"WHERE message_id=old.message_id; END;", tags,
+		set_cols("old", "NULL")) +
+		fmt::format("CREATE TRIGGER hotprops_str8 AFTER INSERT ON message_properties "
+		"WHEN new.proptag IN ({0}) BEGIN {1} UPDATE message_hotprops SET str8=1 "
+		"WHERE message_id=new.message_id; END;", tags_a, add_row);
+}
+
+static std::string hotprops_backfill()
+{
+	auto sub = [](uint32_t tag) {
+		return fmt::format("(SELECT propval FROM message_properties "
+		       "WHERE message_id=m.message_id AND proptag={})", tag);
+	};
+	return fmt::format("INSERT INTO message_hotprops (message_id, delivery_time,"
+	       " lastmod_time, subject_prefix, normalized_subject, sender_name, str8)"
+	       " SELECT m.message_id, {}, {}, {}, {}, {}, EXISTS (SELECT 1 FROM"
+	       " message_properties WHERE message_id=m.message_id AND proptag IN"
+	       " ({},{},{})) FROM messages AS m",
+	       sub(PR_MESSAGE_DELIVERY_TIME), sub(PR_LAST_MODIFICATION_TIME),
+	       sub(PR_SUBJECT_PREFIX), sub(PR_NORMALIZED_SUBJECT),
+	       sub(PR_SENDER_NAME), PR_SUBJECT_PREFIX_A,
+	       PR_NORMALIZED_SUBJECT_A, PR_SENDER_NAME_A);
+}
+
+static constexpr char hotprops_drop[] =
+	"DROP TRIGGER IF EXISTS hotprops_ins;"
+	"DROP TRIGGER IF EXISTS hotprops_upd;"
+	"DROP TRIGGER IF EXISTS hotprops_del;"
+	"DROP TRIGGER IF EXISTS hotprops_str8;"
+	"DROP TABLE IF EXISTS message_hotprops;";
+
+void db_base::hotprops_open(sqlite3 *psqlite)
+{
+	auto stm = gx_sql_prep(psqlite, "SELECT COUNT(*) FROM sqlite_master "
+	           "WHERE type='trigger' AND name LIKE 'hotprops_%'");
+	hotprops = stm != nullptr && stm.step() == SQLITE_ROW &&
+	           stm.col_int64(0) == 4;
+}
+
+hot_src hotprops_source(uint32_t proptag, bool have_table)
+{
+	if (proptag == PR_MESSAGE_SIZE)
+		return hot_src::msgsize;
+	if (!have_table)
+		return hot_src::none;
+	switch (proptag) {
+	case PR_MESSAGE_DELIVERY_TIME: return hot_src::dtime;
+	case PR_LAST_MODIFICATION_TIME: return hot_src::mtime;
+	case PR_SUBJECT: return hot_src::subject;
+	case PR_NORMALIZED_SUBJECT: return hot_src::nsubject;
+	case PR_SENDER_NAME: return hot_src::sender;
+	default: return hot_src::none;
+	}
+}
+
+/**
+ * Turn the message enumeration @q (first column: message_id) into one that
+ * additionally yields the mirrored sort keys for hotprops_bind.
+ */
+std::string hotprops_wrap(const std::string &q, bool have_table)
+{
+	if (!have_table)
+		return "SELECT y.message_id, m.message_size, 1 FROM (" + q +
+		       ") AS y JOIN messages AS m ON m.message_id=y.message_id";
+	return "SELECT y.message_id, m.message_size, h.str8, h.delivery_time,"
+	       " h.lastmod_time, h.subject_prefix, h.normalized_subject,"
+	       " h.sender_name FROM (" + q + ") AS y JOIN messages AS m"
+	       " ON m.message_id=y.message_id LEFT JOIN message_hotprops AS h"
+	       " ON h.message_id=y.message_id";
+}
+
+/**
+ * Bind the value of sort column @hs from the current row of @src (built by
+ * hotprops_wrap) to parameter @pos of @dst. Returns false if the caller needs
+ * to obtain the value through cu_get_property instead.
+ */
+bool hotprops_bind(sqlite3_stmt *src, sqlite3_stmt *dst, int pos, hot_src hs)
+{
+	auto bind_col = [&](int col) {
+		if (sqlite3_column_type(src, col) == SQLITE_NULL)
+			sqlite3_bind_null(dst, pos);
+		else if (col == HC_DTIME || col == HC_MTIME)
+			sqlite3_bind_int64(dst, pos, sqlite3_column_int64(src, col));
+		else
+			sqlite3_bind_text(dst, pos, reinterpret_cast<const char *>(sqlite3_column_text(src, col)),
+				-1, SQLITE_TRANSIENT);
+		return true;
+	};
+	switch (hs) {
+	case hot_src::msgsize:
+		/* cu_get_property truncates the same way */
+		sqlite3_bind_int64(dst, pos, static_cast<uint32_t>(sqlite3_column_int64(src, HC_SIZE)));
+		return true;
+	case hot_src::dtime: return bind_col(HC_DTIME);
+	case hot_src::mtime: return bind_col(HC_MTIME);
+	default:
+		break;
+	}
+	if (sqlite3_column_int64(src, HC_STR8) != 0)
+		return false;
+	switch (hs) {
+	case hot_src::nsubject: return bind_col(HC_NSUBJ);
+	case hot_src::sender: return bind_col(HC_SENDER);
+	case hot_src::subject: {
+		/* Same composition as common_util_get_message_subject */
+		auto pfx = reinterpret_cast<const char *>(sqlite3_column_text(src, HC_PREFIX));
+		auto nrm = reinterpret_cast<const char *>(sqlite3_column_text(src, HC_NSUBJ));
+		std::string s = znul(pfx);
+		s += znul(nrm);
+		sqlite3_bind_text(dst, pos, s.c_str(), s.size(), SQLITE_TRANSIENT);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+BOOL exmdb_server::hotprops_setup(const char *dir, uint32_t flags) try
+{
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return false;
+	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	auto dbase = pdb->lock_base_wr();
+	if (pdb->exec(hotprops_drop) != SQLITE_OK)
+		return false;
+	if (flags & HOTPROPS_ENABLE) {
+		if (pdb->exec(hotprops_schema().c_str()) != SQLITE_OK ||
+		    pdb->exec(hotprops_backfill().c_str()) != SQLITE_OK)
+			return false;
+	}
+	if (sql_transact.commit() != SQLITE_OK)
+		return false;
+	dbase->hotprops = flags & HOTPROPS_ENABLE;
+	mlog(LV_NOTICE, "exmdb: hot property columns for %s %s", dir,
+	     dbase->hotprops ? "(re)built" : "removed");
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2922: ENOMEM");
+	return false;
+}
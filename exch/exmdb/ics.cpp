@@ -18,6 +18,7 @@
 #include "db_engine.hpp"
 
 using namespace gromox;
+using LLU = unsigned long long;
 
 namespace {
 
@@ -86,6 +87,373 @@ static ec_error_t delete_impossible_mids(const idset &given, EID_ARRAY &del)
 	return p1.error;
 }
 
+static void ics_log_content_sync(const char *dir, const char *username,
+    uint64_t folder_id, const idset *pgiven, const idset *pread,
+    const RESTRICTION *prestriction, uint32_t normal_count, uint32_t fai_count,
+    const EID_ARRAY *pupdated_mids, const EID_ARRAY *pchg_mids,
+    const EID_ARRAY *pgiven_mids, const EID_ARRAY *pdeleted_mids,
+    const EID_ARRAY *pnolonger_mids, uint64_t last_cn)
+{
+	if (g_exmdb_ics_log_file.empty())
+		return;
+	std::lock_guard lk(ics_log_mtx);
+	std::unique_ptr<FILE, file_deleter> fh;
+	if (g_exmdb_ics_log_file != "-")
+		fh.reset(fopen(g_exmdb_ics_log_file.c_str(), "a"));
+	if (fh == nullptr)
+		return;
+	fprintf(fh.get(), "-------------\n");
+	fprintf(fh.get(), "dir=%s actor=%s CONTENT_SYNC folder_id=%llxh given=",
+		dir, znul(username), static_cast<unsigned long long>(folder_id));
+	pgiven->dump(fh.get());
+	fprintf(fh.get(), " read=");
+	pread->dump(fh.get());
+	fprintf(fh.get(), " rst=");
+	if (prestriction != nullptr)
+		fprintf(fh.get(), "%s", prestriction->repr().c_str());
+	fprintf(fh.get(), " Out: Msg+FAI=%u+%u upd={",
+		normal_count, fai_count);
+	for (unsigned long long mid : *pupdated_mids)
+		fprintf(fh.get(), "%llxh,", mid);
+	fprintf(fh.get(), "}\nchg={");
+	for (unsigned long long mid : *pchg_mids)
+		fprintf(fh.get(), "%llxh,", mid);
+	fprintf(fh.get(), "}\ngiven={");
+	for (unsigned long long mid : *pgiven_mids)
+		fprintf(fh.get(), "%llxh,", mid);
+	fprintf(fh.get(), "}\ndel={");
+	for (unsigned long long mid : *pdeleted_mids)
+		fprintf(fh.get(), "%llxh,", mid);
+	fprintf(fh.get(), "}\nnolonger={");
+	for (unsigned long long mid : *pnolonger_mids)
+		fprintf(fh.get(), "%llxh,", mid);
+	fprintf(fh.get(), "}\nlastcn=%llxh\n", static_cast<unsigned long long>(last_cn));
+}
+
+/**
+ * Returns the CN up to which @set is gapless, i.e. all of [1..x] are
+ * contained. 0 if there is no such prefix.
+ */
+static uint64_t ics_seen_floor(const idset *set)
+{
+	if (set == nullptr)
+		return 0;
+	for (const auto &r : set->get_repl_list()) {
+		if (r.replid != 1 || r.range_list.size() == 0)
+			continue;
+		return r.range_list.front().lo <= 1 ? r.range_list.front().hi : 0;
+	}
+	return 0;
+}
+
+static bool ics_eid_copy(const std::vector<uint64_t> &src, EID_ARRAY *dst)
+{
+	dst->count = src.size();
+	if (src.empty()) {
+		dst->pids = nullptr;
+		return true;
+	}
+	dst->pids = cu_alloc<uint64_t>(src.size());
+	if (dst->pids == nullptr) {
+		dst->count = 0;
+		return false;
+	}
+	memcpy(dst->pids, src.data(), sizeof(uint64_t) * src.size());
+	return true;
+}
+
+namespace {
+struct ics_chg {
+	uint64_t mid, dtime, mtime;
+};
+}
+
+/**
+ * Change-number driven variant of get_content_sync for the common case (no
+ * restriction, private store or no readstate sync). Instead of classifying
+ * every message of the folder against the idsets, only messages whose CN
+ * (resp. read CN) lies beyond the gapless prefix of @pseen (resp. @pread)
+ * are visited, and deletions are taken from the tombstone table.
+ *
+ * Returns 1 when the outputs are complete, 0 when the caller needs to fall
+ * back to the full scan (e.g. the client's idsets reach back before the
+ * tombstones), and -1 on error.
+ */
+static int ics_content_sync_cn(const char *dir, uint64_t fid_val,
+    const char *username, const idset *pgiven, const idset *pseen,
+    const idset *pseen_fai, const idset *pread, BOOL b_ordered, uint32_t *pfai_count,
+    uint64_t *pfai_total, uint32_t *pnormal_count, uint64_t *pnormal_total,
+    EID_ARRAY *pupdated_mids, EID_ARRAY *pchg_mids, uint64_t *plast_cn,
+    EID_ARRAY *pgiven_mids, EID_ARRAY *pdeleted_mids,
+    EID_ARRAY *pnolonger_mids, EID_ARRAY *pread_mids,
+    EID_ARRAY *punread_mids, uint64_t *plast_readcn) try
+{
+	if (pseen == nullptr && pseen_fai == nullptr)
+		return 0;
+	if (pread != nullptr && !exmdb_server::is_private())
+		return 0;
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return -1;
+	auto transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
+	if (!transact)
+		return -1;
+	{
+		auto stm = pdb->prep("SELECT 1 FROM sqlite_master WHERE "
+		           "type='table' AND name='message_tombstones'");
+		if (stm == nullptr)
+			return -1;
+		if (stm.step() != SQLITE_ROW)
+			return 0;
+	}
+	auto s_normal = pseen != nullptr ? "0" : "NULL";
+	auto s_fai    = pseen_fai != nullptr ? "1" : "NULL";
+	char sql_string[384];
+
+	/*
+	 * #1: MIDs the client has which are no longer here. Every such MID
+	 * must have a tombstone, else the client's state predates the
+	 * tombstones and we cannot tell deletions apart from never-seen ids.
+	 */
+	std::vector<uint64_t> deleted, nolonger;
+	{
+	auto pimpossible = eid_array_init();
+	if (pimpossible == nullptr)
+		return -1;
+	auto cl_0 = make_scope_exit([&]() { eid_array_free(pimpossible); });
+	if (delete_impossible_mids(*pgiven, *pimpossible) != ecSuccess)
+		return -1;
+	deleted.assign(pimpossible->pids, pimpossible->pids + pimpossible->count);
+	}
+	auto n_impossible = deleted.size();
+	uint64_t n_given = 0, n_given_here = 0;
+	snprintf(sql_string, std::size(sql_string), "SELECT count(*) FROM messages"
+	         " WHERE parent_fid=%llu AND is_deleted=0 AND is_associated IN (%s,%s)"
+	         " AND message_id BETWEEN ? AND ?", LLU{fid_val}, s_normal, s_fai);
+	auto stm_here = pdb->prep(sql_string);
+	if (stm_here == nullptr)
+		return -1;
+	snprintf(sql_string, std::size(sql_string), "SELECT t.message_id,"
+	         " m.message_id IS NOT NULL FROM message_tombstones AS t"
+	         " LEFT JOIN messages AS m ON t.message_id=m.message_id"
+	         " WHERE t.folder_id=%llu AND t.message_id BETWEEN ? AND ?"
+	         " ORDER BY t.message_id", LLU{fid_val});
+	auto stm_tomb = pdb->prep(sql_string);
+	if (stm_tomb == nullptr)
+		return -1;
+	for (const auto &repl : pgiven->get_repl_list()) {
+		if (repl.replid != 1)
+			continue;
+		for (const auto &range : repl.range_list) {
+			n_given += range.hi - range.lo + 1;
+			stm_here.bind_int64(1, range.lo);
+			stm_here.bind_int64(2, range.hi);
+			if (stm_here.step() != SQLITE_ROW)
+				return -1;
+			n_given_here += stm_here.col_uint64(0);
+			stm_here.reset();
+			stm_tomb.bind_int64(1, range.lo);
+			stm_tomb.bind_int64(2, range.hi);
+			while (stm_tomb.step() == SQLITE_ROW) {
+				auto eid = rop_util_make_eid_ex(1, stm_tomb.col_uint64(0));
+				/* Soft-deleted messages are still around */
+				if (stm_tomb.col_int64(1) != 0)
+					nolonger.push_back(eid);
+				else
+					deleted.push_back(eid);
+			}
+			stm_tomb.reset();
+		}
+	}
+	stm_here.finalize();
+	stm_tomb.finalize();
+	if (n_given != n_given_here + nolonger.size() + deleted.size() - n_impossible)
+		return 0;
+
+	/*
+	 * #2: Number of messages the server has. The MIDs themselves are
+	 * derived from the idsets below rather than read from the folder.
+	 */
+	snprintf(sql_string, std::size(sql_string), "SELECT count(*) FROM messages"
+	         " WHERE parent_fid=%llu AND is_deleted=0 AND is_associated IN (%s,%s)",
+	         LLU{fid_val}, s_normal, s_fai);
+	auto stm = pdb->prep(sql_string);
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return -1;
+	uint64_t n_here = stm.col_uint64(0);
+	stm.finalize();
+
+	/*
+	 * #3: Changes. Anything at or below the seen floor is known to the
+	 * client, provided the client has the MID (verified via count below).
+	 */
+	uint64_t cn_floor = UINT64_MAX;
+	if (pseen != nullptr)
+		cn_floor = std::min(cn_floor, ics_seen_floor(pseen));
+	if (pseen_fai != nullptr)
+		cn_floor = std::min(cn_floor, ics_seen_floor(pseen_fai));
+	snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
+	         " change_number, is_associated, message_size FROM messages"
+	         " WHERE parent_fid=%llu AND change_number>%llu AND is_deleted=0"
+	         " AND is_associated IN (%s,%s)", LLU{fid_val}, LLU{cn_floor},
+	         s_normal, s_fai);
+	stm = pdb->prep(sql_string);
+	if (stm == nullptr)
+		return -1;
+	xstmt stm_select_mp;
+	if (b_ordered) {
+		stm_select_mp = pdb->prep("SELECT propval FROM "
+		                "message_properties WHERE proptag=? AND message_id=?");
+		if (stm_select_mp == nullptr)
+			return -1;
+	}
+	std::vector<ics_chg> chg;
+	std::vector<uint64_t> here;
+	size_t n_unknown = 0;
+	*pfai_count = *pnormal_count = 0;
+	*pfai_total = *pnormal_total = 0;
+	while (stm.step() == SQLITE_ROW) {
+		uint64_t mid_val = stm.col_uint64(0);
+		auto msg_eid = rop_util_make_eid_ex(1, mid_val);
+		auto chg_eid = rop_util_make_eid_ex(1, stm.col_uint64(1));
+		bool b_fai = stm.col_int64(2) != 0;
+		bool b_given = pgiven->contains(msg_eid);
+		if (!b_given) {
+			++n_unknown;
+			here.push_back(msg_eid);
+		} else if ((b_fai ? pseen_fai : pseen)->contains(chg_eid))
+			continue;
+		ics_chg c{mid_val, 0, 0};
+		if (b_ordered) {
+			stm_select_mp.bind_int64(1, PR_MESSAGE_DELIVERY_TIME);
+			stm_select_mp.bind_int64(2, mid_val);
+			c.dtime = stm_select_mp.step() == SQLITE_ROW ? stm_select_mp.col_uint64(0) : 0;
+			stm_select_mp.reset();
+			stm_select_mp.bind_int64(1, PR_LAST_MODIFICATION_TIME);
+			stm_select_mp.bind_int64(2, mid_val);
+			c.mtime = stm_select_mp.step() == SQLITE_ROW ? stm_select_mp.col_uint64(0) : 0;
+			stm_select_mp.reset();
+		}
+		if (b_fai) {
+			++*pfai_count;
+			*pfai_total += stm.col_uint64(3);
+		} else {
+			++*pnormal_count;
+			*pnormal_total += stm.col_uint64(3);
+		}
+		chg.push_back(c);
+	}
+	stm.finalize();
+	stm_select_mp.finalize();
+	if (n_here - n_given_here != n_unknown)
+		return 0;
+	/*
+	 * The checks in #1 and #3 proved that every MID the client has is
+	 * either here or among deleted/nolonger, and that everything else
+	 * that is here was just collected from the changes.
+	 */
+	std::vector<uint64_t> gone;
+	gone.reserve(deleted.size() - n_impossible + nolonger.size());
+	gone.insert(gone.end(), deleted.begin() + n_impossible, deleted.end());
+	gone.insert(gone.end(), nolonger.begin(), nolonger.end());
+	std::sort(gone.begin(), gone.end());
+	here.reserve(n_here);
+	for (const auto &repl : pgiven->get_repl_list()) {
+		if (repl.replid != 1)
+			continue;
+		for (const auto &range : repl.range_list) {
+			for (auto gcv = range.lo; gcv <= range.hi; ++gcv) {
+				auto eid = rop_util_make_eid_ex(1, gcv);
+				if (!std::binary_search(gone.begin(), gone.end(), eid))
+					here.push_back(eid);
+			}
+		}
+	}
+	std::sort(here.begin(), here.end(), [](uint64_t a, uint64_t b) {
+		return rop_util_get_gc_value(a) > rop_util_get_gc_value(b);
+	});
+	std::sort(chg.begin(), chg.end(),
+		[](const ics_chg &a, const ics_chg &b) { return a.mid < b.mid; });
+	if (b_ordered)
+		std::stable_sort(chg.begin(), chg.end(),
+			[](const ics_chg &a, const ics_chg &b) {
+				return a.dtime != b.dtime ? a.dtime > b.dtime : a.mtime > b.mtime;
+			});
+	std::vector<uint64_t> chg_mids, upd_mids;
+	for (const auto &c : chg) {
+		auto eid = rop_util_make_eid_ex(1, c.mid);
+		chg_mids.push_back(eid);
+		if (pgiven->contains(eid))
+			upd_mids.push_back(eid);
+	}
+
+	/* #4: CN maxima */
+	snprintf(sql_string, std::size(sql_string), "SELECT max(change_number)"
+	         " FROM messages WHERE parent_fid=%llu AND is_deleted=0 AND"
+	         " is_associated IN (%s,%s)", LLU{fid_val}, s_normal, s_fai);
+	stm = pdb->prep(sql_string);
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return -1;
+	*plast_cn = stm.col_uint64(0);
+	if (exmdb_server::is_private())
+		snprintf(sql_string, std::size(sql_string), "SELECT max(read_cn)"
+		         " FROM messages WHERE parent_fid=%llu AND is_deleted=0 AND"
+		         " is_associated IN (%s,%s)", LLU{fid_val}, s_normal, s_fai);
+	else
+		snprintf(sql_string, std::size(sql_string), "SELECT max(r.read_cn)"
+		         " FROM read_cns AS r INNER JOIN messages AS m ON"
+		         " r.message_id=m.message_id WHERE m.parent_fid=%llu AND"
+		         " m.is_deleted=0 AND m.is_associated IN (%s,%s) AND"
+		         " r.username=?", LLU{fid_val}, s_normal, s_fai);
+	stm = pdb->prep(sql_string);
+	if (stm == nullptr)
+		return -1;
+	if (!exmdb_server::is_private())
+		stm.bind_text(1, znul(username));
+	if (stm.step() != SQLITE_ROW)
+		return -1;
+	*plast_readcn = stm.col_uint64(0);
+	stm.finalize();
+	if (*plast_cn != 0)
+		*plast_cn = rop_util_make_eid_ex(1, *plast_cn);
+	if (*plast_readcn != 0)
+		*plast_readcn = rop_util_make_eid_ex(1, *plast_readcn);
+
+	/* #5: Read state changes of otherwise unchanged messages */
+	std::vector<uint64_t> rd_mids, unrd_mids;
+	if (pread != nullptr && pseen != nullptr) {
+		snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
+		         " change_number, read_state, read_cn FROM messages"
+		         " WHERE parent_fid=%llu AND read_cn>%llu AND is_deleted=0"
+		         " AND is_associated=0 ORDER BY message_id", LLU{fid_val},
+		         LLU{ics_seen_floor(pread)});
+		stm = pdb->prep(sql_string);
+		if (stm == nullptr)
+			return -1;
+		while (stm.step() == SQLITE_ROW) {
+			auto msg_eid = rop_util_make_eid_ex(1, stm.col_uint64(0));
+			if (!pgiven->contains(msg_eid) ||
+			    !pseen->contains(rop_util_make_eid_ex(1, stm.col_uint64(1))) ||
+			    pread->contains(rop_util_make_eid_ex(1, stm.col_uint64(3))))
+				continue;
+			(stm.col_int64(2) != 0 ? rd_mids : unrd_mids).push_back(msg_eid);
+		}
+		stm.finalize();
+	}
+	if (!ics_eid_copy(chg_mids, pchg_mids) ||
+	    !ics_eid_copy(upd_mids, pupdated_mids) ||
+	    !ics_eid_copy(here, pgiven_mids) ||
+	    !ics_eid_copy(deleted, pdeleted_mids) ||
+	    !ics_eid_copy(nolonger, pnolonger_mids) ||
+	    !ics_eid_copy(rd_mids, pread_mids) ||
+	    !ics_eid_copy(unrd_mids, punread_mids))
+		return -1;
+	return 1;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2907: ENOMEM");
+	return -1;
+}
+
 /**
  * @username:     Used for retrieving public store readstates
  * @pgiven:       Set of MIDs the client has
@@ -111,6 +479,27 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	*pnormal_count = 0;
 	*pnormal_total = 0;
 	auto b_private = exmdb_server::is_private();
+	auto fid_val = rop_util_get_gc_value(folder_id);
+	if (prestriction == nullptr) {
+		auto ret = ics_content_sync_cn(dir, fid_val, username, pgiven,
+		           pseen, pseen_fai, pread, b_ordered, pfai_count,
+		           pfai_total, pnormal_count, pnormal_total, pupdated_mids,
+		           pchg_mids, plast_cn, pgiven_mids, pdeleted_mids,
+		           pnolonger_mids, pread_mids, punread_mids, plast_readcn);
+		if (ret < 0)
+			return false;
+		if (ret > 0) {
+			ics_log_content_sync(dir, username, folder_id, pgiven, pread,
+			        prestriction, *pnormal_count, *pfai_count,
+			        pupdated_mids, pchg_mids, pgiven_mids,
+			        pdeleted_mids, pnolonger_mids, *plast_cn);
+			return TRUE;
+		}
+		*pfai_count = 0;
+		*pfai_total = 0;
+		*pnormal_count = 0;
+		*pnormal_total = 0;
+	}
 
 	/*
 	 * Setup of scratch space db.
@@ -143,7 +532,6 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
 			return FALSE;
 	}
-	auto fid_val = rop_util_get_gc_value(folder_id);
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
 		return FALSE;
@@ -512,40 +900,9 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		punread_mids->pids = NULL;
 	} /* section 5 */
 
-	if (g_exmdb_ics_log_file.empty())
-		return TRUE;
-	std::lock_guard lk(ics_log_mtx);
-	std::unique_ptr<FILE, file_deleter> fh;
-	if (g_exmdb_ics_log_file != "-")
-		fh.reset(fopen(g_exmdb_ics_log_file.c_str(), "a"));
-	if (fh == nullptr)
-		return TRUE;
-	fprintf(fh.get(), "-------------\n");
-	fprintf(fh.get(), "dir=%s actor=%s CONTENT_SYNC folder_id=%llxh given=",
-		dir, znul(username), static_cast<unsigned long long>(folder_id));
-	pgiven->dump(fh.get());
-	fprintf(fh.get(), " read=");
-	pread->dump(fh.get());
-	fprintf(fh.get(), " rst=");
-	if (prestriction != nullptr)
-		fprintf(fh.get(), "%s", prestriction->repr().c_str());
-	fprintf(fh.get(), " Out: Msg+FAI=%u+%u upd={",
-		*pnormal_count, *pfai_count);
-	for (unsigned long long mid : *pupdated_mids)
-		fprintf(fh.get(), "%llxh,", mid);
-	fprintf(fh.get(), "}\nchg={");
-	for (unsigned long long mid : *pchg_mids)
-		fprintf(fh.get(), "%llxh,", mid);
-	fprintf(fh.get(), "}\ngiven={");
-	for (unsigned long long mid : *pgiven_mids)
-		fprintf(fh.get(), "%llxh,", mid);
-	fprintf(fh.get(), "}\ndel={");
-	for (unsigned long long mid : *pdeleted_mids)
-		fprintf(fh.get(), "%llxh,", mid);
-	fprintf(fh.get(), "}\nnolonger={");
-	for (unsigned long long mid : *pnolonger_mids)
-		fprintf(fh.get(), "%llxh,", mid);
-	fprintf(fh.get(), "}\nlastcn=%llxh\n", static_cast<unsigned long long>(*plast_cn));
+	ics_log_content_sync(dir, username, folder_id, pgiven, pread,
+	        prestriction, *pnormal_count, *pfai_count, pupdated_mids,
+	        pchg_mids, pgiven_mids, pdeleted_mids, pnolonger_mids, *plast_cn);
 	return TRUE;
 }
 
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2024 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -20,12 +21,14 @@
 #include <gromox/exmdb_server.hpp>
 #include <gromox/fileio.h>
 #include <gromox/paths.h>
+#include <gromox/process.hpp>
 #include <gromox/svc_common.h>
 #include <gromox/textmaps.hpp>
 #include <gromox/util.hpp>
 #include "bounce_producer.hpp"
 #include "db_engine.hpp"
 #include "listener.hpp"
+#include "notification_agent.hpp"
 #include "parser.hpp"
 
 using namespace std::string_literals;
@@ -47,18 +50,34 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"dbg_synthesize_content", "0"},
 	{"enable_dam", "1", CFG_BOOL},
 	{"exmdb_body_autosynthesis", "1", CFG_BOOL},
+	{"exmdb_cache_budget", "0", CFG_SIZE},
+	{"exmdb_compile_restrictions", "1", CFG_BOOL},
 	{"exmdb_file_compression", "zstd-6"},
+	{"exmdb_group_commit", "0", CFG_BOOL},
+	{"exmdb_group_commit_window", "0", CFG_TIME_NS, "0", "100ms"},
 	{"exmdb_hosts_allow", ""}, /* ::1 default set later during startup */
 	{"exmdb_listen_port", "5000"},
+	{"exmdb_maintenance_cpu", "10", CFG_SIZE, "1", "100"},
+	{"exmdb_maintenance_idle", "5min", CFG_TIME, "1s"},
+	{"exmdb_maintenance_interval", "0", CFG_TIME},
+	{"exmdb_maintenance_io_rate", "16M", CFG_SIZE},
+	{"exmdb_maintenance_slice", "50ms", CFG_TIME_NS, "1ms", "10s"},
+	{"exmdb_maintenance_softdelete_age", "0", CFG_TIME},
+	{"exmdb_maintenance_tombstone_age", "90d", CFG_TIME},
+	{"exmdb_maintenance_vacuum_max", "256M", CFG_SIZE},
 	{"exmdb_max_sqlite_spares", "3", CFG_SIZE},
+	{"exmdb_mmap_size", "0", CFG_SIZE},
+	{"exmdb_page_cache_budget", "0", CFG_SIZE},
 	{"exmdb_pf_read_per_user", "1"},
 	{"exmdb_pf_read_states", "2"},
 	{"exmdb_private_folder_softdelete", "0", CFG_BOOL},
 	{"exmdb_schema_upgrades", "auto"},
 	{"exmdb_search_nice", "0"},
 	{"exmdb_search_pacing", "250", CFG_SIZE},
+	{"exmdb_search_parallel", "4", CFG_SIZE, "1", "64"},
 	{"exmdb_search_pacing_time", "0.5s", CFG_TIME_NS},
 	{"exmdb_search_yield", "0", CFG_BOOL},
+	{"exmdb_stmt_cache", "64", CFG_SIZE, "0", "4096"},
 	{"exrpc_debug", "0"},
 	{"listen_ip", "::1"},
 	{"listen_port", "exmdb_listen_port", CFG_ALIAS},
@@ -67,9 +86,13 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"max_rpc_stub_threads", "4095M", CFG_SIZE},
 	{"max_rule_number", "1000", CFG_SIZE, "1", "2000"},
 	{"max_store_message_count", "0", CFG_SIZE},
+	{"notify_batch_latency", "0", CFG_TIME_NS, "0", "1s"},
+	{"notify_batch_max", "256", CFG_SIZE, "1", "65536"},
 	{"notify_stub_threads_num", "4", CFG_SIZE, "0"},
 	{"populating_threads_num", "4", CFG_SIZE, "1", "50"},
+	{"rpc_overflow_threads_num", "16", CFG_SIZE, "0", "512"},
 	{"rpc_proxy_connection_num", "10", CFG_SIZE, "0"},
+	{"rpc_worker_threads_num", "0", CFG_SIZE},
 	{"sqlite_debug", "0"},
 	{"sqlite_busy_timeout", "60s", CFG_TIME_NS, "0s", "1h"},
 	{"table_size", "5000", CFG_SIZE, "100"},
@@ -110,8 +133,25 @@ static bool exmdb_provider_reload(std::shared_ptr<config_file> gxcfg = nullptr,
 	g_exmdb_search_yield = pconfig->get_ll("exmdb_search_yield");
 	g_exmdb_search_nice = pconfig->get_ll("exmdb_search_nice");
 	g_exmdb_search_pacing_time = pconfig->get_ll("exmdb_search_pacing_time");
+	g_exmdb_search_parallel = pconfig->get_ll("exmdb_search_parallel");
 	g_exmdb_max_sqlite_spares = pconfig->get_ll("exmdb_max_sqlite_spares");
+	g_exmdb_cache_budget = pconfig->get_ll("exmdb_cache_budget");
+	g_exmdb_stmt_cache = pconfig->get_ll("exmdb_stmt_cache");
+	g_exmdb_compile_res = pconfig->get_ll("exmdb_compile_restrictions");
+	g_exmdb_group_commit_window = pconfig->get_ll("exmdb_group_commit_window");
+	g_exmdb_maint_cpu = pconfig->get_ll("exmdb_maintenance_cpu");
+	g_exmdb_mmap_size = pconfig->get_ll("exmdb_mmap_size");
+	g_exmdb_page_cache_budget = pconfig->get_ll("exmdb_page_cache_budget");
+	g_exmdb_maint_idle = pconfig->get_ll("exmdb_maintenance_idle");
+	g_exmdb_maint_interval = pconfig->get_ll("exmdb_maintenance_interval");
+	g_exmdb_maint_io_rate = pconfig->get_ll("exmdb_maintenance_io_rate");
+	g_exmdb_maint_slice = pconfig->get_ll("exmdb_maintenance_slice");
+	g_exmdb_maint_softdel_age = pconfig->get_ll("exmdb_maintenance_softdelete_age");
+	g_exmdb_maint_tombstone_age = pconfig->get_ll("exmdb_maintenance_tombstone_age");
+	g_exmdb_maint_vacuum_max = pconfig->get_ll("exmdb_maintenance_vacuum_max");
 	g_sqlite_busy_timeout_ns = pconfig->get_ll("sqlite_busy_timeout");
+	g_notify_batch_max = pconfig->get_ll("notify_batch_max");
+	g_notify_batch_latency = pconfig->get_ll("notify_batch_latency");
 	gx_sql_deep_backtrace = gxcfg->get_ll("exmdb_deep_backtrace");
 	gx_force_write_txn = gxcfg->get_ll("exmdb_force_write_txn");
 	auto s = gxcfg->get_value("exmdb_ics_log_file");
@@ -133,6 +173,9 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 	case PLUGIN_RELOAD:
 		exmdb_provider_reload();
 		return TRUE;
+	case PLUGIN_REPORT:
+		db_engine_report();
+		return TRUE;
 	case PLUGIN_EARLY_INIT: {
 		LINK_SVC_API(ppdata);
 		textmaps_init();
@@ -168,6 +211,10 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 		int threads_num = pconfig->get_ll("notify_stub_threads_num");
 		size_t max_threads = pconfig->get_ll("max_rpc_stub_threads");
 		size_t max_routers = pconfig->get_ll("max_router_connections");
+		size_t rpc_workers = pconfig->get_ll("rpc_worker_threads_num");
+		if (rpc_workers == 0)
+			rpc_workers = std::max(gx_concurrency(), 1U);
+		size_t rpc_overflow = pconfig->get_ll("rpc_overflow_threads_num");
 		int table_size = pconfig->get_ll("table_size");
 		char cache_int_s[64];
 		int cache_interval = pconfig->get_ll("cache_interval");
@@ -197,14 +244,16 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 			mlog(LV_INFO, "Content File Compression: off");
 		else
 			mlog(LV_INFO, "Content File Compression: zstd-%d", g_cid_compression);
+		/* Not reloadable; open handles were set up for one or the other */
+		g_exmdb_group_commit = pconfig->get_ll("exmdb_group_commit");
 
 		common_util_init(org_name, max_msg_count, max_rule, max_ext_rule);
 		db_engine_init(table_size, cache_interval, populating_num);
 		uint16_t listen_port = pconfig->get_ll("exmdb_listen_port");
 		if (0 == listen_port) {
-			exmdb_parser_init(0, 0);
+			exmdb_parser_init(0, 0, 0, 0);
 		} else {
-			exmdb_parser_init(max_threads, max_routers);
+			exmdb_parser_init(max_threads, max_routers, rpc_workers, rpc_overflow);
 		}
 		exmdb_client_init(connection_num, threads_num);
 		
@@ -244,6 +293,7 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 #undef EXMIDL
 #undef IDLOUT
 		register_service("exmdb_client_register_proc", exmdb_server::register_proc);
+		register_service("exmdb_client_batch", exmdb_client_local_batch);
 		register_service("pass_service", common_util_pass_service);
 		return TRUE;
 	}
@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Background maintenance of resident, idle mailboxes.
+ *
+ * Every exmdb_maintenance_interval, the db_maint thread looks at mailboxes
+ * that are loaded but have not been used for exmdb_maintenance_idle, picks
+ * the one most in need (largest WAL, most free pages, overdue periodic
+ * tasks) and works on it:
+ *
+ *  - WAL checkpoint (passive, then truncate once fully copied back)
+ *  - freelist reclaim: incremental_vacuum steps, or a one-time VACUUM that
+ *    switches a small enough database to auto_vacuum=INCREMENTAL (only
+ *    while nobody else has the mailbox open)
+ *  - hard deletion of soft-deleted messages past exmdb_maintenance_softdelete_age
+ *  - expiry of message tombstones past exmdb_maintenance_tombstone_age
+ *  - merging of adjacent allocated_eids ranges
+ *  - removal of unreferenced cid/ files (the purge_datafiles routine)
+ *
+ * Work that modifies exchange.sqlite3 is split into batches that hold
+ * giant_lock for at most about exmdb_maintenance_slice each; batch sizes
+ * adapt to how long the previous one took. Between batches, the thread sleeps
+ * long enough to stay within exmdb_maintenance_cpu percent of wall time and
+ * exmdb_maintenance_io_rate (pages read and written, as counted by SQLite).
+ * As soon as someone else uses the mailbox, the work is abandoned until it
+ * becomes idle again.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fmt/core.h>
+#include <sys/stat.h>
+#include <gromox/atomic.hpp>
+#include <gromox/clock.hpp>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+using LLU = unsigned long long;
+
+namespace {
+
+/* Mailboxes probed per round; the cursor makes the rounds cover all of them */
+static constexpr size_t MAINT_PROBES = 64;
+/* Periodic tasks run at most this often per mailbox */
+static constexpr auto MAINT_PERIOD = std::chrono::hours(24);
+static constexpr uint64_t MAINT_WAL_MIN = 4 << 20, MAINT_FREE_MIN = 16 << 20;
+
+struct maint_probe {
+	std::string dir;
+	uint64_t wal = 0, free_bytes = 0, db_bytes = 0, score = 0;
+	unsigned int autovac = 0;
+};
+
+struct maint_job {
+	maint_job(const gromox::atomic_bool &s, std::string &&d, db_conn &&c) :
+		stop(s), dir(std::move(d)), db(std::move(c)) {}
+	bool pace(time_duration busy, uint64_t io_bytes);
+	uint64_t io();
+	bool idle() const;
+	bool unused() const;
+	template<typename F> bool sliced(const char *what, F &&step);
+	void checkpoint();
+	void vacuum(const maint_probe &);
+	void softdel();
+	void tombstones();
+	void merge_eids();
+
+	const gromox::atomic_bool &stop;
+	std::string dir;
+	db_conn db;
+	size_t pgsize = 4096;
+	time_point t_start = tp_now();
+	/* SQLite page counters at the last io() */
+	uint64_t io_miss = 0, io_write = 0;
+};
+
+}
+
+static bool maint_sleep(const gromox::atomic_bool &stop, time_duration d)
+{
+	auto end = tp_now() + d;
+	while (!stop) {
+		auto now = tp_now();
+		if (now >= end)
+			return true;
+		std::this_thread::sleep_for(std::min(end - now,
+			std::chrono::duration_cast<time_duration>(std::chrono::seconds(1))));
+	}
+	return false;
+}
+
+/**
+ * Bytes SQLite read from or wrote to disk since the last call. The counters
+ * are not reset, since db_base::note_cache_stats harvests the misses when the
+ * connection is released.
+ */
+uint64_t maint_job::io()
+{
+	int cur = 0, hi = 0;
+	uint64_t pages = 0;
+	if (sqlite3_db_status(db.psqlite, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hi, 0) == SQLITE_OK) {
+		pages += cur - std::min(io_miss, static_cast<uint64_t>(cur));
+		io_miss = cur;
+	}
+	if (sqlite3_db_status(db.psqlite, SQLITE_DBSTATUS_CACHE_WRITE, &cur, &hi, 0) == SQLITE_OK) {
+		pages += cur - std::min(io_write, static_cast<uint64_t>(cur));
+		io_write = cur;
+	}
+	return pages * pgsize;
+}
+
+/**
+ * Sleep off a piece of work that took @busy and moved @io_bytes. Returns
+ * false if the thread is to stop.
+ */
+bool maint_job::pace(time_duration busy, uint64_t io_bytes)
+{
+	unsigned int cpu = std::clamp(g_exmdb_maint_cpu, 1U, 100U);
+	time_duration rest = busy * (100 - cpu) / cpu;
+	if (g_exmdb_maint_io_rate > 0) {
+		auto io_time = std::chrono::duration_cast<time_duration>(std::chrono::duration<double>(
+		               static_cast<double>(io_bytes) / g_exmdb_maint_io_rate));
+		rest = std::max(rest, io_time - busy);
+	}
+	return maint_sleep(stop, rest);
+}
+
+bool maint_job::idle() const
+{
+	return !stop && db.lock_base_rd()->last_activity.load() < t_start;
+}
+
+/* Nobody but this job has the mailbox open (see db_evictable) */
+bool maint_job::unused() const
+{
+	if (!idle())
+		return false;
+	auto dbase = db.lock_base_rd();
+	return dbase->reference == 1 && dbase->tables.table_list.empty() &&
+	       dbase->nsub_list.empty() && dbase->instance_list.empty();
+}
+
+/**
+ * Run @step(batch) in write transactions of one batch each, holding
+ * giant_lock, until it reports completion (0), failure (<0), or the
+ * mailbox is wanted by someone else.
+ */
+template<typename F> bool maint_job::sliced(const char *what, F &&step)
+{
+	size_t batch = 64;
+	auto slice = std::chrono::nanoseconds(g_exmdb_maint_slice);
+	io();
+	while (idle()) {
+		auto t0 = tp_now();
+		int ret;
+		{
+			auto xact = gx_sql_begin(db.psqlite, txn_mode::write);
+			if (!xact)
+				return false;
+			auto dbase = db.lock_base_wr();
+			ret = step(batch);
+			if (ret < 0 || xact.commit() != SQLITE_OK) {
+				mlog(LV_ERR, "E-2942: maintenance of %s: %s failed", dir.c_str(), what);
+				return false;
+			}
+		}
+		auto busy = tp_now() - t0;
+		if (ret == 0)
+			return true;
+		if (busy < slice / 2 && batch < 65536)
+			batch *= 2;
+		else if (busy > slice && batch > 1)
+			batch /= 2;
+		if (!pace(busy, io()))
+			return false;
+	}
+	return false;
+}
+
+void maint_job::checkpoint()
+{
+	int log = 0, ckpt = 0;
+	auto t0 = tp_now();
+	auto ret = sqlite3_wal_checkpoint_v2(db.psqlite, "main",
+	           SQLITE_CHECKPOINT_PASSIVE, &log, &ckpt);
+	if (ret != SQLITE_OK) {
+		mlog(LV_WARN, "W-2943: checkpoint %s: %s", dir.c_str(), sqlite3_errstr(ret));
+		return;
+	}
+	if (!pace(tp_now() - t0, static_cast<uint64_t>(std::max(ckpt, 0)) * pgsize * 2) ||
+	    log <= 0 || log != ckpt || !idle())
+		return;
+	/* All frames are in the database; reset the WAL file to zero length */
+	auto dbase = db.lock_base_wr();
+	sqlite3_busy_timeout(db.psqlite, std::max(static_cast<int>(g_exmdb_maint_slice / 1000000), 1));
+	sqlite3_wal_checkpoint_v2(db.psqlite, "main", SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr);
+	sqlite3_busy_timeout(db.psqlite, int(g_sqlite_busy_timeout_ns / 1000000));
+}
+
+void maint_job::vacuum(const maint_probe &p)
+{
+	if (p.autovac == 2) {
+		sliced("incremental_vacuum", [&](size_t batch) {
+			auto stm = gx_sql_prep(db.psqlite, fmt::format("PRAGMA incremental_vacuum({})", batch).c_str());
+			if (stm == nullptr)
+				return -1;
+			while (stm.step() == SQLITE_ROW)
+				/* one row per freed page */;
+			stm.finalize();
+			stm = gx_sql_prep(db.psqlite, "PRAGMA freelist_count");
+			return stm != nullptr && stm.step() == SQLITE_ROW &&
+			       stm.col_int64(0) > 0 ? 1 : 0;
+		});
+		return;
+	}
+	if (p.db_bytes > g_exmdb_maint_vacuum_max || !unused())
+		return;
+	/*
+	 * One-time conversion. VACUUM cannot be split; like the vacuum RPC, it
+	 * runs without giant_lock. It is only started while no client has the
+	 * mailbox open, and the size cap bounds how long a writer that shows
+	 * up meanwhile waits in sqlite's busy handler.
+	 */
+	mlog(LV_INFO, "I-2944: maintenance: converting %s to incremental auto_vacuum", dir.c_str());
+	auto t0 = tp_now();
+	gx_sql_cache_flush(db.psqlite);
+	if (gx_sql_exec(db.psqlite, "PRAGMA auto_vacuum=INCREMENTAL") != SQLITE_OK ||
+	    gx_sql_exec(db.psqlite, "VACUUM") != SQLITE_OK)
+		return;
+	pace(tp_now() - t0, p.db_bytes * 2);
+}
+
+void maint_job::softdel()
+{
+	auto cutoff = rop_util_unix_to_nttime(time(nullptr) - static_cast<time_t>(g_exmdb_maint_softdel_age));
+	auto query = fmt::format("SELECT m.message_id, m.message_size, m.is_associated, "
+	             "m.parent_fid FROM messages AS m INNER JOIN message_properties AS mp "
+	             "ON m.message_id=mp.message_id AND mp.proptag={} "
+	             "WHERE m.is_deleted=1 AND mp.propval<={} LIMIT ?",
+	             PR_LAST_MODIFICATION_TIME, cutoff);
+	uint64_t total = 0;
+	auto ok = sliced("purge_softdelete", [&](size_t batch) {
+		auto stm = gx_sql_prep(db.psqlite, query.c_str());
+		auto del = gx_sql_prep(db.psqlite, "DELETE FROM messages WHERE message_id=?");
+		if (stm == nullptr || del == nullptr)
+			return -1;
+		stm.bind_int64(1, batch);
+		uint64_t normal = 0, fai = 0;
+		size_t count = 0;
+		std::unordered_map<uint64_t, uint32_t> per_folder;
+		while (stm.step() == SQLITE_ROW) {
+			(stm.col_uint64(2) ? fai : normal) += stm.col_uint64(1);
+			del.bind_int64(1, stm.col_uint64(0));
+			if (del.step() != SQLITE_DONE)
+				return -1;
+			del.reset();
+			if (sqlite3_column_type(stm, 3) != SQLITE_NULL)
+				++per_folder[stm.col_uint64(3)];
+			++count;
+		}
+		/* Same bookkeeping as the purge_softdelete RPC */
+		for (const auto &[fid, n] : per_folder)
+			if (!common_util_increase_deleted_count(db.psqlite, fid, n))
+				return -1;
+		if (!cu_adjust_store_size(db.psqlite, ADJ_DECREASE, normal, fai))
+			return -1;
+		total += count;
+		return count < batch ? 0 : 1;
+	});
+	if (total > 0)
+		mlog(LV_INFO, "I-2945: maintenance: purged %llu soft-deleted messages from %s",
+		     LLU{total}, dir.c_str());
+	if (ok)
+		db.lock_base_wr()->maint_done.softdel = tp_now();
+}
+
+/**
+ * Forget old deletions. ICS clients whose state still names such a MID no
+ * longer pass the completeness check of the CN-driven content sync and get
+ * the full scan instead, so this only trades speed for space.
+ */
+void maint_job::tombstones()
+{
+	{
+		auto stm = gx_sql_prep(db.psqlite, "SELECT 1 FROM sqlite_master WHERE "
+		           "type='table' AND name='message_tombstones'");
+		if (stm == nullptr)
+			return;
+		if (stm.step() != SQLITE_ROW) {
+			db.lock_base_wr()->maint_done.tombstones = tp_now();
+			return;
+		}
+	}
+	auto cutoff = time(nullptr) - static_cast<time_t>(g_exmdb_maint_tombstone_age);
+	uint64_t total = 0;
+	auto ok = sliced("tombstone expiry", [&](size_t batch) {
+		auto stm = gx_sql_prep(db.psqlite, "DELETE FROM message_tombstones "
+		           "WHERE message_id IN (SELECT message_id FROM "
+		           "message_tombstones WHERE delete_time<? LIMIT ?)");
+		if (stm == nullptr)
+			return -1;
+		stm.bind_int64(1, cutoff);
+		stm.bind_int64(2, batch);
+		if (stm.step() != SQLITE_DONE)
+			return -1;
+		size_t count = sqlite3_changes(db.psqlite);
+		total += count;
+		return count < batch ? 0 : 1;
+	});
+	if (total > 0)
+		mlog(LV_INFO, "I-2971: maintenance: expired %llu message tombstones in %s",
+		     LLU{total}, dir.c_str());
+	if (ok)
+		db.lock_base_wr()->maint_done.tombstones = tp_now();
+}
+
+/**
+ * Collapse adjacent or overlapping allocated_eids ranges (of the same kind)
+ * into one row. common_util_check_allocated_eid only asks whether an ID
+ * lies within any range, which the merged rows answer the same way.
+ */
+void maint_job::merge_eids()
+{
+	uint64_t resume = 0, total = 0;
+	auto ok = sliced("allocated_eids merge", [&](size_t batch) {
+		auto stm = gx_sql_prep(db.psqlite, "SELECT rowid, range_begin, range_end, "
+		           "allocate_time, COALESCE(is_system,0) FROM allocated_eids "
+		           "WHERE range_begin>=? ORDER BY range_begin");
+		auto del = gx_sql_prep(db.psqlite, "DELETE FROM allocated_eids WHERE rowid=?");
+		auto upd = gx_sql_prep(db.psqlite, "UPDATE allocated_eids SET "
+		           "range_end=?, allocate_time=? WHERE rowid=?");
+		if (stm == nullptr || del == nullptr || upd == nullptr)
+			return -1;
+		stm.bind_int64(1, resume);
+		struct { int64_t rowid; uint64_t begin, end, time, sys; } head{};
+		bool have_head = false, changed = false;
+		size_t merged = 0;
+		auto flush = [&]() {
+			if (!have_head || !changed)
+				return true;
+			upd.bind_int64(1, head.end);
+			upd.bind_int64(2, head.time);
+			upd.bind_int64(3, head.rowid);
+			auto r = upd.step();
+			upd.reset();
+			return r == SQLITE_DONE;
+		};
+		int ret = 0;
+		while (stm.step() == SQLITE_ROW) {
+			decltype(head) row{stm.col_int64(0), stm.col_uint64(1),
+				stm.col_uint64(2), stm.col_uint64(3), stm.col_uint64(4)};
+			if (have_head && row.sys == head.sys && row.begin <= head.end + 1) {
+				head.end  = std::max(head.end, row.end);
+				head.time = std::max(head.time, row.time);
+				changed = true;
+				del.bind_int64(1, row.rowid);
+				if (del.step() != SQLITE_DONE)
+					return -1;
+				del.reset();
+				if (++merged >= batch) {
+					/* Pick up this run again in the next slice */
+					resume = head.begin;
+					ret = 1;
+					break;
+				}
+				continue;
+			}
+			if (!flush())
+				return -1;
+			head = row;
+			have_head = true;
+			changed = false;
+		}
+		if (!flush())
+			return -1;
+		total += merged;
+		return ret;
+	});
+	if (total > 0)
+		mlog(LV_INFO, "I-2946: maintenance: merged %llu allocated_eids rows in %s",
+		     LLU{total}, dir.c_str());
+	if (ok)
+		db.lock_base_wr()->maint_done.eids = tp_now();
+}
+
+static bool maint_due(time_point done, time_point now)
+{
+	return done == time_point{} || now - done >= MAINT_PERIOD;
+}
+
+/**
+ * Gather the numbers that decide whether (and how urgently) @p.dir needs
+ * maintenance.
+ */
+static void maint_probe_one(maint_probe &p, time_point now)
+{
+	/* Evicted since db_engine_idle_dirs? Then it is not ours to reload. */
+	auto db = db_engine_peek_db(p.dir.c_str());
+	if (!db)
+		return;
+	struct stat sb;
+	if (stat(fmt::format("{}/exmdb/exchange.sqlite3-wal", p.dir).c_str(), &sb) == 0)
+		p.wal = sb.st_size;
+	auto pragma = [&](const char *q) -> uint64_t {
+		auto stm = gx_sql_prep(db->psqlite, q);
+		return stm != nullptr && stm.step() == SQLITE_ROW ? stm.col_uint64(0) : 0;
+	};
+	auto pgsize = pragma("PRAGMA page_size");
+	p.db_bytes   = pragma("PRAGMA page_count") * pgsize;
+	p.free_bytes = pragma("PRAGMA freelist_count") * pgsize;
+	p.autovac    = pragma("PRAGMA auto_vacuum");
+	if (p.wal >= MAINT_WAL_MIN)
+		p.score += p.wal;
+	if (p.free_bytes >= MAINT_FREE_MIN && p.free_bytes * 4 >= p.db_bytes &&
+	    (p.autovac == 2 || (p.autovac == 0 && p.db_bytes <= g_exmdb_maint_vacuum_max)))
+		p.score += p.free_bytes;
+	auto dbase = db->lock_base_rd();
+	const auto &d = dbase->maint_done;
+	if ((g_exmdb_maint_softdel_age > 0 && maint_due(d.softdel, now)) ||
+	    (g_exmdb_maint_tombstone_age > 0 && maint_due(d.tombstones, now)) ||
+	    maint_due(d.datafiles, now) || maint_due(d.eids, now))
+		p.score += 1;
+}
+
+static void maint_run(const gromox::atomic_bool &stop, maint_probe &&p)
+{
+	auto now = tp_now();
+	auto conn = db_engine_peek_db(p.dir.c_str());
+	if (!conn)
+		return;
+	maint_job job(stop, std::move(p.dir), std::move(*conn));
+	/* Some steps end up in exmdb_server::* / common_util, which want an env */
+	exmdb_server::build_env(job.db.lock_base_rd()->b_private ? EM_PRIVATE : 0,
+		job.dir.c_str());
+	auto cl_0 = make_scope_exit(exmdb_server::free_env);
+	{
+		auto stm = gx_sql_prep(job.db.psqlite, "PRAGMA page_size");
+		if (stm != nullptr && stm.step() == SQLITE_ROW)
+			job.pgsize = std::max(stm.col_uint64(0), static_cast<uint64_t>(512));
+	}
+	mlog(LV_DEBUG, "maintenance: %s (WAL %llu bytes, %llu of %llu bytes free)",
+	     job.dir.c_str(), LLU{p.wal}, LLU{p.free_bytes}, LLU{p.db_bytes});
+	if (p.wal >= MAINT_WAL_MIN && job.idle())
+		job.checkpoint();
+	if (p.free_bytes >= MAINT_FREE_MIN && p.free_bytes * 4 >= p.db_bytes && job.idle())
+		job.vacuum(p);
+	time_point softdel, tombstones, datafiles, eids;
+	{
+		auto dbase = job.db.lock_base_rd();
+		softdel    = dbase->maint_done.softdel;
+		tombstones = dbase->maint_done.tombstones;
+		datafiles  = dbase->maint_done.datafiles;
+		eids       = dbase->maint_done.eids;
+	}
+	if (g_exmdb_maint_softdel_age > 0 && maint_due(softdel, now) && job.idle())
+		job.softdel();
+	if (g_exmdb_maint_tombstone_age > 0 && maint_due(tombstones, now) && job.idle())
+		job.tombstones();
+	if (maint_due(eids, now) && job.idle())
+		job.merge_eids();
+	if (maint_due(datafiles, now) && job.idle()) {
+		/* Reads a snapshot and walks cid/; giant_lock is not involved */
+		auto t0 = tp_now();
+		if (exmdb_server::purge_datafiles(job.dir.c_str()))
+			job.db.lock_base_wr()->maint_done.datafiles = tp_now();
+		job.pace(tp_now() - t0, 0);
+	}
+}
+
+void *db_maint_thread(void *param)
+{
+	auto &stop = *static_cast<const gromox::atomic_bool *>(param);
+	t_db_maint = true;
+	std::string cursor;
+	while (!stop) {
+		if (g_exmdb_maint_interval == 0) {
+			maint_sleep(stop, std::chrono::seconds(1));
+			continue;
+		}
+		if (!maint_sleep(stop, std::chrono::seconds(g_exmdb_maint_interval)))
+			break;
+		auto now = tp_now();
+		auto dirs = db_engine_idle_dirs(now - std::chrono::seconds(g_exmdb_maint_idle));
+		if (dirs.empty())
+			continue;
+		std::sort(dirs.begin(), dirs.end());
+		auto it = std::upper_bound(dirs.begin(), dirs.end(), cursor);
+		std::vector<maint_probe> probes;
+		for (size_t i = 0; i < std::min(dirs.size(), MAINT_PROBES); ++i) {
+			if (it == dirs.end())
+				it = dirs.begin();
+			probes.emplace_back().dir = std::move(*it++);
+			maint_probe_one(probes.back(), now);
+		}
+		cursor = probes.back().dir;
+		auto best = std::max_element(probes.begin(), probes.end(),
+		            [](const maint_probe &a, const maint_probe &b) { return a.score < b.score; });
+		if (best->score == 0)
+			continue;
+		maint_run(stop, std::move(*best));
+	}
+	return nullptr;
+}
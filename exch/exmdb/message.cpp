@@ -32,6 +32,7 @@
 #include <gromox/fileio.h>
 #include <gromox/json.hpp>
 #include <gromox/mapidefs.h>
+#include <gromox/mjson.hpp>
 #include <gromox/mysql_adaptor.hpp>
 #include <gromox/oxcmail.hpp>
 #include <gromox/proptag_array.hpp>
@@ -3743,7 +3744,9 @@ BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
 		newdigest["file"] = "";
 		snprintf(tmp_path, std::size(tmp_path), "%s/ext/%s",
 		         exmdb_server::get_dir(), mid_string);
-		auto djson = json_to_str(std::move(newdigest));
+		std::string djson;
+		if (!mjson_digest_pack(newdigest, djson))
+			return false;
 		wrapfd fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, FMODE_PRIVATE);
 		if (fd.get() >= 0) {
 			if (HXio_fullwrite(fd.get(), djson.c_str(), djson.size()) < 0 ||
@@ -3941,7 +3944,7 @@ BOOL exmdb_server::rule_new_message(const char *dir, const char *username,
 		std::unique_ptr<char[], stdlib_delete> slurp_data(HX_slurp_file(tmp_path, &slurp_size));
 		if (slurp_data != nullptr) {
 			digest.emplace();
-			if (!json_from_str({slurp_data.get(), slurp_size}, *digest))
+			if (!mjson_digest_unpack({slurp_data.get(), slurp_size}, *digest))
 				digest.reset();
 		}
 	}
@@ -154,6 +154,13 @@ static constexpr const char *exmdb_rpc_names[] = {
 	E(imapfile_read),
 	E(imapfile_write),
 	E(imapfile_delete),
+	E(batch),
+	E(fts_rebuild),
+	E(hotprops_setup),
+	E(backup_read),
+	E(store_cache_stats),
+	E(read_attachment_instance_range),
+	E(imapfile_read_range),
 };
 #undef E
 
@@ -162,7 +169,7 @@ namespace exmdb {
 const char *exmdb_rpc_idtoname(exmdb_callid i)
 {
 	auto j = static_cast<uint8_t>(i);
-	static_assert(std::size(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::imapfile_delete) + 1);
+	static_assert(std::size(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::imapfile_read_range) + 1);
 	auto s = j < std::size(exmdb_rpc_names) ? exmdb_rpc_names[j] : nullptr;
 	return znul(s);
 }
@@ -1,19 +1,72 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <poll.h>
 #include <unistd.h>
 #include <utility>
+#include <libHX/io.h>
+#include <gromox/endian.hpp>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
+#include <gromox/scope.hpp>
 #include "notification_agent.hpp"
 #include "parser.hpp"
 
+using namespace gromox;
+
+/* Soft limit for a batch frame; a single datagram is always sent. */
+static constexpr size_t NOTIFY_FRAME_MAX = 4U << 20;
+
+unsigned int g_notify_batch_max = 256;
+unsigned long long g_notify_batch_latency; /* ns */
+
+/**
+ * Notifications which only tell the receiver to go and refresh some state.
+ * If an identical one is still queued, a second copy carries no extra
+ * information and can be dropped.
+ */
+static bool dg_collapsible(db_notify_type t)
+{
+	switch (t) {
+	case db_notify_type::folder_modified:
+	case db_notify_type::message_modified:
+	case db_notify_type::hiertbl_changed:
+	case db_notify_type::cttbl_changed:
+	case db_notify_type::hiertbl_row_modified:
+	case db_notify_type::cttbl_row_modified:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Look for a byte-identical collapsible datagram at the tail of the queue.
+ * The scan stops at the first non-collapsible entry so that the relative
+ * order of e.g. a deletion and a later modification is retained.
+ */
+static bool dg_is_queued(const std::list<router_datagram> &list, const BINARY &bin)
+{
+	size_t scanned = 0;
+	for (auto it = list.crbegin(); it != list.crend() &&
+	     scanned < g_notify_batch_max; ++it, ++scanned) {
+		if (!it->collapsible)
+			return false;
+		if (it->bin.cb == bin.cb && memcmp(it->bin.pb, bin.pb, bin.cb) == 0)
+			return true;
+	}
+	return false;
+}
+
 void notification_agent_backward_notify(const char *remote_id,
     const DB_NOTIFY_DATAGRAM *pnotify)
 {
@@ -32,11 +85,19 @@ void notification_agent_backward_notify(const char *remote_id,
 		exmdb_parser_insert_router(std::move(prouter));
 		return;	
 	}
+	bool collapsible = dg_collapsible(pnotify->db_notify.type);
 	try {
 		std::unique_lock rt_hold(prouter->lock);
-		prouter->datagram_list.push_back(bin);
+		if (collapsible && dg_is_queued(prouter->datagram_list, bin)) {
+			rt_hold.unlock();
+			free(bin.pb);
+			exmdb_parser_insert_router(std::move(prouter));
+			return;
+		}
+		prouter->datagram_list.push_back({bin, collapsible});
 	} catch (...) {
 		free(bin.pb);
+		exmdb_parser_insert_router(std::move(prouter));
 		return;
 	}
 	prouter->waken_cond.notify_one();
@@ -59,61 +120,107 @@ static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION>
 	return TRUE;
 }
 
+/**
+ * Take up to g_notify_batch_max datagrams (or NOTIFY_FRAME_MAX bytes) off
+ * the queue. With a configured latency, wait that much longer for
+ * stragglers to fill up the frame.
+ */
+static void dg_take(ROUTER_CONNECTION &rt, std::unique_lock<std::mutex> &rt_hold,
+    std::list<router_datagram> &out)
+{
+	size_t max = rt.b_batch ? std::max(g_notify_batch_max, 1U) : 1;
+	if (rt.b_batch && g_notify_batch_latency > 0 &&
+	    rt.datagram_list.size() < max)
+		rt.waken_cond.wait_for(rt_hold,
+			std::chrono::nanoseconds(g_notify_batch_latency),
+			[&]() { return rt.b_stop || rt.datagram_list.size() >= max; });
+	auto end = rt.datagram_list.begin();
+	size_t bytes = 0;
+	for (size_t i = 0; i < max && end != rt.datagram_list.end(); ++i) {
+		bytes += end->bin.cb;
+		if (i > 0 && bytes > NOTIFY_FRAME_MAX)
+			break;
+		++end;
+	}
+	out.splice(out.end(), rt.datagram_list, rt.datagram_list.begin(), end);
+}
+
+/**
+ * Build one EXMDB_PROTO_NOTIFY_BATCH frame, [u32 len][u32 count]
+ * followed by the datagrams, which already carry their own length word.
+ */
+static bool dg_write_batch(int fd, std::list<router_datagram> &list)
+{
+	size_t total = 2 * sizeof(uint32_t);
+	for (const auto &d : list)
+		total += d.bin.cb;
+	if (total > UINT32_MAX)
+		return false;
+	std::unique_ptr<uint8_t[]> buf(new(std::nothrow) uint8_t[total]);
+	if (buf == nullptr)
+		return false;
+	cpu_to_le32p(&buf[0], total - sizeof(uint32_t));
+	cpu_to_le32p(&buf[4], list.size());
+	size_t off = 2 * sizeof(uint32_t);
+	for (const auto &d : list) {
+		memcpy(&buf[off], d.bin.pb, d.bin.cb);
+		off += d.bin.cb;
+	}
+	auto ret = HXio_fullwrite(fd, buf.get(), total);
+	return ret >= 0 && static_cast<size_t>(ret) == total;
+}
+
+static void dg_free(std::list<router_datagram> &list)
+{
+	for (auto &&d : list)
+		free(d.bin.pb);
+	list.clear();
+}
+
 void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter)
 {
-	uint32_t ping_buff;
-	
-	while (!prouter->b_stop) {
-		BINARY dg;
-		std::unique_lock cn_hold(prouter->cond_mutex);
-		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
-		prouter->waken_cond.wait_for(cn_hold, std::chrono::seconds(SOCKET_TIMEOUT - 3));
-		cn_hold.unlock();
+	std::list<router_datagram> pending;
+	auto cl_0 = make_scope_exit([&]() { dg_free(pending); });
 
+	while (!prouter->b_stop) {
 		std::unique_lock rt_hold(prouter->lock);
-		if (prouter->datagram_list.size() > 0) {
-			dg = prouter->datagram_list.front();
-			prouter->datagram_list.pop_front();
-		} else {
-			dg.cb = 0;
-			dg.pb = nullptr;
-		}
+		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
+		prouter->waken_cond.wait_for(rt_hold, std::chrono::seconds(SOCKET_TIMEOUT - 3),
+			[&]() { return prouter->b_stop || !prouter->datagram_list.empty(); });
+		if (prouter->b_stop)
+			break;
+		dg_take(*prouter, rt_hold, pending);
 		rt_hold.unlock();
-		if (dg.pb == nullptr) {
-			ping_buff = 0;
+		if (pending.empty()) {
+			uint32_t ping_buff = 0;
 			if (write(prouter->sockd, &ping_buff, sizeof(uint32_t)) != sizeof(uint32_t) ||
 			    !notification_agent_read_response(prouter))
-				goto EXIT_THREAD;
+				break;
 			continue;
 		}
-		while (dg.pb != nullptr) {
-			auto bytes_written = write(prouter->sockd, dg.pb, dg.cb);
-			free(dg.pb);
-			if (bytes_written < 0 ||
-			    static_cast<size_t>(bytes_written) != dg.cb ||
+		if (prouter->b_batch) {
+			if (!dg_write_batch(prouter->sockd, pending) ||
 			    !notification_agent_read_response(prouter))
-				goto EXIT_THREAD;
-			std::unique_lock rt_lock(prouter->lock);
-			if (prouter->datagram_list.size() > 0) {
-				dg = prouter->datagram_list.front();
-				prouter->datagram_list.pop_front();
-			} else {
-				rt_lock.unlock();
-				dg.cb = 0;
-				dg.pb = nullptr;
-			}
+				break;
+			dg_free(pending);
+			continue;
 		}
+		auto &dg = pending.front().bin;
+		auto bytes_written = write(prouter->sockd, dg.pb, dg.cb);
+		if (bytes_written < 0 ||
+		    static_cast<size_t>(bytes_written) != dg.cb ||
+		    !notification_agent_read_response(prouter))
+			break;
+		dg_free(pending);
 	}
- EXIT_THREAD:
 	while (!exmdb_parser_erase_router(prouter))
 		sleep(1);
 	close(prouter->sockd);
 	prouter->sockd = -1;
+	dg_free(pending);
 	{
 		std::lock_guard lk(prouter->lock);
-		for (auto &&bin : prouter->datagram_list)
-			free(bin.pb);
-		prouter->datagram_list.clear();
+		dg_free(prouter->datagram_list);
 	}
 	if (!prouter->b_stop) {
 		prouter->thr_id = {};
@@ -4,3 +4,5 @@
 #include "parser.hpp"
 extern void notification_agent_backward_notify(const char *remote_id, const DB_NOTIFY_DATAGRAM *);
 extern void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&);
+extern unsigned int g_notify_batch_max;
+extern unsigned long long g_notify_batch_latency;
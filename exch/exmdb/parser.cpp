@@ -10,16 +10,17 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <netdb.h>
-#include <poll.h>
 #include <pthread.h>
 #include <string>
 #include <unistd.h>
 #include <unordered_set>
 #include <utility>
 #include <vector>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <libHX/io.h>
@@ -27,6 +28,7 @@
 #include <libHX/string.h>
 #include <gromox/clock.hpp>
 #include <gromox/defs.h>
+#include <gromox/endian.hpp>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -34,7 +36,9 @@
 #include <gromox/list_file.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/process.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/util.hpp>
+#include "db_engine.hpp"
 #include "notification_agent.hpp"
 #include "parser.hpp"
 #ifndef AI_V4MAPPED
@@ -43,15 +47,86 @@
 
 using namespace gromox;
 
-static size_t g_max_threads, g_max_routers;
+namespace {
+
+/* A complete request frame waiting for a worker */
+struct rpc_job {
+	std::shared_ptr<EXMDB_CONNECTION> conn;
+	uint8_t *buf = nullptr; /* PDU (mux: reqid + PDU), from frame_alloc */
+	uint32_t len = 0;
+};
+
+enum class hs_result { close, ok, handed_over };
+
+}
+
+/* Upper bound of requests a single mux connection may have in flight */
+static constexpr unsigned int MUX_INFLIGHT_MAX = 64;
+/* Stop reading from a connection while this much output is queued */
+static constexpr size_t OUTQ_HIGH = 4U << 20;
+/*
+ * How long extra workers (started when every worker is busy with long
+ * requests, or requests waiting on another exmdb server) may idle.
+ */
+static constexpr auto OVERFLOW_WORKER_IDLE = std::chrono::seconds(60);
+/*
+ * Request frame buffers are recycled in two size classes; the vast
+ * majority of exmdb requests fits into the small one. Larger frames go
+ * straight to malloc.
+ */
+static constexpr size_t FRAME_SMALL = 4096, FRAME_LARGE = 65536;
+static constexpr size_t FRAME_SMALL_KEEP = 256, FRAME_LARGE_KEEP = 32;
+static size_t g_max_threads, g_max_routers, g_num_workers, g_max_overflow;
 static std::vector<EXMDB_ITEM> g_local_list;
 static std::unordered_set<std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
 static std::unordered_set<std::shared_ptr<EXMDB_CONNECTION>> g_connection_list;
 static std::mutex g_router_lock, g_connection_lock;
+static std::deque<rpc_job> g_job_queue;
+static std::mutex g_job_lock;
+static std::condition_variable g_job_cv, g_overflow_cv;
+static std::vector<pthread_t> g_worker_ids;
+static size_t g_idle_workers, g_overflow_workers; /* under g_job_lock */
+static gromox::atomic_bool g_worker_stop{true}, g_epoll_stop{true};
+static int g_epoll_fd = -1;
+static pthread_t g_epoll_id;
+static std::vector<uint8_t *> g_frame_small, g_frame_large;
+static std::mutex g_frame_lock;
 unsigned int g_enable_dam;
 
+static uint8_t *frame_alloc(uint32_t len)
+{
+	if (len > FRAME_LARGE)
+		return static_cast<uint8_t *>(malloc(len));
+	auto &pool = len <= FRAME_SMALL ? g_frame_small : g_frame_large;
+	std::unique_lock hold(g_frame_lock);
+	if (pool.size() > 0) {
+		auto p = pool.back();
+		pool.pop_back();
+		return p;
+	}
+	hold.unlock();
+	return static_cast<uint8_t *>(malloc(len <= FRAME_SMALL ? FRAME_SMALL : FRAME_LARGE));
+}
+
+static void frame_free(uint8_t *p, uint32_t len)
+{
+	if (p == nullptr)
+		return;
+	if (len <= FRAME_LARGE) {
+		auto &pool = len <= FRAME_SMALL ? g_frame_small : g_frame_large;
+		std::lock_guard hold(g_frame_lock);
+		/* capacity was reserved in exmdb_parser_run, so no throw */
+		if (pool.size() < pool.capacity()) {
+			pool.push_back(p);
+			return;
+		}
+	}
+	free(p);
+}
+
 EXMDB_CONNECTION::~EXMDB_CONNECTION()
 {
+	frame_free(rbuf, rlen);
 	if (sockd >= 0)
 		close(sockd);
 }
@@ -60,14 +135,17 @@ ROUTER_CONNECTION::~ROUTER_CONNECTION()
 {
 	if (sockd >= 0)
 		close(sockd);
-	for (auto &&bin : datagram_list)
-		free(bin.pb);
+	for (auto &&d : datagram_list)
+		free(d.bin.pb);
 }
 
-void exmdb_parser_init(size_t max_threads, size_t max_routers)
+void exmdb_parser_init(size_t max_threads, size_t max_routers, size_t workers,
+    size_t overflow)
 {
 	g_max_threads = max_threads;
 	g_max_routers = max_routers;
+	g_num_workers = workers;
+	g_max_overflow = overflow;
 }
 
 std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn()
@@ -105,7 +183,12 @@ static BOOL exmdb_parser_dispatch3(const exreq *q0, std::unique_ptr<exresp> &r0)
 	}
 }
 
-static BOOL exmdb_parser_dispatch2(const exreq *prequest, std::unique_ptr<exresp> &r0) try
+/**
+ * @wire: the request was unpacked off the network, so its idset members
+ * are ours to free. Local batches keep them owned by the caller.
+ */
+static BOOL exmdb_parser_dispatch2(const exreq *prequest,
+    std::unique_ptr<exresp> &r0, bool wire) try
 {
 	/*
 	 * Special handling for a few RPCs in lieu of the default code provided
@@ -124,10 +207,12 @@ static BOOL exmdb_parser_dispatch2(const exreq *prequest, std::unique_ptr<exresp
 		           &r.chg_mids, &r.last_cn, &r.given_mids,
 		           &r.deleted_mids, &r.nolonger_mids, &r.read_mids,
 		           &r.unread_mids, &r.last_readcn);
-		delete q.pgiven;
-		delete q.pseen;
-		delete q.pseen_fai;
-		delete q.pread;
+		if (wire) {
+			delete q.pgiven;
+			delete q.pseen;
+			delete q.pseen_fai;
+			delete q.pread;
+		}
 		r0 = std::move(r1);
 		return b_return;
 	}
@@ -139,8 +224,16 @@ static BOOL exmdb_parser_dispatch2(const exreq *prequest, std::unique_ptr<exresp
 		           q.folder_id, q.username, q.pgiven, q.pseen,
 		           &r.fldchgs, &r.last_cn, &r.given_fids,
 		           &r.deleted_fids);
-		delete q.pgiven;
-		delete q.pseen;
+		if (wire) {
+			delete q.pgiven;
+			delete q.pseen;
+		}
+		r0 = std::move(r1);
+		return b_return;
+	}
+	case exmdb_callid::batch: {
+		auto r1 = std::make_unique<exresp_batch>();
+		auto b_return = exmdb_parser_batch(*static_cast<const exreq_batch *>(prequest), *r1, wire);
 		r0 = std::move(r1);
 		return b_return;
 	}
@@ -151,11 +244,41 @@ static BOOL exmdb_parser_dispatch2(const exreq *prequest, std::unique_ptr<exresp
 	return false;
 }
 
+/**
+ * Execute the sub-requests of @q in order. All of them share one set of
+ * database handles. The return value only reflects whether the batch as a
+ * whole could be processed; individual outcomes are in r.status. @wire as
+ * for exmdb_parser_dispatch2.
+ */
+BOOL exmdb_parser_batch(const exreq_batch &q, exresp_batch &r, bool wire) try
+{
+	db_conn_pin pin(q.dir);
+	r.status.reserve(q.reqs.size());
+	r.resps.clear();
+	r.resps.reserve(q.reqs.size());
+	for (const auto &sub : q.reqs) {
+		std::unique_ptr<exresp> sr;
+		auto ok = sub->call_id != exmdb_callid::batch &&
+		          exmdb_parser_dispatch2(sub.get(), sr, wire);
+		if (ok)
+			sr->call_id = sub->call_id;
+		else
+			sr.reset();
+		r.status.push_back(ok ? exmdb_response::success : exmdb_response::dispatch_error);
+		r.resps.push_back(std::move(sr));
+		if (!ok && q.flags & EXMDB_BATCH_STOP_ON_ERROR)
+			break;
+	}
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
 static BOOL exmdb_parser_dispatch(const exreq *prequest, std::unique_ptr<exresp> &presponse)
 {
 	auto tstart = tp_now();
 	exmdb_server::set_dir(prequest->dir);
-	auto ret = exmdb_parser_dispatch2(prequest, presponse);
+	auto ret = exmdb_parser_dispatch2(prequest, presponse, true);
 	if (ret)
 		presponse->call_id = prequest->call_id;
 	if (g_exrpc_debug == 0)
@@ -175,199 +298,665 @@ static inline void stripslash(char *s)
 		s[z-1] = '\0';
 }
 
-static void *request_parser_thread(void *pparam)
+/**
+ * Recompute and install the epoll event mask from the connection's state.
+ * Must be called with conn.wr_lock held.
+ */
+static void conn_rearm_locked(EXMDB_CONNECTION &conn)
+{
+	if (conn.b_stop)
+		return;
+	bool rd_paused;
+	{
+		std::lock_guard ifl_hold(conn.inflight_lock);
+		rd_paused = conn.rd_paused;
+	}
+	auto pending = conn.wbuf.size() - conn.woff;
+	struct epoll_event ev{};
+	ev.events = EPOLLONESHOT;
+	if (!conn.busy && !rd_paused && pending < OUTQ_HIGH)
+		ev.events |= EPOLLIN;
+	if (pending > 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = &conn;
+	/* ENOENT if the reader already dropped the connection; that is fine */
+	epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, conn.sockd, &ev);
+}
+
+static void conn_rearm(EXMDB_CONNECTION &conn)
+{
+	std::lock_guard wr_hold(conn.wr_lock);
+	conn_rearm_locked(conn);
+}
+
+/**
+ * Take a connection out of service. The descriptor itself stays open until
+ * the last job referencing the connection is gone (~EXMDB_CONNECTION), so
+ * that the number cannot be reused under a worker's feet.
+ */
+static void conn_close(EXMDB_CONNECTION &conn)
+{
+	epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, conn.sockd, nullptr);
+	conn.b_stop = true;
+	shutdown(conn.sockd, SHUT_RDWR);
+	std::lock_guard chold(g_connection_lock);
+	g_connection_list.erase(conn.shared_from_this());
+}
+
+/**
+ * Send as much of the queued output as the socket takes without blocking.
+ * Returns false on a socket error. Called with conn.wr_lock held.
+ */
+static bool conn_flush_locked(EXMDB_CONNECTION &conn)
+{
+	while (conn.woff < conn.wbuf.size()) {
+		auto ret = send(conn.sockd, &conn.wbuf[conn.woff],
+		           conn.wbuf.size() - conn.woff, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		conn.woff += ret;
+		conn.wr_progress = time(nullptr);
+	}
+	conn.wbuf.clear();
+	conn.woff = 0;
+	return true;
+}
+
+/**
+ * Queue @z bytes for the peer and push out what fits right now. The rest
+ * goes out from the epoll thread as the socket drains. Never blocks.
+ */
+static bool conn_send(EXMDB_CONNECTION &conn, const void *buf, size_t z) try
+{
+	std::lock_guard wr_hold(conn.wr_lock);
+	if (conn.b_stop)
+		return false;
+	auto was_idle = conn.woff == conn.wbuf.size();
+	if (was_idle) {
+		conn.wbuf.clear();
+		conn.woff = 0;
+		conn.wr_progress = time(nullptr);
+	} else if (conn.woff > conn.wbuf.size() / 2) {
+		conn.wbuf.erase(0, conn.woff);
+		conn.woff = 0;
+	}
+	conn.wbuf.append(static_cast<const char *>(buf), z);
+	if (!conn_flush_locked(conn))
+		return false;
+	if (was_idle != (conn.woff == conn.wbuf.size()))
+		/* output now pending: watch for EPOLLOUT */
+		conn_rearm_locked(conn);
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2969: ENOMEM");
+	return false;
+}
+
+/**
+ * Last words before closing: whatever the socket takes without blocking.
+ */
+static void conn_send_last(EXMDB_CONNECTION &conn, const void *buf, size_t z)
+{
+	if (send(conn.sockd, buf, z, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		/* ignore */;
+}
+
+static void mux_write_frame(EXMDB_CONNECTION &conn, const void *buf, size_t z)
+{
+	if (!conn_send(conn, buf, z))
+		/* Let the reader notice */
+		shutdown(conn.sockd, SHUT_RDWR);
+}
+
+static void mux_write_status(EXMDB_CONNECTION &conn, exmdb_response code,
+    uint32_t reqid)
 {
-	int tv_msec;
-	void *pbuff;
-	int read_len;
-	BOOL b_private;
+	uint8_t buf[9];
+	buf[0] = static_cast<uint8_t>(code);
+	cpu_to_le32p(&buf[1], sizeof(uint32_t));
+	cpu_to_le32p(&buf[5], reqid);
+	mux_write_frame(conn, buf, sizeof(buf));
+}
+
+static void mux_process(rpc_job &&job)
+{
+	auto &conn = *job.conn;
+	auto reqid = le32p_to_cpu(job.buf);
 	BINARY tmp_bin;
-	uint32_t offset;
-	int written_len;
-	BOOL is_writing;
-	BOOL is_connected;
-	uint32_t buff_len;
-	uint8_t resp_buff[5]{};
-	struct pollfd pfd_read;
-	
-	b_private = FALSE; /* whatever for connect request */
-	auto connraw = static_cast<EXMDB_CONNECTION *>(pparam);
-	std::shared_ptr<EXMDB_CONNECTION> pconnection;
-	try {
-		pconnection.reset(connraw);
-	} catch (...) {
-		/* reset() implies deletion of connraw */
-		return nullptr;
+	tmp_bin.pb = job.buf + sizeof(uint32_t);
+	tmp_bin.cb = job.len - sizeof(uint32_t);
+	exmdb_server::build_env(conn.b_private ? EM_PRIVATE : 0, nullptr);
+	exmdb_server::set_remote_id(conn.remote_id.c_str());
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&tmp_bin, request);
+	frame_free(job.buf, job.len);
+	job.buf = nullptr;
+	if (request != nullptr && request->dir != nullptr)
+		stripslash(request->dir);
+	auto tmp_byte = exmdb_response::success;
+	std::unique_ptr<exresp> response;
+	if (status != pack_result::ok || request == nullptr)
+		tmp_byte = exmdb_response::pull_error;
+	else if (request->call_id == exmdb_callid::connect ||
+	    request->call_id == exmdb_callid::listen_notification)
+		tmp_byte = exmdb_response::dispatch_error;
+	else if (!exmdb_parser_dispatch(request.get(), response))
+		tmp_byte = exmdb_response::dispatch_error;
+	else if (exmdb_ext_push_mux_response(response.get(), reqid, &tmp_bin) != pack_result::ok)
+		tmp_byte = exmdb_response::push_error;
+	exmdb_server::free_env();
+	exmdb_server::set_remote_id(nullptr);
+	if (tmp_byte == exmdb_response::success) {
+		mux_write_frame(conn, tmp_bin.pb, tmp_bin.cb);
+		free(tmp_bin.pb);
+	} else {
+		mux_write_status(conn, tmp_byte, reqid);
+	}
+	std::unique_lock ifl_hold(conn.inflight_lock);
+	--conn.inflight;
+	if (conn.rd_paused && conn.inflight < MUX_INFLIGHT_MAX) {
+		conn.rd_paused = false;
+		ifl_hold.unlock();
+		conn_rearm(conn);
+	}
+}
+
+/**
+ * Execute one request of a classic (one-at-a-time) connection. The socket
+ * was left disarmed by the reader, so no further input is looked at until
+ * the response is out.
+ */
+static void classic_process(rpc_job &&job)
+{
+	auto &conn = *job.conn;
+	BINARY tmp_bin;
+	tmp_bin.pb = job.buf;
+	tmp_bin.cb = job.len;
+	exmdb_server::build_env(conn.b_private ? EM_PRIVATE : 0, nullptr);
+	exmdb_server::set_remote_id(conn.remote_id.c_str());
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&tmp_bin, request);
+	frame_free(job.buf, job.len);
+	job.buf = nullptr;
+	if (request != nullptr && request->dir != nullptr)
+		stripslash(request->dir);
+	auto tmp_byte = exmdb_response::success;
+	std::unique_ptr<exresp> response;
+	if (status != pack_result::ok ||
+	    request == nullptr /* [cov-scan] same as status==pack_result::alloc */)
+		tmp_byte = exmdb_response::pull_error;
+	else if (!exmdb_parser_dispatch(request.get(), response))
+		tmp_byte = exmdb_response::dispatch_error;
+	else if (exmdb_ext_push_response(response.get(), &tmp_bin) != pack_result::success)
+		tmp_byte = exmdb_response::push_error;
+	exmdb_server::free_env();
+	exmdb_server::set_remote_id(nullptr);
+	bool keep = false;
+	if (tmp_byte == exmdb_response::success) {
+		keep = conn_send(conn, tmp_bin.pb, tmp_bin.cb);
+		free(tmp_bin.pb);
+	} else {
+		conn_send(conn, &tmp_byte, 1);
 	}
+	/* On error, the reader sees EOF on rearm and drops the connection. */
+	if (!keep)
+		shutdown(conn.sockd, SHUT_RDWR);
+	conn.last_time = time(nullptr);
+	conn.busy = false;
+	conn_rearm(conn);
+}
+
+/**
+ * @arg is non-null for overflow workers, which go away again after
+ * OVERFLOW_WORKER_IDLE without work.
+ */
+static void *rpc_worker_thread(void *arg)
+{
+	bool overflow = arg != nullptr;
+	std::unique_lock jhold(g_job_lock);
+	while (true) {
+		++g_idle_workers;
+		auto ready = []() { return g_worker_stop || g_job_queue.size() > 0; };
+		bool have_work = true;
+		if (!overflow)
+			g_job_cv.wait(jhold, ready);
+		else
+			have_work = g_job_cv.wait_for(jhold, OVERFLOW_WORKER_IDLE, ready);
+		--g_idle_workers;
+		if (!have_work || g_job_queue.size() == 0)
+			break;
+		auto job = std::move(g_job_queue.front());
+		g_job_queue.pop_front();
+		jhold.unlock();
+		if (job.conn->b_mux)
+			mux_process(std::move(job));
+		else
+			classic_process(std::move(job));
+		jhold.lock();
+	}
+	if (overflow) {
+		--g_overflow_workers;
+		jhold.unlock();
+		g_overflow_cv.notify_all();
+	}
+	return nullptr;
+}
+
+static bool job_enqueue(EXMDB_CONNECTION &conn, uint8_t *buf, uint32_t len) try
+{
+	std::unique_lock jhold(g_job_lock);
+	g_job_queue.push_back(rpc_job{conn.shared_from_this(), buf, len});
+	/* Beyond this, requests wait in the queue for the next free worker */
+	auto limit = g_max_overflow;
+	if (g_max_threads != 0 && g_max_threads < g_num_workers + limit)
+		limit = g_max_threads > g_num_workers ? g_max_threads - g_num_workers : 0;
+	bool spawn = g_job_queue.size() > g_idle_workers &&
+	             g_overflow_workers < limit;
+	if (spawn)
+		++g_overflow_workers;
+	jhold.unlock();
+	g_job_cv.notify_one();
+	if (spawn) {
+		pthread_t tid;
+		auto ret = pthread_create4(&tid, nullptr, rpc_worker_thread,
+		           reinterpret_cast<void *>(1));
+		if (ret == 0) {
+			pthread_setname_np(tid, "exmdb_wrk/+");
+			pthread_detach(tid);
+		} else {
+			mlog(LV_WARN, "W-2970: pthread_create: %s", strerror(ret));
+			jhold.lock();
+			--g_overflow_workers;
+		}
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	frame_free(buf, len);
+	return false;
+}
+
+static void *router_thread(void *arg)
+{
+	auto rp = static_cast<std::shared_ptr<ROUTER_CONNECTION> *>(arg);
+	auto prouter = std::move(*rp);
+	delete rp;
+	notification_agent_thread_work(std::move(prouter));
+	return nullptr;
+}
+
+/**
+ * Turn the connection into a notification router (after a successful
+ * listen_notification). The socket changes owner and is served by a
+ * dedicated thread like before.
+ */
+static hs_result conn_to_router(EXMDB_CONNECTION &conn,
+    const exreq_listen_notification &q)
+{
+	exmdb_response tmp_byte;
+	std::shared_ptr<ROUTER_CONNECTION> prouter;
 	try {
+		prouter = std::make_shared<ROUTER_CONNECTION>();
+		prouter->remote_id = q.remote_id;
+	} catch (const std::bad_alloc &) {
+		prouter.reset();
+	}
+	bool too_many = false;
+	if (g_max_routers != 0) {
+		std::lock_guard rhold(g_router_lock);
+		too_many = g_router_list.size() >= g_max_routers;
+	}
+	if (prouter == nullptr) {
+		tmp_byte = exmdb_response::lack_memory;
+	} else if (too_many) {
+		tmp_byte = exmdb_response::max_reached;
+	} else {
+		/* Same flag acknowledgement as for connect */
+		uint8_t resp_buff[9]{};
+		uint32_t resp_len = 5;
+		auto flags = q.proto_flags & EXMDB_PROTO_NOTIFY_BATCH;
+		if (flags != 0) {
+			cpu_to_le32p(&resp_buff[1], sizeof(uint32_t));
+			cpu_to_le32p(&resp_buff[5], flags);
+			resp_len = 9;
+		}
+		/*
+		 * The socket changes hands right after this, so the answer
+		 * has to go out in one piece now. A fresh connection has room
+		 * for it; if not, the peer is misbehaving anyway.
+		 */
+		{
+			std::lock_guard wr_hold(conn.wr_lock);
+			if (conn.woff != conn.wbuf.size() ||
+			    send(conn.sockd, resp_buff, resp_len,
+			    MSG_DONTWAIT | MSG_NOSIGNAL) != resp_len)
+				return hs_result::close;
+		}
+		prouter->b_batch = flags & EXMDB_PROTO_NOTIFY_BATCH;
+		epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, conn.sockd, nullptr);
+		prouter->sockd = conn.sockd;
+		conn.sockd = -1;
+		prouter->last_time = time(nullptr);
 		char txt[52];
-		snprintf(txt, std::size(txt), "exmdb/%s:%hu", pconnection->client_ip, pconnection->client_port);
-		pthread_setname_np(pthread_self(), txt);
+		snprintf(txt, std::size(txt), "exmdb_rt/%s:%hu", conn.client_ip, conn.client_port);
 		std::unique_lock chold(g_connection_lock);
-		g_connection_list.insert(pconnection);
-	} catch (...) {
-		return nullptr;
+		g_connection_list.erase(conn.shared_from_this());
+		chold.unlock();
+		/* conn is gone now */
+		auto arg = new(std::nothrow) std::shared_ptr<ROUTER_CONNECTION>(prouter);
+		if (arg == nullptr)
+			return hs_result::handed_over;
+		std::lock_guard rhold(g_router_lock);
+		try {
+			g_router_list.insert(prouter);
+		} catch (const std::bad_alloc &) {
+			delete arg;
+			return hs_result::handed_over;
+		}
+		auto ret = pthread_create4(&prouter->thr_id, nullptr, router_thread, arg);
+		if (ret != 0) {
+			mlog(LV_WARN, "W-2903: pthread_create: %s", strerror(ret));
+			g_router_list.erase(prouter);
+			delete arg;
+			return hs_result::handed_over;
+		}
+		pthread_setname_np(prouter->thr_id, txt);
+		return hs_result::handed_over;
 	}
-	pbuff = NULL;
-	offset = 0;
-	buff_len = 0;
-	is_writing = FALSE;
-	is_connected = FALSE;
-	while (!pconnection->b_stop) {
-		if (is_writing) {
-			written_len = write(pconnection->sockd,
-			              static_cast<char *>(pbuff) + offset, buff_len - offset);
-			if (written_len <= 0)
-				break;
-			offset += written_len;
-			if (offset == buff_len) {
-				free(pbuff);
-				pbuff = NULL;
-				buff_len = 0;
-				offset = 0;
-				is_writing = FALSE;
+	conn_send_last(conn, &tmp_byte, 1);
+	return hs_result::close;
+}
+
+/**
+ * Process the first request on a connection, which must be either
+ * connect or listen_notification. This is cheap and done directly on the
+ * reader thread.
+ */
+static hs_result conn_handshake(EXMDB_CONNECTION &conn, uint8_t *buf, uint32_t len)
+{
+	BINARY tmp_bin;
+	tmp_bin.pb = buf;
+	tmp_bin.cb = len;
+	exmdb_server::build_env(0, nullptr);
+	auto cl_0 = make_scope_exit([]() { exmdb_server::free_env(); });
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&tmp_bin, request);
+	frame_free(buf, len);
+	exmdb_response tmp_byte;
+	if (status != pack_result::ok || request == nullptr) {
+		tmp_byte = exmdb_response::pull_error;
+	} else if (request->call_id == exmdb_callid::connect) {
+		auto &q = *static_cast<const exreq_connect *>(request.get());
+		BOOL b_private = false;
+		if (!exmdb_parser_is_local(q.prefix, &b_private)) {
+			tmp_byte = exmdb_response::misconfig_prefix;
+		} else if (b_private != q.b_private) {
+			tmp_byte = exmdb_response::misconfig_mode;
+		} else {
+			try {
+				conn.remote_id = q.remote_id;
+			} catch (const std::bad_alloc &) {
+				return hs_result::close;
 			}
-			continue;
+			conn.b_private = b_private;
+			/*
+			 * Acknowledge the protocol flags we support. Old
+			 * clients do not send any, and get the old 5-byte
+			 * response.
+			 */
+			uint8_t cn_buff[9]{};
+			uint32_t cn_len = 5;
+			auto flags = q.proto_flags & EXMDB_PROTO_MUX;
+			if (flags != 0) {
+				cpu_to_le32p(&cn_buff[1], sizeof(uint32_t));
+				cpu_to_le32p(&cn_buff[5], flags);
+				cn_len = 9;
+			}
+			conn.b_mux = flags & EXMDB_PROTO_MUX;
+			conn.b_connected = true;
+			return conn_send(conn, cn_buff, cn_len) ?
+			       hs_result::ok : hs_result::close;
 		}
-		tv_msec = SOCKET_TIMEOUT * 1000;
-		pfd_read.fd = pconnection->sockd;
-		pfd_read.events = POLLIN|POLLPRI;
-		if (poll(&pfd_read, 1, tv_msec) != 1)
-			break;
-		if (NULL == pbuff) {
-			read_len = read(pconnection->sockd,
-					&buff_len, sizeof(uint32_t));
-			if (read_len != sizeof(uint32_t))
-				break;
+	} else if (request->call_id == exmdb_callid::listen_notification) {
+		return conn_to_router(conn, *static_cast<const exreq_listen_notification *>(request.get()));
+	} else {
+		tmp_byte = exmdb_response::connect_incomplete;
+	}
+	conn_send_last(conn, &tmp_byte, 1);
+	return hs_result::close;
+}
+
+/**
+ * Read from the socket without blocking until one frame is complete.
+ * Returns 1 if a frame is in conn.rbuf/rlen (rlen==0 is a ping), 0 if the
+ * socket ran dry, and -1 on EOF/error.
+ */
+static int conn_read_frame(EXMDB_CONNECTION &conn)
+{
+	if (conn.rbuf == nullptr) {
+		while (conn.hdr_off < sizeof(conn.hdr)) {
+			auto ret = recv(conn.sockd, &conn.hdr[conn.hdr_off],
+			           sizeof(conn.hdr) - conn.hdr_off, MSG_DONTWAIT);
+			if (ret == 0)
+				return -1;
+			if (ret < 0)
+				return errno == EAGAIN || errno == EWOULDBLOCK ||
+				       errno == EINTR ? 0 : -1;
+			conn.hdr_off += ret;
+		}
+		conn.hdr_off = 0;
+		conn.rlen = le32p_to_cpu(conn.hdr);
+		conn.roff = 0;
+		if (conn.rlen == 0)
+			return 1;
+		else if (conn.rlen >= UINT_MAX)
+			/* make cov-scan happy that we tested for rlen */
+			return -1;
+		conn.rbuf = frame_alloc(conn.rlen);
+		if (conn.rbuf == nullptr) {
+			auto tmp_byte = exmdb_response::lack_memory;
+			if (!conn.b_mux)
+				conn_send_last(conn, &tmp_byte, 1);
+			return -1;
+		}
+	}
+	while (conn.roff < conn.rlen) {
+		auto ret = recv(conn.sockd, &conn.rbuf[conn.roff],
+		           conn.rlen - conn.roff, MSG_DONTWAIT);
+		if (ret == 0)
+			return -1;
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ||
+			       errno == EINTR ? 0 : -1;
+		conn.roff += ret;
+	}
+	return 1;
+}
+
+static void conn_handle_input(EXMDB_CONNECTION &conn)
+{
+	while (!conn.b_stop) {
+		auto ret = conn_read_frame(conn);
+		if (ret < 0) {
+			conn_close(conn);
+			return;
+		} else if (ret == 0) {
+			conn_rearm(conn);
+			return;
+		}
+		conn.last_time = time(nullptr);
+		if (conn.rlen == 0) {
 			/* ping packet */
-			if (0 == buff_len) {
-				if (HXio_fullwrite(pconnection->sockd, resp_buff, 1) != 1)
-					break;
-				continue;
-			} else if (buff_len >= UINT_MAX) {
-				/* make cov-scan happy that we tested for buff_len */
-				break;
+			static constexpr uint8_t resp_buff[1]{};
+			if (conn.b_mux) {
+				mux_write_status(conn, exmdb_response::success, 0);
+			} else if (!conn_send(conn, resp_buff, 1)) {
+				conn_close(conn);
+				return;
 			}
-			pbuff = malloc(buff_len);
-			if (NULL == pbuff) {
-				auto tmp_byte = exmdb_response::lack_memory;
-				if (HXio_fullwrite(pconnection->sockd, &tmp_byte, 1) != 1 ||
-				    !is_connected)
-					break;
-				buff_len = 0;
-			}
-			offset = 0;
 			continue;
 		}
-		read_len = read(pconnection->sockd,
-		           static_cast<char *>(pbuff) + offset, buff_len - offset);
-		if (read_len <= 0)
-			break;
-		offset += read_len;
-		if (offset < buff_len)
+		auto buf = conn.rbuf;
+		auto len = conn.rlen;
+		conn.rbuf = nullptr;
+		conn.rlen = conn.roff = 0;
+		if (!conn.b_connected) {
+			auto hs = conn_handshake(conn, buf, len);
+			if (hs == hs_result::handed_over)
+				return;
+			if (hs == hs_result::close) {
+				conn_close(conn);
+				return;
+			}
 			continue;
-		exmdb_server::build_env(b_private ? EM_PRIVATE : 0, nullptr);
-		tmp_bin.pv = pbuff;
-		tmp_bin.cb = buff_len;
-		std::unique_ptr<exreq> request;
-		auto status = exmdb_ext_pull_request(&tmp_bin, request);
-		free(pbuff);
-		pbuff = NULL;
-		if (request != nullptr && request->dir != nullptr)
-			stripslash(request->dir);
-		exmdb_response tmp_byte;
-		std::unique_ptr<exresp> response;
-		if (status != pack_result::ok ||
-		    request == nullptr /* [cov-scan] same as status==pack_result::alloc */) {
-			tmp_byte = exmdb_response::pull_error;
-		} else if (!is_connected) {
-			if (request->call_id == exmdb_callid::connect) {
-				auto &q = *static_cast<const exreq_connect *>(request.get());
-				if (!exmdb_parser_is_local(q.prefix, &b_private)) {
-					tmp_byte = exmdb_response::misconfig_prefix;
-				} else if (b_private != q.b_private) {
-					tmp_byte = exmdb_response::misconfig_mode;
-				} else {
-					pconnection->remote_id = q.remote_id;
-					exmdb_server::free_env();
-					exmdb_server::set_remote_id(pconnection->remote_id.c_str());
-					is_connected = TRUE;
-					if (HXio_fullwrite(pconnection->sockd, resp_buff, 5) != 5)
-						break;
-					offset = 0;
-					buff_len = 0;
-					continue;
-				}
-			} else if (request->call_id == exmdb_callid::listen_notification) {
-				auto &q = *static_cast<const exreq_listen_notification *>(request.get());
-				std::shared_ptr<ROUTER_CONNECTION> prouter;
-				try {
-					prouter = std::make_shared<ROUTER_CONNECTION>();
-					prouter->remote_id.reserve(strlen(q.remote_id));
-				} catch (const std::bad_alloc &) {
-				}
-				if (NULL == prouter) {
-					tmp_byte = exmdb_response::lack_memory;
-				} else if (g_max_routers != 0 && g_router_list.size() >= g_max_routers) {
-					tmp_byte = exmdb_response::max_reached;
-				} else {
-					prouter->remote_id = q.remote_id;
-					exmdb_server::free_env();
-					if (5 != write(pconnection->sockd, resp_buff, 5)) {
-						break;
-					} else {
-						prouter->thr_id = pconnection->thr_id;
-						prouter->sockd = pconnection->sockd;
-						pconnection->thr_id = {};
-						pconnection->sockd = -1;
-						prouter->last_time = time(nullptr);
-						std::unique_lock r_hold(g_router_lock);
-						g_router_list.insert(prouter);
-						r_hold.unlock();
-						std::unique_lock chold(g_connection_lock);
-						g_connection_list.erase(pconnection);
-						chold.unlock();
-						notification_agent_thread_work(std::move(prouter));
-					}
-				}
-			} else {
-				tmp_byte = exmdb_response::connect_incomplete;
+		}
+		if (!conn.b_mux) {
+			/*
+			 * No more reading until the worker has queued the
+			 * response; it rearms then.
+			 */
+			conn.busy = true;
+			if (!job_enqueue(conn, buf, len)) {
+				conn.busy = false;
+				conn_close(conn);
+				return;
+			}
+			conn_rearm(conn); /* for EPOLLOUT, if anything is queued */
+			return;
+		}
+		if (len < sizeof(uint32_t)) {
+			frame_free(buf, len);
+			conn_close(conn);
+			return;
+		}
+		std::unique_lock ifl_hold(conn.inflight_lock);
+		auto full = ++conn.inflight >= MUX_INFLIGHT_MAX;
+		if (full)
+			/* Stop reading; the worker bringing it below the mark rearms. */
+			conn.rd_paused = true;
+		ifl_hold.unlock();
+		if (!job_enqueue(conn, buf, len)) {
+			ifl_hold.lock();
+			--conn.inflight;
+			conn.rd_paused = false;
+			ifl_hold.unlock();
+			conn_close(conn);
+			return;
+		} else if (full) {
+			conn_rearm(conn);
+			return;
+		}
+	}
+}
+
+/**
+ * EPOLLOUT: continue sending queued output.
+ */
+static void conn_handle_output(EXMDB_CONNECTION &conn)
+{
+	std::unique_lock wr_hold(conn.wr_lock);
+	if (!conn_flush_locked(conn)) {
+		wr_hold.unlock();
+		conn_close(conn);
+		return;
+	}
+	conn_rearm_locked(conn);
+}
+
+/**
+ * Drop connections that have not seen traffic for SOCKET_TIMEOUT seconds
+ * and have nothing pending, as well as those whose peer has not taken any
+ * of their queued output for that long.
+ */
+static void conn_expire(time_t now)
+{
+	std::vector<std::shared_ptr<EXMDB_CONNECTION>> stale;
+	std::unique_lock chold(g_connection_lock);
+	for (const auto &c : g_connection_list) {
+		bool stalled;
+		{
+			std::lock_guard wr_hold(c->wr_lock);
+			stalled = c->woff < c->wbuf.size() &&
+			          now - c->wr_progress >= SOCKET_TIMEOUT;
+		}
+		if (stalled) {
+			try {
+				stale.push_back(c);
+			} catch (const std::bad_alloc &) {
+				break;
 			}
-		} else if (!exmdb_parser_dispatch(request.get(), response)) {
-			tmp_byte = exmdb_response::dispatch_error;
-		} else if (exmdb_ext_push_response(response.get(), &tmp_bin) != pack_result::success) {
-			tmp_byte = exmdb_response::push_error;
-		} else {
-			exmdb_server::free_env();
-			offset = 0;
-			pbuff = tmp_bin.pb;
-			buff_len = tmp_bin.cb;
-			is_writing = TRUE;
 			continue;
 		}
-		exmdb_server::free_env();
-		if (HXio_fullwrite(pconnection->sockd, &tmp_byte, 1) != 1)
-			/* ignore */;
-		break;
-	}
-	close(pconnection->sockd);
-	pconnection->sockd = -1;
-	free(pbuff);
-	if (!pconnection->b_stop) {
-		pconnection->thr_id = {};
-		pthread_detach(pthread_self());
+		if (c->busy || now - c->last_time < SOCKET_TIMEOUT)
+			continue;
+		std::lock_guard ifl_hold(c->inflight_lock);
+		if (c->inflight > 0)
+			continue;
+		try {
+			stale.push_back(c);
+		} catch (const std::bad_alloc &) {
+			break;
+		}
+	}
+	chold.unlock();
+	for (const auto &c : stale)
+		conn_close(*c);
+}
+
+/**
+ * All connections are watched by this one thread. It only moves bytes
+ * into frame buffers and out of output queues, and answers
+ * pings/handshakes; none of that blocks. Request execution is done by the
+ * rpc_worker_thread pool.
+ */
+static void *epoll_thread(void *)
+{
+	struct epoll_event evs[64];
+	auto last_scan = time(nullptr);
+	while (!g_epoll_stop) {
+		auto num = epoll_wait(g_epoll_fd, evs, std::size(evs), 1000);
+		for (int i = 0; i < num; ++i) {
+			auto conn = static_cast<EXMDB_CONNECTION *>(evs[i].data.ptr);
+			/* Keep the object alive while it possibly gets erased */
+			auto hold = conn->shared_from_this();
+			if (evs[i].events & EPOLLOUT)
+				conn_handle_output(*conn);
+			/* ERR/HUP are reported even while a classic request is out */
+			if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) &&
+			    !conn->busy)
+				conn_handle_input(*conn);
+		}
+		auto now = time(nullptr);
+		if (now != last_scan) {
+			conn_expire(now);
+			last_scan = now;
+		}
 	}
 	return nullptr;
 }
 
-void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&pconnection)
+void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&uconn)
 {
-	auto ret = pthread_create4(&pconnection->thr_id, nullptr,
-	           request_parser_thread, pconnection.get());
-	if (ret != 0)
-		mlog(LV_WARN, "W-1440: pthread_create: %s", strerror(ret));
-	else
-		pconnection.release(); /* thread should be vivid now */
+	std::shared_ptr<EXMDB_CONNECTION> pconnection;
+	try {
+		pconnection = std::move(uconn);
+		std::lock_guard chold(g_connection_lock);
+		g_connection_list.insert(pconnection);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_WARN, "W-1440: ENOMEM");
+		return;
+	}
+	pconnection->last_time = time(nullptr);
+	struct epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = pconnection.get();
+	if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, pconnection->sockd, &ev) != 0) {
+		mlog(LV_WARN, "W-2904: epoll_ctl: %s", strerror(errno));
+		std::lock_guard chold(g_connection_lock);
+		g_connection_list.erase(pconnection);
+	}
 }
 
 std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id)
@@ -410,37 +999,81 @@ int exmdb_parser_run(const char *config_path)
 	}
 	std::erase_if(g_local_list,
 		[&](const EXMDB_ITEM &s) { return !HX_ipaddr_is_local(s.host.c_str(), AI_V4MAPPED); });
+	if (g_num_workers == 0)
+		/* not serving the network */
+		return 0;
+	try {
+		g_frame_small.reserve(FRAME_SMALL_KEEP);
+		g_frame_large.reserve(FRAME_LARGE_KEEP);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2905: ENOMEM");
+		return 2;
+	}
+	g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epoll_fd < 0) {
+		mlog(LV_ERR, "exmdb_provider: epoll_create: %s", strerror(errno));
+		return 2;
+	}
+	g_worker_stop = false;
+	for (size_t i = 0; i < g_num_workers; ++i) {
+		pthread_t tid;
+		ret = pthread_create4(&tid, nullptr, rpc_worker_thread, nullptr);
+		if (ret != 0) {
+			mlog(LV_ERR, "exmdb_provider: pthread_create: %s", strerror(ret));
+			if (g_worker_ids.size() > 0)
+				break;
+			g_worker_stop = true;
+			close(g_epoll_fd);
+			g_epoll_fd = -1;
+			return 2;
+		}
+		char txt[16];
+		snprintf(txt, std::size(txt), "exmdb_wrk/%zu", i);
+		pthread_setname_np(tid, txt);
+		g_worker_ids.push_back(tid);
+	}
+	g_epoll_stop = false;
+	ret = pthread_create4(&g_epoll_id, nullptr, epoll_thread, nullptr);
+	if (ret != 0) {
+		mlog(LV_ERR, "exmdb_provider: pthread_create: %s", strerror(ret));
+		g_epoll_stop = true;
+		exmdb_parser_stop();
+		return 2;
+	}
+	pthread_setname_np(g_epoll_id, "exmdb_epoll");
 	return 0;
 }
 
 void exmdb_parser_stop()
 {
-	std::vector<pthread_t> pthr_ids;
-	
+	if (!g_epoll_stop) {
+		g_epoll_stop = true;
+		pthread_kill(g_epoll_id, SIGALRM);
+		pthread_join(g_epoll_id, nullptr);
+	}
+	/*
+	 * With the reader gone, nothing else erases from the list. Jobs may
+	 * still reference connections; they get write errors and let go.
+	 */
 	std::unique_lock chold(g_connection_lock);
-	size_t num = g_connection_list.size();
-	pthr_ids.reserve(num);
-	if (num > 0) {
-	for (auto &pconnection : g_connection_list) {
+	auto conns = std::move(g_connection_list);
+	g_connection_list.clear();
+	chold.unlock();
+	for (auto &pconnection : conns) {
 		pconnection->b_stop = true;
 		if (pconnection->sockd >= 0)
 			shutdown(pconnection->sockd, SHUT_RDWR); /* closed in ~EXMDB_CONNECTION */
-		if (!pthread_equal(pconnection->thr_id, {})) {
-			pthr_ids.push_back(pconnection->thr_id);
-			pthread_kill(pconnection->thr_id, SIGALRM);
-		}
-	}
-	chold.unlock();
-		for (auto tid : pthr_ids)
-			pthread_join(tid, nullptr);
 	}
+	std::vector<pthread_t> pthr_ids;
 	std::unique_lock rhold(g_router_lock);
-	num = g_router_list.size();
-	pthr_ids.clear();
+	size_t num = g_router_list.size();
 	pthr_ids.reserve(num);
 	if (num > 0) {
 	for (auto &rt : g_router_list) {
-		rt->b_stop = true;
+		{
+			std::lock_guard lk(rt->lock);
+			rt->b_stop = true;
+		}
 		rt->waken_cond.notify_one();
 		if (!pthread_equal(rt->thr_id, {})) {
 			pthr_ids.emplace_back(rt->thr_id);
@@ -451,4 +1084,26 @@ void exmdb_parser_stop()
 		for (auto tid : pthr_ids)
 			pthread_join(tid, nullptr);
 	}
+	std::unique_lock jhold(g_job_lock);
+	g_worker_stop = true;
+	jhold.unlock();
+	g_job_cv.notify_all();
+	for (auto tid : g_worker_ids)
+		pthread_join(tid, nullptr);
+	g_worker_ids.clear();
+	jhold.lock();
+	g_overflow_cv.wait(jhold, []() { return g_overflow_workers == 0; });
+	jhold.unlock();
+	conns.clear();
+	if (g_epoll_fd >= 0) {
+		close(g_epoll_fd);
+		g_epoll_fd = -1;
+	}
+	std::lock_guard fhold(g_frame_lock);
+	for (auto p : g_frame_small)
+		free(p);
+	for (auto p : g_frame_large)
+		free(p);
+	g_frame_small.clear();
+	g_frame_large.clear();
 }
@@ -1,5 +1,7 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <list>
 #include <memory>
 #include <mutex>
@@ -9,15 +11,40 @@
 #include <gromox/common_types.hpp>
 #include <gromox/generic_connection.hpp>
 
-class EXMDB_CONNECTION : public GENERIC_CONNECTION {
+class EXMDB_CONNECTION : public GENERIC_CONNECTION,
+    public std::enable_shared_from_this<EXMDB_CONNECTION> {
 	public:
 	EXMDB_CONNECTION() = default;
 	~EXMDB_CONNECTION();
 	NOMOVE(EXMDB_CONNECTION);
 
 	gromox::atomic_bool b_stop{false};
-	pthread_t thr_id{};
+	bool b_private = false, b_mux = false, b_connected = false;
 	std::string remote_id;
+	/* Frame assembly; only touched by the epoll thread */
+	uint8_t hdr[4]{}, *rbuf = nullptr;
+	uint32_t hdr_off = 0, rlen = 0, roff = 0;
+	/* classic connection: a request is with the worker pool */
+	gromox::atomic_bool busy{false};
+	std::atomic<time_t> last_time{0};
+	/*
+	 * Output queue. Writers (epoll thread and workers) never block: what
+	 * the socket does not take right away is queued here and sent by the
+	 * epoll thread on EPOLLOUT. The epoll registration is only changed
+	 * under wr_lock.
+	 */
+	std::mutex wr_lock, inflight_lock;
+	std::string wbuf; /* under wr_lock */
+	size_t woff = 0; /* under wr_lock */
+	time_t wr_progress = 0; /* last time queued output moved; under wr_lock */
+	unsigned int inflight = 0;
+	bool rd_paused = false; /* under inflight_lock */
+};
+
+/* A serialized DB_NOTIFY_DATAGRAM (including its length word) */
+struct router_datagram {
+	BINARY bin{}; /* manual (de)allocation of .pb */
+	bool collapsible = false;
 };
 
 struct ROUTER_CONNECTION {
@@ -30,12 +57,16 @@ struct ROUTER_CONNECTION {
 	std::string remote_id;
 	int sockd = -1;
 	time_t last_time = 0;
-	std::mutex lock, cond_mutex;
-	std::condition_variable waken_cond;
-	std::list<BINARY> datagram_list; /* manual (de)allocation of .pb */
+	bool b_batch = false; /* EXMDB_PROTO_NOTIFY_BATCH */
+	std::mutex lock;
+	std::condition_variable waken_cond; /* datagram_list/b_stop, under lock */
+	std::list<router_datagram> datagram_list;
 };
 
-extern void exmdb_parser_init(size_t max_threads, size_t max_routers);
+struct exreq_batch;
+struct exresp_batch;
+
+extern void exmdb_parser_init(size_t max_threads, size_t max_routers, size_t workers, size_t overflow);
 extern int exmdb_parser_run(const char *config_path);
 extern void exmdb_parser_stop();
 extern std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn();
@@ -43,5 +74,6 @@ extern void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&);
 extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id);
 extern void exmdb_parser_insert_router(std::shared_ptr<ROUTER_CONNECTION> &&);
 extern BOOL exmdb_parser_erase_router(const std::shared_ptr<ROUTER_CONNECTION> &);
+extern BOOL exmdb_parser_batch(const exreq_batch &, exresp_batch &, bool wire);
 
 extern unsigned int g_exrpc_debug, g_enable_dam;
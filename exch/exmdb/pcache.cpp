@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Process-wide page cache budget.
+ *
+ * SQLite gives every connection its own page cache, sized by PRAGMA
+ * cache_size, so that the total grows with the number of open handles. This
+ * wraps the built-in cache implementation (SQLITE_CONFIG_PCACHE2) and caps
+ * each purgeable cache at an equal share of exmdb_page_cache_budget, or at its
+ * own cache_size if that is smaller. The share is recomputed whenever caches
+ * come or go or the budget is reloaded; a cache picks up the new limit on its
+ * next fetch, i.e. on the thread that owns the connection, since the built-in
+ * caches are not safe to resize from elsewhere. Shrinking the limit makes
+ * SQLite drop that cache's least recently used unpinned pages. Handles that
+ * go back to the spares would not fetch again until reused, so the limit is
+ * also re-applied on release (db_pcache_enforce).
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <sqlite3.h>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+
+namespace {
+
+struct gx_pcache {
+	sqlite3_pcache *base = nullptr;
+	size_t pgbytes = 0;
+	int requested = 0, applied = -1;
+	unsigned int pages = 0;
+	bool purgeable = false;
+	uint64_t epoch = 0, budget = 0;
+};
+
+}
+
+/* Caches never go below this many pages, however many there are */
+static constexpr int PCACHE_MIN_PAGES = 16;
+static sqlite3_pcache_methods2 g_pc_base;
+static std::atomic<size_t> g_pc_caches; /* purgeable ones */
+static std::atomic<uint64_t> g_pc_epoch;
+static std::atomic<uint64_t> g_pc_bytes, g_pc_bytes_peak;
+unsigned long long g_exmdb_page_cache_budget;
+
+static gx_pcache *to_gx(sqlite3_pcache *p)
+{
+	return reinterpret_cast<gx_pcache *>(p);
+}
+
+static void pc_account(gx_pcache *c)
+{
+	unsigned int now = g_pc_base.xPagecount(c->base);
+	if (now == c->pages)
+		return;
+	if (now > c->pages) {
+		auto total = g_pc_bytes += (now - c->pages) * c->pgbytes;
+		auto peak = g_pc_bytes_peak.load();
+		while (total > peak && !g_pc_bytes_peak.compare_exchange_weak(peak, total))
+			/* retry */;
+	} else {
+		g_pc_bytes -= (c->pages - now) * c->pgbytes;
+	}
+	c->pages = now;
+}
+
+static void pc_apply(gx_pcache *c)
+{
+	int limit = c->requested;
+	auto budget = g_exmdb_page_cache_budget;
+	c->epoch  = g_pc_epoch;
+	c->budget = budget;
+	if (c->purgeable && budget > 0) {
+		auto n = std::max(g_pc_caches.load(), static_cast<size_t>(1));
+		uint64_t share = budget / n / std::max(c->pgbytes, static_cast<size_t>(1));
+		share = std::max(share, static_cast<uint64_t>(PCACHE_MIN_PAGES));
+		if (share < static_cast<uint64_t>(limit))
+			limit = share;
+	}
+	if (limit == c->applied)
+		return;
+	c->applied = limit;
+	g_pc_base.xCachesize(c->base, limit);
+	pc_account(c);
+}
+
+static int pc_init(void *)
+{
+	return g_pc_base.xInit != nullptr ? g_pc_base.xInit(g_pc_base.pArg) : SQLITE_OK;
+}
+
+static void pc_shutdown(void *)
+{
+	if (g_pc_base.xShutdown != nullptr)
+		g_pc_base.xShutdown(g_pc_base.pArg);
+}
+
+static sqlite3_pcache *pc_create(int szPage, int szExtra, int bPurgeable)
+{
+	auto c = new(std::nothrow) gx_pcache;
+	if (c == nullptr)
+		return nullptr;
+	c->base = g_pc_base.xCreate(szPage, szExtra, bPurgeable);
+	if (c->base == nullptr) {
+		delete c;
+		return nullptr;
+	}
+	c->pgbytes = szPage + szExtra;
+	c->purgeable = bPurgeable;
+	if (c->purgeable) {
+		++g_pc_caches;
+		++g_pc_epoch;
+	}
+	return reinterpret_cast<sqlite3_pcache *>(c);
+}
+
+static void pc_cachesize(sqlite3_pcache *p, int n)
+{
+	auto c = to_gx(p);
+	c->requested = n;
+	pc_apply(c);
+}
+
+static int pc_pagecount(sqlite3_pcache *p)
+{
+	return g_pc_base.xPagecount(to_gx(p)->base);
+}
+
+static sqlite3_pcache_page *pc_fetch(sqlite3_pcache *p, unsigned int key, int create)
+{
+	auto c = to_gx(p);
+	if (c->epoch != g_pc_epoch || c->budget != g_exmdb_page_cache_budget)
+		pc_apply(c);
+	auto pg = g_pc_base.xFetch(c->base, key, create);
+	if (create)
+		pc_account(c);
+	return pg;
+}
+
+static void pc_unpin(sqlite3_pcache *p, sqlite3_pcache_page *pg, int discard)
+{
+	auto c = to_gx(p);
+	g_pc_base.xUnpin(c->base, pg, discard);
+	if (discard)
+		pc_account(c);
+}
+
+static void pc_rekey(sqlite3_pcache *p, sqlite3_pcache_page *pg,
+    unsigned int oldkey, unsigned int newkey)
+{
+	g_pc_base.xRekey(to_gx(p)->base, pg, oldkey, newkey);
+}
+
+static void pc_truncate(sqlite3_pcache *p, unsigned int limit)
+{
+	auto c = to_gx(p);
+	g_pc_base.xTruncate(c->base, limit);
+	pc_account(c);
+}
+
+static void pc_destroy(sqlite3_pcache *p)
+{
+	auto c = to_gx(p);
+	g_pc_bytes -= c->pages * c->pgbytes;
+	g_pc_base.xDestroy(c->base);
+	if (c->purgeable) {
+		--g_pc_caches;
+		++g_pc_epoch;
+	}
+	delete c;
+}
+
+static void pc_shrink(sqlite3_pcache *p)
+{
+	auto c = to_gx(p);
+	g_pc_base.xShrink(c->base);
+	pc_account(c);
+}
+
+/**
+ * Install the wrapper. Must run before sqlite3_initialize; if SQLite was
+ * already initialized by someone else in this process, the per-connection
+ * caches stay unbounded.
+ */
+void db_pcache_install()
+{
+	if (g_pc_base.xCreate != nullptr)
+		/* Still in place from before a sqlite3_shutdown */
+		return;
+	if (sqlite3_config(SQLITE_CONFIG_GETPCACHE2, &g_pc_base) != SQLITE_OK ||
+	    g_pc_base.xCreate == nullptr) {
+		mlog(LV_WARN, "W-2947: exmdb_provider: cannot obtain the SQLite page cache; exmdb_page_cache_budget has no effect");
+		return;
+	}
+	static const sqlite3_pcache_methods2 wrap = {
+		1, nullptr, pc_init, pc_shutdown, pc_create, pc_cachesize,
+		pc_pagecount, pc_fetch, pc_unpin, pc_rekey, pc_truncate,
+		pc_destroy, pc_shrink,
+	};
+	if (sqlite3_config(SQLITE_CONFIG_PCACHE2, &wrap) != SQLITE_OK) {
+		g_pc_base = {};
+		mlog(LV_WARN, "W-2948: exmdb_provider: cannot install the page cache budget; exmdb_page_cache_budget has no effect");
+	}
+}
+
+/**
+ * Make @db's cache pick up the current share now. Setting cache_size (to the
+ * value it already has) is the one way to reach xCachesize from the thread
+ * that owns the connection.
+ */
+void db_pcache_enforce(sqlite3 *db)
+{
+	if (g_pc_base.xCreate == nullptr || g_exmdb_page_cache_budget == 0 ||
+	    db == nullptr)
+		return;
+	auto stm = gx_sql_prep(db, "PRAGMA main.cache_size");
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return;
+	auto n = stm.col_int64(0);
+	stm.finalize();
+	gx_sql_exec(db, fmt::format("PRAGMA main.cache_size={}", n).c_str());
+}
+
+void db_pcache_report()
+{
+	if (g_pc_base.xCreate == nullptr)
+		return;
+	mlog(LV_INFO, "exmdb_provider: page cache: %zu MB in %zu caches, peak %zu MB "
+	        "(budget %llu MB)", static_cast<size_t>(g_pc_bytes.load() >> 20),
+	        g_pc_caches.load(), static_cast<size_t>(g_pc_bytes_peak.load() >> 20),
+	        g_exmdb_page_cache_budget >> 20);
+}
+
+BOOL exmdb_server::store_cache_stats(const char *dir, uint64_t *mem,
+    uint64_t *hits, uint64_t *misses)
+{
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return false;
+	/* Add what the handle in use by this call has seen so far */
+	int used = 0, hit = 0, miss = 0, hi = 0;
+	sqlite3_db_status(pdb->psqlite, SQLITE_DBSTATUS_CACHE_USED, &used, &hi, 0);
+	sqlite3_db_status(pdb->psqlite, SQLITE_DBSTATUS_CACHE_HIT, &hit, &hi, 0);
+	sqlite3_db_status(pdb->psqlite, SQLITE_DBSTATUS_CACHE_MISS, &miss, &hi, 0);
+	auto dbase = pdb->lock_base_wr();
+	*mem    = dbase->mem_usage() + used;
+	*hits   = dbase->cache_hits + hit;
+	*misses = dbase->cache_misses + miss;
+	return TRUE;
+}
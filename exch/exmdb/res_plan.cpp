@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compiled message restrictions (res_plan).
+ *
+ * cu_eval_msg_restriction walks the RESTRICTION tree for every message and
+ * issues one message_properties lookup per node. A plan is built once per
+ * content table / dynamic search instead:
+ *
+ * - A subtree which only tests scalar numeric properties stored as-is in
+ *   message_properties (RES_PROPERTY, RES_BITMASK, RES_EXIST, and
+ *   AND/OR/NOT thereof) is turned into one SQL expression. Absent values
+ *   are handled like propval_compare_relop_nullok/RESTRICTION_BITMASK::eval
+ *   do.
+ * - Everything else becomes a flat program with short-circuit jumps. Leaf
+ *   nodes share value slots, so a property that is tested several times
+ *   (e.g. an OR over many RES_CONTENT on PR_SUBJECT) is fetched once.
+ *   RES_SUBRESTRICTION, RES_COUNT and the parent-id pseudo properties are
+ *   handed to the interpreter.
+ *
+ * For bulk scans, the pushed-down top-level conjuncts are also offered as a
+ * WHERE clause (prefilter) which the caller appends to its own enumeration.
+ */
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+
+bool g_exmdb_compile_res = true;
+
+/**
+ * Whether message @tag comes straight from message_properties, i.e. is not
+ * produced by gp_spectableprop/gp_msgprop. Only asked for the numeric and
+ * binary types that can be pushed down.
+ */
+static bool msgprop_is_stored(uint32_t tag)
+{
+	switch (tag) {
+	case PR_ENTRYID:
+	case PR_PARENT_ENTRYID:
+	case PR_INSTANCE_SVREID:
+	case PR_STORE_RECORD_KEY:
+	case PidTagFolderId:
+	case PidTagParentFolderId:
+	case PR_MESSAGE_SIZE:
+	case PR_ASSOCIATED:
+	case PidTagChangeNumber:
+	case PR_READ:
+	case PR_HAS_NAMED_PROPERTIES:
+	case PR_HASATTACH:
+	case PidTagMid:
+	case PR_MESSAGE_FLAGS:
+	case PR_HTML:
+	case PR_RTF_COMPRESSED:
+		return false;
+	}
+	return true;
+}
+
+static bool contains_count(const RESTRICTION *r)
+{
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < r->andor->count; ++i)
+			if (contains_count(&r->andor->pres[i]))
+				return true;
+		return false;
+	case RES_NOT:
+		return contains_count(&r->xnot->res);
+	case RES_SUBRESTRICTION:
+		return contains_count(&r->sub->res);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return r->comment->pres != nullptr && contains_count(r->comment->pres);
+	case RES_COUNT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static const char *relop_sql(relop op)
+{
+	switch (op) {
+	case RELOP_LT: return "<";
+	case RELOP_LE: return "<=";
+	case RELOP_GT: return ">";
+	case RELOP_GE: return ">=";
+	case RELOP_EQ: return "=";
+	case RELOP_NE: return "<>";
+	default: return nullptr;
+	}
+}
+
+/*
+ * Row of @tag exists and satisfies @cond; or, if @absent_ok, the row is
+ * absent or satisfies @cond.
+ */
+static std::string sql_prop(const char *mid, uint32_t tag,
+    const std::string &cond, bool absent_ok)
+{
+	if (cond.empty())
+		return fmt::format("EXISTS (SELECT 1 FROM message_properties"
+		       " WHERE message_id={} AND proptag={})", mid, tag);
+	if (!absent_ok)
+		return fmt::format("EXISTS (SELECT 1 FROM message_properties"
+		       " WHERE message_id={} AND proptag={} AND ({}))",
+		       mid, tag, cond);
+	return fmt::format("NOT EXISTS (SELECT 1 FROM message_properties"
+	       " WHERE message_id={} AND proptag={} AND NOT ({}))",
+	       mid, tag, cond);
+}
+
+/*
+ * Comparison of the stored propval against @c as propval_compare does it,
+ * i.e. unsigned 64-bit. SQLite compares signed, so split on the sign bit.
+ * Hex literals are taken as two's complement by SQLite.
+ */
+static std::string sql_cmp_u64(relop op, uint64_t c)
+{
+	auto lit = fmt::format("0x{:x}", c);
+	bool neg = static_cast<int64_t>(c) < 0;
+	switch (op) {
+	case RELOP_EQ: return "propval=" + lit;
+	case RELOP_NE: return "propval<>" + lit;
+	case RELOP_LT: return neg ? "propval>=0 OR propval<" + lit : "propval>=0 AND propval<" + lit;
+	case RELOP_LE: return neg ? "propval>=0 OR propval<=" + lit : "propval>=0 AND propval<=" + lit;
+	case RELOP_GT: return neg ? "propval<0 AND propval>" + lit : "propval<0 OR propval>" + lit;
+	case RELOP_GE: return neg ? "propval<0 AND propval>=" + lit : "propval<0 OR propval>=" + lit;
+	default: return {};
+	}
+}
+
+/**
+ * Translate @r into a boolean SQL expression over message @mid (a column
+ * reference or a bind parameter). Returns false if any part of the subtree
+ * cannot be expressed exactly.
+ */
+static bool sql_of(const RESTRICTION *r, const char *mid, std::string &out)
+{
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR: {
+		if (r->andor->count == 0) {
+			out = r->rt == RES_AND ? "1" : "0";
+			return true;
+		}
+		std::string expr = "(";
+		for (size_t i = 0; i < r->andor->count; ++i) {
+			std::string sub;
+			if (!sql_of(&r->andor->pres[i], mid, sub))
+				return false;
+			if (i > 0)
+				expr += r->rt == RES_AND ? " AND " : " OR ";
+			expr += sub;
+		}
+		out = std::move(expr) + ")";
+		return true;
+	}
+	case RES_NOT: {
+		std::string sub;
+		if (!sql_of(&r->xnot->res, mid, sub))
+			return false;
+		out = "NOT (" + std::move(sub) + ")";
+		return true;
+	}
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (r->comment->pres == nullptr) {
+			out = "1";
+			return true;
+		}
+		return sql_of(r->comment->pres, mid, out);
+	case RES_NULL:
+		out = "1";
+		return true;
+	case RES_PROPERTY: {
+		auto rp = r->prop;
+		auto tag = rp->proptag;
+		auto op = relop_sql(rp->relop);
+		if (!rp->comparable() || op == nullptr ||
+		    rp->propval.pvalue == nullptr || !msgprop_is_stored(tag))
+			return false;
+		/* Absent values sort before anything else */
+		bool absent_ok = three_way_eval(rp->relop, -1);
+		std::string cond;
+		switch (PROP_TYPE(tag)) {
+		case PT_SHORT:
+			cond = fmt::format("(propval & 65535){}{}", op,
+			       *static_cast<const uint16_t *>(rp->propval.pvalue));
+			break;
+		case PT_LONG:
+			cond = fmt::format("(propval & 4294967295){}{}", op,
+			       *static_cast<const uint32_t *>(rp->propval.pvalue));
+			break;
+		case PT_BOOLEAN:
+			cond = fmt::format("((propval & 255)<>0){}{}", op,
+			       !!*static_cast<const uint8_t *>(rp->propval.pvalue) ? 1 : 0);
+			break;
+		case PT_CURRENCY:
+		case PT_I8:
+		case PT_SYSTIME:
+			cond = sql_cmp_u64(rp->relop,
+			       *static_cast<const uint64_t *>(rp->propval.pvalue));
+			break;
+		default:
+			return false;
+		}
+		out = sql_prop(mid, tag, cond, absent_ok);
+		return true;
+	}
+	case RES_BITMASK: {
+		auto rb = r->bm;
+		if (PROP_TYPE(rb->proptag) != PT_LONG ||
+		    !msgprop_is_stored(rb->proptag) ||
+		    (rb->bitmask_relop != BMR_EQZ && rb->bitmask_relop != BMR_NEZ))
+			return false;
+		/* Absent values count as 0 */
+		out = sql_prop(mid, rb->proptag, fmt::format("(propval & {}){}0",
+		      rb->mask, rb->bitmask_relop == BMR_EQZ ? "=" : "<>"),
+		      rb->bitmask_relop == BMR_EQZ);
+		return true;
+	}
+	case RES_EXIST: {
+		auto tag = r->exist->proptag;
+		switch (PROP_TYPE(tag)) {
+		case PT_SHORT:
+		case PT_LONG:
+		case PT_BOOLEAN:
+		case PT_CURRENCY:
+		case PT_I8:
+		case PT_SYSTIME:
+		case PT_FLOAT:
+		case PT_DOUBLE:
+		case PT_APPTIME:
+		case PT_BINARY:
+			break;
+		default:
+			return false;
+		}
+		if (!msgprop_is_stored(tag))
+			return false;
+		out = sql_prop(mid, tag, {}, false);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+struct res_compiler {
+	res_plan &p;
+	std::unordered_map<uint32_t, uint16_t> slots;
+
+	uint16_t slot_of(uint32_t tag);
+	uint32_t add_leaf(const RESTRICTION *, uint32_t tag1 = 0, uint32_t tag2 = 0);
+	void emit_cst(std::vector<res_plan::insn> &, bool);
+	void emit_andor(const RESTRICTION *, std::vector<res_plan::insn> &, bool skip_pushed);
+	void emit(const RESTRICTION *, std::vector<res_plan::insn> &);
+};
+
+uint16_t res_compiler::slot_of(uint32_t tag)
+{
+	auto [it, added] = slots.emplace(tag, static_cast<uint16_t>(p.m_tags.size()));
+	if (added)
+		p.m_tags.push_back(tag);
+	return it->second;
+}
+
+uint32_t res_compiler::add_leaf(const RESTRICTION *r, uint32_t tag1, uint32_t tag2)
+{
+	res_plan::leaf lf{r, 0, 0};
+	if (tag1 != 0)
+		lf.slot = slot_of(tag1);
+	if (tag2 != 0)
+		lf.slot2 = slot_of(tag2);
+	p.m_leaves.push_back(lf);
+	return static_cast<uint32_t>(p.m_leaves.size() - 1);
+}
+
+void res_compiler::emit_cst(std::vector<res_plan::insn> &prog, bool v)
+{
+	prog.push_back({res_plan::opc::cst, v});
+}
+
+/*
+ * AND/OR with short-circuit jumps to the end. With @skip_pushed, AND
+ * members which went into the prefilter are left out.
+ */
+void res_compiler::emit_andor(const RESTRICTION *r,
+    std::vector<res_plan::insn> &prog, bool skip_pushed)
+{
+	auto jop = r->rt == RES_AND ? res_plan::opc::jf : res_plan::opc::jt;
+	std::vector<size_t> fixups;
+	bool any = false;
+	for (size_t i = 0; i < r->andor->count; ++i) {
+		std::string dummy;
+		if (skip_pushed && sql_of(&r->andor->pres[i], "x.message_id", dummy))
+			continue;
+		if (any) {
+			fixups.push_back(prog.size());
+			prog.push_back({jop, 0});
+		}
+		emit(&r->andor->pres[i], prog);
+		any = true;
+	}
+	if (!any) {
+		emit_cst(prog, r->rt == RES_AND);
+		return;
+	}
+	for (auto f : fixups)
+		prog[f].arg = prog.size();
+}
+
+void res_compiler::emit(const RESTRICTION *r, std::vector<res_plan::insn> &prog)
+{
+	using opc = res_plan::opc;
+	std::string expr;
+	if (sql_of(r, "?1", expr)) {
+		if (expr == "1" || expr == "0") {
+			emit_cst(prog, expr == "1");
+			return;
+		}
+		p.m_sql.push_back("SELECT " + std::move(expr));
+		prog.push_back({opc::sql, static_cast<uint32_t>(p.m_sql.size() - 1)});
+		return;
+	}
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR:
+		emit_andor(r, prog, false);
+		return;
+	case RES_NOT:
+		emit(&r->xnot->res, prog);
+		prog.push_back({opc::lnot, 0});
+		return;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (r->comment->pres == nullptr)
+			emit_cst(prog, true);
+		else
+			emit(r->comment->pres, prog);
+		return;
+	case RES_NULL:
+		emit_cst(prog, true);
+		return;
+	case RES_CONTENT:
+		if (!r->cont->comparable())
+			emit_cst(prog, false);
+		else
+			prog.push_back({opc::leaf, add_leaf(r, r->cont->proptag)});
+		return;
+	case RES_PROPERTY:
+		if (!r->prop->comparable())
+			emit_cst(prog, false);
+		else if (r->prop->proptag == PR_PARENT_SVREID ||
+		    r->prop->proptag == PR_PARENT_ENTRYID)
+			prog.push_back({opc::interp, add_leaf(r)});
+		else
+			prog.push_back({opc::leaf, add_leaf(r, r->prop->proptag)});
+		return;
+	case RES_PROPCOMPARE:
+		if (!r->pcmp->comparable())
+			emit_cst(prog, false);
+		else
+			prog.push_back({opc::leaf, add_leaf(r,
+				r->pcmp->proptag1, r->pcmp->proptag2)});
+		return;
+	case RES_BITMASK:
+		if (!r->bm->comparable())
+			emit_cst(prog, false);
+		else
+			prog.push_back({opc::leaf, add_leaf(r, r->bm->proptag)});
+		return;
+	case RES_SIZE:
+		prog.push_back({opc::leaf, add_leaf(r, r->size->proptag)});
+		return;
+	case RES_EXIST:
+		prog.push_back({opc::leaf, add_leaf(r, r->exist->proptag)});
+		return;
+	case RES_SUBRESTRICTION:
+	case RES_COUNT:
+		prog.push_back({opc::interp, add_leaf(r)});
+		return;
+	default:
+		emit_cst(prog, false);
+		return;
+	}
+}
+
+std::shared_ptr<const res_plan> res_plan::compile(const RESTRICTION *r) try
+{
+	if (r == nullptr || !g_exmdb_compile_res)
+		return nullptr;
+	auto plan = std::make_shared<res_plan>();
+	res_compiler c{*plan};
+	c.emit(r, plan->m_prog);
+	/*
+	 * RES_COUNT has a side effect and must see the messages in their
+	 * original order, so nothing is moved ahead into the prefilter.
+	 */
+	if (contains_count(r)) {
+		plan->m_rest = plan->m_prog;
+		return plan;
+	}
+	std::string expr;
+	if (sql_of(r, "x.message_id", expr)) {
+		plan->m_prefilter = std::move(expr);
+		c.emit_cst(plan->m_rest, true);
+	} else if (r->rt == RES_AND) {
+		for (size_t i = 0; i < r->andor->count; ++i) {
+			if (!sql_of(&r->andor->pres[i], "x.message_id", expr))
+				continue;
+			if (!plan->m_prefilter.empty())
+				plan->m_prefilter += " AND ";
+			plan->m_prefilter += expr;
+		}
+		c.emit_andor(r, plan->m_rest, true);
+	} else {
+		plan->m_rest = plan->m_prog;
+	}
+	return plan;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2921: ENOMEM");
+	return nullptr;
+}
+
+bool res_plan::eval(sqlite3 *db, cpid_t cpid, uint64_t mid,
+    bool prefiltered) const
+{
+	return run(prefiltered ? m_rest : m_prog, db, cpid, mid);
+}
+
+bool res_plan::run(const std::vector<insn> &prog, sqlite3 *db, cpid_t cpid,
+    uint64_t mid) const
+{
+	/* Per-slot fetch result: -1 not fetched yet, 0 failed, 1 ok */
+	std::vector<int8_t> have(m_tags.size(), -1);
+	std::vector<void *> val(m_tags.size());
+	auto fetch = [&](uint16_t slot, void *&v) -> bool {
+		if (have[slot] < 0)
+			have[slot] = cu_get_property(MAPI_MESSAGE, mid, cpid,
+			             db, m_tags[slot], &val[slot]) ? 1 : 0;
+		v = val[slot];
+		return have[slot] > 0;
+	};
+
+	bool acc = true;
+	for (size_t pc = 0; pc < prog.size(); ++pc) {
+		auto &in = prog[pc];
+		switch (in.op) {
+		case opc::cst:
+			acc = in.arg != 0;
+			break;
+		case opc::lnot:
+			acc = !acc;
+			break;
+		case opc::jf:
+			if (!acc)
+				pc = in.arg - 1;
+			break;
+		case opc::jt:
+			if (acc)
+				pc = in.arg - 1;
+			break;
+		case opc::sql: {
+			auto stm = gx_sql_prep(db, m_sql[in.arg].c_str());
+			if (stm == nullptr) {
+				acc = false;
+				break;
+			}
+			stm.bind_int64(1, mid);
+			acc = stm.step() == SQLITE_ROW && stm.col_int64(0) != 0;
+			break;
+		}
+		case opc::interp:
+			acc = cu_eval_msg_restriction(db, cpid, mid, m_leaves[in.arg].res);
+			break;
+		case opc::leaf: {
+			auto &lf = m_leaves[in.arg];
+			auto r = lf.res;
+			void *v = nullptr, *v2 = nullptr;
+			switch (r->rt) {
+			case RES_CONTENT:
+				acc = fetch(lf.slot, v) && r->cont->eval(v);
+				break;
+			case RES_PROPERTY:
+				if (!fetch(lf.slot, v))
+					acc = false;
+				else if (v != nullptr && r->prop->proptag == PR_ANR)
+					acc = strcasestr(static_cast<char *>(v),
+					      static_cast<char *>(r->prop->propval.pvalue)) != nullptr;
+				else
+					acc = r->prop->eval(v);
+				break;
+			case RES_PROPCOMPARE:
+				acc = fetch(lf.slot, v) && fetch(lf.slot2, v2) &&
+				      propval_compare_relop_nullok(r->pcmp->relop,
+				      PROP_TYPE(r->pcmp->proptag1), v, v2);
+				break;
+			case RES_BITMASK:
+				acc = fetch(lf.slot, v) && r->bm->eval(v);
+				break;
+			case RES_SIZE:
+				acc = fetch(lf.slot, v) && r->size->eval(v);
+				break;
+			case RES_EXIST:
+				acc = fetch(lf.slot, v) && v != nullptr;
+				break;
+			default:
+				acc = false;
+				break;
+			}
+			break;
+		}
+		}
+	}
+	return acc;
+}
+
+bool cu_eval_msg_plan(const res_plan *plan, sqlite3 *db, cpid_t cpid,
+    uint64_t mid, const RESTRICTION *r)
+{
+	if (plan != nullptr)
+		return plan->eval(db, cpid, mid);
+	return cu_eval_msg_restriction(db, cpid, mid, r);
+}
@@ -363,7 +363,7 @@ unsigned int format_as(proptag_t x) { return x; }
 }
 #endif
 
-static bool purg_discover_cids(sqlite3 *db, const char *dir,
+bool purg_discover_cids(sqlite3 *db, const char *dir,
     std::vector<std::string> &used)
 {
 	used.clear();
@@ -626,6 +626,41 @@ BOOL exmdb_server::imapfile_read(const char *dir, const std::string &type,
 	return TRUE;
 }
 
+/**
+ * Read [@offset, @offset+@length) of an imapfile, or less at the end of the
+ * file or when @length exceeds IMAPFILE_RANGE_MAX. @total is set to the file
+ * size, so a zero @length just queries that.
+ */
+BOOL exmdb_server::imapfile_read_range(const char *dir, const std::string &type,
+    const std::string &mid, uint64_t offset, uint32_t length,
+    std::string *data, uint64_t *total) try
+{
+	static constexpr uint32_t IMAPFILE_RANGE_MAX = 4U << 20;
+	if (!imapfile_type_ok(type) || mid.find('/') != mid.npos)
+		return false;
+	wrapfd fd(open((dir + "/"s + type + "/" + mid).c_str(), O_RDONLY));
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) < 0 || !S_ISREG(sb.st_mode))
+		return false;
+	*total = sb.st_size;
+	data->clear();
+	if (offset >= *total)
+		return TRUE;
+	length = std::min(length, IMAPFILE_RANGE_MAX);
+	data->resize(std::min(static_cast<uint64_t>(length), *total - offset));
+	auto ret = gx_pread_full(fd.get(), data->data(), data->size(), offset);
+	if (ret < 0) {
+		mlog(LV_ERR, "E-2966: read %s/%s/%s: %s", dir, type.c_str(),
+			mid.c_str(), strerror(errno));
+		return false;
+	}
+	data->resize(ret);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2967: ENOMEM");
+	return false;
+}
+
 BOOL exmdb_server::imapfile_write(const char *dir, const std::string &type,
     const std::string &mid, const std::string &data)
 {
@@ -10,7 +10,9 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <list>
+#include <string>
 #include <unistd.h>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <fmt/core.h>
@@ -82,6 +84,158 @@ static BOOL table_sum_table_count(db_conn_ptr &pdb,
 	return TRUE;
 }
 
+/**
+ * Create the row table t<sql_id> in tables.sqlite3. The inst_id index is
+ * created separately (table_create_ct_instidx) since its uniqueness depends
+ * on whether an MVI column is part of the sort order.
+ */
+static BOOL table_create_ct(db_conn_ptr &pdb, uint32_t sql_id, bool b_categ)
+{
+	char sql_string[1024];
+
+	snprintf(sql_string, std::size(sql_string), "CREATE TABLE t%u "
+		"(row_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+		"idx INTEGER UNIQUE DEFAULT NULL, "
+		"prev_id INTEGER UNIQUE DEFAULT NULL, "
+		"inst_id INTEGER NOT NULL, "
+		"row_type INTEGER NOT NULL, "
+		"row_stat INTEGER DEFAULT NULL, "	/* expanded(1) or collapsed(0) */
+		"parent_id INTEGER DEFAULT NULL, "
+		"depth INTEGER NOT NULL, "
+		"count INTEGER DEFAULT NULL, "
+		"unread INTEGER DEFAULT NULL, "
+		"inst_num INTEGER NOT NULL, "
+		"value NONE DEFAULT NULL, "
+		"extremum NONE DEFAULT NULL)",		/* read(unread) for message row */
+		sql_id);
+	if (pdb->eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	if (!b_categ)
+		return TRUE;
+	snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_1 ON "
+		"t%u (inst_id, inst_num)", sql_id, sql_id);
+	if (pdb->eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_2 ON"
+		" t%u (parent_id)", sql_id, sql_id);
+	if (pdb->eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_3 ON t%u"
+		" (parent_id, value)", sql_id, sql_id);
+	if (pdb->eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	return TRUE;
+}
+
+static BOOL table_create_ct_instidx(db_conn_ptr &pdb, uint32_t sql_id,
+    bool b_unique)
+{
+	char sql_string[128];
+
+	snprintf(sql_string, std::size(sql_string), "CREATE %sINDEX t%u_4 "
+	         "ON t%u (inst_id)", b_unique ? "UNIQUE " : "", sql_id, sql_id);
+	return pdb->eph_exec(sql_string) == SQLITE_OK ? TRUE : false;
+}
+
+/**
+ * Serialized form of restriction and sort order, used to recognize
+ * content tables that would produce identical rows.
+ */
+static bool table_ct_key(const RESTRICTION *res, const SORTORDER_SET *sorts,
+    std::string &key)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, 0, 0) ||
+	    ep.p_uint8(res != nullptr) != EXT_ERR_SUCCESS ||
+	    (res != nullptr && ep.p_restriction(*res) != EXT_ERR_SUCCESS) ||
+	    ep.p_uint8(sorts != nullptr) != EXT_ERR_SUCCESS ||
+	    (sorts != nullptr && ep.p_sortorder_set(*sorts) != EXT_ERR_SUCCESS))
+		return false;
+	key.assign(ep.m_cdata, ep.m_offset);
+	return true;
+}
+
+/**
+ * Look for an already-loaded content table whose rows are exactly what a new
+ * load with these parameters would produce.
+ *
+ * Categorized tables never qualify: expand/collapse (and restore_table_state)
+ * rewrite the row table in place, which must not leak into another view.
+ */
+static const table_node *table_find_twin(const db_base &dbase, cpid_t cpid,
+    uint64_t fid_val, const char *username, uint8_t table_flags, bool b_search,
+    const RESTRICTION *prestriction, const SORTORDER_SET *psorts)
+{
+	if (psorts != nullptr && psorts->ccategories > 0)
+		return nullptr;
+	std::string key, key2;
+	if (!table_ct_key(prestriction, psorts, key))
+		return nullptr;
+	for (const auto &t : dbase.tables.table_list) {
+		if (t.type != table_type::content || t.folder_id != fid_val ||
+		    t.table_flags != table_flags || t.cpid != cpid ||
+		    !!t.b_search != b_search || t.b_hint)
+			continue;
+		if (!exmdb_server::is_private() &&
+		    (t.username == nullptr || username == nullptr ||
+		    strcmp(t.username, username) != 0))
+			continue;
+		if (!table_ct_key(t.prestriction, t.psorts, key2) || key != key2)
+			continue;
+		return &t;
+	}
+	return nullptr;
+}
+
+/**
+ * Register a new content table that reads its rows from @twin's row table
+ * instead of materializing them again.
+ */
+static BOOL table_share_content_table(db_conn_ptr &pdb, db_base &dbase,
+    const table_node &twin, uint32_t *ptable_id, uint32_t *prow_count)
+{
+	std::list<table_node> holder;
+	auto ptnode = &holder.emplace_back();
+	ptnode->table_id = pdb->next_table_id();
+	ptnode->sql_id = twin.sql_id;
+	auto remote_id = exmdb_server::get_remote_id();
+	if (remote_id != nullptr) {
+		ptnode->remote_id = strdup(remote_id);
+		if (ptnode->remote_id == nullptr)
+			return false;
+	}
+	ptnode->type = table_type::content;
+	ptnode->folder_id = twin.folder_id;
+	ptnode->table_flags = twin.table_flags;
+	ptnode->b_search = twin.b_search;
+	ptnode->cpid = twin.cpid;
+	ptnode->instance_tag = twin.instance_tag;
+	ptnode->extremum_tag = twin.extremum_tag;
+	ptnode->header_id = twin.header_id;
+	if (twin.username != nullptr) {
+		ptnode->username = strdup(twin.username);
+		if (ptnode->username == nullptr)
+			return false;
+	}
+	if (twin.prestriction != nullptr) {
+		ptnode->prestriction = twin.prestriction->dup();
+		if (ptnode->prestriction == nullptr)
+			return false;
+		ptnode->plan = res_plan::compile(ptnode->prestriction);
+	}
+	if (twin.psorts != nullptr) {
+		ptnode->psorts = sortorder_set_dup(twin.psorts);
+		if (ptnode->psorts == nullptr)
+			return false;
+	}
+	dbase.tables.table_list.splice(dbase.tables.table_list.end(), std::move(holder));
+	dbase.tables.ct_dirty = true;
+	*ptable_id = ptnode->table_id;
+	*prow_count = 0;
+	table_sum_table_count(pdb, ptnode->sql_id, prow_count);
+	return TRUE;
+}
+
 /**
  * @username:   Used for retrieving public store readstates
  */
@@ -235,7 +389,7 @@ BOOL exmdb_server::load_hierarchy_table(const char *dir, uint64_t folder_id,
 
 	std::list<table_node> holder;
 	auto ptnode = &holder.emplace_back();
-	ptnode->table_id = table_id;
+	ptnode->table_id = ptnode->sql_id = table_id;
 	auto remote_id = exmdb_server::get_remote_id();
 	if (NULL != remote_id) {
 		ptnode->remote_id = strdup(remote_id);
@@ -258,7 +412,7 @@ BOOL exmdb_server::load_hierarchy_table(const char *dir, uint64_t folder_id,
 			return FALSE;
 	}
 	snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (folder_id,"
-					" depth) VALUES (?, ?)", ptnode->table_id);
+					" depth) VALUES (?, ?)", ptnode->sql_id);
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -579,47 +733,31 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		b_search = pstmt.col_int64(0) != 0;
 	}
 	auto cl_1 = make_scope_exit([]() { exmdb_server::set_public_username(nullptr); });
+	if (*ptable_id == 0) {
+		auto twin = table_find_twin(*dbase, cpid, fid_val, username,
+		            table_flags, b_search, prestriction, psorts);
+		if (twin != nullptr)
+			return table_share_content_table(pdb, *dbase, *twin,
+			       ptable_id, prow_count);
+	}
+	/*
+	 * A reload keeps the client-visible id but must not write into rows
+	 * that other views may still be reading from.
+	 */
 	uint32_t table_id = *ptable_id != 0 ? *ptable_id : pdb->next_table_id();
+	uint32_t sql_id = *ptable_id != 0 ? pdb->next_table_id() : table_id;
 	auto table_transact = gx_sql_begin(pdb->m_sqlite_eph, txn_mode::write);
 	if (!table_transact)
 		return false;
-	snprintf(sql_string, std::size(sql_string), "CREATE TABLE t%u "
-		"(row_id INTEGER PRIMARY KEY AUTOINCREMENT, "
-		"idx INTEGER UNIQUE DEFAULT NULL, "
-		"prev_id INTEGER UNIQUE DEFAULT NULL, "
-		"inst_id INTEGER NOT NULL, "
-		"row_type INTEGER NOT NULL, "
-		"row_stat INTEGER DEFAULT NULL, "	/* expanded(1) or collapsed(0) */
-		"parent_id INTEGER DEFAULT NULL, "
-		"depth INTEGER NOT NULL, "
-		"count INTEGER DEFAULT NULL, "
-		"unread INTEGER DEFAULT NULL, "
-		"inst_num INTEGER NOT NULL, "
-		"value NONE DEFAULT NULL, "
-		"extremum NONE DEFAULT NULL)",		/* read(unread) for message row */
-		table_id);
-	if (pdb->eph_exec(sql_string) != SQLITE_OK)
+	if (!table_create_ct(pdb, sql_id, psorts != nullptr && psorts->ccategories > 0))
 		return FALSE;
-	if (NULL != psorts && psorts->ccategories > 0) {
-		snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_1 ON "
-			"t%u (inst_id, inst_num)", table_id, table_id);
-		if (pdb->eph_exec(sql_string) != SQLITE_OK)
-			return FALSE;
-		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_2 ON"
-			" t%u (parent_id)", table_id, table_id);
-		if (pdb->eph_exec(sql_string) != SQLITE_OK)
-			return FALSE;
-		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_3 ON t%u"
-			" (parent_id, value)", table_id, table_id);
-		if (pdb->eph_exec(sql_string) != SQLITE_OK)
-			return FALSE;
-	}
 
 	std::list<table_node> holder;
 	auto ptnode = &holder.emplace_back();
 	xstmt pstmt, pstmt1;
 	sqlite3 *psqlite = nullptr;
 	ptnode->table_id = table_id;
+	ptnode->sql_id = sql_id;
 	auto remote_id = exmdb_server::get_remote_id();
 	auto cl_0 = make_scope_exit([&]() {
 		pstmt.finalize();
@@ -646,6 +784,7 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		ptnode->prestriction = prestriction->dup();
 		if (ptnode->prestriction == nullptr)
 			return false;
+		ptnode->plan = res_plan::compile(ptnode->prestriction);
 	}
 	xtransaction psort_transact;
 	if (NULL != psorts) {
@@ -734,13 +873,7 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 			if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
 				return false;
 		}
-		if (ptnode->instance_tag == 0)
-			snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_4 "
-					"ON t%u (inst_id)", table_id, table_id);
-		else
-			snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_4 "
-				"ON t%u (inst_id)", table_id, table_id);
-		if (pdb->eph_exec(sql_string) != SQLITE_OK)
+		if (!table_create_ct_instidx(pdb, sql_id, ptnode->instance_tag == 0))
 			return false;
 		sql_len = snprintf(sql_string, std::size(sql_string), "INSERT INTO stbl VALUES (?");
 		for (size_t i = 0; i < tag_count; ++i)
@@ -754,7 +887,7 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 	} else {
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (inst_id,"
 			" prev_id, row_type, depth, inst_num, idx) VALUES "
-			"(?, ?, %u, 0, 0, ?)", table_id, CONTENT_ROW_MESSAGE);
+			"(?, ?, %u, 0, 0, ?)", sql_id, CONTENT_ROW_MESSAGE);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return false;
@@ -834,12 +967,39 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		            " AND is_associated=0 AND is_deleted=%u",
 		            !!(table_flags & TABLE_FLAG_SOFTDELETES));
 	}
-	pstmt = pdb->prep(sql_string);
+	/* Pushed-down part of the restriction narrows the enumeration itself */
+	auto plan = conv_id == nullptr ? ptnode->plan.get() : nullptr;
+	bool prefiltered = plan != nullptr && !plan->prefilter().empty();
+	std::string enum_query = prefiltered ? "SELECT x.message_id FROM (" +
+	                         std::string(sql_string) + ") AS x WHERE " +
+	                         plan->prefilter() : sql_string;
+	/* Sort keys available from typed columns alongside the message_id */
+	hot_src hot_cols[std::size(tmp_proptags)]{};
+	bool use_hot = false;
+	if (psorts != nullptr) {
+		bool have_table = pdb->has_hotprops();
+		for (size_t i = 0; i < tag_count; ++i) {
+			if (tmp_proptags[i] == ptnode->instance_tag)
+				continue;
+			hot_cols[i] = hotprops_source(tmp_proptags[i], have_table);
+			if (hot_cols[i] != hot_src::none)
+				use_hot = true;
+		}
+		if (use_hot)
+			enum_query = hotprops_wrap(enum_query, have_table);
+	}
+	pstmt = pdb->prep(enum_query.c_str());
 	if (pstmt == nullptr)
 		return false;
 	uint64_t last_row_id = 0;
+	/* Full-text prefilter; candidates still undergo exact evaluation */
+	std::unordered_set<uint64_t> fts_cand;
+	bool use_fts = conv_id == nullptr &&
+	               pdb->fts_candidates(prestriction, fts_cand);
 	while (pstmt.step() == SQLITE_ROW) {
 		uint64_t mid_val = pstmt.col_uint64(0);
+		if (use_fts && fts_cand.count(mid_val) == 0)
+			continue;
 		if (conv_id != nullptr) {
 			uint64_t parent_fid = 0;
 			if (common_util_check_message_associated(pdb->psqlite, mid_val))
@@ -849,6 +1009,9 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 				return false;
 			if (parent_fid == 0)
 				continue;
+		} else if (plan != nullptr) {
+			if (!plan->eval(pdb->psqlite, cpid, mid_val, prefiltered))
+				continue;
 		} else if (prestriction != nullptr &&
 		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction)) {
 			continue;
@@ -859,6 +1022,9 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 				auto tmp_proptag = tmp_proptags[i];
 				if (tmp_proptag == ptnode->instance_tag)
 					continue;
+				if (hot_cols[i] != hot_src::none &&
+				    hotprops_bind(pstmt, pstmt1, i + 2, hot_cols[i]))
+					continue;
 				if (!cu_get_property(MAPI_MESSAGE, mid_val,
 				    cpid, pdb->psqlite, tmp_proptag, &pvalue))
 					return false;
@@ -948,12 +1114,12 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u "
 			    "(inst_id, row_type, row_stat, parent_id, depth, "
 			    "count, inst_num, value, extremum, prev_id) VALUES"
-			    " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", table_id);
+			    " (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", sql_id);
 		pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			return false;
 		snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-		        " unread=? WHERE row_id=?", table_id);
+		        " unread=? WHERE row_id=?", sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return false;
@@ -972,12 +1138,12 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		if (psorts->ccategories > 0) {
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id,"
 			        " row_type, row_stat, depth, prev_id FROM"
-			        " t%u ORDER BY row_id", table_id);
+			        " t%u ORDER BY row_id", sql_id);
 			pstmt = pdb->eph_prep(sql_string);
 			if (pstmt == nullptr)
 				return false;
 			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-			        "idx=? WHERE row_id=?", table_id);
+			        "idx=? WHERE row_id=?", sql_id);
 			pstmt1 = pdb->eph_prep(sql_string);
 			if (pstmt1 == nullptr)
 				return false;
@@ -1008,7 +1174,7 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 			pstmt.finalize();
 			pstmt1.finalize();
 		} else {
-			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=row_id", table_id);
+			snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=row_id", sql_id);
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				return false;
 		}
@@ -1017,10 +1183,11 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 	if (table_transact.commit() != SQLITE_OK)
 		return false;
 	dbase->tables.table_list.splice(dbase->tables.table_list.end(), std::move(holder));
+	dbase->tables.ct_dirty = true;
 	if (*ptable_id == 0)
 		*ptable_id = table_id;
 	*prow_count = 0;
-	table_sum_table_count(pdb, table_id, prow_count); 
+	table_sum_table_count(pdb, sql_id, prow_count);
 	return TRUE;
 } catch (const std::bad_alloc &) {
 	return FALSE;
@@ -1060,7 +1227,7 @@ BOOL exmdb_server::load_content_table(const char *dir, cpid_t cpid,
 	       table_flags, prestriction, psorts, ptable_id, prow_count);
 }
 
-BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id)
+BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id) try
 {
 	BOOL b_result;
 	uint32_t row_count;
@@ -1081,10 +1248,9 @@ BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id)
 
 	std::list<table_node> holder;
 	holder.splice(holder.end(), table_list, iter);
+	dbase->tables.ct_dirty = true;
 	auto ptnode = &holder.back();
-	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", table_id);
-	if (pdb->eph_exec(sql_string) != SQLITE_OK)
-		/* ignore; the id won't be reused anyway */;
+	auto old_sql_id = ptnode->sql_id;
 	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
 	if (!sql_transact)
 		return false;
@@ -1092,9 +1258,32 @@ BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id)
 			ptnode->folder_id, ptnode->username, ptnode->table_flags,
 			ptnode->prestriction, ptnode->psorts, &table_id,
 			&row_count);
+	/* Views which were sharing the old rows move on to the new ones. */
+	auto pnew = b_result && table_id != 0 ? dbase->find_table(table_id) : nullptr;
+	std::vector<uint32_t> sharers;
+	for (auto &t : table_list) {
+		if (t.type != table_type::content || t.sql_id != old_sql_id ||
+		    &t == pnew)
+			continue;
+		if (pnew != nullptr) {
+			t.sql_id = pnew->sql_id;
+			t.header_id = pnew->header_id;
+		}
+		sharers.push_back(t.table_id);
+	}
+	if (pnew != nullptr || sharers.empty()) {
+		snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", old_sql_id);
+		if (pdb->eph_exec(sql_string) != SQLITE_OK)
+			/* ignore; the id won't be reused anyway */;
+	}
 	pdb->notify_cttbl_reload(table_id, *dbase, notifq);
+	for (auto id : sharers)
+		pdb->notify_cttbl_reload(id, *dbase, notifq);
 	dg_notify(std::move(notifq));
 	return b_result;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2906: ENOMEM");
+	return false;
 }
 
 static BOOL table_load_permissions(sqlite3 *psqlite,
@@ -1167,7 +1356,7 @@ BOOL exmdb_server::load_permission_table(const char *dir, uint64_t folder_id,
 
 	std::list<table_node> holder;
 	auto ptnode = &holder.emplace_back();
-	ptnode->table_id = table_id;
+	ptnode->table_id = ptnode->sql_id = table_id;
 	auto remote_id = exmdb_server::get_remote_id();
 	if (NULL != remote_id) {
 		ptnode->remote_id = strdup(remote_id);
@@ -1178,7 +1367,7 @@ BOOL exmdb_server::load_permission_table(const char *dir, uint64_t folder_id,
 	ptnode->folder_id = fid_val;
 	ptnode->table_flags = table_flags;
 	snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u "
-		"(member_id) VALUES (?)", ptnode->table_id);
+		"(member_id) VALUES (?)", ptnode->sql_id);
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -1335,7 +1524,7 @@ BOOL exmdb_server::load_rule_table(const char *dir, uint64_t folder_id,
 
 	std::list<table_node> holder;
 	auto ptnode = &holder.emplace_back();
-	ptnode->table_id = table_id;
+	ptnode->table_id = ptnode->sql_id = table_id;
 	auto remote_id = exmdb_server::get_remote_id();
 	if (NULL != remote_id) {
 		ptnode->remote_id = strdup(remote_id);
@@ -1350,7 +1539,7 @@ BOOL exmdb_server::load_rule_table(const char *dir, uint64_t folder_id,
 			return FALSE;
 	}
 	snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u "
-		"(rule_id) VALUES (?)", ptnode->table_id);
+		"(rule_id) VALUES (?)", ptnode->sql_id);
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -1389,8 +1578,15 @@ BOOL exmdb_server::unload_table(const char *dir, uint32_t table_id)
 
 	std::list<table_node> holder;
 	holder.splice(holder.end(), table_list, iter);
+	dbase->tables.ct_dirty = true;
+	auto &tnode = holder.back();
+	/* Rows stay while another view still reads them. */
+	if (tnode.type == table_type::content &&
+	    dbase->sql_table_users(tnode.sql_id) > 0)
+		return TRUE;
+	auto sql_id = tnode.sql_id;
 	dbase.reset();
-	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", table_id);
+	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", sql_id);
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
 		/* ignore - table_id is not going to get reused anyway */;
 	return TRUE;
@@ -1403,7 +1599,14 @@ BOOL exmdb_server::sum_table(const char *dir,
 	if (!pdb)
 		return FALSE;
 	/* Only one SQL operation, no transaction needed. */
-	return table_sum_table_count(pdb, table_id, prows);
+	auto sql_id = table_id;
+	{
+		auto dbase = pdb->lock_base_rd();
+		auto ptnode = dbase->find_table(table_id);
+		if (ptnode != nullptr)
+			sql_id = ptnode->sql_id;
+	}
+	return table_sum_table_count(pdb, sql_id, prows);
 }
 
 static BOOL table_column_content_tmptbl(
@@ -1563,6 +1766,106 @@ const table_node *db_base::find_table(uint32_t table_id) const
 	return nullptr;
 }
 
+table_node *db_base::find_table(uint32_t table_id)
+{
+	for (auto &t : tables.table_list)
+		if (t.table_id == table_id)
+			return &t;
+	return nullptr;
+}
+
+/**
+ * Of all content tables reading from the same row table, the first one is
+ * the one whose notification path maintains those rows.
+ */
+bool db_base::is_primary_table(const table_node &node) const
+{
+	for (const auto &t : tables.table_list)
+		if (t.type == table_type::content && t.sql_id == node.sql_id)
+			return &t == &node;
+	return false;
+}
+
+/**
+ * Collect the primary content tables of @folder_id into @spare by walking
+ * table_list, without restriction slots. Used when the registry cannot be
+ * built.
+ */
+static const ct_bucket *content_tables_scan(const db_base &dbase,
+    uint64_t folder_id, bool fai, ct_bucket &spare) try
+{
+	spare.tables.clear();
+	spare.slots.clear();
+	spare.slot_keys.clear();
+	for (auto &t : dbase.tables.table_list)
+		if (t.type == table_type::content && t.folder_id == folder_id &&
+		    !!(t.table_flags & TABLE_FLAG_ASSOCIATED) == fai &&
+		    dbase.is_primary_table(t))
+			spare.tables.push_back({const_cast<table_node *>(&t), ct_bucket::NO_SLOT});
+	return &spare;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2980: ENOMEM; content tables of folder %llu not updated",
+	        LLU{folder_id});
+	return nullptr;
+}
+
+/**
+ * Look up the primary content tables of @folder_id, rebuilding the registry
+ * first if table_list has changed since. Should the rebuild run out of
+ * memory, the tables are gathered into @spare by a full scan instead.
+ * Returns nullptr if there are no such tables (or not even that worked).
+ */
+const ct_bucket *db_base::content_tables(uint64_t folder_id, bool fai,
+    ct_bucket &spare) try
+{
+	if (tables.ct_dirty) {
+		for (auto &m : tables.ct_index)
+			m.clear();
+		std::unordered_set<uint32_t> seen;
+		std::string key;
+		for (auto &t : tables.table_list) {
+			/* Rows of shared tables are maintained through the first user. */
+			if (t.type != table_type::content || !seen.insert(t.sql_id).second)
+				continue;
+			auto &b = tables.ct_index[!!(t.table_flags & TABLE_FLAG_ASSOCIATED)][t.folder_id];
+			auto slot = ct_bucket::NO_SLOT;
+			if (t.prestriction != nullptr) {
+				/* An unserializable restriction gets a slot of its own (empty key). */
+				if (table_ct_key(t.prestriction, nullptr, key))
+					key += std::to_string(static_cast<unsigned int>(t.cpid));
+				else
+					key.clear();
+				auto it = key.empty() ? b.slot_keys.end() :
+				          std::find(b.slot_keys.begin(), b.slot_keys.end(), key);
+				if (it != b.slot_keys.end()) {
+					slot = it - b.slot_keys.begin();
+				} else {
+					slot = b.slots.size();
+					b.slots.push_back(&t);
+					b.slot_keys.push_back(key);
+				}
+			}
+			b.tables.push_back({&t, slot});
+		}
+		tables.ct_dirty = false;
+	}
+	auto &m = tables.ct_index[fai];
+	auto it = m.find(folder_id);
+	return it != m.end() ? &it->second : nullptr;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2920: ENOMEM");
+	tables.ct_dirty = true;
+	return content_tables_scan(*this, folder_id, fai, spare);
+}
+
+size_t db_base::sql_table_users(uint32_t sql_id) const
+{
+	return std::count_if(tables.table_list.cbegin(), tables.table_list.cend(),
+	       [&](const table_node &t) {
+	       	return t.type == table_type::content && t.sql_id == sql_id;
+	       });
+}
+
 static BOOL query_hierarchy(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
     const PROPTAG_ARRAY *pproptags, uint32_t start_pos, int32_t row_needed,
     TARRAY_SET *pset)
@@ -1652,7 +1955,7 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 		end_pos = start_pos + row_needed;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
 			" WHERE idx>=%u AND idx<%u ORDER BY idx ASC",
-			table_id, start_pos + 1, end_pos + 1);
+			ptnode->sql_id, start_pos + 1, end_pos + 1);
 		pset->pparray = cu_alloc<TPROPVAL_ARRAY *>(row_needed);
 	} else {
 		end_pos = start_pos + row_needed;
@@ -1660,7 +1963,7 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 			end_pos = 0;
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
 			" WHERE idx>=%u AND idx<%u ORDER BY idx DESC",
-			table_id, end_pos + 1, start_pos + 1);
+			ptnode->sql_id, end_pos + 1, start_pos + 1);
 		pset->pparray = cu_alloc<TPROPVAL_ARRAY *>(start_pos - end_pos);
 	}
 	if (pset->pparray == nullptr)
@@ -1671,14 +1974,14 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 	xstmt pstmt1, pstmt2;
 	if (NULL != ptnode->psorts && ptnode->psorts->ccategories > 0) {
 		snprintf(sql_string, std::size(sql_string), "SELECT parent_id FROM"
-			" t%u WHERE row_id=?", ptnode->table_id);
+			" t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return FALSE;
 	}
 	if (ptnode->psorts != nullptr) {
 		snprintf(sql_string, std::size(sql_string), "SELECT value FROM"
-			" t%u WHERE row_id=?", ptnode->table_id);
+			" t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt2 = pdb->eph_prep(sql_string);
 		if (pstmt2 == nullptr)
 			return FALSE;
@@ -2140,11 +2443,11 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 
 	if (b_forward)
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
-		         " WHERE idx>=%u ORDER BY idx ASC", table_id,
+		         " WHERE idx>=%u ORDER BY idx ASC", ptnode->sql_id,
 		         start_pos + 1);
 	else
 		snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
-		         " WHERE idx<=%u ORDER BY idx DESC", table_id,
+		         " WHERE idx<=%u ORDER BY idx DESC", ptnode->sql_id,
 		         start_pos + 1);
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
@@ -2152,12 +2455,12 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 	xstmt pstmt1, pstmt2;
 	if (NULL != ptnode->psorts && ptnode->psorts->ccategories > 0) {
 		snprintf(sql_string, std::size(sql_string), "SELECT parent_id FROM"
-		         " t%u WHERE row_id=?", ptnode->table_id);
+		         " t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return FALSE;
 		snprintf(sql_string, std::size(sql_string), "SELECT value FROM"
-		         " t%u WHERE row_id=?", ptnode->table_id);
+		         " t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt2 = pdb->eph_prep(sql_string);
 		if (pstmt2 == nullptr)
 			return FALSE;
@@ -2351,7 +2654,7 @@ BOOL exmdb_server::locate_table(const char *dir,
 			inst_id |= rop_util_get_gc_value(inst_id);
 		}
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u "
-		          "WHERE folder_id=%llu", ptnode->table_id, LLU{inst_id});
+		          "WHERE folder_id=%llu", ptnode->sql_id, LLU{inst_id});
 		break;
 	case table_type::content:
 		inst_id = rop_util_get_replid(inst_id) == 1 ?
@@ -2359,16 +2662,16 @@ BOOL exmdb_server::locate_table(const char *dir,
 		          rop_util_get_gc_value(inst_id) | 0x100000000000000ULL;
 		snprintf(sql_string, std::size(sql_string), "SELECT idx, row_type "
 				"FROM t%u WHERE inst_id=%llu AND inst_num=%u",
-				ptnode->table_id, LLU{inst_id}, inst_num);
+				ptnode->sql_id, LLU{inst_id}, inst_num);
 		break;
 	case table_type::permission:
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u "
-			"WHERE member_id=%llu", ptnode->table_id, LLU{inst_id});
+			"WHERE member_id=%llu", ptnode->sql_id, LLU{inst_id});
 		break;
 	case table_type::rule:
 		inst_id = rop_util_get_gc_value(inst_id);
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u "
-		          "WHERE rule_id=%llu", ptnode->table_id, LLU{inst_id});
+		          "WHERE rule_id=%llu", ptnode->sql_id, LLU{inst_id});
 		break;
 	default:
 		return FALSE;
@@ -2465,7 +2768,7 @@ static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
 		  rop_util_get_gc_value(inst_id) | 0x100000000000000ULL;
 	snprintf(sql_string, std::size(sql_string), "SELECT * FROM t%u"
 	         " WHERE inst_id=%llu AND inst_num=%u",
-	         table_id, LLU{inst_id}, inst_num);
+	         ptnode->sql_id, LLU{inst_id}, inst_num);
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -2477,12 +2780,12 @@ static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
 	xstmt pstmt1, pstmt2;
 	if (NULL != ptnode->psorts && ptnode->psorts->ccategories > 0) {
 		snprintf(sql_string, std::size(sql_string), "SELECT parent_id FROM"
-		         " t%u WHERE row_id=?", ptnode->table_id);
+		         " t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return FALSE;
 		snprintf(sql_string, std::size(sql_string), "SELECT value FROM"
-		         " t%u WHERE row_id=?", ptnode->table_id);
+		         " t%u WHERE row_id=?", ptnode->sql_id);
 		pstmt2 = pdb->eph_prep(sql_string);
 		if (pstmt2 == nullptr)
 			return FALSE;
@@ -2580,20 +2883,20 @@ BOOL exmdb_server::mark_table(const char *dir,
 	switch (ptnode->type) {
 	case table_type::hierarchy:
 		snprintf(sql_string, std::size(sql_string), "SELECT folder_id FROM t%u"
-				" WHERE idx=%u", ptnode->table_id, position + 1);
+				" WHERE idx=%u", ptnode->sql_id, position + 1);
 		break;
 	case table_type::content:
 		snprintf(sql_string, std::size(sql_string), "SELECT inst_id,"
 			" inst_num, row_type FROM t%u WHERE idx=%u",
-			ptnode->table_id, position + 1);
+			ptnode->sql_id, position + 1);
 		break;
 	case table_type::permission:
 		snprintf(sql_string, std::size(sql_string), "SELECT member_id FROM t%u "
-			"WHERE idx=%u", ptnode->table_id, position + 1);
+			"WHERE idx=%u", ptnode->sql_id, position + 1);
 		break;
 	case table_type::rule:
 		snprintf(sql_string, std::size(sql_string), "SELECT rule_id FROM t%u "
-			"WHERE idx=%u", ptnode->table_id, position + 1);
+			"WHERE idx=%u", ptnode->sql_id, position + 1);
 		break;
 	default:
 		return FALSE;
@@ -2644,7 +2947,7 @@ BOOL exmdb_server::get_table_all_proptags(const char *dir,
 	case table_type::hierarchy: {
 		std::vector<uint32_t> tags;
 		snprintf(sql_string, std::size(sql_string), "SELECT "
-			"folder_id FROM t%u", ptnode->table_id);
+			"folder_id FROM t%u", ptnode->sql_id);
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			return FALSE;
@@ -2674,7 +2977,7 @@ BOOL exmdb_server::get_table_all_proptags(const char *dir,
 	case table_type::content: {
 		std::vector<uint32_t> tags;
 		snprintf(sql_string, std::size(sql_string), "SELECT inst_id,"
-				" row_type FROM t%u", ptnode->table_id);
+				" row_type FROM t%u", ptnode->sql_id);
 		auto pstmt = pdb->eph_prep(sql_string);
 		if (pstmt == nullptr)
 			return FALSE;
@@ -2846,7 +3149,7 @@ BOOL exmdb_server::expand_table(const char *dir,
 	inst_id = rop_util_get_gc_value(inst_id) | 0x100000000000000ULL;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_type, "
 			"row_stat, depth, idx FROM t%u WHERE inst_id=%llu"
-			" AND inst_num=0", ptnode->table_id, LLU{inst_id});
+			" AND inst_num=0", ptnode->sql_id, LLU{inst_id});
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -2866,7 +3169,7 @@ BOOL exmdb_server::expand_table(const char *dir,
 	*pposition = idx - 1;
 	pstmt.finalize();
 	snprintf(sql_string, std::size(sql_string), "SELECT count(*) FROM"
-			" t%u WHERE parent_id=?", ptnode->table_id);
+			" t%u WHERE parent_id=?", ptnode->sql_id);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -2877,7 +3180,7 @@ BOOL exmdb_server::expand_table(const char *dir,
 		*prow_count = sqlite3_column_int64(pstmt, 0);
 	} else {
 		snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_stat "
-				"FROM t%u WHERE parent_id=?", ptnode->table_id);
+				"FROM t%u WHERE parent_id=?", ptnode->sql_id);
 		auto pstmt1 = pdb->eph_prep(sql_string);
 		if (pstmt1 == nullptr)
 			return FALSE;
@@ -2888,19 +3191,19 @@ BOOL exmdb_server::expand_table(const char *dir,
 	}
 	pstmt.finalize();
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET row_stat=1 "
-	        "WHERE row_id=%llu", ptnode->table_id, LLU{row_id});
+	        "WHERE row_id=%llu", ptnode->sql_id, LLU{row_id});
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
 		return FALSE;
 	if (*prow_count == 0)
 		return TRUE;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id "
 		"FROM t%u WHERE idx>%u ORDER BY idx DESC",
-		ptnode->table_id, idx);
+		ptnode->sql_id, idx);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=idx+%u"
-			" WHERE row_id=?", ptnode->table_id, *prow_count);
+			" WHERE row_id=?", ptnode->sql_id, *prow_count);
 	auto pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
 		return FALSE;
@@ -2914,12 +3217,12 @@ BOOL exmdb_server::expand_table(const char *dir,
 	pstmt.finalize();
 	pstmt1.finalize();
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_stat"
-			" FROM t%u WHERE prev_id=?", ptnode->table_id);
+			" FROM t%u WHERE prev_id=?", ptnode->sql_id);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-		" idx=? WHERE row_id=?", ptnode->table_id);
+		" idx=? WHERE row_id=?", ptnode->sql_id);
 	pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
 		return FALSE;
@@ -2959,7 +3262,7 @@ BOOL exmdb_server::collapse_table(const char *dir,
 		return false;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_type, "
 		"row_stat, depth, idx FROM t%u WHERE inst_id=%llu AND"
-		" inst_num=0", ptnode->table_id, LLU{inst_id});
+		" inst_num=0", ptnode->sql_id, LLU{inst_id});
 	auto pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -2979,19 +3282,19 @@ BOOL exmdb_server::collapse_table(const char *dir,
 	*pposition = idx - 1;
 	pstmt.finalize();
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET row_stat=0 "
-	        "WHERE row_id=%llu", ptnode->table_id, LLU{row_id});
+	        "WHERE row_id=%llu", ptnode->sql_id, LLU{row_id});
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
 		return FALSE;
 	*prow_count = 0;
 	prev_id = row_id;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, "
 			"depth, prev_id FROM t%u WHERE idx>%u "
-			"ORDER BY idx ASC", ptnode->table_id, idx);
+			"ORDER BY idx ASC", ptnode->sql_id, idx);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-		" idx=? WHERE row_id=?", ptnode->table_id);
+		" idx=? WHERE row_id=?", ptnode->sql_id);
 	dbase.reset();
 	auto pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
@@ -3217,7 +3520,7 @@ BOOL exmdb_server::store_table_state(const char *dir,
 	if (!sql_transact_eph)
 		return false;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, inst_id,"
-			" row_stat, depth FROM t%u", ptnode->table_id);
+			" row_stat, depth FROM t%u", ptnode->sql_id);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
@@ -3232,12 +3535,12 @@ BOOL exmdb_server::store_table_state(const char *dir,
 	if (pstmt1 == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "SELECT parent_id FROM"
-			" t%u WHERE row_id=?", ptnode->table_id);
+			" t%u WHERE row_id=?", ptnode->sql_id);
 	auto pstmt2 = pdb->eph_prep(sql_string);
 	if (pstmt2 == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "SELECT value FROM"
-			" t%u WHERE row_id=?", ptnode->table_id);
+			" t%u WHERE row_id=?", ptnode->sql_id);
 	auto stm_sel_vtx = pdb->eph_prep(sql_string);
 	if (stm_sel_vtx == nullptr)
 		return FALSE;
@@ -3389,12 +3692,12 @@ BOOL exmdb_server::restore_table_state(const char *dir,
 	/* reset table into initial state */
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, "
 		"row_stat, depth FROM t%u WHERE row_type=%u",
-		ptnode->table_id, CONTENT_ROW_HEADER);
+		ptnode->sql_id, CONTENT_ROW_HEADER);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-		"row_stat=? WHERE row_id=?", ptnode->table_id);
+		"row_stat=? WHERE row_id=?", ptnode->sql_id);
 	pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
 		return FALSE;
@@ -3426,17 +3729,17 @@ BOOL exmdb_server::restore_table_state(const char *dir,
 	if (pstmt == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id FROM t%u WHERE"
-			" parent_id=? AND value IS NULL", ptnode->table_id);
+			" parent_id=? AND value IS NULL", ptnode->sql_id);
 	pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id FROM t%u WHERE"
-				" parent_id=? AND value=?", ptnode->table_id);
+				" parent_id=? AND value=?", ptnode->sql_id);
 	pstmt2 = pdb->eph_prep(sql_string);
 	if (pstmt2 == nullptr)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET "
-		"row_stat=? WHERE row_id=?", ptnode->table_id);
+		"row_stat=? WHERE row_id=?", ptnode->sql_id);
 	stm_upd_tx = pdb->eph_prep(sql_string);
 	if (stm_upd_tx == nullptr)
 		return FALSE;
@@ -3488,16 +3791,16 @@ BOOL exmdb_server::restore_table_state(const char *dir,
 	stm_upd_tx.finalize();
 	sqlite3_close(psqlite);
 	cl_0.release();
-	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptnode->table_id);
+	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET idx=NULL", ptnode->sql_id);
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
 		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, row_stat"
-			" FROM t%u WHERE prev_id=?", ptnode->table_id);
+			" FROM t%u WHERE prev_id=?", ptnode->sql_id);
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return false;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET"
-		" idx=? WHERE row_id=?", ptnode->table_id);
+		" idx=? WHERE row_id=?", ptnode->sql_id);
 	pstmt1 = pdb->eph_prep(sql_string);
 	if (pstmt1 == nullptr)
 		return false;
@@ -3515,11 +3818,11 @@ BOOL exmdb_server::restore_table_state(const char *dir,
  RESTORE_POSITION:
 	if (message_id != 0)
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u WHERE "
-				"inst_id=%llu AND inst_num=%llu", ptnode->table_id,
+				"inst_id=%llu AND inst_num=%llu", ptnode->sql_id,
 				LLU{message_id}, LLU{inst_num});
 	else
 		snprintf(sql_string, std::size(sql_string), "SELECT idx FROM t%u WHERE"
-		          " row_id=%llu", ptnode->table_id, LLU{row_id1});
+		          " row_id=%llu", ptnode->sql_id, LLU{row_id1});
 	pstmt = pdb->eph_prep(sql_string);
 	if (pstmt == nullptr)
 		return false;
@@ -24,6 +24,7 @@
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <fmt/core.h>
 #include <libHX/ctype_helper.h>
@@ -32,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <vmime/header.hpp>
+#include <vmime/text.hpp>
 #include <gromox/atomic.hpp>
 #include <gromox/database.h>
 #include <gromox/dbop.h>
@@ -67,6 +69,9 @@ enum {
 	CONFIG_ID_USERNAME = 1, /* obsolete */
 };
 
+/* Expunge tombstones kept per folder for QRESYNC */
+static constexpr unsigned int VANISHED_KEEP = 16384;
+
 enum class midb_cond {
 	x_none,	all, answered, deleted, draft, flagged,
 	is_new, old, recent, seen,
@@ -144,7 +149,9 @@ struct IDB_ITEM {
 	NOMOVE(IDB_ITEM);
 
 	sqlite3 *psqlite = nullptr;
+	sqlite3 *psidx = nullptr; /* search index, opened on first use */
 	std::string username;
+	std::string imap_charset; /* from the last P-DTLU */
 	time_t last_time = 0, load_time = 0;
 	uint32_t sub_id = 0;
 	/* client reference count, item can be flushed into file system only count is 0 */
@@ -167,6 +174,7 @@ enum {
 
 unsigned int g_midb_schema_upgrades;
 unsigned int g_midb_cache_interval, g_midb_reload_interval;
+bool g_midb_search_index = true;
 
 static constexpr time_duration DB_LOCK_TIMEOUT = std::chrono::seconds(60);
 static size_t g_table_size;
@@ -234,34 +242,68 @@ static std::unique_ptr<char[]> me_ct_to_utf8(const char *charset,
 	return nullptr;
 }
 
-static uint64_t me_get_digest(sqlite3 *psqlite, const char *mid_string,
-    Json::Value &digest) try
+/**
+ * Obtain the stored (binary) digest of @mid_string, making it from the eml
+ * if there is none yet.
+ */
+static bool me_get_ext(const char *mid_string, std::string &bin) try
 {
 	auto dir = cu_get_maildir();
 	std::string slurp_data;
 	if (exmdb_client::imapfile_read(dir, "ext", mid_string, &slurp_data)) {
-		if (!json_from_str(slurp_data.c_str(), digest))
-			return 0;
-	} else {
-		if (!exmdb_client::imapfile_read(dir, "eml", mid_string, &slurp_data))
-			return 0;
-		MAIL imail;
-		if (!imail.load_from_str(slurp_data.c_str(), slurp_data.size()))
-			return 0;
-		size_t size = 0;
-		if (imail.make_digest(&size, digest) <= 0)
-			return 0;
-		digest["file"] = "";
-		auto djson = json_to_str(digest);
-		if (!exmdb_client::imapfile_write(dir, "ext", mid_string, djson)) {
-			mlog(LV_ERR, "E-1754: imapfile_write %s/ext/%s did not complete",
-				dir, mid_string);
-			return 0;
+		if (mjson_digest_is_binary(slurp_data)) {
+			bin = std::move(slurp_data);
+			return true;
 		}
+		/* Files from before the binary format are converted on use */
+		Json::Value digest;
+		if (!mjson_digest_unpack(slurp_data, digest) ||
+		    !mjson_digest_pack(digest, bin))
+			return false;
+		if (!exmdb_client::imapfile_write(dir, "ext", mid_string, bin))
+			mlog(LV_WARN, "W-2962: imapfile_write %s/ext/%s did not complete",
+				dir, mid_string);
+		return true;
+	}
+	if (!exmdb_client::imapfile_read(dir, "eml", mid_string, &slurp_data))
+		return false;
+	MAIL imail;
+	if (!imail.load_from_str(slurp_data.c_str(), slurp_data.size()))
+		return false;
+	size_t size = 0;
+	if (imail.make_digest(&size, "", bin) <= 0)
+		return false;
+	if (!exmdb_client::imapfile_write(dir, "ext", mid_string, bin)) {
+		mlog(LV_ERR, "E-1754: imapfile_write %s/ext/%s did not complete",
+			dir, mid_string);
+		return false;
 	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2977: ENOMEM");
+	return false;
+}
+
+/* Set up @m from the stored digest @bin of @mid_string */
+static bool me_load_ext(std::string_view bin, const char *mid_string, MJSON &m)
+{
+	if (!m.load_from_digest(bin))
+		return false;
+	m.filename = mid_string;
+	m.path = cu_get_maildir() + "/eml"s;
+	return true;
+}
+
+/* JSON form of the digest plus the message state, for P-DTLU */
+static uint64_t me_get_digest(sqlite3 *psqlite, const char *mid_string,
+    Json::Value &digest) try
+{
+	std::string bin;
+	if (!me_get_ext(mid_string, bin) || !mjson_digest_unpack(bin, digest))
+		return 0;
 	auto pstmt = gx_sql_prep(psqlite, "SELECT uid, recent, read,"
 	             " unsent, flagged, replied, forwarded, deleted,"
-	             " folder_id FROM messages WHERE mid_string=?");
+	             " folder_id, modseq FROM messages WHERE mid_string=?");
 	if (pstmt == nullptr)
 		return 0;
 	sqlite3_bind_text(pstmt, 1, mid_string, -1, SQLITE_STATIC);
@@ -277,6 +319,7 @@ static uint64_t me_get_digest(sqlite3 *psqlite, const char *mid_string,
 	digest["replied"]   = Json::Value::UInt64(pstmt.col_int64(5));
 	digest["forwarded"] = Json::Value::UInt64(pstmt.col_int64(6));
 	digest["deleted"]   = Json::Value::UInt64(pstmt.col_int64(7));
+	digest["modseq"]    = Json::Value::UInt64(pstmt.col_uint64(9));
 	return folder_id;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1139: ENOMEM");
@@ -436,6 +479,449 @@ static bool me_ct_search_head(const char *charset, const char *mid_string,
 	return false;
 }
 
+/*
+ * Search index (exmdb/midb_fts.sqlite3)
+ *
+ * Holds, per mid_string, the decoded header fields, the subject/from/to/cc
+ * digest fields and the text parts of a message. A trigram FTS5 table over
+ * these narrows keyword criteria down to candidates, which are then checked
+ * against the stored text with the same strcasestr semantics as the
+ * eml-based path, so the eml is not fetched again. Rows are added when a
+ * message arrives and, for older messages, as their folder gets searched,
+ * at most SIDX_CATCHUP_MAX per search; the rest are matched from the eml
+ * until a later search gets to them. Messages that cannot be indexed get a
+ * docid of -1 so that they are not retried by every search. Bodies beyond
+ * SIDX_BODY_MAX are stored truncated and marked incomplete; BODY/TEXT on
+ * those falls back to reading the eml. The file is a cache and can be
+ * deleted at any time.
+ */
+static constexpr char sidx_schema[] =
+"CREATE VIRTUAL TABLE IF NOT EXISTS mtext USING fts5(hdr, subject, sender, rcpt, cc, body, tokenize='trigram');"
+"CREATE TABLE IF NOT EXISTS mstate (mid_string TEXT PRIMARY KEY, docid INTEGER NOT NULL, complete INTEGER NOT NULL);";
+static constexpr size_t SIDX_BODY_MAX = 1U << 20;
+/* Messages indexed per transaction when catching up on a folder */
+static constexpr unsigned int SIDX_BATCH = 64;
+/* Messages added to the index by one search at most */
+static constexpr unsigned int SIDX_CATCHUP_MAX = 256;
+
+enum {
+	SIDX_HDR, SIDX_SUBJECT, SIDX_SENDER, SIDX_RCPT, SIDX_CC, SIDX_BODY,
+	SIDX_NCOLS,
+};
+
+namespace {
+
+struct sidx_ctx {
+	sidx_ctx() = default;
+	~sidx_ctx();
+	NOMOVE(sidx_ctx);
+
+	sqlite3 *db = nullptr;
+	xstmt st_state, st_row;
+	/* docids which can possibly match, for nodes the trigram index can serve */
+	std::unordered_map<const ct_node *, std::unordered_set<int64_t>> cand;
+	std::string cur_mid;
+	int64_t docid = -1;
+	bool complete = false, have_cols = false;
+	std::string cols[SIDX_NCOLS];
+};
+
+}
+
+sidx_ctx::~sidx_ctx()
+{
+	st_state.finalize();
+	st_row.finalize();
+	if (db != nullptr)
+		sqlite3_close(db);
+}
+
+static sqlite3 *me_sidx_open(const char *dir)
+{
+	auto path = dir + "/exmdb/midb_fts.sqlite3"s;
+	sqlite3 *db = nullptr;
+	auto ret = sqlite3_open_v2(path.c_str(), &db,
+	           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	if (ret != SQLITE_OK) {
+		mlog(LV_ERR, "E-2951: sqlite3_open %s: %s", path.c_str(), sqlite3_errstr(ret));
+		sqlite3_close(db);
+		return nullptr;
+	}
+	sqlite3_busy_timeout(db, 60000);
+	gx_sql_exec(db, "PRAGMA journal_mode=WAL");
+	gx_sql_exec(db, "PRAGMA synchronous=NORMAL");
+	if (gx_sql_exec(db, sidx_schema) != SQLITE_OK) {
+		mlog(LV_ERR, "E-2952: %s is not usable, searching without index", path.c_str());
+		sqlite3_close(db);
+		return nullptr;
+	}
+	return db;
+}
+
+static sqlite3 *me_sidx_get(IDB_ITEM *pidb)
+{
+	if (!g_midb_search_index)
+		return nullptr;
+	if (pidb->psidx == nullptr)
+		pidb->psidx = me_sidx_open(cu_get_maildir());
+	return pidb->psidx;
+}
+
+static void me_sidx_forget(sqlite3 *sidx, const char *mid_string)
+{
+	auto stm = gx_sql_prep(sidx, "SELECT docid FROM mstate WHERE mid_string=?");
+	if (stm == nullptr)
+		return;
+	stm.bind_text(1, mid_string);
+	if (stm.step() != SQLITE_ROW)
+		return;
+	auto docid = stm.col_int64(0);
+	stm.finalize();
+	gx_sql_exec(sidx, fmt::format("DELETE FROM mtext WHERE rowid={}", docid).c_str());
+	stm = gx_sql_prep(sidx, "DELETE FROM mstate WHERE mid_string=?");
+	if (stm == nullptr)
+		return;
+	stm.bind_text(1, mid_string);
+	stm.step();
+}
+
+/* Append the decoded text of one MIME part (cf. me_ct_enum_mime) */
+static void me_sidx_part(const MJSON_MIME &m, const std::string &eml,
+    std::string &out, bool &complete)
+{
+	if (!complete)
+		return;
+	if (m.get_mtype() != mime_type::single &&
+	    m.get_mtype() != mime_type::single_obj)
+		return;
+	if (strncmp(m.get_ctype(), "text/", 5) != 0) {
+		auto filename = m.get_filename();
+		if (*filename == '\0')
+			return;
+		auto rs = me_ct_decode_mime(g_default_charset, filename);
+		if (rs != nullptr) {
+			out += rs.get();
+			out += '\n';
+		}
+		return;
+	}
+	if (m.get_content_offset() >= eml.size())
+		return;
+	std::string_view ctview(eml.data() + m.get_content_offset(),
+		std::min(eml.size() - m.get_content_offset(), m.get_content_length()));
+	std::string content;
+	if (m.encoding_is_b()) {
+		content = base64_decode(ctview);
+	} else if (m.encoding_is_q()) {
+		content.resize(ctview.size());
+		auto xl = qp_decode_ex(content.data(), content.size(), ctview.data(), ctview.size());
+		if (xl < 0)
+			return;
+		content.resize(xl);
+	} else {
+		content = ctview;
+	}
+	auto charset = m.get_charset();
+	auto rs = me_ct_to_utf8(*charset != '\0' ? charset : g_default_charset,
+	          content.c_str());
+	if (rs == nullptr)
+		return;
+	out += rs.get();
+	out += '\n';
+	if (out.size() <= SIDX_BODY_MAX)
+		return;
+	/* Cut at a character boundary */
+	out.resize(SIDX_BODY_MAX);
+	while (!out.empty() && (out.back() & 0xC0) == 0x80)
+		out.pop_back();
+	if (!out.empty() && static_cast<unsigned char>(out.back()) >= 0xC0)
+		out.pop_back();
+	complete = false;
+}
+
+/**
+ * (Re-)index one message. The caller should hold a write transaction on
+ * @sidx when doing many.
+ */
+static bool me_sidx_index(sqlite3 *sidx, sqlite3 *psqlite,
+    const char *mid_string) try
+{
+	std::string bin;
+	MJSON mjson;
+	if (!me_get_ext(mid_string, bin) || !me_load_ext(bin, mid_string, mjson))
+		return false;
+	std::string eml;
+	if (!exmdb_client::imapfile_read(cu_get_maildir(), "eml", mid_string, &eml))
+		return false;
+	std::string cols[SIDX_NCOLS];
+	const std::string *dfields[] = {nullptr, &mjson.subject, &mjson.from, &mjson.to, &mjson.cc};
+	for (unsigned int i = SIDX_SUBJECT; i <= SIDX_CC; ++i) {
+		auto rs = me_ct_decode_mime(g_default_charset, dfields[i]->c_str());
+		if (rs != nullptr)
+			cols[i] = rs.get();
+	}
+
+	vmime::parsingContext vpctx;
+	vpctx.setInternationalizedEmailSupport(true); /* RFC 6532 */
+	vmime::header hdr;
+	hdr.parse(vpctx, eml);
+	for (const auto &hf : hdr.getFieldList()) {
+		vmime::text txt;
+		txt.parse(hf->getValue()->generate());
+		auto v = txt.getConvertedText(vmime::charsets::UTF_8);
+		std::replace(v.begin(), v.end(), '\r', ' ');
+		std::replace(v.begin(), v.end(), '\n', ' ');
+		cols[SIDX_HDR] += hf->getName() + ": " + v + "\n";
+	}
+
+	bool complete = true;
+	mjson.enum_mime([&](const MJSON_MIME *m) {
+		me_sidx_part(*m, eml, cols[SIDX_BODY], complete);
+	});
+
+	me_sidx_forget(sidx, mid_string);
+	auto stm = gx_sql_prep(sidx, "INSERT INTO mtext (hdr, subject,"
+	           " sender, rcpt, cc, body) VALUES (?,?,?,?,?,?)");
+	if (stm == nullptr)
+		return false;
+	for (unsigned int i = 0; i < SIDX_NCOLS; ++i)
+		stm.bind_text(i + 1, cols[i]);
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	auto docid = sqlite3_last_insert_rowid(sidx);
+	stm = gx_sql_prep(sidx, "INSERT INTO mstate (mid_string, docid, complete) VALUES (?,?,?)");
+	if (stm == nullptr)
+		return false;
+	stm.bind_text(1, mid_string);
+	stm.bind_int64(2, docid);
+	stm.bind_int64(3, complete);
+	return stm.step() == SQLITE_DONE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2953: ENOMEM");
+	return false;
+} catch (const std::exception &e) {
+	mlog(LV_DEBUG, "midb: cannot index %s: %s", mid_string, e.what());
+	return false;
+}
+
+/* Remember that @mid_string could not be indexed (docid -1) */
+static void me_sidx_skip(sqlite3 *sidx, const char *mid_string)
+{
+	me_sidx_forget(sidx, mid_string);
+	auto stm = gx_sql_prep(sidx, "INSERT INTO mstate (mid_string, docid, complete) VALUES (?,-1,0)");
+	if (stm == nullptr)
+		return;
+	stm.bind_text(1, mid_string);
+	stm.step();
+}
+
+/*
+ * Index up to SIDX_CATCHUP_MAX messages of @folder_id the index has not
+ * seen yet.
+ */
+static void me_sidx_catchup(sqlite3 *sidx, sqlite3 *psqlite,
+    uint64_t folder_id) try
+{
+	auto stm = gx_sql_prep(psqlite, fmt::format("SELECT mid_string FROM"
+	           " messages WHERE folder_id={}", folder_id).c_str());
+	auto chk = gx_sql_prep(sidx, "SELECT 1 FROM mstate WHERE mid_string=?");
+	if (stm == nullptr || chk == nullptr)
+		return;
+	std::vector<std::string> todo;
+	while (todo.size() < SIDX_CATCHUP_MAX && stm.step() == SQLITE_ROW) {
+		auto mid = stm.col_text(0);
+		chk.reset();
+		chk.bind_text(1, mid);
+		if (chk.step() != SQLITE_ROW)
+			todo.emplace_back(mid);
+	}
+	stm.finalize();
+	chk.finalize();
+	if (todo.size() > SIDX_BATCH)
+		mlog(LV_INFO, "I-2954: midb: adding %zu messages of %s to the search index",
+		        todo.size(), cu_get_maildir());
+	for (size_t i = 0; i < todo.size(); i += SIDX_BATCH) {
+		auto txn = gx_sql_begin(sidx, txn_mode::write);
+		if (!txn)
+			return;
+		for (size_t j = i; j < std::min(todo.size(), i + SIDX_BATCH); ++j) {
+			if (me_sidx_index(sidx, psqlite, todo[j].c_str()))
+				continue;
+			mlog(LV_DEBUG, "midb: %s/eml/%s not indexed",
+			        cu_get_maildir(), todo[j].c_str());
+			me_sidx_skip(sidx, todo[j].c_str());
+		}
+		if (txn.commit() != SQLITE_OK)
+			return;
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2955: ENOMEM");
+}
+
+static const char *me_sidx_columns(midb_cond c)
+{
+	switch (c) {
+	case midb_cond::header: return "hdr";
+	case midb_cond::subject: return "subject";
+	case midb_cond::from: return "sender";
+	case midb_cond::to: return "rcpt";
+	case midb_cond::cc: return "cc";
+	case midb_cond::body: return "body";
+	case midb_cond::text: return "{subject sender rcpt cc body}";
+	default: return nullptr;
+	}
+}
+
+static bool me_sidx_wanted(const CONDITION_TREE &tree)
+{
+	for (const auto &n : tree)
+		if (n.pbranch != nullptr ? me_sidx_wanted(*n.pbranch) :
+		    me_sidx_columns(n.condition) != nullptr)
+			return true;
+	return false;
+}
+
+/* Fill sidx_ctx::cand for every node whose keyword is long enough */
+static bool me_sidx_candidates(sidx_ctx &x, const CONDITION_TREE &tree) try
+{
+	for (const auto &n : tree) {
+		if (n.pbranch != nullptr) {
+			if (!me_sidx_candidates(x, *n.pbranch))
+				return false;
+			continue;
+		}
+		auto col = me_sidx_columns(n.condition);
+		if (col == nullptr)
+			continue;
+		auto kw = n.condition == midb_cond::header ? n.ct_headers[1] : n.ct_keyword;
+		/* trigram needs at least three characters to use the index */
+		size_t nchars = 0;
+		for (auto p = kw; *p != '\0'; ++p)
+			if ((*p & 0xC0) != 0x80)
+				++nchars;
+		if (nchars < 3)
+			continue;
+		std::string q = col;
+		q += " : \"";
+		for (auto p = kw; *p != '\0'; ++p) {
+			if (*p == '"')
+				q += '"';
+			q += *p;
+		}
+		q += '"';
+		auto stm = gx_sql_prep(x.db, "SELECT rowid FROM mtext WHERE mtext MATCH ?");
+		if (stm == nullptr)
+			return false;
+		stm.bind_text(1, q);
+		auto &set = x.cand[&n];
+		int ret;
+		while ((ret = stm.step()) == SQLITE_ROW)
+			set.insert(stm.col_int64(0));
+		if (ret != SQLITE_DONE)
+			return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2956: ENOMEM");
+	return false;
+}
+
+static std::unique_ptr<sidx_ctx> me_sidx_setup(sqlite3 *psqlite,
+    uint64_t folder_id, const CONDITION_TREE &tree) try
+{
+	if (!g_midb_search_index || !me_sidx_wanted(tree))
+		return nullptr;
+	auto x = std::make_unique<sidx_ctx>();
+	x->db = me_sidx_open(cu_get_maildir());
+	if (x->db == nullptr)
+		return nullptr;
+	me_sidx_catchup(x->db, psqlite, folder_id);
+	x->st_state = gx_sql_prep(x->db, "SELECT docid, complete FROM mstate WHERE mid_string=?");
+	x->st_row = gx_sql_prep(x->db, "SELECT hdr, subject, sender, rcpt,"
+	            " cc, body FROM mtext WHERE rowid=?");
+	if (x->st_state == nullptr || x->st_row == nullptr ||
+	    !me_sidx_candidates(*x, tree))
+		return nullptr;
+	return x;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2957: ENOMEM");
+	return nullptr;
+}
+
+static bool me_sidx_header(const std::string &hdr, const char *tag,
+    const char *value)
+{
+	auto taglen = strlen(tag);
+	for (size_t pos = 0; pos < hdr.size(); ) {
+		auto eol = hdr.find('\n', pos);
+		if (eol == hdr.npos)
+			eol = hdr.size();
+		std::string line(hdr, pos, eol - pos);
+		pos = eol + 1;
+		auto colon = line.find(": ");
+		if (colon != taglen || strncasecmp(line.c_str(), tag, taglen) != 0)
+			continue;
+		if (strcasestr(line.c_str() + colon + 2, value) != nullptr)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Evaluate a keyword/header criterion from the index. Returns -1 if the index
+ * cannot answer it for this message, else 0 or 1.
+ */
+static int me_sidx_match(sidx_ctx &x, const char *mid_string, const ct_node &n)
+{
+	if (me_sidx_columns(n.condition) == nullptr)
+		return -1;
+	if (x.cur_mid != mid_string) {
+		x.cur_mid = mid_string;
+		x.docid = -1;
+		x.have_cols = false;
+		x.st_state.reset();
+		x.st_state.bind_text(1, mid_string);
+		if (x.st_state.step() == SQLITE_ROW) {
+			x.docid = x.st_state.col_int64(0);
+			x.complete = x.st_state.col_int64(1) != 0;
+		}
+	}
+	if (x.docid < 0)
+		return -1;
+	if (!x.complete && (n.condition == midb_cond::body ||
+	    n.condition == midb_cond::text))
+		return -1;
+	auto it = x.cand.find(&n);
+	if (it != x.cand.end() && it->second.count(x.docid) == 0)
+		return 0;
+	if (!x.have_cols) {
+		x.st_row.reset();
+		x.st_row.bind_int64(1, x.docid);
+		if (x.st_row.step() != SQLITE_ROW)
+			return -1;
+		for (unsigned int i = 0; i < SIDX_NCOLS; ++i)
+			x.cols[i] = znul(x.st_row.col_text(i));
+		x.have_cols = true;
+	}
+	auto has = [&](unsigned int col) {
+		return strcasestr(x.cols[col].c_str(), n.ct_keyword) != nullptr;
+	};
+	switch (n.condition) {
+	case midb_cond::header:
+		return me_sidx_header(x.cols[SIDX_HDR], n.ct_headers[0], n.ct_headers[1]);
+	case midb_cond::subject: return has(SIDX_SUBJECT);
+	case midb_cond::from: return has(SIDX_SENDER);
+	case midb_cond::to: return has(SIDX_RCPT);
+	case midb_cond::cc: return has(SIDX_CC);
+	case midb_cond::body: return has(SIDX_BODY);
+	case midb_cond::text:
+		return has(SIDX_CC) || has(SIDX_SENDER) || has(SIDX_SUBJECT) ||
+		       has(SIDX_RCPT) || has(SIDX_BODY);
+	default:
+		return -1;
+	}
+}
+
 enum ctm_field {
 	CTM_MSGID, CTM_MODTIME, CTM_UID, CTM_RECENT, CTM_READ, CTM_UNSENT,
 	CTM_FLAGGED, CTM_REPLIED, CTM_FWD, CTM_DELETED, CTM_RCVDTIME,
@@ -444,20 +930,25 @@ enum ctm_field {
 
 static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
     sqlite3_stmt *pstmt_message, const char *mid_string, int id, int total_mail,
-    uint32_t uidnext, const CONDITION_TREE *ptree) try
+    uint32_t uidnext, const CONDITION_TREE *ptree, sidx_ctx *sx) try
 {
 	int sp = 0;
 	bool b_loaded, b_result, b_result1, results[1024];
 	midb_conj conjunction;
 	time_t tmp_time;
-	size_t temp_len;
-	char temp_buff[1024];
-	char temp_buff1[1024];
 	midb_conj conjunctions[1024];
 	KEYWORD_ENUM keyword_enum;
 	const CONDITION_TREE *trees[1024];
 	CONDITION_TREE::const_iterator pnode, nodes[1024];
-	Json::Value digest;
+	MJSON mjson;
+	auto load = [&]() {
+		std::string bin;
+		return me_get_ext(mid_string, bin) && me_load_ext(bin, mid_string, mjson);
+	};
+	auto hit = [&](const std::string &field, const char *keyword) {
+		auto rs = me_ct_decode_mime(charset, field.c_str());
+		return rs != nullptr && strcasestr(rs.get(), keyword) != nullptr;
+	};
 	
 #define PUSH_MATCH(TREE, NODE, CONJUNCTION, RESULT) \
 		{trees[sp]=TREE;nodes[sp]=NODE;conjunctions[sp]=CONJUNCTION;results[sp]=RESULT;sp++;}
@@ -482,6 +973,9 @@ static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
 			PUSH_MATCH(ptree, pnode, conjunction, b_result)
 			ptree = ptree_node->pbranch;
 			goto PROC_BEGIN;
+		} else if (int r; sx != nullptr &&
+		    (r = me_sidx_match(*sx, mid_string, *ptree_node)) >= 0) {
+			b_result1 = r > 0;
 		} else {
 			switch (ptree_node->condition) {
 			case midb_cond::all:
@@ -515,40 +1009,26 @@ static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::body: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				MJSON temp_mjson;
-				snprintf(temp_buff, 256, "%s/eml",
-						cu_get_maildir());
-				if (!temp_mjson.load_from_json(digest))
-					break;
-				temp_mjson.path = temp_buff;
-				keyword_enum.pjson = &temp_mjson;
+				keyword_enum.pjson = &mjson;
 				keyword_enum.b_result = FALSE;
 				keyword_enum.charset = charset;
 				keyword_enum.keyword = ptree_node->ct_keyword;
-				temp_mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
+				mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
 				if (keyword_enum.b_result)
 					b_result1 = true;
 				break;
 			}
 			case midb_cond::cc: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				if (!get_digest(digest, "cc", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
+				b_result1 = hit(mjson.cc, ptree_node->ct_keyword);
 				break;
 			}
 			case midb_cond::deleted:
@@ -580,19 +1060,11 @@ static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::from: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				if (!get_digest(digest, "from", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
+				b_result1 = hit(mjson.from, ptree_node->ct_keyword);
 				break;
 			}
 			case midb_cond::header:
@@ -718,101 +1190,42 @@ static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::subject: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				if (!get_digest(digest, "subject", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
+				b_result1 = hit(mjson.subject, ptree_node->ct_keyword);
 				break;
 			}
 			case midb_cond::text: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				if (get_digest(digest, "cc", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
-					break;
-				if (get_digest(digest, "from", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
-					break;
-				if (get_digest(digest, "subject", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
+				if (hit(mjson.cc, ptree_node->ct_keyword) ||
+				    hit(mjson.from, ptree_node->ct_keyword) ||
+				    hit(mjson.subject, ptree_node->ct_keyword) ||
+				    hit(mjson.to, ptree_node->ct_keyword)) {
+					b_result1 = true;
 					break;
-				if (get_digest(digest, "to", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
 				}
-				if (b_result1)
-					break;
-				MJSON temp_mjson;
-				snprintf(temp_buff, 256, "%s/eml",
-						cu_get_maildir());
-				if (!temp_mjson.load_from_json(digest))
-					break;
-				temp_mjson.path = temp_buff;
-				keyword_enum.pjson = &temp_mjson;
+				keyword_enum.pjson = &mjson;
 				keyword_enum.b_result = FALSE;
 				keyword_enum.charset = charset;
 				keyword_enum.keyword = ptree_node->ct_keyword;
-				temp_mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
+				mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
 				if (keyword_enum.b_result)
 					b_result1 = true;
 				break;
 			}
 			case midb_cond::to: {
 				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
+					if (!load())
 						break;
 					b_loaded = true;
 				}
-				if (!get_digest(digest, "to", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
+				b_result1 = hit(mjson.to, ptree_node->ct_keyword);
 				break;
 			}
 			case midb_cond::unanswered:
@@ -1247,6 +1660,7 @@ static std::optional<std::vector<int>> me_ct_match(const char *charset,
 	                     "WHERE mid_string=?");
 	if (pstmt_message == nullptr)
 		return {};
+	auto sx = me_sidx_setup(psqlite, folder_id, *ptree);
 	snprintf(sql_string, std::size(sql_string), "SELECT mid_string, uid FROM "
 	          "messages WHERE folder_id=%llu ORDER BY uid", LLU{folder_id});
 	pstmt = gx_sql_prep(psqlite, sql_string);
@@ -1258,7 +1672,7 @@ static std::optional<std::vector<int>> me_ct_match(const char *charset,
 		auto mid_string = pstmt.col_text(0);
 		uid = sqlite3_column_int64(pstmt, 1);
 		if (me_ct_match_mail(psqlite, charset, pstmt_message,
-		    mid_string, i, total_mail, uidnext, ptree))
+		    mid_string, i, total_mail, uidnext, ptree, sx.get()))
 			presult->push_back(b_uid ? uid : i);
 	}
 	return presult;
@@ -1332,8 +1746,10 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 	
 	auto dir = cu_get_maildir();
 	std::string djson;
+	Json::Value digest;
 	if (e.midstr.size() > 0 &&
-	    !exmdb_client::imapfile_read(dir, "ext", e.midstr, &djson))
+	    (!exmdb_client::imapfile_read(dir, "ext", e.midstr, &djson) ||
+	    !mjson_digest_unpack(djson, digest)))
 		e.midstr.clear();
 	if (e.midstr.empty()) {
 		if (!cu_switch_allocator())
@@ -1361,11 +1777,11 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 			return;
 		}
 		cu_switch_allocator();
-		Json::Value digest;
 		if (imail.make_digest(&size, digest) <= 0)
 			return;
 		digest["file"] = "";
-		djson = json_to_str(digest);
+		if (!mjson_digest_pack(digest, djson))
+			return;
 		e.midstr = std::to_string(time(nullptr)) + "." + std::to_string(++g_sequence_id) + ".midb";
 		if (!exmdb_client::imapfile_write(dir, "ext", e.midstr, djson)) {
 			mlog(LV_ERR, "E-1770: imapfile_write %s/ext/%s incomplete", dir, e.midstr.c_str());
@@ -1385,9 +1801,6 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 	(*puidnext) ++;
 	bool b_unsent = e.msg_flags & MSGFLAG_UNSENT;
 	bool b_read   = e.msg_flags & MSGFLAG_READ;
-	Json::Value digest;
-	if (!json_from_str(djson.c_str(), digest))
-		return;
 	djson.clear();
 	me_extract_digest_fields(digest, subject,
 		std::size(subject), from, std::size(from), rcpt,
@@ -1435,7 +1848,7 @@ static void me_sync_message(IDB_ITEM *pidb, xstmt &stm_insert,
 		}
 		return;
 	}
-	auto qstr = fmt::format("SELECT m.uid, f.name FROM messages AS m "
+	auto qstr = fmt::format("SELECT m.uid, f.name, m.mid_string FROM messages AS m "
 	            "INNER JOIN folders AS f ON m.folder_id=f.folder_id "
 	            "WHERE m.message_id={}", message_id);
 	auto stm = gx_sql_prep(pidb->psqlite, qstr.c_str());
@@ -1444,6 +1857,10 @@ static void me_sync_message(IDB_ITEM *pidb, xstmt &stm_insert,
 		auto folder_name = stm.col_text(1);
 		system_services_broadcast_event(fmt::format("MESSAGE-EXPUNGE {} {} {}",
 			pidb->username, base64_encode(folder_name), stm.col_uint64(0)).c_str());
+		/* The replacement gets a new mid_string, indexed on first search */
+		auto sidx = me_sidx_get(pidb);
+		if (sidx != nullptr)
+			me_sidx_forget(sidx, znul(stm.col_text(2)));
 	}
 	stm.finalize();
 	qstr = fmt::format("DELETE FROM messages WHERE message_id={}", message_id);
@@ -1648,6 +2065,45 @@ static inline bool ipf_note(const char *c)
 	return c == nullptr || class_match_prefix(c, "IPF.Note") == 0;
 }
 
+/**
+ * Cap the expunge history per folder. What is cut off is summarized by the
+ * uid-0 row, which P-VNSH consults to tell whether the history it has is
+ * complete.
+ */
+static void me_prune_vanished(sqlite3 *psqlite) try
+{
+	auto qstr = fmt::format("SELECT folder_id FROM vanished WHERE uid<>0 "
+	            "GROUP BY folder_id HAVING count(*)>{}", VANISHED_KEEP);
+	auto stm = gx_sql_prep(psqlite, qstr.c_str());
+	if (stm == nullptr)
+		return;
+	std::vector<uint64_t> fids;
+	while (stm.step() == SQLITE_ROW)
+		fids.push_back(stm.col_uint64(0));
+	stm.finalize();
+	for (auto fid : fids) {
+		qstr = fmt::format("SELECT modseq FROM vanished WHERE folder_id={} "
+		       "AND uid<>0 ORDER BY modseq DESC LIMIT 1 OFFSET {}",
+		       fid, VANISHED_KEEP);
+		stm = gx_sql_prep(psqlite, qstr.c_str());
+		if (stm == nullptr || stm.step() != SQLITE_ROW)
+			continue;
+		auto cut = stm.col_uint64(0);
+		stm.finalize();
+		auto xact = gx_sql_begin(psqlite, txn_mode::write);
+		if (!xact)
+			return;
+		qstr = fmt::format("DELETE FROM vanished WHERE folder_id={0} AND "
+		       "(uid=0 OR modseq<={1}); INSERT INTO vanished (folder_id, "
+		       "uid, modseq) VALUES ({0}, 0, {1})", fid, cut);
+		if (gx_sql_exec(psqlite, qstr.c_str()) != SQLITE_OK ||
+		    xact.commit() != SQLITE_OK)
+			return;
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2965: ENOMEM");
+}
+
 static BOOL me_sync_mailbox(IDB_ITEM *pidb, bool force_resync = false) try
 {
 	auto dir = cu_get_maildir();
@@ -1836,6 +2292,7 @@ static BOOL me_sync_mailbox(IDB_ITEM *pidb, bool force_resync = false) try
 	if (pidb_transact.commit() != SQLITE_OK)
 		return false;
 	}
+	me_prune_vanished(pidb->psqlite);
 	cl_err.release();
 	if (!exmdb_client::subscribe_notification(dir,
 	    NF_OBJECT_CREATED | NF_OBJECT_DELETED | NF_OBJECT_MODIFIED |
@@ -1991,6 +2448,8 @@ void idb_item_del::operator()(IDB_ITEM *pidb)
 
 IDB_ITEM::~IDB_ITEM()
 {
+	if (psidx != nullptr)
+		sqlite3_close(psidx);
 	if (psqlite != nullptr)
 		sqlite3_close(psqlite);
 }
@@ -2135,11 +2594,9 @@ static int me_minst(int argc, char **argv, int sockd) try
 	MAIL imail;
 	if (!imail.load_from_str(pbuff.c_str(), pbuff.size()))
 		return MIDB_E_IMAIL_RETRIEVE;
-	Json::Value digest;
-	if (imail.make_digest(&mess_len, digest) <= 0)
+	std::string djson;
+	if (imail.make_digest(&mess_len, "", djson) <= 0)
 		return MIDB_E_IMAIL_DIGEST;
-	digest["file"] = "";
-	auto djson = json_to_str(digest);
 	if (!exmdb_client::imapfile_write(argv[1], "ext", argv[3], djson)) {
 		mlog(LV_ERR, "E-2073: imapfile_write %s/ext/%s failed", argv[1], argv[3]);
 		return MIDB_E_DISK_ERROR;
@@ -2586,13 +3043,29 @@ static int me_punid(int argc, char **argv, int sockd)
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
+/**
+ * Expunges leave their modseq behind in `vanished`, so the highest value
+ * never goes backwards even when the newest messages are gone.
+ */
+static uint64_t me_highest_modseq(sqlite3 *psqlite, uint64_t folder_id)
+{
+	auto qstr = fmt::format("SELECT max(m) FROM ("
+	            "SELECT max(modseq) AS m FROM messages WHERE folder_id={0} "
+	            "UNION ALL SELECT max(modseq) FROM vanished WHERE folder_id={0})",
+	            folder_id);
+	auto stm = gx_sql_prep(psqlite, qstr.c_str());
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return 1;
+	return std::max(stm.col_uint64(0), static_cast<uint64_t>(1));
+}
+
 /**
  * Folder summary
  *
  * Request:
  * 	P-FDDT <store-dir> <folder-name>
  * Response:
- * 	TRUE <#messages> <#recents> <#unreads> <uidvalidity> <uidnext>
+ * 	TRUE <#messages> <#recents> <#unreads> <uidvalidity> <uidnext> <highestmodseq>
  */
 static int me_pfddt(int argc, char **argv, int sockd)
 {
@@ -2638,10 +3111,11 @@ static int me_pfddt(int argc, char **argv, int sockd)
 		return MIDB_E_SQLPREP;
 	size_t recents = pstmt.step() == SQLITE_ROW ? pstmt.col_uint64(0) : 0;
 	pstmt.finalize();
+	auto modseq = me_highest_modseq(pidb->psqlite, folder_id);
 	pidb.reset();
-	auto temp_len = sprintf(temp_buff, "TRUE %zu %zu %zu %llu %llu\r\n",
+	auto temp_len = sprintf(temp_buff, "TRUE %zu %zu %zu %llu %llu %llu\r\n",
 	                total, recents, unreads, LLU{folder_id},
-	                LLU{uidnext + 1});
+	                LLU{uidnext + 1}, LLU{modseq});
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
@@ -2732,6 +3206,7 @@ namespace {
 struct simu_node {
 	uint32_t uid;
 	unsigned int size;
+	uint64_t modseq;
 	std::string flags, mid_string;
 };
 
@@ -2764,6 +3239,7 @@ static int simu_query(IDB_ITEM *pidb, const char *sql_string,
 			sn.flags += midb_flag::forwarded;
 		sn.flags += ')';
 		sn.size = pstmt.col_uint64(10);
+		sn.modseq = pstmt.col_uint64(11);
 		temp_list.push_back(std::move(sn));
 	}
 	return 0;
@@ -2772,63 +3248,41 @@ static int simu_query(IDB_ITEM *pidb, const char *sql_string,
 	return MIDB_E_NO_MEMORY;
 }
 
-/**
- * Give summary of messages present in folder (via IMAP UID)
- *
- * Request:
- * 	P-SIMU <store-dir> <folder-name> <uid(min)> <uid(max)>
- * Response:
- * 	TRUE <#msgcount>
- * 	- <midstr> <uid> <flags> <size>  // repeat x #msgcount
- *
- * midb_agent:list_mail [POP3 logic] uses midstr and size.
- * midb_agent:fetch_simple_uid [IMAP logic] uses midstr, uid, flags.
+/*
+ * simu_query over the IMAP UID range @first:@last of @folder_id, for messages
+ * with a modseq above @changedsince.
  */
-static int me_psimu(int argc, char **argv, int sockd) try
+static int simu_range(IDB_ITEM *pidb, uint64_t folder_id,
+    seq_node::value_type first, seq_node::value_type last,
+    uint64_t changedsince, std::vector<simu_node> &temp_list)
 {
-	int total_mail = 0;
-	
-	seq_node::value_type first = strtol(argv[3], nullptr, 0), last = strtol(argv[4], nullptr, 0);
-	if (first < 1 && first != SEQ_STAR)
-		return MIDB_E_PARAMETER_ERROR;
-	if (last < 1 && last != SEQ_STAR)
-		return MIDB_E_PARAMETER_ERROR;
-	if (first != SEQ_STAR && last != SEQ_STAR && last < first)
-		std::swap(first, last);
-	auto pidb = me_get_idb(argv[1]);
-	if (pidb == nullptr)
-		return MIDB_E_HASHTABLE_FULL;
-	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
-	if (folder_id == 0)
-		return MIDB_E_NO_FOLDER_TRYCREATE;
-
 	std::string qstr;
 	if (first == SEQ_STAR && last == SEQ_STAR)
 		/* "MAX:MAX" */
 		qstr = "SELECT 0, mid_string, uid, replied, unsent, flagged,"
-		       " deleted, read, recent, forwarded, size"
+		       " deleted, read, recent, forwarded, size, modseq"
 		       " FROM messages WHERE folder_id=" + std::to_string(folder_id) +
 		       " ORDER BY uid DESC LIMIT 1";
 	else if (first == SEQ_STAR)
 		/* "MAX:99" */
 		qstr = fmt::format("SELECT 0, mid_string, uid, replied, unsent, "
-		       "flagged, deleted, read, recent, forwarded, size "
+		       "flagged, deleted, read, recent, forwarded, size, modseq "
 		       "FROM messages WHERE folder_id={} AND uid<={} "
 		       "ORDER BY uid DESC LIMIT 1", folder_id, last);
 	else if (last == SEQ_STAR)
 		/* "99:MAX" */
 		qstr = fmt::format("SELECT 0, mid_string, uid, replied, unsent, "
-		       "flagged, deleted, read, recent, forwarded, size "
-		       "FROM messages WHERE folder_id={} AND uid>={} ORDER BY uid",
-		       folder_id, first);
+		       "flagged, deleted, read, recent, forwarded, size, modseq "
+		       "FROM messages WHERE folder_id={} AND uid>={} AND modseq>{} "
+		       "ORDER BY uid", folder_id, first, changedsince);
 	else
 		qstr = fmt::format("SELECT 0, mid_string, uid, replied, unsent, "
-		       "flagged, deleted, read, recent, forwarded, size "
+		       "flagged, deleted, read, recent, forwarded, size, modseq "
 		       "FROM messages WHERE folder_id={} AND uid>={} AND uid<={} "
-		       "ORDER BY uid", folder_id, first, last);
+		       "AND modseq>{} ORDER BY uid", folder_id, first, last,
+		       changedsince);
 
-	std::vector<simu_node> temp_list;
-	auto iret = simu_query(pidb.get(), qstr.c_str(), total_mail, temp_list);
+	auto iret = simu_query(pidb, qstr.c_str(), 0, temp_list);
 	if (iret != 0)
 		return iret;
 	if (temp_list.size() == 0 && (first == SEQ_STAR || last == SEQ_STAR)) {
@@ -2838,20 +3292,61 @@ static int me_psimu(int argc, char **argv, int sockd) try
 		 * any assigned UID value".
 		 */
 		qstr = "SELECT 0, mid_string, uid, replied, unsent, flagged,"
-		       " deleted, read, recent, forwarded, size"
+		       " deleted, read, recent, forwarded, size, modseq"
 		       " FROM messages WHERE folder_id=" + std::to_string(folder_id) +
 		       " ORDER BY uid DESC LIMIT 1";
-		iret = simu_query(pidb.get(), qstr.c_str(), total_mail, temp_list);
+		iret = simu_query(pidb, qstr.c_str(), 0, temp_list);
 		if (iret != 0)
 			return iret;
 	}
+	/* The "MAX" forms above pick their message regardless of changedsince */
+	std::erase_if(temp_list, [=](const simu_node &sn) { return sn.modseq <= changedsince; });
+	return 0;
+}
+
+/**
+ * Give summary of messages present in folder (via IMAP UID)
+ *
+ * Request:
+ * 	P-SIMU <store-dir> <folder-name> <uid(min)> <uid(max)> [<changedsince>]
+ * Response:
+ * 	TRUE <#msgcount>
+ * 	- <midstr> <uid> <flags> <size> <modseq>  // repeat x #msgcount
+ *
+ * With changedsince, only messages whose modseq is larger are listed.
+ *
+ * midb_agent:list_mail [POP3 logic] uses midstr and size.
+ * midb_agent:fetch_simple_uid [IMAP logic] uses midstr, uid, flags, modseq.
+ */
+static int me_psimu(int argc, char **argv, int sockd) try
+{
+	seq_node::value_type first = strtol(argv[3], nullptr, 0), last = strtol(argv[4], nullptr, 0);
+	uint64_t changedsince = argc > 5 ? strtoull(argv[5], nullptr, 0) : 0;
+	if (first < 1 && first != SEQ_STAR)
+		return MIDB_E_PARAMETER_ERROR;
+	if (last < 1 && last != SEQ_STAR)
+		return MIDB_E_PARAMETER_ERROR;
+	if (first != SEQ_STAR && last != SEQ_STAR && last < first)
+		std::swap(first, last);
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER_TRYCREATE;
+
+	std::vector<simu_node> temp_list;
+	auto iret = simu_range(pidb.get(), folder_id, first, last,
+	            changedsince, temp_list);
+	if (iret != 0)
+		return iret;
 
 	std::string rsp;
 	rsp.reserve(65536);
 	rsp += "TRUE " + std::to_string(temp_list.size()) + "\r\n";
 	for (const auto &sn : temp_list) {
-		rsp += fmt::format("- {} {} {} {}\r\n", sn.mid_string, sn.uid,
-		       sn.flags, sn.size);
+		rsp += fmt::format("- {} {} {} {} {}\r\n", sn.mid_string, sn.uid,
+		       sn.flags, sn.size, sn.modseq);
 		if (rsp.size() < rsp.capacity() / 2)
 			continue;
 		auto ret = cmd_write(sockd, rsp.c_str(), rsp.size());
@@ -2931,14 +3426,127 @@ static int dtlu_query(IDB_ITEM *pidb, const char *sql_string,
 	return 0;
 }
 
+/*
+ * IMAP renderings of BODY, BODYSTRUCTURE and ENVELOPE, kept per message and
+ * charset in the imapcache table, so that FETCH need not rebuild them (and,
+ * for messages with embedded rfc822 parts, re-read the eml) every time. Rows
+ * go with their messages row through the foreign key; an eml that changes
+ * gets a new messages row and is rendered afresh.
+ */
+/* Larger renderings are not kept, and imap computes them itself */
+static constexpr size_t IMAPCACHE_MAX = 64 * 1024;
+
+/* Mirrors what icp_process_fetch_item would produce from the digest */
+static bool me_imap_render(std::string_view digest, const char *mid_string,
+    const char *charset, std::string &body, std::string &bs, std::string &env)
+{
+	MJSON mjson;
+	if (!me_load_ext(digest, mid_string, mjson))
+		return false;
+	auto dir = cu_get_maildir();
+	mjson_io io;
+	auto rfc_path = dir + "/tmp/imap.rfc822"s;
+	bool built = false;
+	if (mjson.has_rfc822_part()) {
+		std::string eml;
+		if (!exmdb_client::imapfile_read(dir, "eml", mid_string, &eml))
+			return false;
+		io.place(mjson.path + "/" + mjson.get_mail_filename(), std::move(eml));
+		built = mjson.rfc822_build(io, rfc_path.c_str());
+	}
+	auto structure = [&](BOOL ext, std::string &out) {
+		out.clear();
+		if (built && mjson.rfc822_fetch(io, rfc_path.c_str(), charset,
+		    ext, out) != -1)
+			return;
+		out.clear();
+		if (mjson.fetch_structure(io, charset, ext, out) == -1)
+			out = "NIL";
+	};
+	structure(false, body);
+	structure(TRUE, bs);
+	env.clear();
+	if (mjson.fetch_envelope(charset, env) == -1)
+		env = "NIL";
+	return true;
+}
+
+static bool me_imapcache_fill(sqlite3 *psqlite, const char *mid_string,
+    const char *charset, std::string_view digest, std::string &body,
+    std::string &bs, std::string &env)
+{
+	if (!me_imap_render(digest, mid_string, charset, body, bs, env) ||
+	    body.size() + bs.size() + env.size() > IMAPCACHE_MAX)
+		return false;
+	auto stm = gx_sql_prep(psqlite, "INSERT OR REPLACE INTO imapcache"
+	           " (message_id, charset, body, bodystructure, envelope)"
+	           " SELECT message_id, ?, ?, ?, ? FROM messages WHERE mid_string=?");
+	if (stm == nullptr)
+		return true; /* schema not upgraded; still usable for this reply */
+	stm.bind_text(1, charset);
+	stm.bind_text(2, body);
+	stm.bind_text(3, bs);
+	stm.bind_text(4, env);
+	stm.bind_text(5, mid_string);
+	stm.step();
+	return true;
+}
+
+/**
+ * Get the cached renderings of @mid_string for @charset, computing them from
+ * the stored @digest if this is the first time.
+ */
+static bool me_imapcache_get(sqlite3 *psqlite, const char *mid_string,
+    const char *charset, std::string_view digest, std::string &body,
+    std::string &bs, std::string &env)
+{
+	auto stm = gx_sql_prep(psqlite, "SELECT c.body, c.bodystructure,"
+	           " c.envelope FROM imapcache AS c INNER JOIN messages AS m"
+	           " ON c.message_id=m.message_id WHERE m.mid_string=? AND c.charset=?");
+	if (stm != nullptr) {
+		stm.bind_text(1, mid_string);
+		stm.bind_text(2, charset);
+	}
+	if (stm != nullptr && stm.step() == SQLITE_ROW) {
+		body = stm.col_text(0);
+		bs   = stm.col_text(1);
+		env  = stm.col_text(2);
+		return true;
+	}
+	stm.finalize();
+	return me_imapcache_fill(psqlite, mid_string, charset, digest,
+	       body, bs, env);
+}
+
+/* P-DTLU form of me_imapcache_get */
+static void me_imapcache_attach(sqlite3 *psqlite, const char *mid_string,
+    const char *charset, Json::Value &digest) try
+{
+	std::string bin, body, bs, env;
+	if (!me_get_ext(mid_string, bin) ||
+	    !me_imapcache_get(psqlite, mid_string, charset, bin, body, bs, env))
+		return;
+	digest["imapcset"] = charset;
+	digest["imapbody"] = std::move(body);
+	digest["imapbs"]   = std::move(bs);
+	digest["imapenv"]  = std::move(env);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2963: ENOMEM");
+}
+
 /**
  * Fetch detail (via IMAP UID)
  *
  * Request:
- * 	P-DTLU <store-dir> <folder-name> <1-based imapuid(min)> <1-based imapuid(max)>
+ * 	P-DTLU <store-dir> <folder-name> <1-based imapuid(min)> <1-based imapuid(max)> [<charset>]
  * Response:
  * 	TRUE <#messages>
  * 	- <digest>  // repeat x #messages
+ *
+ * With a charset, digests carry the IMAP renderings for that charset
+ * (imapcset, imapbody, imapbs, imapenv) when available.
+ *
+ * This is the JSON form kept for older imap; see P-DTLB.
  */
 static int me_pdtlu(int argc, char **argv, int sockd) try
 {
@@ -2958,6 +3566,8 @@ static int me_pdtlu(int argc, char **argv, int sockd) try
 	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
+	if (argc > 5)
+		pidb->imap_charset = argv[5];
 	/* UNSET always means MAX, never MIN */
 	if (first == SEQ_STAR && last == SEQ_STAR)
 		snprintf(sql_string, std::size(sql_string), "SELECT mid_string"
@@ -3005,7 +3615,15 @@ static int me_pdtlu(int argc, char **argv, int sockd) try
 		Json::Value digest;
 		if (me_get_digest(pidb->psqlite, dt.c_str(), digest) == 0)
 			digest = Json::objectValue;
+		else if (argc > 5)
+			me_imapcache_attach(pidb->psqlite, dt.c_str(), argv[5], digest);
 		auto djson = json_to_str(digest);
+		if (djson.size() > MAX_DIGLEN && digest.isMember("imapcset")) {
+			/* midb_agent caps lines; do without the renderings */
+			for (auto k : {"imapcset", "imapbody", "imapbs", "imapenv"})
+				digest.removeMember(k);
+			djson = json_to_str(digest);
+		}
 		djson.insert(0, temp_buff);
 		djson.append("\r\n");
 		ret = cmd_write(sockd, djson.c_str(), djson.size());
@@ -3018,6 +3636,71 @@ static int me_pdtlu(int argc, char **argv, int sockd) try
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * Fetch detail (via IMAP UID), with the stored digest as-is
+ *
+ * Request:
+ * 	P-DTLB <store-dir> <folder-name> <1-based imapuid(min)> <1-based imapuid(max)> [<charset>]
+ * Response:
+ * 	TRUE <#messages>
+ * 	- <midstr> <uid> <flags> <modseq> <digest> [<body> <bodystructure> <envelope>]
+ *
+ * <digest> is the base64 of the ext/ file, for MJSON::load_from_digest, or
+ * "-" if there is none. With a charset, the base64 of the IMAP renderings for
+ * that charset follow when available.
+ */
+static int me_pdtlb(int argc, char **argv, int sockd) try
+{
+	seq_node::value_type first = strtol(argv[3], nullptr, 0), last = strtol(argv[4], nullptr, 0);
+	if (first < 1 && first != SEQ_STAR)
+		return MIDB_E_PARAMETER_ERROR;
+	if (last < 1 && last != SEQ_STAR)
+		return MIDB_E_PARAMETER_ERROR;
+	if (first != SEQ_STAR && last != SEQ_STAR && last < first)
+		std::swap(first, last);
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER;
+	if (argc > 5)
+		pidb->imap_charset = argv[5];
+	std::vector<simu_node> temp_list;
+	auto iret = simu_range(pidb.get(), folder_id, first, last, 0, temp_list);
+	if (iret != 0)
+		return iret;
+
+	auto rsp = "TRUE " + std::to_string(temp_list.size()) + "\r\n";
+	auto ret = cmd_write(sockd, rsp.c_str(), rsp.size());
+	if (ret != 0)
+		return ret;
+	for (const auto &sn : temp_list) {
+		std::string bin, body, bs, env;
+		if (!me_get_ext(sn.mid_string.c_str(), bin))
+			bin.clear();
+		rsp = fmt::format("- {} {} {} {} {}", sn.mid_string, sn.uid,
+		      sn.flags, sn.modseq, bin.empty() ? "-" : base64_encode(bin));
+		if (argc > 5 && !bin.empty() &&
+		    me_imapcache_get(pidb->psqlite, sn.mid_string.c_str(),
+		    argv[5], bin, body, bs, env)) {
+			auto extra = " " + base64_encode(body) + " " +
+			             base64_encode(bs) + " " + base64_encode(env);
+			/* midb_agent caps lines; do without the renderings */
+			if (rsp.size() + extra.size() <= 2 * MAX_DIGLEN)
+				rsp += std::move(extra);
+		}
+		rsp += "\r\n";
+		ret = cmd_write(sockd, rsp.c_str(), rsp.size());
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2978: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 static std::string flags_rn(sqlite3 *db, uint64_t gcv)
 {
 	auto qstr = "SELECT replied,unsent,flagged,forwarded,deleted,read,recent "
@@ -3039,68 +3722,42 @@ static std::string flags_rn(sqlite3 *db, uint64_t gcv)
 	return out;
 }
 
-/**
- * Set flags on message. For (S)een and (U)nsent, exmdb is contacted(!), which
- * is different from GFLG.
- *
- * Request:
- * 	P-SFLG <store-dir> <folder-name> <mid> <flags>
- * Response:
- * 	TRUE
- */
-static int me_psflg(int argc, char **argv, int sockd) try
+/* Find @mid in @folder, for the flag commands */
+static int me_flags_lookup(IDB_ITEM *pidb, const char *folder,
+    const char *mid, uint64_t *message_id)
 {
-	uint64_t read_cn;
-	uint64_t message_id;
-	PROBLEM_ARRAY problems;
-	TPROPVAL_ARRAY propvals;
-
-	auto pidb = me_get_idb(argv[1]);
-	if (pidb == nullptr)
-		return MIDB_E_HASHTABLE_FULL;
-	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	auto folder_id = me_get_folder_id(pidb, folder);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
 	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id,"
 	             " folder_id FROM messages WHERE mid_string=?");
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
-	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
+	sqlite3_bind_text(pstmt, 1, mid, -1, SQLITE_STATIC);
 	if (SQLITE_ROW != pstmt.step() ||
 	    gx_sql_col_uint64(pstmt, 1) != folder_id)
 		return MIDB_E_NO_MESSAGE;
-	message_id = sqlite3_column_int64(pstmt, 0);
-	pstmt.finalize();
+	*message_id = sqlite3_column_int64(pstmt, 0);
+	return 0;
+}
 
-	/*
-	 * The backnotification (msg_modified) arrives belatedly, so we UPDATE
-	 * the table here already.
-	 */
-	std::string qstr = "UPDATE messages SET ";
-	bool set_answered  = strchr(argv[4], midb_flag::answered)  != nullptr;
-	bool set_unsent    = strchr(argv[4], midb_flag::unsent)    != nullptr;
-	bool set_flagged   = strchr(argv[4], midb_flag::flagged)   != nullptr;
-	bool set_forwarded = strchr(argv[4], midb_flag::forwarded) != nullptr;
-	bool set_deleted   = strchr(argv[4], midb_flag::deleted)   != nullptr;
-	bool set_seen      = strchr(argv[4], midb_flag::seen)      != nullptr;
-	bool set_recent    = strchr(argv[4], midb_flag::recent)    != nullptr;
-	if (set_answered)  qstr += "replied=1,";
-	if (set_unsent)    qstr += "unsent=1,";
-	if (set_flagged)   qstr += "flagged=1,";
-	if (set_forwarded) qstr += "forwarded=1,";
-	if (set_deleted)   qstr += "deleted=1,";
-	if (set_seen)      qstr += "read=1,";
-	if (set_recent)    qstr += "recent=1,";
-	if (qstr.back() == ',') {
-		qstr.pop_back();
-		qstr += " WHERE message_id=" + std::to_string(message_id);
-		gx_sql_exec(pidb->psqlite, qstr.c_str());
-	}
+/* exmdb's side of setting @flags (midb_flag letters) */
+static int me_flags_set_exmdb(const char *dir, uint64_t message_id,
+    const char *flags)
+{
+	uint64_t read_cn;
+	PROBLEM_ARRAY problems;
+	TPROPVAL_ARRAY propvals;
+	bool set_answered  = strchr(flags, midb_flag::answered)  != nullptr;
+	bool set_unsent    = strchr(flags, midb_flag::unsent)    != nullptr;
+	bool set_flagged   = strchr(flags, midb_flag::flagged)   != nullptr;
+	bool set_forwarded = strchr(flags, midb_flag::forwarded) != nullptr;
+	bool set_seen      = strchr(flags, midb_flag::seen)      != nullptr;
 
 	if (set_unsent) {
 		static constexpr proptag_t tmp_proptag[] = {PR_MESSAGE_FLAGS};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(tmp_proptag), deconst(tmp_proptag)};
-		if (!exmdb_client::get_message_properties(argv[1], NULL,
+		if (!exmdb_client::get_message_properties(dir, NULL,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals) || propvals.count == 0)
 			return MIDB_E_MDB_GETMSGPROPS;
@@ -3108,7 +3765,7 @@ static int me_psflg(int argc, char **argv, int sockd) try
 		if (!(message_flags & MSGFLAG_UNSENT)) {
 			message_flags |= MSGFLAG_UNSENT;
 			propvals.ppropval[0].pvalue = &message_flags;
-			if (!exmdb_client::set_message_properties(argv[1],
+			if (!exmdb_client::set_message_properties(dir,
 			    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 			    &propvals, &problems))
 				return MIDB_E_MDB_SETMSGPROPS;
@@ -3118,7 +3775,7 @@ static int me_psflg(int argc, char **argv, int sockd) try
 		const uint32_t val = set_answered ? MAIL_ICON_REPLIED : MAIL_ICON_FORWARDED;
 		const TAGGED_PROPVAL tp[] = {{PR_ICON_INDEX, deconst(&val)}};
 		const TPROPVAL_ARRAY ta = {std::size(tp), deconst(tp)};
-		if (!exmdb_client::set_message_properties(argv[1],
+		if (!exmdb_client::set_message_properties(dir,
 		    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &ta, &problems))
 			return MIDB_E_MDB_SETMSGPROPS;
@@ -3130,79 +3787,34 @@ static int me_psflg(int argc, char **argv, int sockd) try
 			{PR_FOLLOWUP_ICON, deconst(&icon)},
 		};
 		static constexpr TPROPVAL_ARRAY ta = {std::size(tp), deconst(tp)};
-		if (!exmdb_client::set_message_properties(argv[1],
+		if (!exmdb_client::set_message_properties(dir,
 		    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &ta, &problems))
 			return MIDB_E_MDB_SETMSGPROPS;
 	}
-	if (set_seen && !exmdb_client::set_message_read_state(argv[1], nullptr,
+	if (set_seen && !exmdb_client::set_message_read_state(dir, nullptr,
 	    rop_util_make_eid_ex(1, message_id), 1, &read_cn))
 		return MIDB_E_MDB_SETMSGRD;
-	auto new_flags = flags_rn(pidb->psqlite, message_id);
-	pidb.reset();
-	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
-} catch (const std::bad_alloc &) {
-	mlog(LV_ERR, "E-1751: ENOMEM");
-	return MIDB_E_NO_MEMORY;
+	return 0;
 }
 
-/**
- * Remove flags on message. Flags (S)een and (U)nsent trigger contact to exmdb.
- *
- * Request:
- * 	P-RFLG <store-dir> <folder-name> <mid> <flags>
- * Response:
- * 	TRUE
- */
-static int me_prflg(int argc, char **argv, int sockd) try
+/* exmdb's side of clearing @flags */
+static int me_flags_clear_exmdb(const char *dir, uint64_t message_id,
+    const char *flags)
 {
 	uint64_t read_cn;
-	uint64_t message_id;
 	PROBLEM_ARRAY problems;
 	TPROPVAL_ARRAY propvals;
-
-	auto pidb = me_get_idb(argv[1]);
-	if (pidb == nullptr)
-		return MIDB_E_HASHTABLE_FULL;
-	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
-	if (folder_id == 0)
-		return MIDB_E_NO_FOLDER;
-	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id,"
-	             " folder_id FROM messages WHERE mid_string=?");
-	if (pstmt == nullptr)
-		return MIDB_E_SQLPREP;
-	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
-	if (SQLITE_ROW != pstmt.step() ||
-	    gx_sql_col_uint64(pstmt, 1) != folder_id)
-		return MIDB_E_NO_MESSAGE;
-	message_id = sqlite3_column_int64(pstmt, 0);
-	pstmt.finalize();
-
-	std::string qstr = "UPDATE messages SET ";
-	bool set_answered  = strchr(argv[4], midb_flag::answered)  != nullptr;
-	bool set_unsent    = strchr(argv[4], midb_flag::unsent)    != nullptr;
-	bool set_flagged   = strchr(argv[4], midb_flag::flagged)   != nullptr;
-	bool set_forwarded = strchr(argv[4], midb_flag::forwarded) != nullptr;
-	bool set_deleted   = strchr(argv[4], midb_flag::deleted)   != nullptr;
-	bool set_seen      = strchr(argv[4], midb_flag::seen)      != nullptr;
-	bool set_recent    = strchr(argv[4], midb_flag::recent)    != nullptr;
-	if (set_answered)  qstr += "replied=0,";
-	if (set_unsent)    qstr += "unsent=0,";
-	if (set_flagged)   qstr += "flagged=0,";
-	if (set_forwarded) qstr += "forwarded=0,";
-	if (set_deleted)   qstr += "deleted=0,";
-	if (set_seen)      qstr += "read=0,";
-	if (set_recent)    qstr += "recent=0,";
-	if (qstr.back() == ',') {
-		qstr.pop_back();
-		qstr += " WHERE message_id=" + std::to_string(message_id);
-		gx_sql_exec(pidb->psqlite, qstr.c_str());
-	}
+	bool set_answered  = strchr(flags, midb_flag::answered)  != nullptr;
+	bool set_unsent    = strchr(flags, midb_flag::unsent)    != nullptr;
+	bool set_flagged   = strchr(flags, midb_flag::flagged)   != nullptr;
+	bool set_forwarded = strchr(flags, midb_flag::forwarded) != nullptr;
+	bool set_seen      = strchr(flags, midb_flag::seen)      != nullptr;
 
 	if (set_unsent) {
 		static constexpr proptag_t tmp_proptag[] = {PR_MESSAGE_FLAGS};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(tmp_proptag), deconst(tmp_proptag)};
-		if (!exmdb_client::get_message_properties(argv[1], nullptr,
+		if (!exmdb_client::get_message_properties(dir, nullptr,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals) || propvals.count == 0)
 			return MIDB_E_MDB_GETMSGPROPS;
@@ -3210,7 +3822,7 @@ static int me_prflg(int argc, char **argv, int sockd) try
 		if (message_flags & MSGFLAG_UNSENT) {
 			message_flags &= ~MSGFLAG_UNSENT;
 			propvals.ppropval[0].pvalue = &message_flags;
-			if (!exmdb_client::set_message_properties(argv[1],
+			if (!exmdb_client::set_message_properties(dir,
 			    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 			    &propvals, &problems))
 				return MIDB_E_MDB_SETMSGPROPS;
@@ -3220,13 +3832,13 @@ static int me_prflg(int argc, char **argv, int sockd) try
 		static constexpr proptag_t proptags_1[] = {PR_ICON_INDEX};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(proptags_1), deconst(proptags_1)};
 		TPROPVAL_ARRAY propvals{};
-		if (exmdb_client::get_message_properties(argv[1], nullptr,
+		if (exmdb_client::get_message_properties(dir, nullptr,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals)) {
 			uint32_t testfor = set_answered ? MAIL_ICON_REPLIED : MAIL_ICON_FORWARDED;
 			auto icon = propvals.get<const uint32_t>(PR_ICON_INDEX);
 			if (icon != nullptr && *icon == testfor)
-				if (!exmdb_client::remove_message_properties(argv[1], CP_ACP,
+				if (!exmdb_client::remove_message_properties(dir, CP_ACP,
 				    rop_util_make_eid_ex(1, message_id), &proptags))
 					/* ignore */;
 		}
@@ -3236,13 +3848,123 @@ static int me_prflg(int argc, char **argv, int sockd) try
 			PR_FLAG_STATUS, PR_FOLLOWUP_ICON, PR_TODO_ITEM_FLAGS,
 		};
 		static constexpr PROPTAG_ARRAY ta = {std::size(tags), deconst(tags)};
-		if (!exmdb_client::remove_message_properties(argv[1], CP_ACP,
+		if (!exmdb_client::remove_message_properties(dir, CP_ACP,
 		    rop_util_make_eid_ex(1, message_id), &ta))
 			return MIDB_E_MDB_SETMSGPROPS;
 	}
-	if (set_seen && !exmdb_client::set_message_read_state(argv[1], nullptr,
+	if (set_seen && !exmdb_client::set_message_read_state(dir, nullptr,
 	    rop_util_make_eid_ex(1, message_id), 0, &read_cn))
 		return MIDB_E_MDB_SETMSGRD;
+	return 0;
+}
+
+/**
+ * Set the @set and clear the @clear flags of a message. With @unchangedsince,
+ * nothing is changed if the message's modseq went above that value; the
+ * check is part of the UPDATE, and *@refused tells the outcome.
+ */
+static int me_flags_apply(IDB_ITEM *pidb, const char *dir, uint64_t message_id,
+    const char *set, const char *clear, const uint64_t *unchangedsince = nullptr,
+    bool *refused = nullptr)
+{
+	static constexpr std::pair<char, const char *> columns[] = {
+		{midb_flag::answered, "replied"}, {midb_flag::unsent, "unsent"},
+		{midb_flag::flagged, "flagged"}, {midb_flag::forwarded, "forwarded"},
+		{midb_flag::deleted, "deleted"}, {midb_flag::seen, "read"},
+		{midb_flag::recent, "recent"},
+	};
+	/*
+	 * The backnotification (msg_modified) arrives belatedly, so we UPDATE
+	 * the table here already.
+	 */
+	std::string qstr;
+	for (const auto &[letter, column] : columns) {
+		if (strchr(set, letter) != nullptr)
+			qstr += column + "=1,"s;
+		else if (strchr(clear, letter) != nullptr)
+			qstr += column + "=0,"s;
+	}
+	if (unchangedsince != nullptr)
+		*refused = false;
+	if (qstr.empty()) {
+		if (unchangedsince == nullptr)
+			return 0;
+		auto stm = gx_sql_prep(pidb->psqlite, ("SELECT modseq FROM messages"
+		           " WHERE message_id=" + std::to_string(message_id)).c_str());
+		if (stm == nullptr)
+			return MIDB_E_SQLPREP;
+		*refused = stm.step() == SQLITE_ROW && stm.col_uint64(0) > *unchangedsince;
+		return 0;
+	}
+	qstr.pop_back();
+	qstr = "UPDATE messages SET " + qstr + " WHERE message_id=" +
+	       std::to_string(message_id);
+	if (unchangedsince == nullptr) {
+		gx_sql_exec(pidb->psqlite, qstr.c_str());
+	} else {
+		qstr += " AND modseq<=" + std::to_string(*unchangedsince);
+		if (gx_sql_exec(pidb->psqlite, qstr.c_str()) != SQLITE_OK)
+			return MIDB_E_SQLUNEXP;
+		if (sqlite3_changes(pidb->psqlite) == 0) {
+			*refused = true;
+			return 0;
+		}
+	}
+	auto ret = me_flags_set_exmdb(dir, message_id, set);
+	if (ret != 0)
+		return ret;
+	return me_flags_clear_exmdb(dir, message_id, clear);
+}
+
+/**
+ * Set flags on message. For (S)een and (U)nsent, exmdb is contacted(!), which
+ * is different from GFLG.
+ *
+ * Request:
+ * 	P-SFLG <store-dir> <folder-name> <mid> <flags>
+ * Response:
+ * 	TRUE
+ */
+static int me_psflg(int argc, char **argv, int sockd) try
+{
+	uint64_t message_id = 0;
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto ret = me_flags_lookup(pidb.get(), argv[2], argv[3], &message_id);
+	if (ret != 0)
+		return ret;
+	ret = me_flags_apply(pidb.get(), argv[1], message_id, argv[4], "");
+	if (ret != 0)
+		return ret;
+	auto new_flags = flags_rn(pidb->psqlite, message_id);
+	pidb.reset();
+	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1751: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
+/**
+ * Remove flags on message. Flags (S)een and (U)nsent trigger contact to exmdb.
+ *
+ * Request:
+ * 	P-RFLG <store-dir> <folder-name> <mid> <flags>
+ * Response:
+ * 	TRUE
+ */
+static int me_prflg(int argc, char **argv, int sockd) try
+{
+	uint64_t message_id = 0;
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto ret = me_flags_lookup(pidb.get(), argv[2], argv[3], &message_id);
+	if (ret != 0)
+		return ret;
+	ret = me_flags_apply(pidb.get(), argv[1], message_id, "", argv[4]);
+	if (ret != 0)
+		return ret;
 	auto new_flags = flags_rn(pidb->psqlite, message_id);
 	pidb.reset();
 	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
@@ -3251,6 +3973,57 @@ static int me_prflg(int argc, char **argv, int sockd) try
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * Store flags on a message unless it was modified after a given modseq
+ * (STORE UNCHANGEDSINCE, RFC 7162 §3.1.3).
+ *
+ * Request:
+ * 	P-CSFL <store-dir> <folder-name> <mid> <op> <flags> <unchangedsince>
+ * Response:
+ * 	TRUE <flags>	// stored, new flags as with P-SFLG
+ * 	TRUE MODIFIED	// refused, nothing was changed
+ *
+ * <op> is "+" (add), "-" (remove) or "=" (replace the IMAP flags).
+ */
+static int me_pcsfl(int argc, char **argv, int sockd) try
+{
+	uint64_t message_id = 0;
+	uint64_t unchangedsince = strtoull(argv[6], nullptr, 0);
+	std::string clear;
+	const char *set = "";
+	if (strcmp(argv[4], "+") == 0) {
+		set = argv[5];
+	} else if (strcmp(argv[4], "-") == 0) {
+		clear = argv[5];
+	} else if (strcmp(argv[4], "=") == 0) {
+		set = argv[5];
+		for (auto c : {midb_flag::answered, midb_flag::unsent,
+		    midb_flag::flagged, midb_flag::deleted, midb_flag::seen,
+		    midb_flag::recent})
+			if (strchr(set, c) == nullptr)
+				clear += c;
+	} else {
+		return MIDB_E_PARAMETER_ERROR;
+	}
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto ret = me_flags_lookup(pidb.get(), argv[2], argv[3], &message_id);
+	if (ret != 0)
+		return ret;
+	bool refused = false;
+	ret = me_flags_apply(pidb.get(), argv[1], message_id, set,
+	      clear.c_str(), &unchangedsince, &refused);
+	if (ret != 0)
+		return ret;
+	auto rsp = refused ? "TRUE MODIFIED\r\n"s : flags_rn(pidb->psqlite, message_id);
+	pidb.reset();
+	return cmd_write(sockd, rsp.c_str(), rsp.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2979: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 /**
  * Get flags on message from midb.sqlite without contacting exmdb.
  * You better hope that the change notification socket is working,
@@ -3259,7 +4032,7 @@ static int me_prflg(int argc, char **argv, int sockd) try
  * Request:
  * 	P-GFLG <store-dir> <folder-name> <mid>
  * Response:
- * 	TRUE <flags>
+ * 	TRUE <flags> <modseq>
  *
  * Flags: e.g. Answered(A), Unsent(U), Flagged(F), Deleted(D), Read/Seen(S),
  * Recent(R), Forwarded(W)
@@ -3273,7 +4046,7 @@ static int me_pgflg(int argc, char **argv, int sockd) try
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
 	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id, recent, "
-	             "read, unsent, flagged, replied, forwarded, deleted "
+	             "read, unsent, flagged, replied, forwarded, deleted, modseq "
 	             "FROM messages WHERE mid_string=?");
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
@@ -3289,15 +4062,105 @@ static int me_pgflg(int argc, char **argv, int sockd) try
 	if (pstmt.col_int64(7) != 0) ans += midb_flag::deleted;
 	if (pstmt.col_int64(2) != 0) ans += midb_flag::seen;
 	if (pstmt.col_int64(1) != 0) ans += midb_flag::recent;
+	ans += ") " + std::to_string(pstmt.col_uint64(8)) + "\r\n";
 	pstmt.finalize();
 	pidb.reset();
-	ans += ")\r\n";
 	return cmd_write(sockd, ans.c_str(), ans.size());
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2419: ENOMEM");
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * List the IMAP UIDs expunged from a folder after the given modseq.
+ *
+ * Request:
+ * 	P-VNSH <store-dir> <folder-name> <modseq>
+ * Response:
+ * 	TRUE [<uid-set>]
+ *
+ * If the tombstones back to that modseq have been pruned already, every UID
+ * below uidnext which is not in the folder is reported instead; RFC 7162
+ * lets VANISHED (EARLIER) contain UIDs the client never saw.
+ */
+static int me_pvnsh(int argc, char **argv, int sockd) try
+{
+	uint64_t since = strtoull(argv[3], nullptr, 0);
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER;
+	auto qstr = fmt::format("SELECT modseq FROM vanished "
+	            "WHERE folder_id={} AND uid=0", folder_id);
+	auto stm = gx_sql_prep(pidb->psqlite, qstr.c_str());
+	if (stm == nullptr)
+		return MIDB_E_SQLPREP;
+	bool complete = stm.step() != SQLITE_ROW || since >= stm.col_uint64(0);
+	stm.finalize();
+
+	std::string rsp = "TRUE";
+	uint32_t lo = 0, hi = 0;
+	auto emit = [&]() {
+		if (lo == 0)
+			return;
+		rsp += rsp.size() == 4 ? ' ' : ',';
+		rsp += std::to_string(lo);
+		if (hi != lo)
+			rsp += ":" + std::to_string(hi);
+	};
+	if (complete) {
+		qstr = fmt::format("SELECT uid FROM vanished WHERE folder_id={} "
+		       "AND uid<>0 AND modseq>{} ORDER BY uid", folder_id, since);
+		stm = gx_sql_prep(pidb->psqlite, qstr.c_str());
+		if (stm == nullptr)
+			return MIDB_E_SQLPREP;
+		while (stm.step() == SQLITE_ROW) {
+			uint32_t uid = stm.col_uint64(0);
+			if (lo != 0 && (uid == hi || uid == hi + 1)) {
+				hi = uid;
+				continue;
+			}
+			emit();
+			lo = hi = uid;
+		}
+		emit();
+	} else {
+		qstr = fmt::format("SELECT uidnext FROM folders WHERE folder_id={}", folder_id);
+		stm = gx_sql_prep(pidb->psqlite, qstr.c_str());
+		if (stm == nullptr)
+			return MIDB_E_SQLPREP;
+		uint32_t last_uid = stm.step() == SQLITE_ROW ? stm.col_uint64(0) : 0;
+		qstr = fmt::format("SELECT uid FROM messages WHERE folder_id={} ORDER BY uid", folder_id);
+		stm = gx_sql_prep(pidb->psqlite, qstr.c_str());
+		if (stm == nullptr)
+			return MIDB_E_SQLPREP;
+		uint32_t next = 1;
+		while (stm.step() == SQLITE_ROW) {
+			uint32_t uid = stm.col_uint64(0);
+			if (uid > next) {
+				lo = next;
+				hi = uid - 1;
+				emit();
+			}
+			next = std::max(next, uid + 1);
+		}
+		if (next <= last_uid) {
+			lo = next;
+			hi = last_uid;
+			emit();
+		}
+	}
+	stm.finalize();
+	pidb.reset();
+	rsp += "\r\n";
+	return cmd_write(sockd, rsp.c_str(), rsp.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2964: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 /**
  * Search and list messages
  *
@@ -3585,6 +4448,23 @@ static void notif_msg_added(IDB_ITEM *pidb,
 	me_insert_message(pstmt, &uidnext, message_id, pidb->psqlite,
 		syncmessage_entry{mod_time, received_time, message_flags,
 		znul(str), set_answered, set_forwarded, b_flagged});
+	pstmt.finalize();
+	auto sidx = me_sidx_get(pidb);
+	if (sidx == nullptr && pidb->imap_charset.empty())
+		return;
+	qstr = fmt::format("SELECT mid_string FROM messages WHERE message_id={}", message_id);
+	pstmt = gx_sql_prep(pidb->psqlite, qstr.c_str());
+	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+		return;
+	std::string mid = pstmt.col_text(0);
+	pstmt.finalize();
+	if (sidx != nullptr)
+		me_sidx_index(sidx, pidb->psqlite, mid.c_str());
+	/* Have the renderings ready for when imap fetches the new message */
+	std::string bin, body, bs, env;
+	if (!pidb->imap_charset.empty() && me_get_ext(mid.c_str(), bin))
+		me_imapcache_fill(pidb->psqlite, mid.c_str(),
+			pidb->imap_charset.c_str(), bin, body, bs, env);
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2418: ENOMEM");
 }
@@ -3593,13 +4473,16 @@ static void notif_msg_deleted(IDB_ITEM *pidb,
     uint64_t folder_id, uint64_t message_id, const std::string &username,
     const char *folder_name) try
 {
-	auto qstr = fmt::format("SELECT folder_id, uid FROM "
+	auto qstr = fmt::format("SELECT folder_id, uid, mid_string FROM "
 	            "messages WHERE message_id={}", message_id);
 	auto pstmt = gx_sql_prep(pidb->psqlite, qstr.c_str());
 	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW ||
 	    gx_sql_col_uint64(pstmt, 0) != folder_id)
 		return;
 	auto uid = pstmt.col_uint64(1);
+	auto sidx = me_sidx_get(pidb);
+	if (sidx != nullptr)
+		me_sidx_forget(sidx, znul(pstmt.col_text(2)));
 	pstmt.finalize();
 	qstr = fmt::format("DELETE FROM messages WHERE message_id={}", message_id);
 	gx_sql_exec(pidb->psqlite, qstr.c_str());
@@ -4087,14 +4970,17 @@ static constexpr struct {
 	{"P-SUBF", {me_psubf, 3}},
 	{"P-UNSF", {me_punsf, 3}},
 	{"P-SUBL", {me_psubl, 2}},
-	{"P-SIMU", {me_psimu, 5}},
+	{"P-SIMU", {me_psimu, 5, 6}},
 	{"P-DELL", {me_pdell, 3}},
-	{"P-DTLU", {me_pdtlu, 5}},
+	{"P-DTLU", {me_pdtlu, 5, 6}},
+	{"P-DTLB", {me_pdtlb, 5, 6}},
 	{"P-SFLG", {me_psflg, 5}},
 	{"P-RFLG", {me_prflg, 5}},
+	{"P-CSFL", {me_pcsfl, 7}},
 	{"P-GFLG", {me_pgflg, 4}},
 	{"P-SRHL", {me_psrhl, 5}},
 	{"P-SRHU", {me_psrhu, 5}},
+	{"P-VNSH", {me_pvnsh, 4}},
 	{"X-UNLD", {me_xunld, 2}},
 	{"X-RSYM", {me_xrsym, 2}},
 	{"X-RSYF", {me_xrsyf, 3}},
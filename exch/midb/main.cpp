@@ -95,6 +95,7 @@ static constexpr cfg_directive midb_cfg_defaults[] = {
 	{"midb_log_level", "4" /* LV_NOTICE */},
 	{"midb_reload_interval", "60min", CFG_TIME, "1min", "1year"},
 	{"midb_schema_upgrades", "auto"},
+	{"midb_search_index", "yes", CFG_BOOL},
 	{"midb_table_size", "5000", CFG_SIZE, "100", "50000"},
 	{"midb_threads_num", "100", CFG_SIZE, "20", "1000"},
 	{"notify_stub_threads_num", "10", CFG_SIZE, "1", "200"},
@@ -125,6 +126,7 @@ static bool midb_reload_config(std::shared_ptr<config_file> gxconfig = nullptr,
 	g_cmd_debug = pconfig->get_ll("midb_cmd_debug");
 	g_midb_cache_interval = pconfig->get_ll("midb_cache_interval");
 	g_midb_reload_interval = pconfig->get_ll("midb_reload_interval");
+	g_midb_search_index = pconfig->get_ll("midb_search_index");
 	auto s = pconfig->get_value("midb_schema_upgrades");
 	if (strcmp(s, "auto") == 0)
 		g_midb_schema_upgrades = MIDB_UPGRADE_AUTO;
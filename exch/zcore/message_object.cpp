@@ -10,6 +10,7 @@
 #include <vector>
 #include <libHX/string.h>
 #include <gromox/defs.h>
+#include <gromox/exmdb_client.hpp>
 #include <gromox/ext_buffer.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/mapidefs.h>
@@ -244,7 +245,6 @@ errno_t message_object::init_message(bool fai, cpid_t new_cpid)
 ec_error_t message_object::save()
 {
 	auto pmessage = this;
-	uint32_t result;
 	BINARY *pbin_pcl;
 	uint32_t *pgroup_id;
 	INDEX_ARRAY tmp_indices;
@@ -255,12 +255,29 @@ ec_error_t message_object::save()
 		return ecSuccess;
 	auto dir = pmessage->pstore->get_dir();
 	auto pinfo = zs_get_info();
-	if (!exmdb_client::allocate_cn(dir, &pmessage->change_num))
-		return ecError;
-	void *assoc = nullptr;
-	if (!exmdb_client_get_instance_property(dir, pmessage->instance_id,
-	    PR_ASSOCIATED, &assoc))
+	/* Change number and current instance state in one round trip */
+	static constexpr uint32_t pre_tags[] = {PR_ASSOCIATED, PR_PREDECESSOR_CHANGE_LIST};
+	PROPTAG_ARRAY pre_proptags = {std::size(pre_tags), deconst(pre_tags)};
+	exmdb_batch pre_batch(dir, EXMDB_BATCH_STOP_ON_ERROR);
+	size_t i_cn, i_props;
+	try {
+		auto q = std::make_unique<exreq_allocate_cn>();
+		q->call_id = exmdb_callid::allocate_cn;
+		i_cn = pre_batch.add<exresp_allocate_cn>(std::move(q));
+		auto q1 = std::make_unique<exreq_get_instance_properties>();
+		q1->call_id = exmdb_callid::get_instance_properties;
+		q1->size_limit = 0;
+		q1->instance_id = pmessage->instance_id;
+		q1->pproptags = &pre_proptags;
+		i_props = pre_batch.add<exresp_get_instance_properties>(std::move(q1));
+	} catch (const std::bad_alloc &) {
+		return ecServerOOM;
+	}
+	if (!pre_batch.flush() || !pre_batch.ok(i_cn) || !pre_batch.ok(i_props))
 		return ecError;
+	pmessage->change_num = pre_batch.get<exresp_allocate_cn>(i_cn)->cn;
+	auto &pre_vals = pre_batch.get<exresp_get_instance_properties>(i_props)->propvals;
+	auto assoc = pre_vals.getval(PR_ASSOCIATED);
 	BOOL b_fai = pvb_disabled(assoc) ? false : TRUE;
 	tmp_propvals.count = 0;
 	tmp_propvals.ppropval = cu_alloc<TAGGED_PROPVAL>(8);
@@ -292,10 +309,7 @@ ec_error_t message_object::save()
 	tmp_propvals.emplace_back(PR_LAST_MODIFIER_ENTRYID, abk_eid);
 
 	if (0 != pmessage->message_id) {
-		if (!exmdb_client_get_instance_property(dir,
-		    pmessage->instance_id, PR_PREDECESSOR_CHANGE_LIST,
-		    reinterpret_cast<void **>(&pbin_pcl)))
-			return ecError;
+		pbin_pcl = static_cast<BINARY *>(pre_vals.getval(PR_PREDECESSOR_CHANGE_LIST));
 		if (!pmessage->b_new && pbin_pcl == nullptr)
 			return ecError;
 
@@ -319,14 +333,29 @@ ec_error_t message_object::save()
 	*/
 	tmp_propval.proptag = PidTagChangeNumber;
 	tmp_propval.pvalue = &pmessage->change_num;
-	if (!exmdb_client_set_instance_property(dir,
-	    pmessage->instance_id, &tmp_propval, &result))
+	TPROPVAL_ARRAY cn_vals = {1, &tmp_propval};
+	exmdb_batch flush_batch(dir, EXMDB_BATCH_STOP_ON_ERROR);
+	size_t i_set, i_flush;
+	try {
+		auto q = std::make_unique<exreq_set_instance_properties>();
+		q->call_id = exmdb_callid::set_instance_properties;
+		q->instance_id = pmessage->instance_id;
+		q->pproperties = &cn_vals;
+		i_set = flush_batch.add<exresp_set_instance_properties>(std::move(q));
+		auto q1 = std::make_unique<exreq_flush_instance>();
+		q1->call_id = exmdb_callid::flush_instance;
+		q1->instance_id = pmessage->instance_id;
+		i_flush = flush_batch.add<exresp_flush_instance>(std::move(q1));
+	} catch (const std::bad_alloc &) {
 		return ecServerOOM;
-	
-	ec_error_t e_result = ecError;
-	if (!exmdb_client::flush_instance(dir, pmessage->instance_id,
-	    &e_result) || e_result != ecSuccess)
-		return e_result;
+	}
+	if (!flush_batch.flush() || !flush_batch.ok(i_set))
+		return ecRpcFailed;
+	auto flush_resp = flush_batch.get<exresp_flush_instance>(i_flush);
+	if (flush_resp == nullptr)
+		return ecRpcFailed;
+	if (flush_resp->e_result != ecSuccess)
+		return flush_resp->e_result;
 
 	auto is_new = pmessage->b_new;
 	pmessage->b_new = FALSE;
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <sqlite3.h>
 #include <gromox/defs.h>
@@ -43,13 +44,17 @@ class GX_EXPORT xsavepoint {
 
 extern GX_EXPORT int gx_sql_step(sqlite3_stmt *, unsigned int flags = 0);
 
+class stmt_cache;
+
+/**
+ * Statement handle. If obtained from a handle's statement cache (see
+ * gx_sql_cache_attach), the statement is returned to @m_home instead of
+ * being finalized.
+ */
 struct GX_EXPORT xstmt {
 	xstmt() = default;
-	xstmt(xstmt &&o) noexcept : m_ptr(o.m_ptr) { o.m_ptr = nullptr; }
-	~xstmt() {
-		if (m_ptr != nullptr)
-			sqlite3_finalize(m_ptr);
-	}
+	xstmt(xstmt &&o) noexcept : m_ptr(o.m_ptr), m_home(std::move(o.m_home)) { o.m_ptr = nullptr; }
+	~xstmt() { finalize(); }
 	/*
 	 * How sqlite treats literals in SQL command text:
 	 * - if L is a hex integer literal (0x prefix),
@@ -69,20 +74,17 @@ struct GX_EXPORT xstmt {
 	inline uint64_t col_uint64(unsigned int col) { return sqlite3_column_int64(m_ptr, col); }
 	inline int step(unsigned int flags = 0) { return gx_sql_step(m_ptr, flags); }
 	inline int reset() { return sqlite3_reset(m_ptr); }
-	void finalize() {
-		if (m_ptr != nullptr)
-			sqlite3_finalize(m_ptr);
-		m_ptr = nullptr;
-	}
+	void finalize();
 	inline void operator=(std::nullptr_t) { finalize(); }
 	void operator=(xstmt &&o) noexcept {
-		if (m_ptr != nullptr)
-			sqlite3_finalize(m_ptr);
+		finalize();
 		m_ptr = o.m_ptr;
+		m_home = std::move(o.m_home);
 		o.m_ptr = nullptr;
 	}
 	operator sqlite3_stmt *() { return m_ptr; }
 	sqlite3_stmt *m_ptr = nullptr;
+	std::shared_ptr<stmt_cache> m_home;
 };
 
 enum {
@@ -97,6 +99,10 @@ extern GX_EXPORT struct xstmt gx_sql_prep(sqlite3 *, const char *);
 extern GX_EXPORT xtransaction gx_sql_begin3(const std::string &, sqlite3 *, txn_mode);
 #define gx_sql_begin(...) gx_sql_begin3(std::string(__FILE__) + ":" + std::to_string(__LINE__), __VA_ARGS__)
 extern GX_EXPORT int gx_sql_exec(sqlite3 *, const char *query, unsigned int flags = 0);
+extern GX_EXPORT void gx_sql_cache_attach(sqlite3 *, size_t max_stmts);
+extern GX_EXPORT void gx_sql_cache_detach(sqlite3 *);
+extern GX_EXPORT void gx_sql_cache_flush(sqlite3 *);
+extern GX_EXPORT void gx_sql_cache_stats(uint64_t &hits, uint64_t &misses);
 
 static inline uint64_t gx_sql_col_uint64(sqlite3_stmt *s, int c)
 {
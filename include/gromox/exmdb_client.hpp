@@ -3,15 +3,18 @@
 #include <condition_variable>
 #include <ctime>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <string>
+#include <vector>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/fileio.h>
 #include <gromox/list_file.hpp>
 
 struct DB_NOTIFY;
-struct exreq;
-struct exresp;
 
 namespace gromox {
 
@@ -31,12 +34,14 @@ enum {
 	EXMDB_CLIENT_ASYNC_CONNECT = 0x8U,
 };
 
+struct mux_conn;
 struct remote_svr;
 
 struct agent_thread {
 	remote_svr *pserver = nullptr;
 	pthread_t thr_id{};
 	int sockd = -1;
+	bool b_batch = false; /* EXMDB_PROTO_NOTIFY_BATCH negotiated */
 	gromox::atomic_bool startup_wait{false};
 	std::condition_variable startup_cv;
 };
@@ -54,7 +59,9 @@ struct remote_conn {
 struct GX_EXPORT remote_svr : public EXMDB_ITEM {
 	remote_svr(EXMDB_ITEM &&o) noexcept : EXMDB_ITEM(std::move(o)) {}
 	std::list<remote_conn> conn_list;
+	std::vector<std::shared_ptr<mux_conn>> mux_list;
 	std::atomic<unsigned int> active_handles{0};
+	bool mux_refused = false; /* server does not speak EXMDB_PROTO_MUX */
 };
 
 struct GX_EXPORT remote_conn_ref {
@@ -77,8 +84,81 @@ using REMOTE_CONN_floating = remote_conn_ref;
 
 extern GX_EXPORT void exmdb_client_init(unsigned int conn_max, unsigned int notify_threads_max);
 extern GX_EXPORT void exmdb_client_stop();
+extern GX_EXPORT void exmdb_client_set_mux_connections(unsigned int);
 extern GX_EXPORT int exmdb_client_run(const char *dir, unsigned int fl = EXMDB_CLIENT_NO_FLAGS, void (*)(const remote_svr &) = nullptr, void (*)() = nullptr, void (*)(const char *, BOOL, uint32_t, const DB_NOTIFY *) = nullptr);
 extern GX_EXPORT bool exmdb_client_is_local(const char *pfx, BOOL *pvt);
+extern GX_EXPORT bool exmdb_client_is_samehost(const char *pfx);
 extern GX_EXPORT BOOL exmdb_client_do_rpc(const exreq *, exresp *);
 
+/**
+ * Collects exmdb calls for one store and executes them in a single round
+ * trip (exmdb_callid::batch).
+ *
+ * 	exmdb_batch b(dir);
+ * 	auto q = std::make_unique<exreq_get_message_properties>();
+ * 	q->call_id = exmdb_callid::get_message_properties;
+ * 	...
+ * 	auto i = b.add<exresp_get_message_properties>(std::move(q));
+ * 	if (b.flush()) { auto r = b.get<exresp_get_message_properties>(i); ... }
+ *
+ * The executor passed to flush is exmdb_client_do_rpc by default; plugins
+ * running alongside exmdb_provider use the "exmdb_client_batch" service
+ * instead so that local stores are served without a socket.
+ */
+class GX_EXPORT exmdb_batch {
+	public:
+	using exec_t = BOOL (*)(const exreq *, exresp *);
+
+	exmdb_batch(const char *dir, unsigned int flags = 0);
+	NOMOVE(exmdb_batch);
+
+	/* Queue @q (call_id set by caller); returns its index. Throws bad_alloc. */
+	template<typename R> size_t add(std::unique_ptr<exreq> &&q)
+	{
+		return add(std::move(q), std::make_unique<R>());
+	}
+	size_t add(std::unique_ptr<exreq> &&, std::unique_ptr<exresp> &&);
+	size_t size() const { return m_req.reqs.size(); }
+	/* Transport/batch-level failure returns false; see ok()/get() for the calls */
+	BOOL flush(exec_t = exmdb_client_do_rpc);
+	bool ok(size_t i) const;
+	template<typename R> R *get(size_t i) const
+	{
+		return ok(i) ? static_cast<R *>(m_resp.resps[i].get()) : nullptr;
+	}
+	void clear();
+
+	private:
+	std::string m_dir;
+	exreq_batch m_req;
+	exresp_batch m_resp;
+};
+
+/**
+ * Random access to a file below a store's eml/ or ext/ directory without
+ * loading all of it. When exmdb_list.txt says the store is on this host, the
+ * file is opened directly; otherwise ranges are pulled with
+ * imapfile_read_range, so the caller must have its RPC environment set up
+ * around open() and read().
+ */
+class GX_EXPORT imapfile_reader {
+	public:
+	imapfile_reader() = default;
+	~imapfile_reader() { close(); }
+	NOMOVE(imapfile_reader);
+
+	bool open(const char *dir, const char *type, const char *mid);
+	void close();
+	bool is_open() const { return m_open; }
+	uint64_t size() const { return m_size; }
+	bool read(void *buf, size_t len, uint64_t ofs);
+
+	private:
+	static constexpr size_t READAHEAD = 256U << 10;
+	wrapfd m_fd;
+	std::string m_dir, m_type, m_mid, m_buf;
+	uint64_t m_bufofs = 0, m_size = 0;
+	bool m_open = false;
+};
+
 }
@@ -140,3 +140,9 @@ EXMIDL(recalc_store_size, (const char *dir, uint32_t flags))
 EXMIDL(imapfile_read, (const char *dir, const std::string &type, const std::string &mid, IDLOUT std::string *data))
 EXMIDL(imapfile_write, (const char *dir, const std::string &type, const std::string &mid, const std::string &data))
 EXMIDL(imapfile_delete, (const char *dir, const std::string &type, const std::string &mid))
+EXMIDL(fts_rebuild, (const char *dir))
+EXMIDL(hotprops_setup, (const char *dir, uint32_t flags))
+EXMIDL(backup_read, (const char *dir, uint64_t session, uint64_t rate, IDLOUT uint64_t *next_session, std::string *data))
+EXMIDL(store_cache_stats, (const char *dir, IDLOUT uint64_t *mem, uint64_t *hits, uint64_t *misses))
+EXMIDL(read_attachment_instance_range, (const char *dir, uint32_t instance_id, uint32_t proptag, uint64_t offset, uint32_t length, IDLOUT BINARY *data, uint64_t *total))
+EXMIDL(imapfile_read_range, (const char *dir, const std::string &type, const std::string &mid, uint64_t offset, uint32_t length, IDLOUT std::string *data, uint64_t *total))
@@ -7,6 +7,7 @@
 struct message_content;
 
 extern int exmdb_client_run_front(const char *);
+extern BOOL exmdb_client_local_batch(const exreq *, exresp *);
 extern BOOL exmdb_client_relay_delivery(const char *dir, const char *ev_from, const char *ev_to, cpid_t, const message_content *, const char *digest, uint32_t *result);
 
 namespace exmdb_client_local {
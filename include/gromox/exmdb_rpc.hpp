@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
 #include <gromox/element_data.hpp>
@@ -24,6 +25,23 @@ enum class exmdb_response : uint8_t {
 	invalid = 0xff,
 };
 
+/*
+ * Flags for exreq_connect::proto_flags, exreq_listen_notification::proto_flags
+ * and the respective responses
+ */
+enum {
+	/*
+	 * Frames carry a request ID so that several requests can be in flight
+	 * on the same connection and be answered out of order.
+	 */
+	EXMDB_PROTO_MUX = 0x1U,
+	/*
+	 * (listen_notification only) Notification frames carry a count and
+	 * several datagrams, acknowledged together.
+	 */
+	EXMDB_PROTO_NOTIFY_BATCH = 0x2U,
+};
+
 enum class exmdb_callid : uint8_t {
 	connect = 0x00,
 	listen_notification = 0x01,
@@ -170,6 +188,13 @@ enum class exmdb_callid : uint8_t {
 	imapfile_read = 0x8e,
 	imapfile_write = 0x8f,
 	imapfile_delete = 0x90,
+	batch = 0x91,
+	fts_rebuild = 0x92,
+	hotprops_setup = 0x93,
+	backup_read = 0x94,
+	store_cache_stats = 0x95,
+	read_attachment_instance_range = 0x96,
+	imapfile_read_range = 0x97,
 	/* update exch/exmdb_provider/names.cpp:exmdb_rpc_idtoname! */
 };
 
@@ -184,10 +209,12 @@ struct exreq_connect final : public exreq {
 	char *prefix;
 	char *remote_id;
 	BOOL b_private;
+	uint32_t proto_flags = 0; /* optional trailer; absent with old clients */
 };
 
 struct exreq_listen_notification final : public exreq {
 	char *remote_id;
+	uint32_t proto_flags = 0; /* optional trailer; absent with old clients */
 };
 
 struct exreq_get_named_propids final : public exreq {
@@ -855,6 +882,25 @@ struct exreq_recalc_store_size final : public exreq {
 	uint32_t flags = 0;
 };
 
+/* Flags for exreq_hotprops_setup::flags; without ENABLE, the mirror is removed */
+enum {
+	HOTPROPS_ENABLE = 0x1U,
+};
+
+struct exreq_hotprops_setup final : public exreq {
+	uint32_t flags = 0;
+};
+
+struct exreq_backup_read final : public exreq {
+	uint64_t session = 0, rate = 0;
+};
+
+struct exreq_read_attachment_instance_range final : public exreq {
+	uint32_t instance_id = 0, proptag = 0;
+	uint64_t offset = 0;
+	uint32_t length = 0;
+};
+
 struct exreq_imapfile_read final : public exreq {
 	std::string type, mid;
 };
@@ -865,6 +911,31 @@ struct exreq_imapfile_write final : public exreq {
 
 using exreq_imapfile_delete = exreq_imapfile_read;
 
+struct exreq_imapfile_read_range final : public exreq {
+	std::string type, mid;
+	uint64_t offset = 0;
+	uint32_t length = 0;
+};
+
+/* Flags for exreq_batch::flags */
+enum {
+	/* Do not execute the remaining sub-requests after one has failed */
+	EXMDB_BATCH_STOP_ON_ERROR = 0x1U,
+};
+
+/* Upper bound for the number of sub-requests in one batch */
+static constexpr uint32_t EXMDB_BATCH_MAX = 1024;
+
+/*
+ * A run of requests for the same store, executed in order by the server
+ * under a single database acquisition. The sub-requests implicitly use the
+ * dir of the batch; they cannot be connect, listen_notification or batch.
+ */
+struct exreq_batch final : public exreq {
+	uint8_t flags = 0;
+	std::vector<std::unique_ptr<exreq>> reqs;
+};
+
 struct exresp {
 	exresp() = default; /* Prevent use of direct-init-list */
 	virtual ~exresp() = default;
@@ -1312,6 +1383,25 @@ struct exresp_imapfile_read final : public exresp {
 	std::string data;
 };
 
+struct exresp_imapfile_read_range final : public exresp {
+	std::string data;
+	uint64_t total = 0;
+};
+
+struct exresp_backup_read final : public exresp {
+	uint64_t next_session = 0;
+	std::string data;
+};
+
+struct exresp_store_cache_stats final : public exresp {
+	uint64_t mem = 0, hits = 0, misses = 0;
+};
+
+struct exresp_read_attachment_instance_range final : public exresp {
+	BINARY data{};
+	uint64_t total = 0;
+};
+
 using exreq_ping_store = exreq;
 using exreq_get_all_named_propids = exreq;
 using exreq_get_store_all_proptags = exreq;
@@ -1320,6 +1410,8 @@ using exreq_allocate_cn = exreq;
 using exreq_vacuum = exreq;
 using exreq_unload_store = exreq;
 using exreq_purge_datafiles = exreq;
+using exreq_fts_rebuild = exreq;
+using exreq_store_cache_stats = exreq;
 using exreq_create_folder_v1 = exreq_create_folder;
 using exresp_remove_folder_properties = exresp;
 using exresp_reload_content_table = exresp;
@@ -1351,6 +1443,8 @@ using exresp_ping_store = exresp;
 using exresp_notify_new_mail = exresp;
 using exresp_purge_softdelete = exresp;
 using exresp_purge_datafiles = exresp;
+using exresp_fts_rebuild = exresp;
+using exresp_hotprops_setup = exresp;
 using exresp_autoreply_tsupdate = exresp;
 using exresp_recalc_store_size = exresp;
 using exresp_flush_instance = exresp_error;
@@ -1359,6 +1453,16 @@ using exresp_movecopy_folder = exresp_error;
 using exresp_imapfile_write = exresp;
 using exresp_imapfile_delete = exresp;
 
+struct exresp_batch final : public exresp {
+	/* One entry per executed sub-request; shorter than reqs if stopped early */
+	std::vector<exmdb_response> status;
+	/*
+	 * Sub-responses. For exmdb_ext_pull_response, the caller provides
+	 * objects of the right type (with call_id set) for every sub-request.
+	 */
+	std::vector<std::unique_ptr<exresp>> resps;
+};
+
 struct DB_NOTIFY_DATAGRAM {
 	char *dir = nullptr;
 	BOOL b_table = false;
@@ -1370,6 +1474,8 @@ extern GX_EXPORT pack_result exmdb_ext_pull_request(const BINARY *, std::unique_
 extern GX_EXPORT pack_result exmdb_ext_push_request(const exreq *, BINARY *);
 extern GX_EXPORT pack_result exmdb_ext_pull_response(const BINARY *, exresp *partial_fill_by_caller);
 extern GX_EXPORT pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *);
+extern GX_EXPORT pack_result exmdb_ext_push_mux_request(const exreq *, uint32_t reqid, BINARY *);
+extern GX_EXPORT pack_result exmdb_ext_push_mux_response(const exresp *, uint32_t reqid, BINARY *);
 extern GX_EXPORT pack_result exmdb_ext_pull_db_notify(const BINARY *, DB_NOTIFY_DATAGRAM *);
 extern GX_EXPORT pack_result exmdb_ext_push_db_notify(const DB_NOTIFY_DATAGRAM *, BINARY *);
 extern GX_EXPORT const char *exmdb_rpc_strerror(exmdb_response);
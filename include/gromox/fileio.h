@@ -91,6 +91,8 @@ extern GX_EXPORT void startup_banner(const char *);
 extern GX_EXPORT std::string zstd_decompress(std::string_view);
 extern GX_EXPORT size_t gx_decompressed_size(const char *);
 extern GX_EXPORT errno_t gx_decompress_file(const char *, BINARY &, void *(*)(size_t), void *(*)(void *, size_t));
+extern GX_EXPORT errno_t gx_decompress_file_range(const char *, uint64_t offset, uint32_t length, BINARY &, void *(*)(size_t), uint64_t *total);
+extern GX_EXPORT ssize_t gx_pread_full(int fd, void *, size_t, uint64_t offset);
 extern GX_EXPORT errno_t gx_compress_tofd(std::string_view, int fd, uint8_t complvl = 0);
 extern GX_EXPORT errno_t gx_compress_tofile(std::string_view, const char *outfile, uint8_t complvl = 0, unsigned int mode = FMODE_PRIVATE);
 extern GX_EXPORT std::string base64_encode(const std::string_view &);
@@ -34,6 +34,7 @@ struct EXMDB_ITEM {
 		EXMDB_PUBLIC,
 	} type;
 	bool local = false;
+	bool samehost = false; /* host is this machine, whether or not direct */
 };
 
 extern GX_EXPORT std::unique_ptr<LIST_FILE> list_file_initd(const char *filename, const char *sdlist, const char *format, unsigned int mode = EMPTY_ON_ABSENCE);
@@ -29,6 +29,7 @@ struct GX_EXPORT MAIL {
 	const MIME *get_head() const;
 	bool get_charset(std::string &out) const;
 	int make_digest(size_t *offset, Json::Value &) const;
+	int make_digest(size_t *offset, const char *file, std::string &) const;
 	MIME *add_child(MIME *base, int opt);
 	void enum_mime(MAIL_MIME_ENUM, void *) const;
 	bool dup(MAIL *dst);
@@ -2,6 +2,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <json/value.h>
@@ -60,6 +61,7 @@ struct GX_EXPORT MJSON_MIME {
 struct GX_EXPORT MJSON {
 	void clear();
 	BOOL load_from_json(const Json::Value &);
+	BOOL load_from_digest(std::string_view);
 	int fetch_structure(mjson_io &, const char *cset, BOOL ext, std::string &out) const;
 	int fetch_envelope(const char *cset, std::string &out) const;
 	bool has_rfc822_part() const;
@@ -90,6 +92,10 @@ struct GX_EXPORT MJSON {
 	}
 };
 
+extern GX_EXPORT bool mjson_digest_is_binary(std::string_view);
+extern GX_EXPORT bool mjson_digest_pack(const Json::Value &, std::string &);
+extern GX_EXPORT bool mjson_digest_unpack(std::string_view, Json::Value &);
+
 enum {
 	MJSON_FLAG_READ,
 	MJSON_FLAG_REPLIED,
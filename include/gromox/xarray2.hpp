@@ -2,17 +2,22 @@
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
 #pragma once
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <vector>
-#include <json/value.h>
 #include <gromox/defs.h>
 
+/**
+ * @digest:	stored digest, for MJSON::load_from_digest
+ * @imapcset:	charset that @imapbody, @imapbs and @imapenv were made for
+ */
 struct MITEM {
 	std::string mid;
 	int id = 0, uid = 0;
 	char flag_bits = 0;
-	Json::Value digest;
+	uint64_t modseq = 0;
+	std::string digest, imapcset, imapbody, imapbs, imapenv;
 };
 
 /**
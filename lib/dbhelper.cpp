@@ -1,11 +1,16 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021-2023 grommunio GmbH
 // This file is part of Gromox.
+#include <atomic>
 #include <cstdio>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <unordered_map>
 #include <sqlite3.h>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 #include <fmt/core.h>
 #include <gromox/database.h>
@@ -14,10 +19,158 @@
 
 namespace gromox {
 
+/**
+ * LRU-bounded set of idle (reset) prepared statements of one sqlite3 handle,
+ * keyed by SQL text. A statement that is handed out leaves the cache and only
+ * comes back when its xstmt is finalized.
+ */
+class stmt_cache {
+	public:
+	stmt_cache(size_t max) : m_max(max) {}
+	~stmt_cache() { close(); }
+	NOMOVE(stmt_cache);
+	sqlite3_stmt *get(const char *query);
+	void put(sqlite3_stmt *);
+	void clear();
+	void close();
+
+	private:
+	using lru_list = std::list<std::pair<std::string, sqlite3_stmt *>>;
+	std::mutex m_lock;
+	lru_list m_lru; /* most recently used first */
+	std::unordered_map<std::string_view, lru_list::iterator> m_index;
+	size_t m_max = 0;
+	bool m_closed = false;
+};
+
 static std::unordered_map<std::string, std::string> active_xa; /* which callchain obtained RW */
 static std::mutex active_xa_lock;
+static std::shared_mutex g_stmtcache_lock;
+static std::unordered_map<const sqlite3 *, std::shared_ptr<stmt_cache>> g_stmtcache_map;
+static std::atomic<size_t> g_stmtcache_count;
+static std::atomic<uint64_t> g_stmtcache_hits, g_stmtcache_misses;
 unsigned int gx_sqlite_debug, gx_force_write_txn, gx_sql_deep_backtrace;
 
+sqlite3_stmt *stmt_cache::get(const char *query)
+{
+	std::lock_guard lk(m_lock);
+	auto it = m_index.find(query);
+	if (it == m_index.end())
+		return nullptr;
+	auto stm = it->second->second;
+	auto node = it->second;
+	m_index.erase(it);
+	m_lru.erase(node);
+	return stm;
+}
+
+void stmt_cache::put(sqlite3_stmt *stm) try
+{
+	sqlite3_reset(stm);
+	sqlite3_clear_bindings(stm);
+	std::lock_guard lk(m_lock);
+	if (m_closed) {
+		sqlite3_finalize(stm);
+		return;
+	}
+	auto it = m_index.find(sqlite3_sql(stm));
+	if (it != m_index.end()) {
+		/* Two users had the same query at once; keep one. */
+		sqlite3_finalize(stm);
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return;
+	}
+	m_lru.emplace_front(sqlite3_sql(stm), stm);
+	m_index.emplace(m_lru.front().first, m_lru.begin());
+	while (m_lru.size() > m_max) {
+		m_index.erase(m_lru.back().first);
+		sqlite3_finalize(m_lru.back().second);
+		m_lru.pop_back();
+	}
+} catch (const std::bad_alloc &) {
+	sqlite3_finalize(stm);
+}
+
+void stmt_cache::clear()
+{
+	std::lock_guard lk(m_lock);
+	m_index.clear();
+	for (auto &e : m_lru)
+		sqlite3_finalize(e.second);
+	m_lru.clear();
+}
+
+void stmt_cache::close()
+{
+	clear();
+	std::lock_guard lk(m_lock);
+	m_closed = true;
+}
+
+static std::shared_ptr<stmt_cache> stmt_cache_of(const sqlite3 *db)
+{
+	std::shared_lock lk(g_stmtcache_lock);
+	auto it = g_stmtcache_map.find(db);
+	return it != g_stmtcache_map.end() ? it->second : nullptr;
+}
+
+/**
+ * Give @db a statement cache of up to @max idle statements. Only statements
+ * with bind parameters are kept, since SQL with inlined values is rarely
+ * seen twice. The cache must be detached before @db is closed.
+ */
+void gx_sql_cache_attach(sqlite3 *db, size_t max) try
+{
+	if (max == 0)
+		return;
+	auto c = std::make_shared<stmt_cache>(max);
+	std::unique_lock lk(g_stmtcache_lock);
+	g_stmtcache_map[db] = std::move(c);
+	g_stmtcache_count = g_stmtcache_map.size();
+} catch (const std::bad_alloc &) {
+	mlog(LV_WARN, "W-2919: ENOMEM, no statement cache for this handle");
+}
+
+void gx_sql_cache_detach(sqlite3 *db)
+{
+	std::unique_lock lk(g_stmtcache_lock);
+	auto it = g_stmtcache_map.find(db);
+	if (it == g_stmtcache_map.end())
+		return;
+	/* Statements still out are finalized on return. */
+	it->second->close();
+	g_stmtcache_map.erase(it);
+	g_stmtcache_count = g_stmtcache_map.size();
+}
+
+/**
+ * Drop all idle statements of @db, e.g. after a schema change.
+ */
+void gx_sql_cache_flush(sqlite3 *db)
+{
+	auto c = stmt_cache_of(db);
+	if (c != nullptr)
+		c->clear();
+}
+
+void gx_sql_cache_stats(uint64_t &hits, uint64_t &misses)
+{
+	hits = g_stmtcache_hits;
+	misses = g_stmtcache_misses;
+}
+
+void xstmt::finalize()
+{
+	if (m_ptr == nullptr)
+		return;
+	if (m_home != nullptr)
+		m_home->put(m_ptr);
+	else
+		sqlite3_finalize(m_ptr);
+	m_ptr = nullptr;
+	m_home.reset();
+}
+
 static bool write_statement(const char *q)
 {
 	return strncasecmp(q, "CREATE", 6) == 0 || strncasecmp(q, "ALTER", 5) == 0 ||
@@ -36,11 +189,25 @@ xstmt gx_sql_prep(sqlite3 *db, const char *query)
 		mlog(LV_ERR, "sqlite_prep(%s) \"%s\": illegal ro->rw switch at [%s]",
 			znul(sqlite3_db_filename(db, nullptr)),
 			query, simple_backtrace().c_str());
+	auto cache = g_stmtcache_count > 0 ? stmt_cache_of(db) : nullptr;
+	if (cache != nullptr) {
+		out.m_ptr = cache->get(query);
+		if (out.m_ptr != nullptr) {
+			++g_stmtcache_hits;
+			out.m_home = std::move(cache);
+			return out;
+		}
+	}
 	int ret = sqlite3_prepare_v2(db, query, -1, &out.m_ptr, nullptr);
 	if (ret != SQLITE_OK)
 		mlog(LV_ERR, "sqlite_prep(%s) \"%s\": %s (%d)",
 			znul(sqlite3_db_filename(db, nullptr)),
 		        query, sqlite3_errstr(ret), ret);
+	else if (cache != nullptr && out.m_ptr != nullptr &&
+	    sqlite3_bind_parameter_count(out.m_ptr) > 0) {
+		++g_stmtcache_misses;
+		out.m_home = std::move(cache);
+	}
 	return out;
 }
 
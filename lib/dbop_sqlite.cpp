@@ -346,6 +346,38 @@ static constexpr char tbl_fixsyseidalloc_16[] =
 static constexpr char tbl_fixsyseidalloc_17[] =
 "UPDATE configurations SET config_value=(SELECT MAX(range_end) FROM allocated_eids) WHERE config_id=3"; // CONIFG_ID_MAXIMUM_EID
 
+/*
+ * Tombstones record which messages left which folder, so that ICS does not
+ * have to probe every MID of the client's idset to find deletions.
+ */
+#define TBL_TOMBSTONES_18 \
+"CREATE TABLE IF NOT EXISTS `message_tombstones` (" \
+"  `message_id` INTEGER PRIMARY KEY," \
+"  `folder_id` INTEGER NOT NULL," \
+"  `is_associated` INTEGER," \
+"  `delete_time` INTEGER NOT NULL);" \
+"CREATE INDEX IF NOT EXISTS fid_tombstones_index18 ON message_tombstones(folder_id);" \
+"CREATE INDEX IF NOT EXISTS parent_cn_index18 ON messages(parent_fid, change_number);" \
+"CREATE TRIGGER IF NOT EXISTS msg_tombstone_del18 AFTER DELETE ON messages" \
+"  WHEN old.parent_fid IS NOT NULL BEGIN" \
+"  REPLACE INTO message_tombstones VALUES (old.message_id, old.parent_fid," \
+"  old.is_associated, strftime('%s','now')); END;" \
+"CREATE TRIGGER IF NOT EXISTS msg_tombstone_softdel18 AFTER UPDATE OF is_deleted ON messages" \
+"  WHEN new.parent_fid IS NOT NULL AND new.is_deleted<>0 AND old.is_deleted=0 BEGIN" \
+"  REPLACE INTO message_tombstones VALUES (new.message_id, new.parent_fid," \
+"  new.is_associated, strftime('%s','now')); END;" \
+"CREATE TRIGGER IF NOT EXISTS msg_tombstone_undel18 AFTER UPDATE OF is_deleted ON messages" \
+"  WHEN new.is_deleted=0 AND old.is_deleted<>0 BEGIN" \
+"  DELETE FROM message_tombstones WHERE message_id=new.message_id; END;" \
+"CREATE TRIGGER IF NOT EXISTS msg_tombstone_ins18 AFTER INSERT ON messages" \
+"  WHEN new.parent_fid IS NOT NULL BEGIN" \
+"  DELETE FROM message_tombstones WHERE message_id=new.message_id; END;"
+
+static constexpr char tbl_pvt_tombstones_18[] = TBL_TOMBSTONES_18
+"CREATE INDEX IF NOT EXISTS parent_readcn_index18 ON messages(parent_fid, read_cn);";
+
+static constexpr char tbl_pub_tombstones_18[] = TBL_TOMBSTONES_18;
+
 static constexpr char tbl_pub_folders_0[] =
 "CREATE TABLE folders ("
 "  folder_id INTEGER PRIMARY KEY,"
@@ -439,6 +471,7 @@ static constexpr tbl_init tbl_pvt_init_top[] = {
 	{"search_scopes", tbl_pvt_searchscopes_0},
 	{"search_result", tbl_pvt_searchresult_0},
 	{"autoreply_ts", tbl_pvt_autoreply_ts_11},
+	{"message_tombstones", tbl_pvt_tombstones_18},
 	TABLE_END,
 };
 
@@ -483,6 +516,7 @@ static constexpr tbl_init tbl_pub_init_top[] = {
 	{"read_states", tbl_pub_readst_0},
 	{"read_cns", tbl_pub_readcn_0},
 	{"replguidmap", tbl_replguidmap_14},
+	{"message_tombstones", tbl_pub_tombstones_18},
 	TABLE_END,
 };
 
@@ -565,6 +599,59 @@ static constexpr char tbl_midb_mapping_0[] =
 "  mid_string TEXT NOT NULL,"
 "  flag_string TEXT)";
 
+static constexpr char tbl_midb_imapcache_4[] =
+"CREATE TABLE imapcache ("
+"  message_id INTEGER NOT NULL,"
+"  charset TEXT NOT NULL COLLATE NOCASE,"
+"  body TEXT NOT NULL,"
+"  bodystructure TEXT NOT NULL,"
+"  envelope TEXT NOT NULL,"
+"  PRIMARY KEY (message_id, charset),"
+"  FOREIGN KEY (message_id)"
+"  	REFERENCES messages (message_id)"
+"  	ON DELETE CASCADE"
+"  	ON UPDATE CASCADE)";
+
+/*
+ * IMAP mod-sequences (RFC 7162). configurations:11 is the mailbox-wide
+ * counter; every insertion, flag change and deletion of a message takes the
+ * next value. Deletions leave a row in `vanished`; a row with uid 0 records
+ * the modseq up to which older rows have been pruned.
+ */
+static constexpr char tbl_midb_modseq_5[] =
+"ALTER TABLE messages ADD COLUMN modseq INTEGER NOT NULL DEFAULT 1;"
+"CREATE INDEX fid_modseq_index ON messages(folder_id, modseq);"
+"CREATE TABLE vanished ("
+"  folder_id INTEGER NOT NULL,"
+"  uid INTEGER NOT NULL,"
+"  modseq INTEGER NOT NULL);"
+"CREATE INDEX vanished_fid_modseq_index ON vanished(folder_id, modseq);"
+"INSERT OR REPLACE INTO configurations (config_id, config_value) VALUES (11, 1);"
+"CREATE TRIGGER modseq_insert AFTER INSERT ON messages BEGIN"
+"  UPDATE configurations SET config_value=config_value+1 WHERE config_id=11;"
+"  UPDATE messages SET modseq=(SELECT config_value FROM configurations WHERE config_id=11)"
+"    WHERE message_id=NEW.message_id;"
+"END;"
+"CREATE TRIGGER modseq_update AFTER UPDATE OF"
+"  unsent, recent, read, flagged, replied, forwarded, deleted ON messages"
+"  WHEN OLD.unsent IS NOT NEW.unsent OR OLD.recent IS NOT NEW.recent OR"
+"  OLD.read IS NOT NEW.read OR OLD.flagged IS NOT NEW.flagged OR"
+"  OLD.replied IS NOT NEW.replied OR OLD.forwarded IS NOT NEW.forwarded OR"
+"  OLD.deleted IS NOT NEW.deleted BEGIN"
+"  UPDATE configurations SET config_value=config_value+1 WHERE config_id=11;"
+"  UPDATE messages SET modseq=(SELECT config_value FROM configurations WHERE config_id=11)"
+"    WHERE message_id=NEW.message_id;"
+"END;"
+"CREATE TRIGGER modseq_delete AFTER DELETE ON messages"
+"  WHEN EXISTS (SELECT 1 FROM folders WHERE folder_id=OLD.folder_id) BEGIN"
+"  UPDATE configurations SET config_value=config_value+1 WHERE config_id=11;"
+"  INSERT INTO vanished (folder_id, uid, modseq) SELECT OLD.folder_id, OLD.uid,"
+"    config_value FROM configurations WHERE config_id=11;"
+"END;"
+"CREATE TRIGGER vanished_folder AFTER DELETE ON folders BEGIN"
+"  DELETE FROM vanished WHERE folder_id=OLD.folder_id;"
+"END";
+
 static constexpr tbl_init tbl_midb_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"folders", tbl_midb_folders_0},
@@ -578,6 +665,8 @@ static constexpr tbl_init tbl_midb_init_top[] = {
 	{"folders", tbl_midb_folders_3},
 	{"messages", tbl_midb_msgs_0},
 	{"mapping", tbl_midb_mapping_0},
+	{"imapcache", tbl_midb_imapcache_4},
+	{"vanished", tbl_midb_modseq_5},
 	TABLE_END,
 };
 
@@ -606,6 +695,7 @@ static constexpr tblite_upgradefn tbl_pvt_upgrade_list[] = {
 	{15, tbl_fixsyseidalloc_15},
 	{16, tbl_fixsyseidalloc_16},
 	{17, tbl_fixsyseidalloc_17},
+	{18, tbl_pvt_tombstones_18},
 	/* advance schema numbers in lockstep with public stores */
 	TABLE_END,
 };
@@ -621,6 +711,7 @@ static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
 	{15, tbl_fixsyseidalloc_15},
 	{16, tbl_fixsyseidalloc_16},
 	{17, tbl_fixsyseidalloc_17},
+	{18, tbl_pub_tombstones_18},
 	/* advance schema numbers in lockstep with private stores */
 	TABLE_END,
 };
@@ -629,6 +720,8 @@ static constexpr tblite_upgradefn tbl_midb_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
 	{2, nullptr, "folders", tbl_midb_folders_2, tbl_midb_folders_move2_3},
 	{3, nullptr, "folders", tbl_midb_folders_3, tbl_midb_folders_move2_3},
+	{4, tbl_midb_imapcache_4},
+	{5, tbl_midb_modseq_5},
 	TABLE_END,
 };
 
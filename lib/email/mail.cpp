@@ -12,6 +12,7 @@
 #include <gromox/json.hpp>
 #include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
+#include <gromox/mjson.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
 
@@ -492,6 +493,23 @@ int MAIL::make_digest(size_t *poffset, Json::Value &digest) const try
 	return -1;
 }
 
+/*
+ * Same, but produce the binary form that goes into ext/ files, with @file
+ * as the "file" member.
+ */
+int MAIL::make_digest(size_t *poffset, const char *file, std::string &out) const try
+{
+	Json::Value digest;
+	auto ret = make_digest(poffset, digest);
+	if (ret <= 0)
+		return ret;
+	digest["file"] = file;
+	return mjson_digest_pack(digest, out) ? 1 : -1;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2961: ENOMEM");
+	return -1;
+}
+
 static void mail_enum_text_mime_charset(const MIME *pmime, void *param)
 {
 	auto &cset = *static_cast<std::string *>(param);
@@ -2,12 +2,15 @@
 // SPDX-FileCopyrightText: 2020–2025 grommunio GmbH
 // This file is part of Gromox.
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <fmt/core.h>
 #include <libHX/ctype_helper.h>
@@ -16,6 +19,7 @@
 #include <libHX/string.h>
 #include <vmime/mailboxList.hpp>
 #include <gromox/defs.h>
+#include <gromox/endian.hpp>
 #include <gromox/fileio.h>
 #include <gromox/json.hpp>
 #include <gromox/mail.hpp>
@@ -53,6 +57,7 @@ struct BUILD_PARAM {
 
 static bool mjson_parse_array(MJSON *, const Json::Value &, unsigned int type);
 static BOOL mjson_record_node(MJSON *, const Json::Value &, unsigned int type);
+static bool mjson_insert_node(MJSON *, MJSON_MIME &&, unsigned int type);
 static int mjson_fetch_mime_structure(mjson_io &, const MJSON_MIME *, const char *storage_path, const char *msg_filename, const char *cset, const char *email_charset, BOOL b_ext, std::string &out);
 static std::string mjson_cvt_addr(const EMAIL_ADDR &);
 static std::string mjson_add_backslash(const char *);
@@ -191,10 +196,7 @@ const MJSON_MIME *MJSON::get_mime(const char *id) const
 
 static BOOL mjson_record_node(MJSON *pjson, const Json::Value &jv, unsigned int type) try
 {
-	MJSON_MIME temp_mime;
-	temp_mime.mime_type = type == TYPE_STRUCTURE ? mime_type::multiple : mime_type::single;
-
-	auto &m    = temp_mime;
+	MJSON_MIME m;
 	m.id       = jv["id"].asString();
 	m.ctype    = jv["ctype"].asString();
 	m.encoding = jv["encoding"].asString();
@@ -206,6 +208,17 @@ static BOOL mjson_record_node(MJSON *pjson, const Json::Value &jv, unsigned int
 	m.head     = jv["head"].asUInt();
 	m.begin    = jv["begin"].asUInt();
 	m.length   = jv["length"].asUInt();
+	return mjson_insert_node(pjson, std::move(m), type);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2062: ENOMEM");
+	return false;
+}
+
+static bool mjson_insert_node(MJSON *pjson, MJSON_MIME &&temp_mime,
+    unsigned int type)
+{
+	auto &m = temp_mime;
+	m.mime_type = type == TYPE_STRUCTURE ? mime_type::multiple : mime_type::single;
 	if (m.ctype.empty())
 		m.ctype = "application/octet-stream";
 
@@ -244,9 +257,6 @@ static BOOL mjson_record_node(MJSON *pjson, const Json::Value &jv, unsigned int
 		part_ptr = end + 1;
 	}
 	return false;
-} catch (const std::bad_alloc &) {
-	mlog(LV_ERR, "E-2062: ENOMEM");
-	return false;
 }
 
 static bool mjson_parse_array(MJSON *m, const Json::Value &jv, unsigned int type)
@@ -268,6 +278,419 @@ static bool mjson_parse_array(MJSON *m, const Json::Value &jv, unsigned int type
 	return true;
 }
 
+/*
+ * Binary digest format, as stored in ext/ files (version 1). All integers
+ * are little-endian.
+ *
+ *   header   "GXDG", u16 version, u16 reserved, u32 ntop, u32 nparts,
+ *            u32 nfields, u32 strtab_offset                     (24 bytes)
+ *   parts    nparts * {u32 kind, u32 first, u32 count}          (12 bytes)
+ *            kind 0 is an element of "structure", 1 of "mimes";
+ *            first/count select that part's run in the field table
+ *   fields   nfields * {u32 key, u8 type, u8[3] 0, u64 value}   (16 bytes)
+ *            the first ntop fields are the top-level members;
+ *            key is the strtab offset of the member name;
+ *            strings have value = length << 32 | strtab offset
+ *   strtab   NUL-terminated names and string values
+ *
+ * Values are kept as they appear in the JSON form (i.e. header fields stay
+ * base64-encoded), so that the two forms convert into each other losslessly.
+ */
+static constexpr char DG_MAGIC[4] = {'G', 'X', 'D', 'G'};
+static constexpr uint16_t DG_VERSION = 1;
+static constexpr size_t DG_HDR_SIZE = 24, DG_PART_SIZE = 12, DG_FIELD_SIZE = 16;
+
+enum {
+	DG_NULL, DG_STRING, DG_INT, DG_UINT, DG_BOOL, DG_REAL,
+};
+
+namespace {
+
+struct dg_field {
+	std::string_view key, str;
+	uint8_t type = DG_NULL;
+	uint64_t num = 0;
+};
+
+struct dg_reader {
+	bool open(std::string_view);
+	bool field(uint32_t idx, dg_field &) const;
+	bool part(uint32_t idx, uint32_t &kind, uint32_t &first, uint32_t &count) const;
+	bool cstr(uint64_t ofs, uint64_t len, std::string_view &) const;
+
+	std::string_view m_buf;
+	uint32_t ntop = 0, nparts = 0, nfields = 0, strtab = 0;
+};
+
+struct dg_writer {
+	bool add(const std::string &key, const Json::Value &);
+	uint32_t put(std::string_view);
+
+	std::string m_fields, m_strtab;
+	std::unordered_map<std::string, uint32_t> m_keys;
+	uint32_t nfields = 0;
+};
+
+}
+
+bool dg_reader::open(std::string_view buf)
+{
+	if (!mjson_digest_is_binary(buf) || buf.size() < DG_HDR_SIZE)
+		return false;
+	auto p = buf.data();
+	if (le16p_to_cpu(&p[4]) != DG_VERSION)
+		return false;
+	ntop    = le32p_to_cpu(&p[8]);
+	nparts  = le32p_to_cpu(&p[12]);
+	nfields = le32p_to_cpu(&p[16]);
+	strtab  = le32p_to_cpu(&p[20]);
+	uint64_t tables = DG_HDR_SIZE + static_cast<uint64_t>(nparts) * DG_PART_SIZE +
+	                  static_cast<uint64_t>(nfields) * DG_FIELD_SIZE;
+	if (ntop > nfields || tables > strtab || strtab > buf.size())
+		return false;
+	m_buf = buf;
+	return true;
+}
+
+bool dg_reader::cstr(uint64_t ofs, uint64_t len, std::string_view &out) const
+{
+	auto tlen = m_buf.size() - strtab;
+	/* Must be followed by its NUL */
+	if (ofs >= tlen || len >= tlen - ofs || m_buf[strtab+ofs+len] != '\0')
+		return false;
+	out = m_buf.substr(strtab + ofs, len);
+	return true;
+}
+
+bool dg_reader::field(uint32_t idx, dg_field &f) const
+{
+	if (idx >= nfields)
+		return false;
+	auto p = &m_buf[DG_HDR_SIZE + static_cast<size_t>(nparts) * DG_PART_SIZE +
+	         static_cast<size_t>(idx) * DG_FIELD_SIZE];
+	uint64_t key = le32p_to_cpu(&p[0]);
+	if (key >= m_buf.size() - strtab)
+		return false;
+	auto kp = &m_buf[strtab+key];
+	auto ke = static_cast<const char *>(memchr(kp, '\0', m_buf.size() - strtab - key));
+	if (ke == nullptr)
+		return false;
+	f.key  = std::string_view(kp, ke - kp);
+	f.type = p[4];
+	f.num  = le64p_to_cpu(&p[8]);
+	f.str  = {};
+	if (f.type == DG_STRING)
+		return cstr(f.num & UINT32_MAX, f.num >> 32, f.str);
+	return f.type <= DG_REAL;
+}
+
+bool dg_reader::part(uint32_t idx, uint32_t &kind, uint32_t &first,
+    uint32_t &count) const
+{
+	if (idx >= nparts)
+		return false;
+	auto p = &m_buf[DG_HDR_SIZE + static_cast<size_t>(idx) * DG_PART_SIZE];
+	kind  = le32p_to_cpu(&p[0]);
+	first = le32p_to_cpu(&p[4]);
+	count = le32p_to_cpu(&p[8]);
+	return kind <= 1 && static_cast<uint64_t>(first) + count <= nfields;
+}
+
+uint32_t dg_writer::put(std::string_view s)
+{
+	auto ofs = m_strtab.size();
+	if (ofs + s.size() + 1 > UINT32_MAX)
+		throw std::bad_alloc();
+	m_strtab += s;
+	m_strtab += '\0';
+	return ofs;
+}
+
+bool dg_writer::add(const std::string &key, const Json::Value &v)
+{
+	uint8_t type;
+	uint64_t num = 0;
+	switch (v.type()) {
+	case Json::nullValue:
+		type = DG_NULL;
+		break;
+	case Json::stringValue: {
+		auto s = v.asString();
+		type = DG_STRING;
+		num  = static_cast<uint64_t>(s.size()) << 32 | put(s);
+		break;
+	}
+	case Json::intValue:
+		type = DG_INT;
+		num  = v.asInt64();
+		break;
+	case Json::uintValue:
+		type = DG_UINT;
+		num  = v.asUInt64();
+		break;
+	case Json::booleanValue:
+		type = DG_BOOL;
+		num  = v.asBool();
+		break;
+	case Json::realValue: {
+		double d = v.asDouble();
+		type = DG_REAL;
+		memcpy(&num, &d, sizeof(num));
+		break;
+	}
+	default:
+		return false;
+	}
+	auto it = m_keys.find(key);
+	if (it == m_keys.end())
+		it = m_keys.emplace(key, put(key)).first;
+	char rec[DG_FIELD_SIZE]{};
+	cpu_to_le32p(&rec[0], it->second);
+	rec[4] = type;
+	cpu_to_le64p(&rec[8], num);
+	m_fields.append(rec, sizeof(rec));
+	++nfields;
+	return true;
+}
+
+bool mjson_digest_is_binary(std::string_view s)
+{
+	return s.size() >= sizeof(DG_MAGIC) &&
+	       memcmp(s.data(), DG_MAGIC, sizeof(DG_MAGIC)) == 0;
+}
+
+/**
+ * Convert a digest as made by MAIL::make_digest into the binary form.
+ * Members of the top-level object or of a part that are not scalars, other
+ * than the "structure" and "mimes" arrays, are dropped.
+ */
+bool mjson_digest_pack(const Json::Value &root, std::string &out) try
+{
+	if (!root.isObject())
+		return false;
+	dg_writer w;
+	for (auto it = root.begin(); it != root.end(); ++it)
+		if (!it->isArray() && !it->isObject())
+			w.add(it.name(), *it);
+	auto ntop = w.nfields;
+	std::string parts;
+	uint32_t nparts = 0;
+	static constexpr const char *arrays[] = {"structure", "mimes"};
+	for (uint32_t kind = 0; kind < std::size(arrays); ++kind) {
+		const auto &arr = root[arrays[kind]];
+		if (!arr.isArray())
+			continue;
+		for (const auto &e0 : arr) {
+			/* cf. mjson_parse_array */
+			auto &e = e0.isArray() && e0.size() == 1 ? e0[0] : e0;
+			if (!e.isObject())
+				return false;
+			auto first = w.nfields;
+			for (auto it = e.begin(); it != e.end(); ++it)
+				if (!it->isArray() && !it->isObject())
+					w.add(it.name(), *it);
+			char rec[DG_PART_SIZE];
+			cpu_to_le32p(&rec[0], kind);
+			cpu_to_le32p(&rec[4], first);
+			cpu_to_le32p(&rec[8], w.nfields - first);
+			parts.append(rec, sizeof(rec));
+			++nparts;
+		}
+	}
+	uint64_t strtab = DG_HDR_SIZE + parts.size() + w.m_fields.size();
+	if (strtab > UINT32_MAX)
+		return false;
+	char hdr[DG_HDR_SIZE];
+	memcpy(&hdr[0], DG_MAGIC, sizeof(DG_MAGIC));
+	cpu_to_le16p(&hdr[4], DG_VERSION);
+	cpu_to_le16p(&hdr[6], 0);
+	cpu_to_le32p(&hdr[8], ntop);
+	cpu_to_le32p(&hdr[12], nparts);
+	cpu_to_le32p(&hdr[16], w.nfields);
+	cpu_to_le32p(&hdr[20], strtab);
+	out.clear();
+	out.reserve(strtab + w.m_strtab.size());
+	out.append(hdr, sizeof(hdr));
+	out += parts;
+	out += w.m_fields;
+	out += w.m_strtab;
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2958: ENOMEM");
+	return false;
+}
+
+static Json::Value dg_to_json(const dg_field &f)
+{
+	switch (f.type) {
+	case DG_STRING: return Json::Value(std::string(f.str));
+	case DG_INT: return Json::Value(static_cast<Json::Value::Int64>(f.num));
+	case DG_UINT: return Json::Value(static_cast<Json::Value::UInt64>(f.num));
+	case DG_BOOL: return Json::Value(f.num != 0);
+	case DG_REAL: {
+		double d;
+		memcpy(&d, &f.num, sizeof(d));
+		return Json::Value(d);
+	}
+	default: return Json::Value();
+	}
+}
+
+/**
+ * Turn a digest in either form, binary or JSON text, into a Json::Value.
+ */
+bool mjson_digest_unpack(std::string_view data, Json::Value &root) try
+{
+	if (!mjson_digest_is_binary(data))
+		return json_from_str(data, root);
+	dg_reader rd;
+	if (!rd.open(data))
+		return false;
+	root = Json::objectValue;
+	dg_field f;
+	for (uint32_t i = 0; i < rd.ntop; ++i) {
+		if (!rd.field(i, f))
+			return false;
+		root[std::string(f.key)] = dg_to_json(f);
+	}
+	auto &structure = root["structure"] = Json::arrayValue;
+	auto &mimes = root["mimes"] = Json::arrayValue;
+	for (uint32_t i = 0; i < rd.nparts; ++i) {
+		uint32_t kind, first, count;
+		if (!rd.part(i, kind, first, count))
+			return false;
+		Json::Value e = Json::objectValue;
+		for (uint32_t j = first; j < first + count; ++j) {
+			if (!rd.field(j, f))
+				return false;
+			e[std::string(f.key)] = dg_to_json(f);
+		}
+		(kind == 0 ? structure : mimes).append(std::move(e));
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2959: ENOMEM");
+	return false;
+}
+
+static std::string dg_str(const dg_field &f)
+{
+	return f.type == DG_STRING ? std::string(f.str) : std::string();
+}
+
+static uint64_t dg_num(const dg_field &f)
+{
+	return f.type == DG_INT || f.type == DG_UINT || f.type == DG_BOOL ? f.num : 0;
+}
+
+/**
+ * Same as load_from_json, but directly from the stored digest, without
+ * building a JSON tree when it is in binary form.
+ */
+BOOL MJSON::load_from_digest(std::string_view data) try
+{
+	if (!mjson_digest_is_binary(data)) {
+		Json::Value root;
+		return json_from_str(data, root) && load_from_json(root);
+	}
+	dg_reader rd;
+	if (!rd.open(data))
+		return false;
+	clear();
+	dg_field f;
+	for (uint32_t i = 0; i < rd.ntop; ++i) {
+		if (!rd.field(i, f))
+			return false;
+		auto &k = f.key;
+		if (k == "file")
+			filename = dg_str(f);
+		else if (k == "uid")
+			uid = dg_num(f);
+		else if (k == "charset")
+			charset = dg_str(f);
+		else if (k == "msgid")
+			msgid = base64_decode(f.str);
+		else if (k == "from")
+			from = base64_decode(f.str);
+		else if (k == "sender")
+			sender = base64_decode(f.str);
+		else if (k == "reply")
+			reply = base64_decode(f.str);
+		else if (k == "to")
+			to = base64_decode(f.str);
+		else if (k == "cc")
+			cc = base64_decode(f.str);
+		else if (k == "inreply")
+			inreply = base64_decode(f.str);
+		else if (k == "subject")
+			subject = base64_decode(f.str);
+		else if (k == "received")
+			received = base64_decode(f.str);
+		else if (k == "date")
+			date = base64_decode(f.str);
+		else if (k == "notification")
+			notification = base64_decode(f.str);
+		else if (k == "ref")
+			ref = base64_decode(f.str);
+		else if (k == "read")
+			read = dg_num(f) != 0;
+		else if (k == "replied")
+			replied = dg_num(f) != 0;
+		else if (k == "unsent")
+			unsent = dg_num(f) != 0;
+		else if (k == "forwarded")
+			forwarded = dg_num(f) != 0;
+		else if (k == "flag")
+			flag = dg_num(f) != 0;
+		else if (k == "priority")
+			priority = dg_num(f);
+		else if (k == "size")
+			size = dg_num(f);
+	}
+	HX_strltrim(received.data());
+	received.resize(strlen(received.data()));
+	for (uint32_t i = 0; i < rd.nparts; ++i) {
+		uint32_t kind, first, count;
+		if (!rd.part(i, kind, first, count))
+			return false;
+		MJSON_MIME m;
+		for (uint32_t j = first; j < first + count; ++j) {
+			if (!rd.field(j, f))
+				return false;
+			auto &k = f.key;
+			if (k == "id")
+				m.id = dg_str(f);
+			else if (k == "ctype")
+				m.ctype = dg_str(f);
+			else if (k == "encoding")
+				m.encoding = dg_str(f);
+			else if (k == "charset")
+				m.charset = dg_str(f);
+			else if (k == "filename")
+				m.filename = base64_decode(f.str);
+			else if (k == "cid")
+				m.cid = base64_decode(f.str);
+			else if (k == "cntl")
+				m.cntl = base64_decode(f.str);
+			else if (k == "cntdspn")
+				m.cntdspn = dg_str(f);
+			else if (k == "head")
+				m.head = dg_num(f);
+			else if (k == "begin")
+				m.begin = dg_num(f);
+			else if (k == "length")
+				m.length = dg_num(f);
+		}
+		if (!mjson_insert_node(this, std::move(m),
+		    kind == 0 ? TYPE_STRUCTURE : TYPE_MIMES))
+			return false;
+	}
+	return m_root.has_value() && !m_root->contains_none_type();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2960: ENOMEM");
+	return false;
+}
+
 int MJSON::fetch_structure(mjson_io &io, const char *cset, BOOL b_ext,
     std::string &buf) const try
 {
@@ -390,11 +813,8 @@ static int mjson_fetch_mime_structure(mjson_io &io, const MJSON_MIME *pmime,
 			auto fd = io.find(temp_path);
 			if (io.invalid(fd))
 				goto RFC822_FAILURE;
-			Json::Value digest;
-			if (!json_from_str(fd->second, digest))
-				goto RFC822_FAILURE;
 			MJSON temp_mjson;
-			if (!temp_mjson.load_from_json(digest))
+			if (!temp_mjson.load_from_digest(fd->second))
 				goto RFC822_FAILURE;
 			temp_mjson.path = storage_path;
 			buf += ' ';
@@ -606,7 +1026,12 @@ static void mjson_enum_build(const MJSON_MIME *pmime, BUILD_PARAM *pbuild) { try
 		digest["file"] = pmime->get_id();
 	else
 		digest["file"] = std::string(pbuild->filename) + "." + pmime->get_id();
-	pbuild->io.place(dgt_path, json_to_str(digest));
+	std::string dgt;
+	if (!mjson_digest_pack(digest, dgt)) {
+		pbuild->build_result = FALSE;
+		return;
+	}
+	pbuild->io.place(dgt_path, std::move(dgt));
 	if (!temp_mjson.load_from_json(digest)) {
 		pbuild->build_result = FALSE;
 		return;
@@ -669,10 +1094,7 @@ BOOL MJSON::rfc822_get(mjson_io &io, MJSON *pjson, const char *storage_path,
 		auto fd = io.find(dgt_path);
 		if (io.invalid(fd))
 			continue;
-		pjson->clear();
-		Json::Value digest;
-		if (!json_from_str(fd->second, digest) ||
-		    !pjson->load_from_json(digest))
+		if (!pjson->load_from_digest(fd->second))
 			return false;
 		pjson->path = temp_path;
 		strcpy(mime_id, pdot + 1);
@@ -3,23 +3,33 @@
 // This file is part of Gromox.
 #include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <netdb.h>
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#include <libHX/io.h>
 #include <libHX/socket.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <gromox/atomic.hpp>
 #include <gromox/config_file.hpp>
 #include <gromox/endian.hpp>
 #include <gromox/exmdb_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/ext_buffer.hpp>
+#include <gromox/fileio.h>
 #include <gromox/list_file.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/mapidefs.h>
@@ -33,6 +43,32 @@
 
 namespace gromox {
 
+namespace {
+
+/* A caller waiting for its response on a multiplexed connection */
+struct mux_slot {
+	std::condition_variable cv;
+	BINARY bin{}; /* complete response frame, malloc'd */
+	bool done = false;
+};
+
+}
+
+/* A connection speaking EXMDB_PROTO_MUX, shared by many callers */
+struct mux_conn {
+	mux_conn(remote_svr *s) : psvr(s) {}
+	NOMOVE(mux_conn);
+	~mux_conn();
+
+	remote_svr *psvr = nullptr;
+	int sockd = -1;
+	pthread_t thr_id{};
+	std::mutex wr_lock, pend_lock;
+	std::unordered_map<uint32_t, mux_slot *> pending; /* under pend_lock */
+	uint32_t next_reqid = 1; /* under pend_lock; 0 is for pings */
+	bool b_dead = false; /* under pend_lock */
+};
+
 static int mdcl_rpc_timeout = -1;
 static constexpr unsigned int mdcl_ping_timeout = 2;
 static_assert(SOCKET_TIMEOUT >= mdcl_ping_timeout);
@@ -40,7 +76,7 @@ static std::list<agent_thread> mdcl_agent_list;
 static std::list<remote_svr> mdcl_server_list;
 static std::mutex mdcl_server_lock; /* he protecc mdcl_server_list+mdcl_agent_list */
 static atomic_bool mdcl_notify_stop;
-static unsigned int mdcl_conn_max, mdcl_threads_max;
+static unsigned int mdcl_conn_max, mdcl_threads_max, mdcl_mux_conns;
 static pthread_t mdcl_scan_id;
 static void (*mdcl_build_env)(const remote_svr &);
 static void (*mdcl_free_env)();
@@ -57,6 +93,15 @@ remote_conn::~remote_conn()
 	}
 }
 
+mux_conn::~mux_conn()
+{
+	if (sockd >= 0) {
+		close(sockd);
+		if (psvr != nullptr)
+			--psvr->active_handles;
+	}
+}
+
 remote_conn_ref::remote_conn_ref(remote_conn_ref &&o)
 {
 	reset(true);
@@ -77,6 +122,7 @@ void remote_conn_ref::reset(bool lost)
 }
 
 static constexpr cfg_directive exmdb_client_dflt[] = {
+	{"exmdb_client_mux_connections", "0", CFG_SIZE},
 	{"exmdb_client_rpc_timeout", "0", CFG_TIME, "0"},
 	CFG_TABLE_END,
 };
@@ -93,6 +139,7 @@ void exmdb_client_init(unsigned int conn_max, unsigned int notify_threads_max)
 			mdcl_rpc_timeout = -1;
 		if (mdcl_rpc_timeout > 0)
 			mdcl_rpc_timeout *= 1000;
+		mdcl_mux_conns = cfg->get_ll("exmdb_client_mux_connections");
 	}
 	setup_sigalrm();
 	mdcl_notify_stop = true;
@@ -103,6 +150,12 @@ void exmdb_client_init(unsigned int conn_max, unsigned int notify_threads_max)
 	GUID::machine_id().to_str(mdcl_remote_id + z, std::size(mdcl_remote_id) - z, 32);
 }
 
+/* Overrides gromox.cfg:exmdb_client_mux_connections (call before _run) */
+void exmdb_client_set_mux_connections(unsigned int n)
+{
+	mdcl_mux_conns = n;
+}
+
 void exmdb_client_stop()
 {
 	if (mdcl_conn_max != 0 && !mdcl_notify_stop) {
@@ -127,14 +180,25 @@ void exmdb_client_stop()
 			close(conn.sockd);
 			conn.sockd = -1;
 		}
+		/* Readers see EOF, fail their pending callers and exit. */
+		for (auto &mc : srv.mux_list)
+			shutdown(mc->sockd, SHUT_RDWR);
+		for (auto &mc : srv.mux_list)
+			if (!pthread_equal(mc->thr_id, {}))
+				pthread_join(mc->thr_id, nullptr);
+		srv.mux_list.clear();
 	}
 	mdcl_build_env = nullptr;
 	mdcl_free_env = nullptr;
 	mdcl_event_proc = nullptr;
 }
 
+/**
+ * @want_flags:	EXMDB_PROTO_* flags to request
+ * @got_flags:	flags the server agreed to (optional)
+ */
 static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
-    const char *prog_id)
+    const char *prog_id, uint32_t want_flags = 0, uint32_t *got_flags = nullptr)
 {
 	int sockd = HX_inet_connect(srv.host.c_str(), srv.port, 0);
 	if (sockd < 0) {
@@ -155,9 +219,11 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		rqc.prefix = deconst(srv.prefix.c_str());
 		rqc.remote_id = mdcl_remote_id;
 		rqc.b_private = srv.type == EXMDB_ITEM::EXMDB_PRIVATE ? TRUE : false;
+		rqc.proto_flags = want_flags;
 	} else {
 		rql.call_id = exmdb_callid::listen_notification;
 		rql.remote_id = mdcl_remote_id;
+		rql.proto_flags = want_flags;
 	}
 	BINARY bin;
 	if (b_listen) {
@@ -180,6 +246,8 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 	    bin.pb == nullptr)
 		return -1;
 	auto response_code = static_cast<exmdb_response>(bin.pb[0]);
+	/* Old servers ignore the flags and send the short form. */
+	uint32_t flags = bin.cb == 9 ? le32p_to_cpu(&bin.pb[5]) : 0;
 	exmdb_rpc_free(bin.pb);
 	bin.pb = nullptr;
 	if (response_code != exmdb_response::success) {
@@ -187,12 +255,14 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		       srv.host.c_str(), srv.port, srv.prefix.c_str(),
 		       exmdb_rpc_strerror(response_code));
 		return -1;
-	} else if (bin.cb != 5) {
+	} else if (bin.cb != 5 && bin.cb != 9) {
 		mlog(LV_ERR, "exmdb_client: response format error "
 		       "during connect to [%s]:%hu/%s",
 		       srv.host.c_str(), srv.port, srv.prefix.c_str());
 		return -1;
 	}
+	if (got_flags != nullptr)
+		*got_flags = flags & want_flags;
 	cl_sock.release();
 	return sockd;
 }
@@ -261,24 +331,74 @@ static void *cl_pinger(void *)
 	return nullptr;
 }
 
+/*
+ * Upper bound for one notification frame. The server sends at most 4 MB per
+ * batch (plus one datagram if that alone is larger).
+ */
+static constexpr uint32_t mdcl_notify_frame_max = 16U << 20;
+
+/**
+ * Split an EXMDB_PROTO_NOTIFY_BATCH frame ([u32 count] {[u32 len][datagram]}*)
+ * and pull all contained datagrams.
+ */
+static bool cl_notif_pull_batch(const uint8_t *buf, uint32_t len,
+    std::vector<DB_NOTIFY_DATAGRAM> &out) try
+{
+	if (len < sizeof(uint32_t))
+		return false;
+	uint32_t count = le32p_to_cpu(buf);
+	uint32_t off = sizeof(uint32_t);
+	if (count > (len - off) / sizeof(uint32_t))
+		return false;
+	out.resize(count);
+	for (auto &notify : out) {
+		if (len - off < sizeof(uint32_t))
+			return false;
+		uint32_t dg_len = le32p_to_cpu(&buf[off]);
+		off += sizeof(uint32_t);
+		if (dg_len > len - off)
+			return false;
+		BINARY bin;
+		bin.cb = dg_len;
+		bin.pb = deconst(&buf[off]);
+		if (exmdb_ext_pull_db_notify(&bin, &notify) != EXT_ERR_SUCCESS)
+			return false;
+		off += dg_len;
+	}
+	return off == len;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
 static int cl_notif_reader3(agent_thread &agent, pollfd &pfd,
-    uint8_t (&buff)[0x8000], uint32_t &buff_len, uint32_t &offset)
+    std::vector<uint8_t> &buff, uint32_t &buff_len, uint32_t &offset)
 {
 	if (poll(&pfd, 1, SOCKET_TIMEOUT * 1000) != 1)
 		return -1;
 	if (buff_len == 0) {
-		if (read(agent.sockd, &buff_len, sizeof(uint32_t)) != sizeof(uint32_t))
+		uint32_t len_le;
+		if (read(agent.sockd, &len_le, sizeof(len_le)) != sizeof(len_le))
 			return -1;
+		buff_len = le32_to_cpu(len_le);
 		/* ping packet */
 		if (buff_len == 0) {
 			auto resp_code = exmdb_response::success;
 			if (write(agent.sockd, &resp_code, 1) != 1)
 				return -1;
+		} else if (buff_len > mdcl_notify_frame_max) {
+			mlog(LV_ERR, "exmdb_client: notification frame of %u bytes "
+			        "from [%s]:%hu exceeds limit", buff_len,
+			        agent.pserver->host.c_str(), agent.pserver->port);
+			return -1;
+		} else try {
+			buff.resize(buff_len);
+		} catch (const std::bad_alloc &) {
+			return -1;
 		}
 		offset = 0;
 		return 0;
 	}
-	auto read_len = read(agent.sockd, buff + offset, buff_len - offset);
+	auto read_len = read(agent.sockd, &buff[offset], buff_len - offset);
 	if (read_len <= 0)
 		return -1;
 	offset += read_len;
@@ -286,36 +406,48 @@ static int cl_notif_reader3(agent_thread &agent, pollfd &pfd,
 		return 0;
 
 	/* packet complete */
-	BINARY bin;
-	bin.cb = buff_len;
-	bin.pb = buff;
 	mdcl_build_env(*agent.pserver);
 	auto cl_0 = make_scope_exit([]() { if (mdcl_free_env != nullptr) mdcl_free_env(); });
-	DB_NOTIFY_DATAGRAM notify;
-	auto resp_code = exmdb_ext_pull_db_notify(&bin, &notify) == EXT_ERR_SUCCESS ?
-	                 exmdb_response::success : exmdb_response::pull_error;
+	std::vector<DB_NOTIFY_DATAGRAM> notes;
+	bool ok;
+	if (agent.b_batch) {
+		ok = cl_notif_pull_batch(buff.data(), buff_len, notes);
+	} else try {
+		BINARY bin;
+		bin.cb = buff_len;
+		bin.pb = buff.data();
+		notes.resize(1);
+		ok = exmdb_ext_pull_db_notify(&bin, &notes[0]) == EXT_ERR_SUCCESS;
+	} catch (const std::bad_alloc &) {
+		ok = false;
+	}
+	auto resp_code = ok ? exmdb_response::success : exmdb_response::pull_error;
 	if (write(agent.sockd, &resp_code, 1) != 1)
 		return -1;
-	if (resp_code == exmdb_response::success)
-		for (size_t i = 0; i < notify.id_array.size(); ++i)
-			mdcl_event_proc(notify.dir, notify.b_table,
-				notify.id_array[i], &notify.db_notify);
+	if (ok)
+		for (const auto &notify : notes)
+			for (size_t i = 0; i < notify.id_array.size(); ++i)
+				mdcl_event_proc(notify.dir, notify.b_table,
+					notify.id_array[i], &notify.db_notify);
 	buff_len = 0;
 	return 0;
 }
 
 static void cl_notif_reader2(agent_thread &agent)
 {
-	agent.sockd = exmdb_client_connect_exmdb(*agent.pserver, true, "mdclntfy");
+	uint32_t flags = 0;
+	agent.sockd = exmdb_client_connect_exmdb(*agent.pserver, true,
+	              "mdclntfy", EXMDB_PROTO_NOTIFY_BATCH, &flags);
 	if (agent.sockd < 0) {
 		sleep(1);
 		return;
 	}
+	agent.b_batch = flags & EXMDB_PROTO_NOTIFY_BATCH;
 	agent.startup_wait = false;
 	agent.startup_cv.notify_one();
 	struct pollfd pfd = {agent.sockd, POLLIN | POLLPRI};
 	uint32_t buff_len = 0, offset = 0;
-	uint8_t buff[0x8000];
+	std::vector<uint8_t> buff;
 	while (cl_notif_reader3(agent, pfd, buff, buff_len, offset) == 0)
 		/* */;
 	close(agent.sockd);
@@ -394,6 +526,7 @@ int exmdb_client_run(const char *cfgdir, unsigned int flags,
 		if (flags & EXMDB_CLIENT_SKIP_REMOTE && !local)
 			continue; /* mostly used by midb */
 		item.local = (flags & EXMDB_CLIENT_ALLOW_DIRECT) ? local : false;
+		item.samehost = local;
 		if (item.local) try {
 			/* mostly used by exmdb_provider */
 			mdcl_server_list.emplace_back(std::move(item));
@@ -447,6 +580,15 @@ bool exmdb_client_is_local(const char *prefix, BOOL *pvt)
 	return true;
 }
 
+bool exmdb_client_is_samehost(const char *prefix)
+{
+	auto i = std::find_if(mdcl_server_list.cbegin(), mdcl_server_list.cend(),
+	         [&](const EXMDB_ITEM &s) {
+	         	return strncmp(s.prefix.c_str(), prefix, s.prefix.size()) == 0;
+	         });
+	return i != mdcl_server_list.cend() && i->samehost;
+}
+
 static bool sock_ready_for_write(int fd)
 {
 	struct pollfd pfd = {fd, POLLIN};
@@ -498,10 +640,203 @@ static remote_conn_ref exmdb_client_get_connection(const char *dir)
 	return fc;
 }
 
+static void mux_fail_pending(mux_conn &mc)
+{
+	std::lock_guard ph(mc.pend_lock);
+	mc.b_dead = true;
+	for (auto &[reqid, slot] : mc.pending) {
+		slot->done = true;
+		slot->cv.notify_one();
+	}
+	mc.pending.clear();
+}
+
+static bool mux_read_frame(mux_conn &mc)
+{
+	uint8_t hdr[9];
+	if (HXio_fullread(mc.sockd, hdr, sizeof(hdr)) != sizeof(hdr))
+		return false;
+	auto len = le32p_to_cpu(&hdr[1]);
+	if (len < sizeof(uint32_t) || len > UINT32_MAX - 5)
+		return false;
+	auto reqid = le32p_to_cpu(&hdr[5]);
+	BINARY bin;
+	bin.cb = len + 5;
+	bin.pb = static_cast<uint8_t *>(malloc(bin.cb));
+	if (bin.pb == nullptr)
+		return false;
+	memcpy(bin.pb, hdr, sizeof(hdr));
+	auto rem = bin.cb - sizeof(hdr);
+	if (rem > 0 && HXio_fullread(mc.sockd, &bin.pb[sizeof(hdr)], rem) !=
+	    static_cast<ssize_t>(rem)) {
+		free(bin.pb);
+		return false;
+	}
+	std::unique_lock ph(mc.pend_lock);
+	auto it = mc.pending.find(reqid);
+	if (it == mc.pending.end()) {
+		/* ping reply, or the caller gave up waiting */
+		ph.unlock();
+		free(bin.pb);
+		return true;
+	}
+	auto slot = it->second;
+	mc.pending.erase(it);
+	slot->bin = bin;
+	slot->done = true;
+	slot->cv.notify_one();
+	return true;
+}
+
+static void *mux_reader(void *arg)
+{
+	auto &mc = *static_cast<mux_conn *>(arg);
+	struct pollfd pfd = {mc.sockd, POLLIN | POLLPRI};
+	static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
+	while (!mdcl_notify_stop) {
+		auto ret = poll(&pfd, 1, (SOCKET_TIMEOUT - 3) * 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			/* Idle; keep the server from timing out the connection. */
+			auto ping_buff = cpu_to_le32(0);
+			std::lock_guard wr_hold(mc.wr_lock);
+			if (write(mc.sockd, &ping_buff, sizeof(ping_buff)) != sizeof(ping_buff))
+				break;
+			continue;
+		}
+		if (!mux_read_frame(mc))
+			break;
+	}
+	mux_fail_pending(mc);
+	return nullptr;
+}
+
+/**
+ * Returns a multiplexed connection for @dir, or nullptr if the caller should
+ * use the classic one-request-per-connection path.
+ */
+static std::shared_ptr<mux_conn> exmdb_client_get_mux(const char *dir) try
+{
+	std::lock_guard sv_hold(mdcl_server_lock);
+	auto i = *dir == '\0' ? mdcl_server_list.begin() :
+	         std::find_if(mdcl_server_list.begin(), mdcl_server_list.end(),
+	         [&](const remote_svr &s) { return strncmp(dir, s.prefix.c_str(), s.prefix.size()) == 0; });
+	if (i == mdcl_server_list.end() || i->mux_refused)
+		return nullptr;
+	auto &srv = *i;
+	std::erase_if(srv.mux_list, [](const std::shared_ptr<mux_conn> &mc) {
+		std::unique_lock ph(mc->pend_lock);
+		if (!mc->b_dead)
+			return false;
+		ph.unlock();
+		pthread_join(mc->thr_id, nullptr);
+		return true;
+	});
+	static std::atomic<unsigned int> rr;
+	if (srv.mux_list.size() >= mdcl_mux_conns ||
+	    (srv.mux_list.size() > 0 && srv.active_handles >= mdcl_conn_max))
+		return srv.mux_list[rr++ % srv.mux_list.size()];
+	if (srv.active_handles >= mdcl_conn_max)
+		return nullptr;
+	uint32_t flags = 0;
+	auto sockd = exmdb_client_connect_exmdb(srv, false, "mdcl", EXMDB_PROTO_MUX, &flags);
+	if (sockd < 0)
+		return srv.mux_list.size() > 0 ? srv.mux_list[rr++ % srv.mux_list.size()] : nullptr;
+	++srv.active_handles;
+	if (!(flags & EXMDB_PROTO_MUX)) {
+		/* Older server; keep the socket for the classic path. */
+		mlog(LV_INFO, "exmdb_client: [%s]:%hu does not support multiplexing",
+		        srv.host.c_str(), srv.port);
+		srv.mux_refused = true;
+		srv.conn_list.emplace_back(&srv);
+		srv.conn_list.back().sockd = sockd;
+		srv.conn_list.back().last_time = time(nullptr);
+		return nullptr;
+	}
+	auto mc = std::make_shared<mux_conn>(&srv);
+	mc->sockd = sockd;
+	auto ret = pthread_create4(&mc->thr_id, nullptr, mux_reader, mc.get());
+	if (ret != 0) {
+		mlog(LV_ERR, "exmdb_client: pthread_create: %s", strerror(ret));
+		return nullptr;
+	}
+	pthread_setname_np(mc->thr_id, "exmdbcl/mux");
+	srv.mux_list.push_back(mc);
+	if (mdcl_agent_list.size() < mdcl_threads_max)
+		launch_notify_listener(srv);
+	return mc;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "exmdb_client: ENOMEM");
+	return nullptr;
+}
+
+static BOOL exmdb_client_do_mux_rpc(mux_conn &mc, const exreq *rq, exresp *rsp) try
+{
+	mux_slot slot;
+	std::unique_lock ph(mc.pend_lock);
+	if (mc.b_dead)
+		return false;
+	auto reqid = mc.next_reqid++;
+	if (reqid == 0)
+		reqid = mc.next_reqid++;
+	mc.pending.emplace(reqid, &slot);
+	ph.unlock();
+	auto cl_0 = make_scope_exit([&]() {
+		std::lock_guard hold(mc.pend_lock);
+		mc.pending.erase(reqid);
+		free(slot.bin.pb);
+	});
+
+	BINARY bin;
+	if (exmdb_ext_push_mux_request(rq, reqid, &bin) != EXT_ERR_SUCCESS)
+		return false;
+	std::unique_lock wr_hold(mc.wr_lock);
+	auto ok = exmdb_client_write_socket(mc.sockd, bin, SOCKET_TIMEOUT * 1000);
+	wr_hold.unlock();
+	free(bin.pb);
+	if (!ok) {
+		/* Partial frame may have been sent; the stream is unusable. */
+		shutdown(mc.sockd, SHUT_RDWR);
+		return false;
+	}
+	ph.lock();
+	auto pred = [&]() { return slot.done; };
+	if (mdcl_rpc_timeout < 0) {
+		slot.cv.wait(ph, pred);
+	} else if (!slot.cv.wait_for(ph, std::chrono::milliseconds(mdcl_rpc_timeout), pred)) {
+		/*
+		 * Give up on this request (cl_0 unregisters it); other
+		 * requests on the connection remain unaffected.
+		 */
+		ph.unlock();
+		return false;
+	}
+	ph.unlock();
+	if (slot.bin.pb == nullptr || slot.bin.cb < 9 ||
+	    slot.bin.pb[0] != static_cast<uint8_t>(exmdb_response::success))
+		return false;
+	rsp->call_id = rq->call_id;
+	bin.pb = slot.bin.pb + 9;
+	bin.cb = slot.bin.cb - 9;
+	return exmdb_ext_pull_response(&bin, rsp) == EXT_ERR_SUCCESS ? TRUE : false;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "exmdb_client: ENOMEM");
+	return false;
+}
+
 BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 {
 	BINARY bin;
 
+	if (mdcl_mux_conns > 0) {
+		auto mc = exmdb_client_get_mux(rq->dir);
+		if (mc != nullptr)
+			return exmdb_client_do_mux_rpc(*mc, rq, rsp);
+	}
+
 	if (exmdb_ext_push_request(rq, &bin) != EXT_ERR_SUCCESS)
 		return false;
 	auto conn = exmdb_client_get_connection(rq->dir);
@@ -542,6 +877,124 @@ BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 	return ret == EXT_ERR_SUCCESS ? TRUE : false;
 }
 
+exmdb_batch::exmdb_batch(const char *dir, unsigned int flags) :
+	m_dir(dir)
+{
+	m_req.call_id = exmdb_callid::batch;
+	m_req.dir = m_dir.data();
+	m_req.flags = flags;
+}
+
+size_t exmdb_batch::add(std::unique_ptr<exreq> &&q, std::unique_ptr<exresp> &&r)
+{
+	q->dir = m_dir.data();
+	r->call_id = q->call_id;
+	/* Make sure neither push_back throws after the other succeeded */
+	if (m_req.reqs.size() == m_req.reqs.capacity())
+		m_req.reqs.reserve(std::max<size_t>(8, 2 * m_req.reqs.size()));
+	m_resp.resps.reserve(m_req.reqs.capacity());
+	m_req.reqs.push_back(std::move(q));
+	m_resp.resps.push_back(std::move(r));
+	return m_req.reqs.size() - 1;
+}
+
+BOOL exmdb_batch::flush(exec_t exec)
+{
+	m_resp.status.clear();
+	if (m_req.reqs.size() == 0)
+		return TRUE;
+	if (m_req.reqs.size() > EXMDB_BATCH_MAX)
+		return false;
+	m_resp.call_id = exmdb_callid::batch;
+	return exec(&m_req, &m_resp);
+}
+
+bool exmdb_batch::ok(size_t i) const
+{
+	return i < m_resp.status.size() && i < m_resp.resps.size() &&
+	       m_resp.status[i] == exmdb_response::success &&
+	       m_resp.resps[i] != nullptr;
+}
+
+void exmdb_batch::clear()
+{
+	m_req.reqs.clear();
+	m_resp.status.clear();
+	m_resp.resps.clear();
+}
+
+bool imapfile_reader::open(const char *dir, const char *type, const char *mid)
+{
+	close();
+	if (exmdb_client_is_samehost(dir)) {
+		auto path = std::string(dir) + "/" + type + "/" + mid;
+		wrapfd fd = ::open(path.c_str(), O_RDONLY);
+		struct stat sb;
+		if (fd.get() >= 0 && fstat(fd.get(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+			m_size = sb.st_size;
+			m_fd = std::move(fd);
+			m_open = true;
+			return true;
+		}
+		/* Different mount namespace or permissions; go via exmdb. */
+	}
+	m_dir = dir;
+	m_type = type;
+	m_mid = mid;
+	std::string data;
+	if (!exmdb_client_remote::imapfile_read_range(m_dir.c_str(), m_type,
+	    m_mid, 0, 0, &data, &m_size))
+		return false;
+	m_open = true;
+	return true;
+}
+
+void imapfile_reader::close()
+{
+	m_fd.close_rd();
+	m_buf.clear();
+	m_bufofs = m_size = 0;
+	m_open = false;
+}
+
+/**
+ * Fill @buf with @len bytes from offset @ofs. Reading past the end of the
+ * file counts as failure. Remote reads are done in windows of
+ * READAHEAD bytes so that successive small reads (POP3/IMAP send chunks)
+ * cost one round trip per window.
+ */
+bool imapfile_reader::read(void *vbuf, size_t len, uint64_t ofs)
+{
+	if (!m_open || ofs > m_size || len > m_size - ofs)
+		return false;
+	if (len == 0)
+		return true;
+	if (m_fd.get() >= 0)
+		return gx_pread_full(m_fd.get(), vbuf, len, ofs) ==
+		       static_cast<ssize_t>(len);
+	auto buf = static_cast<char *>(vbuf);
+	while (len > 0) {
+		if (ofs < m_bufofs || ofs >= m_bufofs + m_buf.size()) {
+			uint32_t want = std::min(static_cast<uint64_t>(std::max(len, READAHEAD)),
+			                m_size - ofs);
+			uint64_t total = 0;
+			m_buf.clear();
+			if (!exmdb_client_remote::imapfile_read_range(m_dir.c_str(),
+			    m_type, m_mid, ofs, want, &m_buf, &total) ||
+			    m_buf.empty())
+				return false;
+			m_bufofs = ofs;
+		}
+		auto skip = ofs - m_bufofs;
+		auto seg  = std::min(len, static_cast<size_t>(m_buf.size() - skip));
+		memcpy(buf, &m_buf[skip], seg);
+		buf += seg;
+		ofs += seg;
+		len -= seg;
+	}
+	return true;
+}
+
 }
 
 #ifdef TEST1
@@ -38,24 +38,39 @@ static pack_result exmdb_pull(EXT_PULL &x, exreq_connect &d)
 {
 	TRY(x.g_str(&d.prefix));
 	TRY(x.g_str(&d.remote_id));
-	return x.g_bool(&d.b_private);
+	TRY(x.g_bool(&d.b_private));
+	/* Older clients do not send the protocol flags. */
+	d.proto_flags = 0;
+	if (x.m_data_size - x.m_offset < sizeof(uint32_t))
+		return pack_result::ok;
+	return x.g_uint32(&d.proto_flags);
 }
 
 static pack_result exmdb_push(EXT_PUSH &x, const exreq_connect &d)
 {
 	TRY(x.p_str(d.prefix));
 	TRY(x.p_str(d.remote_id));
-	return x.p_bool(d.b_private);
+	TRY(x.p_bool(d.b_private));
+	if (d.proto_flags == 0)
+		return pack_result::ok;
+	return x.p_uint32(d.proto_flags);
 }
 
 static pack_result exmdb_pull(EXT_PULL &x, exreq_listen_notification &d)
 {
-	return x.g_str(&d.remote_id);
+	TRY(x.g_str(&d.remote_id));
+	d.proto_flags = 0;
+	if (x.m_data_size - x.m_offset < sizeof(uint32_t))
+		return pack_result::ok;
+	return x.g_uint32(&d.proto_flags);
 }
 
 static pack_result exmdb_push(EXT_PUSH &x, const exreq_listen_notification &d)
 {
-	return x.p_str(d.remote_id);
+	TRY(x.p_str(d.remote_id));
+	if (d.proto_flags == 0)
+		return pack_result::ok;
+	return x.p_uint32(d.proto_flags);
 }
 
 static pack_result exmdb_pull(EXT_PULL &x, exreq_get_named_propids &d)
@@ -2244,6 +2259,44 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_recalc_store_size &d)
 	return x.p_uint32(d.flags);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exreq_hotprops_setup &d)
+{
+	return x.g_uint32(&d.flags);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_hotprops_setup &d)
+{
+	return x.p_uint32(d.flags);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_backup_read &d)
+{
+	TRY(x.g_uint64(&d.session));
+	return x.g_uint64(&d.rate);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_backup_read &d)
+{
+	TRY(x.p_uint64(d.session));
+	return x.p_uint64(d.rate);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_read_attachment_instance_range &d)
+{
+	TRY(x.g_uint32(&d.instance_id));
+	TRY(x.g_uint32(&d.proptag));
+	TRY(x.g_uint64(&d.offset));
+	return x.g_uint32(&d.length);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_read_attachment_instance_range &d)
+{
+	TRY(x.p_uint32(d.instance_id));
+	TRY(x.p_uint32(d.proptag));
+	TRY(x.p_uint64(d.offset));
+	return x.p_uint32(d.length);
+}
+
 static pack_result exmdb_pull(EXT_PULL &x, exreq_imapfile_read &d)
 {
 	TRY(x.g_str(&d.type));
@@ -2256,6 +2309,22 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_read &d)
 	return x.p_str(d.mid);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exreq_imapfile_read_range &d)
+{
+	TRY(x.g_str(&d.type));
+	TRY(x.g_str(&d.mid));
+	TRY(x.g_uint64(&d.offset));
+	return x.g_uint32(&d.length);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_read_range &d)
+{
+	TRY(x.p_str(d.type));
+	TRY(x.p_str(d.mid));
+	TRY(x.p_uint64(d.offset));
+	return x.p_uint32(d.length);
+}
+
 static pack_result exmdb_pull(EXT_PULL &x, exreq_imapfile_write &d) try
 {
 	TRY(x.g_str(&d.type));
@@ -2277,6 +2346,54 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_write &d)
 	return x.p_bytes(d.data.data(), z);
 }
 
+static pack_result exmdb_ext_pull_request2(EXT_PULL &, exmdb_callid, std::unique_ptr<exreq> &);
+static pack_result exmdb_ext_push_request3(EXT_PUSH &, const exreq *);
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_batch &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_uint8(&d.flags));
+	TRY(x.g_uint32(&count));
+	if (count > EXMDB_BATCH_MAX)
+		return pack_result::range;
+	d.reqs.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint8_t raw_call_id;
+		TRY(x.g_uint8(&raw_call_id));
+		auto call_id = static_cast<exmdb_callid>(raw_call_id);
+		if (call_id == exmdb_callid::connect ||
+		    call_id == exmdb_callid::listen_notification ||
+		    call_id == exmdb_callid::batch)
+			return pack_result::bad_callid;
+		std::unique_ptr<exreq> sub;
+		auto ret = exmdb_ext_pull_request2(x, call_id, sub);
+		if (sub != nullptr)
+			d.reqs.push_back(std::move(sub));
+		if (ret != pack_result::ok)
+			return ret;
+	}
+	return pack_result::ok;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_batch &d)
+{
+	if (d.reqs.size() > EXMDB_BATCH_MAX)
+		return pack_result::range;
+	TRY(x.p_uint8(d.flags));
+	TRY(x.p_uint32(d.reqs.size()));
+	for (const auto &sub : d.reqs) {
+		if (sub->call_id == exmdb_callid::connect ||
+		    sub->call_id == exmdb_callid::listen_notification ||
+		    sub->call_id == exmdb_callid::batch)
+			return pack_result::bad_callid;
+		TRY(x.p_uint8(static_cast<uint8_t>(sub->call_id)));
+		TRY(exmdb_ext_push_request3(x, sub.get()));
+	}
+	return pack_result::ok;
+}
+
 #define RQ_WITH_ARGS \
 	E(get_named_propids) \
 	E(get_named_propnames) \
@@ -2403,7 +2520,12 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_write &d)
 	E(write_message_v2) \
 	E(imapfile_read) \
 	E(imapfile_write) \
-	E(imapfile_delete)
+	E(imapfile_delete) \
+	E(batch) \
+	E(hotprops_setup) \
+	E(backup_read) \
+	E(read_attachment_instance_range) \
+	E(imapfile_read_range)
 
 /**
  * This uses *& because we do not know which request type we are going to get
@@ -2434,12 +2556,28 @@ pack_result exmdb_ext_pull_request(const BINARY *pbin_in,
 
 	char *dir = nullptr;
 	TRY(ext_pull.g_str(&dir));
+	auto xret = exmdb_ext_pull_request2(ext_pull, call_id, prequest);
+	if (prequest == nullptr)
+		return xret;
+	prequest->dir = dir;
+	if (call_id == exmdb_callid::batch)
+		for (auto &sub : static_cast<exreq_batch &>(*prequest).reqs)
+			sub->dir = dir;
+	return xret;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+/* Arguments of a request, i.e. what follows call_id and dir */
+static pack_result exmdb_ext_pull_request2(EXT_PULL &ext_pull,
+    exmdb_callid call_id, std::unique_ptr<exreq> &prequest) try
+{
 	pack_result xret;
 	xret = pack_result::bad_callid;
 	switch (call_id) {
 	case exmdb_callid::connect:
 	case exmdb_callid::listen_notification:
-		break;
+		return xret;
 	case exmdb_callid::ping_store:
 	case exmdb_callid::get_all_named_propids:
 	case exmdb_callid::get_store_all_proptags:
@@ -2447,7 +2585,9 @@ pack_result exmdb_ext_pull_request(const BINARY *pbin_in,
 	case exmdb_callid::allocate_cn:
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
-	case exmdb_callid::purge_datafiles: {
+	case exmdb_callid::purge_datafiles:
+	case exmdb_callid::fts_rebuild:
+	case exmdb_callid::store_cache_stats: {
 		prequest = std::make_unique<exreq>();
 		xret = EXT_ERR_SUCCESS;
 		break;
@@ -2461,34 +2601,33 @@ pack_result exmdb_ext_pull_request(const BINARY *pbin_in,
 	RQ_WITH_ARGS
 #undef E
 	}
-	prequest->call_id = call_id;
-	prequest->dir = dir;
+	if (prequest != nullptr)
+		prequest->call_id = call_id;
 	return xret;
 } catch (const std::bad_alloc &) {
 	return pack_result::alloc;
 }
 
-pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
+static pack_result exmdb_ext_push_request2(EXT_PUSH &ext_push,
+    const exreq *prequest)
 {
-	EXT_PUSH ext_push;
-	
-	if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT))
-		return EXT_ERR_ALLOC;
-	auto status = ext_push.advance(sizeof(uint32_t));
+	auto status = ext_push.p_uint8(static_cast<uint8_t>(prequest->call_id));
 	if (status != EXT_ERR_SUCCESS)
 		return status;
-	status = ext_push.p_uint8(static_cast<uint8_t>(prequest->call_id));
-	if (status != EXT_ERR_SUCCESS)
-		return status;
-	if (prequest->call_id == exmdb_callid::connect) {
-		status = exmdb_push(ext_push, *static_cast<const exreq_connect *>(prequest));
-	} else if (prequest->call_id == exmdb_callid::listen_notification) {
-		status = exmdb_push(ext_push, *static_cast<const exreq_listen_notification *>(prequest));
-	} else {
+	if (prequest->call_id == exmdb_callid::connect)
+		return exmdb_push(ext_push, *static_cast<const exreq_connect *>(prequest));
+	else if (prequest->call_id == exmdb_callid::listen_notification)
+		return exmdb_push(ext_push, *static_cast<const exreq_listen_notification *>(prequest));
 	status = ext_push.p_str(prequest->dir);
 	if (status != EXT_ERR_SUCCESS)
 		return status;
-	status = pack_result::bad_callid;
+	return exmdb_ext_push_request3(ext_push, prequest);
+}
+
+/* Counterpart to exmdb_ext_pull_request2 */
+static pack_result exmdb_ext_push_request3(EXT_PUSH &ext_push,
+    const exreq *prequest)
+{
 	switch (prequest->call_id) {
 	case exmdb_callid::connect:
 	case exmdb_callid::listen_notification:
@@ -2501,13 +2640,26 @@ pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
 	case exmdb_callid::purge_datafiles:
-		status = EXT_ERR_SUCCESS;
-		break;
-#define E(t) case exmdb_callid::t: status = exmdb_push(ext_push, *static_cast<const exreq_ ## t *>(prequest)); break;
+	case exmdb_callid::fts_rebuild:
+	case exmdb_callid::store_cache_stats:
+		return EXT_ERR_SUCCESS;
+#define E(t) case exmdb_callid::t: return exmdb_push(ext_push, *static_cast<const exreq_ ## t *>(prequest));
 	RQ_WITH_ARGS
 #undef E
 	}
-	}
+	return pack_result::bad_callid;
+}
+
+pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
+{
+	EXT_PUSH ext_push;
+	
+	if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT))
+		return EXT_ERR_ALLOC;
+	auto status = ext_push.advance(sizeof(uint32_t));
+	if (status != EXT_ERR_SUCCESS)
+		return status;
+	status = exmdb_ext_push_request2(ext_push, prequest);
 	if (status != EXT_ERR_SUCCESS)
 		return status;
 	pbin_out->cb = ext_push.m_offset;
@@ -2520,6 +2672,27 @@ pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
 	return EXT_ERR_SUCCESS;
 }
 
+/**
+ * Multiplexed framing (EXMDB_PROTO_MUX): the request ID follows the length
+ * word and is echoed back by the server in the response.
+ */
+pack_result exmdb_ext_push_mux_request(const exreq *prequest, uint32_t reqid,
+    BINARY *pbin_out)
+{
+	EXT_PUSH ext_push;
+
+	if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT))
+		return EXT_ERR_ALLOC;
+	TRY(ext_push.advance(sizeof(uint32_t)));
+	TRY(ext_push.p_uint32(reqid));
+	TRY(exmdb_ext_push_request2(ext_push, prequest));
+	pbin_out->cb = ext_push.m_offset;
+	ext_push.m_offset = 0;
+	TRY(ext_push.p_uint32(pbin_out->cb - sizeof(uint32_t)));
+	pbin_out->pb = ext_push.release();
+	return EXT_ERR_SUCCESS;
+}
+
 static pack_result exmdb_pull(EXT_PULL &x, exresp_get_all_named_propids &d)
 {
 	return x.g_propid_a(&d.propids);
@@ -3702,6 +3875,104 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read &d)
 	return x.p_bytes(d.data.data(), d.data.size());
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exresp_backup_read &d) try
+{
+	TRY(x.g_uint64(&d.next_session));
+	uint32_t z;
+	TRY(x.g_uint32(&z));
+	d.data.resize(z);
+	return x.g_bytes(d.data.data(), z);
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_backup_read &d)
+{
+	TRY(x.p_uint64(d.next_session));
+	auto z = std::min(static_cast<size_t>(UINT32_MAX), d.data.size());
+	TRY(x.p_uint32(z));
+	return x.p_bytes(d.data.data(), z);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_store_cache_stats &d)
+{
+	TRY(x.g_uint64(&d.mem));
+	TRY(x.g_uint64(&d.hits));
+	return x.g_uint64(&d.misses);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_store_cache_stats &d)
+{
+	TRY(x.p_uint64(d.mem));
+	TRY(x.p_uint64(d.hits));
+	return x.p_uint64(d.misses);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_read_attachment_instance_range &d)
+{
+	TRY(x.g_bin_ex(&d.data));
+	return x.g_uint64(&d.total);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_read_attachment_instance_range &d)
+{
+	TRY(x.p_bin_ex(d.data));
+	return x.p_uint64(d.total);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_imapfile_read_range &d) try
+{
+	uint32_t z;
+	TRY(x.g_uint32(&z));
+	d.data.resize(z);
+	TRY(x.g_bytes(d.data.data(), z));
+	return x.g_uint64(&d.total);
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read_range &d)
+{
+	auto z = std::min(static_cast<size_t>(UINT32_MAX), d.data.size());
+	TRY(x.p_uint32(z));
+	TRY(x.p_bytes(d.data.data(), z));
+	return x.p_uint64(d.total);
+}
+
+static pack_result exmdb_ext_pull_response2(EXT_PULL &, exresp *);
+static pack_result exmdb_ext_push_response2(EXT_PUSH &, const exresp *);
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_batch &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_uint32(&count));
+	if (count > d.resps.size())
+		return pack_result::format;
+	d.status.clear();
+	d.status.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint8_t st;
+		TRY(x.g_uint8(&st));
+		d.status.push_back(static_cast<exmdb_response>(st));
+		if (d.status.back() == exmdb_response::success)
+			TRY(exmdb_ext_pull_response2(x, d.resps[i].get()));
+	}
+	return pack_result::ok;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_batch &d)
+{
+	TRY(x.p_uint32(d.status.size()));
+	for (size_t i = 0; i < d.status.size(); ++i) {
+		TRY(x.p_uint8(static_cast<uint8_t>(d.status[i])));
+		if (d.status[i] == exmdb_response::success)
+			TRY(exmdb_ext_push_response2(x, d.resps[i].get()));
+	}
+	return pack_result::ok;
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3736,7 +4007,9 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read &d)
 	E(autoreply_tsupdate) \
 	E(recalc_store_size) \
 	E(imapfile_write) \
-	E(imapfile_delete)
+	E(imapfile_delete) \
+	E(fts_rebuild) \
+	E(hotprops_setup)
 #define RSP_WITH_ARGS \
 	E(get_all_named_propids) \
 	E(get_named_propids) \
@@ -3837,7 +4110,12 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read &d)
 	E(store_eid_to_user) \
 	E(autoreply_tsquery) \
 	E(write_message_v2) \
-	E(imapfile_read)
+	E(imapfile_read) \
+	E(batch) \
+	E(backup_read) \
+	E(store_cache_stats) \
+	E(read_attachment_instance_range) \
+	E(imapfile_read_range)
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 /*
@@ -3849,6 +4127,11 @@ pack_result exmdb_ext_pull_response(const BINARY *pbin_in, exresp *presponse)
 	EXT_PULL ext_pull;
 	
 	ext_pull.init(pbin_in->pb, pbin_in->cb, exmdb_rpc_alloc, EXT_FLAG_WCOUNT);
+	return exmdb_ext_pull_response2(ext_pull, presponse);
+}
+
+static pack_result exmdb_ext_pull_response2(EXT_PULL &ext_pull, exresp *presponse)
+{
 	switch (presponse->call_id) {
 	case exmdb_callid::connect:
 	case exmdb_callid::listen_notification:
@@ -3864,6 +4147,24 @@ pack_result exmdb_ext_pull_response(const BINARY *pbin_in, exresp *presponse)
 	return pack_result::bad_callid;
 }
 
+static pack_result exmdb_ext_push_response2(EXT_PUSH &ext_push,
+    const exresp *presponse)
+{
+	switch (presponse->call_id) {
+	case exmdb_callid::connect:
+	case exmdb_callid::listen_notification:
+		break;
+#define E(t) case exmdb_callid::t:
+	RSP_WITHOUT_ARGS
+		return EXT_ERR_SUCCESS;
+#undef E
+#define E(t) case exmdb_callid::t: return exmdb_push(ext_push, *static_cast<const exresp_ ## t *>(presponse));
+	RSP_WITH_ARGS
+#undef E
+	}
+	return pack_result::bad_callid;
+}
+
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
 {
@@ -3877,21 +4178,7 @@ pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
 	status = ext_push.advance(sizeof(uint32_t));
 	if (status != EXT_ERR_SUCCESS)
 		return status;
-
-	status = pack_result::bad_callid;
-	switch (presponse->call_id) {
-	case exmdb_callid::connect:
-	case exmdb_callid::listen_notification:
-		break;
-#define E(t) case exmdb_callid::t:
-	RSP_WITHOUT_ARGS
-		status = EXT_ERR_SUCCESS;
-		break;
-#undef E
-#define E(t) case exmdb_callid::t: status = exmdb_push(ext_push, *static_cast<const exresp_ ## t *>(presponse)); break;
-	RSP_WITH_ARGS
-#undef E
-	}
+	status = exmdb_ext_push_response2(ext_push, presponse);
 	if (status != EXT_ERR_SUCCESS)
 		return status;
 	pbin_out->cb = ext_push.m_offset;
@@ -3904,6 +4191,25 @@ pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
 	return EXT_ERR_SUCCESS;
 }
 
+/* Counterpart to exmdb_ext_push_mux_request */
+pack_result exmdb_ext_push_mux_response(const exresp *presponse, uint32_t reqid,
+    BINARY *pbin_out)
+{
+	EXT_PUSH ext_push;
+
+	if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT))
+		return EXT_ERR_ALLOC;
+	TRY(ext_push.p_uint8(static_cast<uint8_t>(exmdb_response::success)));
+	TRY(ext_push.advance(sizeof(uint32_t)));
+	TRY(ext_push.p_uint32(reqid));
+	TRY(exmdb_ext_push_response2(ext_push, presponse));
+	pbin_out->cb = ext_push.m_offset;
+	ext_push.m_offset = 1;
+	TRY(ext_push.p_uint32(pbin_out->cb - sizeof(uint32_t) - 1));
+	pbin_out->pb = ext_push.release();
+	return EXT_ERR_SUCCESS;
+}
+
 pack_result exmdb_ext_pull_db_notify(const BINARY *pbin_in,
 	DB_NOTIFY_DATAGRAM *pnotify)
 {
@@ -1276,6 +1276,116 @@ errno_t gx_decompress_file(const char *infile, BINARY &outbin,
 	return ENOMEM;
 }
 
+/**
+ * Decompress only the bytes [@offset, @offset+@length) of @infile. Output
+ * before @offset is decompressed into a scratch buffer and dropped, and the
+ * file is not read any further than needed to complete the range. @total
+ * receives the decompressed size if the frame header records it (files from
+ * gx_compress_tofd always do), or UINT64_MAX otherwise.
+ */
+errno_t gx_decompress_file_range(const char *infile, uint64_t offset,
+    uint32_t length, BINARY &outbin, void *(*alloc)(size_t),
+    uint64_t *total) try
+{
+	outbin = {};
+	*total = 0;
+	wrapfd fd(open(infile, O_RDONLY));
+	if (fd.get() < 0)
+		return errno;
+	struct stat sb;
+	if (fstat(fd.get(), &sb) < 0)
+		return errno;
+	if (!S_ISREG(sb.st_mode))
+		return 0;
+
+	auto strm = ZSTD_createDStream();
+	if (strm == nullptr)
+		throw std::bad_alloc();
+	auto cl_0 = make_scope_exit([&]() { ZSTD_freeDStream(strm); });
+	ZSTD_initDStream(strm);
+
+	size_t inbufsize = ZSTD_DStreamInSize();
+	if (static_cast<unsigned long long>(sb.st_size) < inbufsize)
+		inbufsize = sb.st_size;
+	auto inbuf = std::make_unique<char[]>(inbufsize);
+	auto rdret = read(fd.get(), inbuf.get(), inbufsize);
+	if (rdret < 0)
+		return errno;
+	auto outsize = ZSTD_getFrameContentSize(inbuf.get(), rdret);
+	if (outsize == ZSTD_CONTENTSIZE_ERROR)
+		return EIO;
+	if (outsize == ZSTD_CONTENTSIZE_UNKNOWN) {
+		*total = UINT64_MAX;
+	} else {
+		*total = outsize;
+		length = offset >= outsize ? 0 :
+		         std::min(static_cast<uint64_t>(length), static_cast<uint64_t>(outsize - offset));
+	}
+	outbin.pv = alloc(static_cast<size_t>(length) + 1);
+	if (outbin.pv == nullptr)
+		return ENOMEM;
+
+	size_t scratchsize = offset > 0 ? ZSTD_DStreamOutSize() : 0;
+	auto scratch = std::make_unique<char[]>(scratchsize);
+	uint64_t pos = 0; /* decompressed bytes seen so far */
+	ZSTD_inBuffer inds = {inbuf.get(), static_cast<size_t>(rdret)};
+	/*
+	 * The decoder may hold back output even after all input was consumed;
+	 * it is only drained once a call leaves room in the output buffer.
+	 */
+	bool flushed = true;
+	while (outbin.cb < length) {
+		if (inds.pos == inds.size && flushed) {
+			rdret = read(fd.get(), inbuf.get(), inbufsize);
+			if (rdret < 0)
+				return errno;
+			if (rdret == 0)
+				break;
+			inds = {inbuf.get(), static_cast<size_t>(rdret), 0};
+		}
+		ZSTD_outBuffer outds{};
+		if (pos < offset)
+			outds = {scratch.get(), static_cast<size_t>(std::min(
+			         static_cast<uint64_t>(scratchsize), offset - pos)), 0};
+		else
+			outds = {outbin.pb + outbin.cb, length - outbin.cb, 0};
+		auto zret = ZSTD_decompressStream(strm, &outds, &inds);
+		if (ZSTD_isError(zret)) {
+			mlog(LV_ERR, "ZSTD_decompressStream %s: %s",
+				infile, ZSTD_getErrorName(zret));
+			return EIO;
+		}
+		flushed = outds.pos < outds.size || zret == 0;
+		if (pos >= offset)
+			outbin.cb += outds.pos;
+		pos += outds.pos;
+	}
+	outbin.pb[outbin.cb] = '\0';
+	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+/**
+ * pread(2) that only returns short at end of file.
+ */
+ssize_t gx_pread_full(int fd, void *vbuf, size_t len, uint64_t offset)
+{
+	auto buf = static_cast<char *>(vbuf);
+	size_t done = 0;
+	while (done < len) {
+		auto ret = pread(fd, &buf[done], len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
 errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
 {
 #ifdef HAVE_FSETXATTR
@@ -14,6 +14,7 @@
 #include <cstring>
 #include <fcntl.h>
 #include <memory>
+#include <optional>
 #include <string>
 #include <unistd.h>
 #include <utility>
@@ -29,7 +30,6 @@
 #include <gromox/exmdb_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/fileio.h>
-#include <gromox/json.hpp>
 #include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
 #include <gromox/mapi_types.hpp>
@@ -249,6 +249,37 @@ static std::string quote_encode(const std::string &u7)
 	return quote_encode(u7.c_str());
 }
 
+std::string icp_seq_format(const imap_seq_list &list)
+{
+	std::string s;
+	for (const auto &r : list) {
+		if (!s.empty())
+			s += ',';
+		s += std::to_string(r.lo);
+		if (r.hi != r.lo)
+			s += ":" + std::to_string(r.hi);
+	}
+	return s;
+}
+
+/**
+ * Reduce a uid-set as returned by midb (P-VNSH) to the UIDs in @within.
+ */
+static std::string icp_seq_intersect(const std::string &set,
+    const imap_seq_list &within)
+{
+	imap_seq_list in, out;
+	if (set.empty() || parse_imap_seq(in, set.c_str()) != 0)
+		return {};
+	for (const auto &a : in)
+		for (const auto &b : within) {
+			auto lo = std::max(a.lo, b.lo), hi = std::min(a.hi, b.hi);
+			if (lo <= hi)
+				out.insert(lo, hi);
+		}
+	return icp_seq_format(out);
+}
+
 static BOOL icp_parse_fetch_args(mdi_list &plist,
     BOOL *pb_detail, BOOL *pb_data, char *string, char **argv, int argc) try
 {
@@ -281,6 +312,7 @@ static BOOL icp_parse_fetch_args(mdi_list &plist,
 			0 == strcasecmp(argv[i], "ENVELOPE") ||
 			0 == strcasecmp(argv[i], "FLAGS") ||
 			0 == strcasecmp(argv[i], "INTERNALDATE") ||
+			0 == strcasecmp(argv[i], "MODSEQ") ||
 			0 == strcasecmp(argv[i], "RFC822") ||
 			0 == strcasecmp(argv[i], "RFC822.HEADER") ||
 			0 == strcasecmp(argv[i], "RFC822.SIZE") ||
@@ -484,17 +516,12 @@ static void icp_convert_flags_string(int flag_bits, char *flags_string)
 	flags_string[len + 1] = '\0';
 }
 
-static int icp_match_field(mjson_io &io, const char *cmd_tag,
-    const char *file_path, size_t offset, size_t length, BOOL b_not,
-    const char *tags, size_t offset1, ssize_t length1, std::string &value) try
+static int icp_match_field(const std::string &buff, const char *cmd_tag,
+    BOOL b_not, const char *tags, size_t offset1, ssize_t length1,
+    std::string &value) try
 {
 	auto pbody = strchr(cmd_tag, '[');
-	if (length > 128 * 1024)
-		return -1;
-	auto fd = io.find(file_path);
-	if (io.invalid(fd))
-		return -1;
-	auto buff = io.substr(fd, offset, length);
+	auto length = buff.size();
 
 	char temp_buff[1024], *tmp_argv[128];
 	int tmp_argc;
@@ -671,22 +698,30 @@ static int pstruct_else(imap_context &ctx, MJSON *pjson,
 		buf += "BODY"s + pbody + " NIL";
 		return 0;
 	}
-	std::string eml_path;
-	if (storage_path == nullptr) {
+	if (pmime->get_head_length() > 128 * 1024) {
+		buf += "BODY"s + pbody + " NIL";
+		return 0;
+	}
+	std::string eml_path, head;
+	if (storage_path == nullptr)
 		eml_path = ctx.maildir + "/eml/"s + pjson->get_mail_filename();
-		if (!ctx.io_actor.exists(eml_path)) {
-			std::string content;
-			if (exmdb_client::imapfile_read(ctx.maildir, "eml",
-			    pjson->get_mail_filename(), &content))
-				ctx.io_actor.place(eml_path, std::move(content));
-		}
-	} else {
+	else
 		eml_path = ctx.maildir + "/tmp/imap.rfc822/"s + storage_path + "/" + pjson->get_mail_filename();
+	auto fd = ctx.io_actor.find(eml_path);
+	if (ctx.io_actor.valid(fd)) {
+		head = mjson_io::substr(fd, pmime->get_head_offset(), pmime->get_head_length());
+	} else if (storage_path == nullptr) {
+		/* Only the header block is needed, not the whole message */
+		imapfile_reader rd;
+		head.resize(pmime->get_head_length());
+		if (!rd.open(ctx.maildir, "eml", pjson->get_mail_filename()) ||
+		    !rd.read(head.data(), head.size(), pmime->get_head_offset()))
+			head.clear();
 	}
 	std::string b2;
-	int len = icp_match_field(ctx.io_actor, cmd_tag.c_str(), eml_path.c_str(),
-	          pmime->get_head_offset(), pmime->get_head_length(),
-	          b_not, data_item, offset, length, b2);
+	int len = head.empty() ? -1 :
+	          icp_match_field(head, cmd_tag.c_str(), b_not, data_item,
+	          offset, length, b2);
 	if (len == -1)
 		buf += "BODY"s + pbody + " NIL";
 	else
@@ -720,6 +755,41 @@ static int icp_print_structure(imap_context &ctx, MJSON *pjson,
 	return -1;
 }
 
+/**
+ * Returns the BODY/BODYSTRUCTURE/ENVELOPE rendering that midb supplied with
+ * the digest for this session's charset, if any.
+ */
+static const char *icp_fetch_cached(const imap_context &ctx,
+    const MITEM &item, const char *key)
+{
+	if (!(item.flag_bits & FLAG_LOADED) || item.imapcset.empty() ||
+	    strcasecmp(item.imapcset.c_str(), ctx.defcharset) != 0)
+		return nullptr;
+	auto &v = strcmp(key, "imapbody") == 0 ? item.imapbody :
+	          strcmp(key, "imapbs") == 0 ? item.imapbs : item.imapenv;
+	return v.empty() ? nullptr : v.c_str();
+}
+
+static bool icp_fetch_needs_digest(const imap_context &ctx,
+    const MITEM &item, const mdi_list &items)
+{
+	for (const auto &kw : items) {
+		auto k = kw.c_str();
+		if (strcasecmp(k, "FLAGS") == 0 || strcasecmp(k, "UID") == 0 ||
+		    strcasecmp(k, "MODSEQ") == 0)
+			continue;
+		if ((strcasecmp(k, "BODY") == 0 &&
+		    icp_fetch_cached(ctx, item, "imapbody") != nullptr) ||
+		    (strcasecmp(k, "BODYSTRUCTURE") == 0 &&
+		    icp_fetch_cached(ctx, item, "imapbs") != nullptr) ||
+		    (strcasecmp(k, "ENVELOPE") == 0 &&
+		    icp_fetch_cached(ctx, item, "imapenv") != nullptr))
+			continue;
+		return true;
+	}
+	return false;
+}
+
 static int icp_process_fetch_item(imap_context &ctx,
     BOOL b_data, MITEM *pitem, int item_id, mdi_list &pitem_list) try
 {
@@ -728,15 +798,21 @@ static int icp_process_fetch_item(imap_context &ctx,
 	MJSON mjson;
 	std::string buf;
 	
-	if (pitem->flag_bits & FLAG_LOADED) {
+	if (pitem->flag_bits & FLAG_LOADED &&
+	    icp_fetch_needs_digest(ctx, *pitem, pitem_list)) {
 		auto eml_path = std::string(pcontext->maildir) + "/eml";
-		if (!mjson.load_from_json(pitem->digest)) {
-			mlog(LV_ERR, "E-1921: load_from_json %s/%s oopsied", ctx.maildir, ctx.mid.c_str());
+		if (!mjson.load_from_digest(pitem->digest)) {
+			mlog(LV_ERR, "E-1921: load_from_digest %s/%s oopsied", ctx.maildir, pitem->mid.c_str());
 			return 1923;
 		}
+		mjson.filename = pitem->mid;
 		mjson.path = eml_path;
 		auto eml_file = eml_path + "/"s + pitem->mid;
-		if (!ctx.io_actor.exists(eml_file)) {
+		/*
+		 * Only the rfc822 part extraction needs the message in memory;
+		 * bodies are streamed from the file when the response is sent.
+		 */
+		if (mjson.has_rfc822_part() && !ctx.io_actor.exists(eml_file)) {
 			std::string content;
 			if (exmdb_client::imapfile_read(ctx.maildir, "eml", pitem->mid, &content))
 				ctx.io_actor.place(eml_file, std::move(content));
@@ -751,7 +827,20 @@ static int icp_process_fetch_item(imap_context &ctx,
 		else
 			buf += ' ';
 		auto kw = kwss.data();
-		if (strcasecmp(kw, "BODY") == 0) {
+		const char *cached;
+		if (strcasecmp(kw, "BODY") == 0 &&
+		    (cached = icp_fetch_cached(ctx, *pitem, "imapbody")) != nullptr) {
+			buf += "BODY ";
+			buf += cached;
+		} else if (strcasecmp(kw, "BODYSTRUCTURE") == 0 &&
+		    (cached = icp_fetch_cached(ctx, *pitem, "imapbs")) != nullptr) {
+			buf += "BODYSTRUCTURE ";
+			buf += cached;
+		} else if (strcasecmp(kw, "ENVELOPE") == 0 &&
+		    (cached = icp_fetch_cached(ctx, *pitem, "imapenv")) != nullptr) {
+			buf += "ENVELOPE ";
+			buf += cached;
+		} else if (strcasecmp(kw, "BODY") == 0) {
 			buf += "BODY ";
 			if (mjson.has_rfc822_part()) {
 				auto rfc_path = std::string(pcontext->maildir) + "/tmp/imap.rfc822";
@@ -865,6 +954,8 @@ static int icp_process_fetch_item(imap_context &ctx,
 		} else if (strcasecmp(kw, "UID") == 0) {
 			buf += "UID ";
 			buf += std::to_string(pitem->uid);
+		} else if (strcasecmp(kw, "MODSEQ") == 0) {
+			buf += fmt::format("MODSEQ ({})", pitem->modseq);
 		} else if (strncasecmp(kw, "BODY[", 5) == 0 ||
 		    strncasecmp(kw, "BODY.PEEK[", 10) == 0) {
 			auto pbody = strchr(kw, '[');
@@ -963,71 +1054,84 @@ static int icp_process_fetch_item(imap_context &ctx,
 	return 1918;
 }
 
-static void icp_store_flags(const char *cmd, const std::string &mid,
-    int id, unsigned int uid, unsigned int flag_bits, imap_context &ctx)
+/**
+ * With @unchangedsince, midb refuses the change if the message has a higher
+ * modseq by now; false is returned in that case.
+ */
+static bool icp_store_flags(const char *cmd, const std::string &mid,
+    int id, unsigned int uid, unsigned int flag_bits, imap_context &ctx,
+    const uint64_t *unchangedsince = nullptr)
 {
 	auto pcontext = &ctx;
 	int errnum;
 	char buff[1024];
 	int string_length;
 	char flags_string[128];
+	uint64_t modseq = 0;
+	bool b_silent = strcasestr(cmd, ".SILENT") != nullptr;
 	
 	string_length = 0;
-	if (0 == strcasecmp(cmd, "FLAGS") ||
+	if (unchangedsince != nullptr) {
+		char op = cmd[0] == '+' || cmd[0] == '-' ? cmd[0] : '=';
+		bool modified = false;
+		if (midb_agent::store_flags(pcontext->maildir,
+		    pcontext->selected_folder, mid, op, flag_bits,
+		    *unchangedsince, &modified, &errnum) != MIDB_RESULT_OK)
+			return true;
+		if (modified)
+			return false;
+	} else if (0 == strcasecmp(cmd, "FLAGS") ||
 		0 == strcasecmp(cmd, "FLAGS.SILENT")) {
 		midb_agent::unset_flags(pcontext->maildir, pcontext->selected_folder,
 			mid, FLAG_ANSWERED | FLAG_FLAGGED | FLAG_DELETED |
 			FLAG_SEEN | FLAG_DRAFT | FLAG_RECENT, nullptr, &errnum);
 		midb_agent::set_flags(pcontext->maildir, pcontext->selected_folder,
 			mid, flag_bits, nullptr, &errnum);
-		if (0 == strcasecmp(cmd, "FLAGS")) {
-			icp_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-		}
 	} else if (0 == strcasecmp(cmd, "+FLAGS") ||
 		0 == strcasecmp(cmd, "+FLAGS.SILENT")) {
 		midb_agent::set_flags(pcontext->maildir, pcontext->selected_folder,
 			mid, flag_bits, nullptr, &errnum);
-		if (0 == strcasecmp(cmd, "+FLAGS") && 
-			MIDB_RESULT_OK == midb_agent::get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			icp_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-		}
 	} else if (0 == strcasecmp(cmd, "-FLAGS") ||
 		0 == strcasecmp(cmd, "-FLAGS.SILENT")) {
 		midb_agent::unset_flags(pcontext->maildir, pcontext->selected_folder,
 			mid, flag_bits, nullptr, &errnum);
-		if (0 == strcasecmp(cmd, "-FLAGS") &&
-			MIDB_RESULT_OK == midb_agent::get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			icp_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, std::size(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-		}
+	} else {
+		return true;
 	}
-	if (string_length != 0)
-		imap_parser_safe_write(pcontext, buff, string_length);
+	/*
+	 * With CONDSTORE, the new MODSEQ is reported even for .SILENT
+	 * (RFC 7162 §3.1.3), so the flags are re-read in that case too.
+	 */
+	if (b_silent && !pcontext->b_condstore)
+		return true;
+	if ((cmd[0] == '+' || cmd[0] == '-' || pcontext->b_condstore) &&
+	    midb_agent::get_flags(pcontext->maildir, pcontext->selected_folder,
+	    mid, &flag_bits, &errnum, &modseq) != MIDB_RESULT_OK)
+		return true;
+	if (b_silent) {
+		string_length = uid != 0 ?
+			gx_snprintf(buff, std::size(buff),
+				"* %d FETCH (UID %u MODSEQ (%llu))\r\n", id, uid,
+				static_cast<unsigned long long>(modseq)) :
+			gx_snprintf(buff, std::size(buff),
+				"* %d FETCH (MODSEQ (%llu))\r\n", id,
+				static_cast<unsigned long long>(modseq));
+	} else {
+		icp_convert_flags_string(flag_bits, flags_string);
+		string_length = uid != 0 ?
+			gx_snprintf(buff, std::size(buff),
+				"* %d FETCH (FLAGS %s UID %d", id, flags_string, uid) :
+			gx_snprintf(buff, std::size(buff),
+				"* %d FETCH (FLAGS %s", id, flags_string);
+		if (pcontext->b_condstore)
+			string_length += gx_snprintf(&buff[string_length],
+				std::size(buff) - string_length, " MODSEQ (%llu)",
+				static_cast<unsigned long long>(modseq));
+		string_length += gx_snprintf(&buff[string_length],
+			std::size(buff) - string_length, ")\r\n");
+	}
+	imap_parser_safe_write(pcontext, buff, string_length);
+	return true;
 }
 
 static BOOL icp_convert_imaptime(const char *str_time, time_t *ptime)
@@ -1175,6 +1279,35 @@ int icp_capability(int argc, char **argv, imap_context &ctx) try
 	return 1918;
 }
 
+/**
+ * RFC 5161 ENABLE. QRESYNC implies CONDSTORE (RFC 7162 §3.2.3).
+ */
+int icp_enable(int argc, char **argv, imap_context &ctx) try
+{
+	if (!ctx.is_authed())
+		return 1804;
+	if (argc < 3)
+		return 1800;
+	std::string buf = "* ENABLED";
+	for (int i = 2; i < argc; ++i) {
+		if (strcasecmp(argv[i], "CONDSTORE") == 0) {
+			if (!ctx.b_condstore)
+				buf += " CONDSTORE";
+			ctx.b_condstore = true;
+		} else if (strcasecmp(argv[i], "QRESYNC") == 0) {
+			if (!ctx.b_qresync)
+				buf += " QRESYNC";
+			ctx.b_condstore = ctx.b_qresync = true;
+		}
+	}
+	/* IMAP_CODE_2170031: OK ENABLE completed */
+	buf += fmt::format("\r\n{} {}", argv[0], resource_get_imap_code(1731, 1));
+	imap_parser_safe_write(&ctx, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1918;
+}
+
 int icp_id(int argc, char **argv, imap_context &ctx) try
 {
 	auto pcontext = &ctx;
@@ -1497,38 +1630,144 @@ int content_array::refresh(imap_context &ctx, const std::string &folder,
 	return 0;
 }
 
+/**
+ * Parameters of "SELECT mbox (QRESYNC (uidvalidity modseq [known-uids]))",
+ * RFC 7162 §3.2.5. The optional sequence match data is not used.
+ */
+struct qresync_param {
+	uint32_t uidvalidity = 0;
+	uint64_t modseq = 0;
+	imap_seq_list known_uids;
+};
+
+static bool icp_parse_select_params(imap_context &ctx, char *str,
+    std::optional<qresync_param> &qr)
+{
+	char *argv[4], *qargv[4];
+	auto len = strlen(str);
+	if (len < 2 || str[0] != '(' || str[len-1] != ')')
+		return false;
+	auto argc = parse_imap_args(str + 1, len - 2, argv, std::size(argv));
+	if (argc < 1)
+		return false;
+	for (int i = 0; i < argc; ++i) {
+		if (strcasecmp(argv[i], "CONDSTORE") == 0) {
+			ctx.b_condstore = true;
+			continue;
+		}
+		if (strcasecmp(argv[i], "QRESYNC") != 0 || i + 1 >= argc ||
+		    !ctx.b_qresync)
+			return false;
+		auto p = argv[++i];
+		len = strlen(p);
+		if (len < 2 || p[0] != '(' || p[len-1] != ')')
+			return false;
+		auto qargc = parse_imap_args(p + 1, len - 2, qargv, std::size(qargv));
+		if (qargc < 2)
+			return false;
+		qr.emplace();
+		char *end = nullptr;
+		qr->uidvalidity = strtoul(qargv[0], &end, 10);
+		if (end == qargv[0] || *end != '\0' || qr->uidvalidity == 0)
+			return false;
+		qr->modseq = strtoull(qargv[1], &end, 10);
+		if (end == qargv[1] || *end != '\0' || qr->modseq == 0)
+			return false;
+		if (qargc >= 3) {
+			if (parse_imap_seq(qr->known_uids, qargv[2]) != 0)
+				return false;
+		} else {
+			qr->known_uids.insert(1, SEQ_STAR);
+		}
+	}
+	return true;
+}
+
+/**
+ * Changes since the client's last known state for SELECT (QRESYNC): UIDs
+ * expunged in the meantime (as one VANISHED (EARLIER) line) and the current
+ * flags of everything modified.
+ */
+static int icp_selex_qresync(imap_context &ctx, const std::string &folder,
+    const qresync_param &qr, std::string &buf)
+{
+	std::string vset;
+	int errnum = 0;
+	auto ssr = midb_agent::vanished_uid(ctx.maildir, folder,
+	           qr.modseq, vset, &errnum);
+	auto ret = m2icode(ssr, errnum);
+	if (ret != 0)
+		return ret;
+	vset = icp_seq_intersect(vset, qr.known_uids);
+	if (!vset.empty())
+		buf += "* VANISHED (EARLIER) " + vset + "\r\n";
+	XARRAY xa;
+	imap_seq_list all_seq;
+	all_seq.insert(1, SEQ_STAR);
+	ssr = midb_agent::fetch_simple_uid(ctx.maildir, folder,
+	      all_seq, &xa, &errnum, qr.modseq);
+	ret = m2icode(ssr, errnum);
+	if (ret != 0)
+		return ret;
+	for (auto &item : xa.m_vec) {
+		auto ct_item = ctx.contents.get_itemx(item.uid);
+		if (ct_item == nullptr || item.modseq <= qr.modseq)
+			continue;
+		char flags_string[128];
+		icp_convert_flags_string(item.flag_bits, flags_string);
+		buf += fmt::format("* {} FETCH (UID {} FLAGS {} MODSEQ ({}))\r\n",
+		       ct_item->id, item.uid, flags_string, item.modseq);
+	}
+	return 0;
+}
+
 static int icp_selex(int argc, char **argv, imap_context &ctx, bool readonly) try
 {
 	auto pcontext = &ctx;
 	int errnum;
 	std::string sys_name;
+	std::optional<qresync_param> qresync;
     
 	if (!pcontext->is_authed())
 		return 1804;
 	if (argc < 3 || 0 == strlen(argv[2]) || strlen(argv[2]) >= 1024 ||
 	    !icp_imapfolder_to_sysfolder(argv[2], sys_name))
 		return 1800;
+	if (argc >= 4 && !icp_parse_select_params(*pcontext, argv[3], qresync))
+		return 1800;
+	std::string buf;
 	if (iproto_stat::select == pcontext->proto_stat) {
 		imap_parser_remove_select(pcontext);
 		pcontext->proto_stat = iproto_stat::auth;
 		pcontext->selected_folder.clear();
+		if (pcontext->b_qresync)
+			buf = "* OK [CLOSED] previous mailbox closed\r\n";
 	}
 	
 	uint32_t uidvalid = 0, uidnext = 0;
+	uint64_t highestmodseq = 0;
 	auto ssr = midb_agent::summary_folder(pcontext->maildir, sys_name,
-	           nullptr, nullptr, nullptr, &uidvalid, &uidnext, &errnum);
+	           nullptr, nullptr, nullptr, &uidvalid, &uidnext,
+	           &highestmodseq, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
 	ret = pcontext->contents.refresh(*pcontext, sys_name, true);
 	if (ret != 0)
 		return ret;
+	std::string qbuf;
+	if (qresync.has_value() && qresync->uidvalidity == uidvalid &&
+	    qresync->modseq < highestmodseq) {
+		ret = icp_selex_qresync(*pcontext, sys_name, *qresync, qbuf);
+		if (ret != 0)
+			return ret;
+	}
 	pcontext->selected_folder = sys_name;
 	pcontext->proto_stat = iproto_stat::select;
 	pcontext->b_readonly = readonly;
 	imap_parser_add_select(pcontext);
 
-	auto buf = fmt::format(
+	buf += fmt::format(
 		"* {} EXISTS\r\n"
 		"* {} RECENT\r\n"
 		"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
@@ -1545,6 +1784,11 @@ static int icp_selex(int argc, char **argv, imap_context &ctx, bool readonly) tr
 	auto s_command  = readonly ? "EXAMINE" : "SELECT";
 	buf += fmt::format("* OK [UIDVALIDITY {}] UIDs valid\r\n"
 	       "* OK [UIDNEXT {}] predicted next UID\r\n", uidvalid, uidnext);
+	if (highestmodseq != 0)
+		buf += fmt::format("* OK [HIGHESTMODSEQ {}] highest\r\n", highestmodseq);
+	else
+		buf += "* OK [NOMODSEQ] no mod-sequences\r\n";
+	buf += std::move(qbuf);
 	if (g_rfc9051_enable)
 		buf += fmt::format("* LIST () \"/\" {}\r\n", quote_encode(argv[2]));
 	buf += fmt::format("{} OK [{}] {} completed\r\n",
@@ -1940,8 +2184,10 @@ int icp_status(int argc, char **argv, imap_context &ctx) try
 
 	size_t exists = 0, recent = 0, unseen = 0;
 	uint32_t uidvalid = 0, uidnext = 0;
+	uint64_t highestmodseq = 0;
 	auto ssr = midb_agent::summary_folder(pcontext->maildir, sys_name,
-	           &exists, &recent, &unseen, &uidvalid, &uidnext, &errnum);
+	           &exists, &recent, &unseen, &uidvalid, &uidnext,
+	           &highestmodseq, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
@@ -1963,6 +2209,8 @@ int icp_status(int argc, char **argv, imap_context &ctx) try
 			buf += fmt::format("UIDVALIDITY {}", uidvalid);
 		else if (strcasecmp(temp_argv[i], "UNSEEN") == 0)
 			buf += fmt::format("UNSEEN {}", unseen);
+		else if (strcasecmp(temp_argv[i], "HIGHESTMODSEQ") == 0)
+			buf += fmt::format("HIGHESTMODSEQ {}", highestmodseq);
 		else
 			return 1800;
 	}
@@ -2062,7 +2310,7 @@ int icp_append(int argc, char **argv, imap_context &ctx) try
 		uint32_t uidvalid = 0;
 		if (midb_agent::summary_folder(pcontext->maildir,
 		    sys_name, nullptr, nullptr, nullptr, &uidvalid, nullptr,
-		    &errnum) == MIDB_RESULT_OK &&
+		    nullptr, &errnum) == MIDB_RESULT_OK &&
 		    midb_agent::get_uid(pcontext->maildir, sys_name,
 		    mid_string.c_str(), &uid) == MIDB_RESULT_OK) {
 			buf = fmt::format("{} {} [APPENDUID {} {}] {}",
@@ -2196,7 +2444,7 @@ static int icp_append_end2(int argc, char **argv, imap_context &ctx) try
 		unsigned int uid = 0;
 		if (midb_agent::summary_folder(pcontext->maildir,
 		    sys_name, nullptr, nullptr, nullptr, &uidvalid,
-		    nullptr, &errnum) == MIDB_RESULT_OK &&
+		    nullptr, nullptr, &errnum) == MIDB_RESULT_OK &&
 		    midb_agent::get_uid(pcontext->maildir, sys_name,
 		    cmid.c_str(), &uid) == MIDB_RESULT_OK) {
 			buf = fmt::format("{} {} [APPENDUID {} {}] {}",
@@ -2392,6 +2640,59 @@ static errno_t parse_imap_seqx(const imap_context &ctx, char *range_string,
 	return ENOMEM;
 }
 
+/**
+ * Parse the RFC 7162 FETCH modifier list "(CHANGEDSINCE n [VANISHED])".
+ * Using it switches on CONDSTORE for the session.
+ */
+static bool icp_parse_fetch_mod(imap_context &ctx, char *str,
+    uint64_t *changedsince, bool *vanished)
+{
+	char *argv[4];
+	auto len = strlen(str);
+	if (len < 2 || str[0] != '(' || str[len-1] != ')')
+		return false;
+	auto argc = parse_imap_args(str + 1, len - 2, argv, std::size(argv));
+	if (argc < 1)
+		return false;
+	bool b_changedsince = false;
+	for (int i = 0; i < argc; ++i) {
+		if (strcasecmp(argv[i], "CHANGEDSINCE") == 0 && i + 1 < argc) {
+			char *end = nullptr;
+			*changedsince = strtoull(argv[++i], &end, 10);
+			if (end == argv[i] || *end != '\0')
+				return false;
+			b_changedsince = true;
+		} else if (strcasecmp(argv[i], "VANISHED") == 0) {
+			*vanished = true;
+		} else {
+			return false;
+		}
+	}
+	if (!b_changedsince)
+		return false;
+	ctx.b_condstore = true;
+	return true;
+}
+
+/**
+ * Whether MODSEQ has to be reported. A CHANGEDSINCE modifier implies it, as
+ * does any use of the item, which also switches on CONDSTORE.
+ */
+static bool icp_fetch_modseq(imap_context &ctx, mdi_list &items,
+    bool b_changedsince) try
+{
+	auto has = std::any_of(items.cbegin(), items.cend(),
+	           [](const std::string &e) { return strcasecmp(e.c_str(), "MODSEQ") == 0; });
+	if (!has && !b_changedsince)
+		return false;
+	if (!has)
+		items.emplace_back("MODSEQ");
+	ctx.b_condstore = true;
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
 static int fetch_trivial_uid(imap_context &ctx, const imap_seq_list &range_list,
     XARRAY &xa) try
 {
@@ -2420,13 +2721,26 @@ int icp_fetch(int argc, char **argv, imap_context &ctx)
 		return 1805;
 	if (argc < 4 || parse_imap_seqx(*pcontext, argv[2], list_uid) != 0)
 		return 1800;
+	uint64_t changedsince = 0;
+	bool b_vanished = false;
+	if (argc >= 5 && (!icp_parse_fetch_mod(*pcontext, argv[4],
+	    &changedsince, &b_vanished) || b_vanished))
+		/* VANISHED is only valid with UID FETCH */
+		return 1800;
 	if (!icp_parse_fetch_args(list_data, &b_detail,
 	    &b_data, argv[3], tmp_argv, std::size(tmp_argv)))
 		return 1800;
+	/* The seqid cache has no current modseqs, so go to midb for those. */
+	auto b_modseq = icp_fetch_modseq(*pcontext, list_data, argc >= 5);
 	XARRAY xarray;
 	auto ssr = b_detail ?
 	           midb_agent::fetch_detail_uid(pcontext->maildir,
-	           pcontext->selected_folder, list_uid, &xarray, &errnum) :
+	           pcontext->selected_folder, list_uid, pcontext->defcharset,
+	           &xarray, &errnum) :
+	           b_modseq ?
+	           midb_agent::fetch_simple_uid(pcontext->maildir,
+	           pcontext->selected_folder, list_uid, &xarray, &errnum,
+	           changedsince) :
 	           fetch_trivial_uid(*pcontext, list_uid, xarray);
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
@@ -2444,6 +2758,8 @@ int icp_fetch(int argc, char **argv, imap_context &ctx)
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
+		if (changedsince > 0 && pitem->modseq <= changedsince)
+			continue;
 		result = icp_process_fetch_item(ctx, b_data,
 		         pitem, ct_item->id, list_data);
 		if (result != 0)
@@ -2476,19 +2792,50 @@ static bool store_flagkeyword(const char *str)
 	return false;
 }
 
-int icp_store(int argc, char **argv, imap_context &ctx)
+/**
+ * Parse the RFC 7162 STORE modifier "(UNCHANGEDSINCE n)", which may precede
+ * the flag keyword. Using it switches on CONDSTORE for the session.
+ */
+static bool icp_parse_store_mod(imap_context &ctx, char *str,
+    uint64_t *unchangedsince)
+{
+	char *argv[2];
+	auto len = strlen(str);
+	if (len < 2 || str[0] != '(' || str[len-1] != ')')
+		return false;
+	if (parse_imap_args(str + 1, len - 2, argv, std::size(argv)) != 2 ||
+	    strcasecmp(argv[0], "UNCHANGEDSINCE") != 0)
+		return false;
+	char *end = nullptr;
+	*unchangedsince = strtoull(argv[1], &end, 10);
+	if (end == argv[1] || *end != '\0')
+		return false;
+	ctx.b_condstore = true;
+	return true;
+}
+
+int icp_store(int argc, char **argv, imap_context &ctx) try
 {
 	auto pcontext = &ctx;
 	int errnum, i;
 	int flag_bits;
 	int temp_argc;
 	char *temp_argv[8];
-	imap_seq_list list_uid;
+	imap_seq_list list_uid, modified;
 
 	if (pcontext->proto_stat != iproto_stat::select)
 		return 1805;
-	if (argc < 5 || parse_imap_seqx(*pcontext, argv[2], list_uid) != 0 ||
-	    !store_flagkeyword(argv[3]))
+	if (argc < 5 || parse_imap_seqx(*pcontext, argv[2], list_uid) != 0)
+		return 1800;
+	uint64_t unchangedsince = 0;
+	bool b_unchangedsince = argv[3][0] == '(';
+	auto tag = argv[0];
+	if (b_unchangedsince) {
+		if (argc < 6 || !icp_parse_store_mod(*pcontext, argv[3], &unchangedsince))
+			return 1800;
+		++argv;
+	}
+	if (!store_flagkeyword(argv[3]))
 		return 1800;
 	if ('(' == argv[4][0] && ')' == argv[4][strlen(argv[4]) - 1]) {
 		temp_argc = parse_imap_args(argv[4] + 1, strlen(argv[4]) - 2,
@@ -2530,12 +2877,24 @@ int icp_store(int argc, char **argv, imap_context &ctx)
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
-		icp_store_flags(argv[3], pitem->mid,
-			ct_item->id, 0, flag_bits, ctx);
+		if (!icp_store_flags(argv[3], pitem->mid, ct_item->id, 0,
+		    flag_bits, ctx, b_unchangedsince ? &unchangedsince : nullptr)) {
+			modified.insert(ct_item->id);
+			continue;
+		}
 		imap_parser_bcast_flags(*pcontext, pitem->uid);
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1721;
+	if (modified.size() == 0)
+		return 1721;
+	/* IMAP_CODE_2170032: OK <MODIFIED> STORE completed */
+	auto buf = fmt::format("{} {} [MODIFIED {}] {}", tag,
+	           resource_get_imap_code(1732, 1), icp_seq_format(modified),
+	           resource_get_imap_code(1732, 2));
+	imap_parser_safe_write(pcontext, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1915;
 }
 
 int icp_copy(int argc, char **argv, imap_context &ctx) try
@@ -2564,7 +2923,7 @@ int icp_copy(int argc, char **argv, imap_context &ctx) try
 	uint32_t uidvalidity = 0;
 	if (midb_agent::summary_folder(pcontext->maildir,
 	    sys_name, nullptr, nullptr, nullptr, &uidvalidity, nullptr,
-	    &errnum) != MIDB_RESULT_OK)
+	    nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
@@ -2691,22 +3050,46 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 		return 1805;
 	if (argc < 5 || parse_imap_seq(list_seq, argv[3]) != 0)
 		return 1800;
+	uint64_t changedsince = 0;
+	bool b_vanished = false;
+	if (argc >= 6 && !icp_parse_fetch_mod(*pcontext, argv[5],
+	    &changedsince, &b_vanished))
+		return 1800;
+	if (b_vanished && !pcontext->b_qresync)
+		return 1800;
 	if (!icp_parse_fetch_args(list_data, &b_detail,
 	    &b_data, argv[4], tmp_argv, std::size(tmp_argv)))
 		return 1800;
 	if (std::none_of(list_data.cbegin(), list_data.cend(),
 	    [](const std::string &e) { return strcasecmp(e.c_str(), "UID") == 0; }))
 		list_data.emplace_back("UID");
+	icp_fetch_modseq(*pcontext, list_data, argc >= 6);
 	XARRAY xarray;
 	auto ssr = b_detail ?
 	           midb_agent::fetch_detail_uid(pcontext->maildir,
-	           pcontext->selected_folder, list_seq, &xarray, &errnum) :
+	           pcontext->selected_folder, list_seq, pcontext->defcharset,
+	           &xarray, &errnum) :
 	           midb_agent::fetch_simple_uid(pcontext->maildir,
-	           pcontext->selected_folder, list_seq, &xarray, &errnum);
+	           pcontext->selected_folder, list_seq, &xarray, &errnum,
+	           changedsince);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
 	pcontext->stream.clear();
+	if (b_vanished) {
+		std::string vset;
+		ssr = midb_agent::vanished_uid(pcontext->maildir,
+		      pcontext->selected_folder, changedsince, vset, &errnum);
+		ret = m2icode(ssr, errnum);
+		if (ret != 0)
+			return ret;
+		vset = icp_seq_intersect(vset, list_seq);
+		if (!vset.empty()) {
+			vset = "* VANISHED (EARLIER) " + vset + "\r\n";
+			if (pcontext->stream.write(vset.c_str(), vset.size()) != STREAM_WRITE_OK)
+				return 1922;
+		}
+	}
 	num = xarray.get_capacity();
 	imrpc_build_env();
 	auto cl_0 = make_scope_exit(imrpc_free_env);
@@ -2715,6 +3098,8 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
+		if (changedsince > 0 && pitem->modseq <= changedsince)
+			continue;
 		ret = icp_process_fetch_item(ctx, b_data,
 		      pitem, ct_item->id, list_data);
 		if (ret != 0)
@@ -2739,17 +3124,26 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 	return 1918;
 }
 
-int icp_uid_store(int argc, char **argv, imap_context &ctx)
+int icp_uid_store(int argc, char **argv, imap_context &ctx) try
 {
 	auto pcontext = &ctx;
 	int errnum, i, flag_bits, temp_argc;
 	char *temp_argv[8];
-	imap_seq_list list_seq;
+	imap_seq_list list_seq, modified;
 
 	if (pcontext->proto_stat != iproto_stat::select)
 		return 1805;
-	if (argc < 6 || parse_imap_seq(list_seq, argv[3]) != 0 ||
-	    !store_flagkeyword(argv[4]))
+	if (argc < 6 || parse_imap_seq(list_seq, argv[3]) != 0)
+		return 1800;
+	uint64_t unchangedsince = 0;
+	bool b_unchangedsince = argv[4][0] == '(';
+	auto tag = argv[0];
+	if (b_unchangedsince) {
+		if (argc < 7 || !icp_parse_store_mod(*pcontext, argv[4], &unchangedsince))
+			return 1800;
+		++argv;
+	}
+	if (!store_flagkeyword(argv[4]))
 		return 1800;
 	if ('(' == argv[5][0] && ')' == argv[5][strlen(argv[5]) - 1]) {
 		temp_argc = parse_imap_args(argv[5] + 1, strlen(argv[5]) - 2,
@@ -2791,12 +3185,24 @@ int icp_uid_store(int argc, char **argv, imap_context &ctx)
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
-		icp_store_flags(argv[4], pitem->mid,
-			ct_item->id, pitem->uid, flag_bits, ctx);
+		if (!icp_store_flags(argv[4], pitem->mid, ct_item->id, pitem->uid,
+		    flag_bits, ctx, b_unchangedsince ? &unchangedsince : nullptr)) {
+			modified.insert(pitem->uid);
+			continue;
+		}
 		imap_parser_bcast_flags(*pcontext, pitem->uid);
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1724;
+	if (modified.size() == 0)
+		return 1724;
+	/* IMAP_CODE_2170033: OK <MODIFIED> UID STORE completed */
+	auto buf = fmt::format("{} {} [MODIFIED {}] {}", tag,
+	           resource_get_imap_code(1733, 1), icp_seq_format(modified),
+	           resource_get_imap_code(1733, 2));
+	imap_parser_safe_write(pcontext, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1915;
 }
 
 int icp_uid_copy(int argc, char **argv, imap_context &ctx) try
@@ -2825,7 +3231,7 @@ int icp_uid_copy(int argc, char **argv, imap_context &ctx) try
 	uint32_t uidvalidity = 0;
 	if (midb_agent::summary_folder(pcontext->maildir,
 	    sys_name, nullptr, nullptr, nullptr, &uidvalidity,
-	    nullptr, &errnum) != MIDB_RESULT_OK)
+	    nullptr, nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
@@ -12,6 +12,7 @@
 #include <gromox/common_types.hpp>
 #include <gromox/config_file.hpp>
 #include <gromox/contexts_pool.hpp>
+#include <gromox/exmdb_client.hpp>
 #include <gromox/generic_connection.hpp>
 #include <gromox/mjson.hpp>
 #include <gromox/range_set.hpp>
@@ -101,13 +102,16 @@ struct imap_context final : public schedule_context {
 	isched_stat sched_stat = isched_stat::none;
 	char *write_buff = nullptr;
 	size_t write_length = 0, write_offset = 0;
-	size_t wrdat_offset = 0;
+	uint64_t wrdat_offset = 0;
 	time_t selected_time = 0;
 	std::string selected_folder;
 	content_array contents;
-	std::string wrdat_content;
+	std::string wrdat_content; /* literal source, unless wrdat_file is open */
+	gromox::imapfile_reader wrdat_file;
 	bool wrdat_active = false;
 	BOOL b_readonly = false; /* is selected folder read only, this is for the examine command */
+	/* RFC 7162 extensions switched on by ENABLE or first use */
+	bool b_condstore = false, b_qresync = false;
 	std::atomic<unsigned int> async_change_mask{0};
 	/*
 	 * Because one mail can get repeatedly re-flagged, f_flags is modeled
@@ -151,6 +155,7 @@ extern void imap_parser_log_info(imap_context *, int level, const char *format,
 
 extern void icp_clsfld(imap_context &);
 extern int icp_capability(int argc, char **argv, imap_context &);
+extern int icp_enable(int argc, char **argv, imap_context &);
 extern int icp_id(int argc, char **argv, imap_context &);
 extern int icp_noop(int argc, char **argv, imap_context &);
 extern int icp_logout(int argc, char **argv, imap_context &);
@@ -188,6 +193,7 @@ extern int icp_uid_store(int argc, char **argv, imap_context &);
 extern int icp_uid_copy(int argc, char **argv, imap_context &);
 extern int icp_uid_expunge(int argc, char **argv, imap_context &);
 extern int icp_dval(int argc, char **argv, imap_context &, unsigned int res);
+extern std::string icp_seq_format(const gromox::imap_seq_list &);
 
 extern char *capability_list(char *, size_t, imap_context *);
 
@@ -61,6 +61,8 @@ static void imap_parser_event_flag(const char *username, const char *folder, uin
 static int imap_parser_dispatch_cmd(int argc, char **argv, imap_context &);
 static void imap_parser_context_clear(imap_context *);
 static int imap_parser_wrdat_retrieve(imap_context &);
+static void imap_parser_wrdat_clear(imap_context &);
+static bool imap_parser_wrdat_copy(imap_context &, char *, size_t);
 
 unsigned int g_imapcmd_debug;
 int g_max_auth_times, g_block_auth_fail;
@@ -619,8 +621,7 @@ static tproc_status ps_cmd_processing(imap_context &ctx)
 		if (pcontext->sched_stat == isched_stat::appended) {
 			if (0 != argc) {
 				/* Clears pcontext->mid; is this wanted here? */
-				ctx.wrdat_active = false;
-				ctx.wrdat_content = {};
+				imap_parser_wrdat_clear(ctx);
 				size_t string_length = 0;
 				auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
 				pcontext->connection.write(pcontext->tag_string, strlen(pcontext->tag_string));
@@ -791,6 +792,8 @@ static tproc_status ps_stat_wrdat(imap_context &ctx)
 		switch (imap_parser_wrdat_retrieve(ctx)) {
 		case IMAP_RETRIEVE_TERM:
 			pcontext->stream.clear();
+			/* Response complete; drop the message data it referenced */
+			ctx.io_actor.clear();
 			if (0 == pcontext->write_length) {
 				pcontext->sched_stat = isched_stat::rdcmd;
 				return tproc_status::literal_checking;
@@ -809,15 +812,19 @@ static tproc_status ps_stat_wrdat(imap_context &ctx)
 	auto len = pcontext->literal_len - pcontext->current_len;
 	if (len > 64 * 1024)
 		len = 64 * 1024;
-	memcpy(ctx.write_buff, &ctx.wrdat_content[ctx.wrdat_offset], len);
-	ctx.wrdat_offset += len;
+	if (!imap_parser_wrdat_copy(ctx, ctx.write_buff, len)) {
+		imap_parser_wrdat_clear(ctx);
+		/* IMAP_CODE_2180008: internal error, fail to retrieve from stream object */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1808, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	}
 	pcontext->current_len += len;
 	pcontext->write_length = len;
 	pcontext->write_offset = 0;
 	if (pcontext->literal_len != pcontext->current_len)
 		return tproc_status::cont;
-	ctx.wrdat_active = false;
-	ctx.wrdat_content = {};
+	imap_parser_wrdat_clear(ctx);
 	pcontext->literal_len = 0;
 	pcontext->current_len = 0;
 	if (imap_parser_wrdat_retrieve(ctx) != IMAP_RETRIEVE_ERROR)
@@ -923,12 +930,40 @@ static tproc_status ps_end_processing(imap_context *pcontext,
 		pcontext->proto_stat = iproto_stat::auth;
 		pcontext->selected_folder[0] = '\0';
 	}
-	ctx.wrdat_active = false;
-	ctx.wrdat_content = {};
+	imap_parser_wrdat_clear(ctx);
 	imap_parser_context_clear(pcontext);
 	return tproc_status::close;
 }
 
+static void imap_parser_wrdat_clear(imap_context &ctx)
+{
+	ctx.wrdat_active = false;
+	ctx.wrdat_content = {};
+	ctx.wrdat_file.close();
+}
+
+/**
+ * Copy the next @len bytes of the literal being sent to @dst, from the file
+ * if one is open (pulling it over exmdb as needed) or else from
+ * wrdat_content.
+ */
+static bool imap_parser_wrdat_copy(imap_context &ctx, char *dst, size_t len)
+{
+	if (ctx.wrdat_file.is_open()) {
+		imrpc_build_env();
+		auto cl_0 = make_scope_exit(imrpc_free_env);
+		if (!ctx.wrdat_file.read(dst, len, ctx.wrdat_offset)) {
+			mlog(LV_ERR, "E-2968: read of message data failed at offset %llu",
+				static_cast<unsigned long long>(ctx.wrdat_offset));
+			return false;
+		}
+	} else {
+		memcpy(dst, &ctx.wrdat_content[ctx.wrdat_offset], len);
+	}
+	ctx.wrdat_offset += len;
+	return true;
+}
+
 static int imap_parser_wrdat_retrieve(imap_context &ctx)
 {
 	auto pcontext = &ctx;
@@ -975,14 +1010,19 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 			} else {
 				*ptr = '\0';
 				*ptr1 = '\0';
-				ctx.wrdat_active = false;
-				ctx.wrdat_content = {};
+				imap_parser_wrdat_clear(ctx);
 				try {
 					auto eml_path = ctx.maildir + "/eml/"s + (last_line + 8);
 					auto fd = ctx.io_actor.find(eml_path);
 					if (ctx.io_actor.valid(fd)) {
 						ctx.wrdat_content = fd->second;
 						ctx.wrdat_active = true;
+					} else {
+						/* Stream from the file, only the range asked for */
+						imrpc_build_env();
+						auto cl_0 = make_scope_exit(imrpc_free_env);
+						ctx.wrdat_active = ctx.wrdat_file.open(ctx.maildir,
+						                   "eml", last_line + 8);
 					}
 				} catch (const std::bad_alloc &) {
 					mlog(LV_ERR, "E-1466: ENOMEM");
@@ -991,27 +1031,29 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 					strcpy(&pcontext->write_buff[pcontext->write_length], "NIL");
 					pcontext->write_length += 3;
 				} else {
+					uint64_t wrdat_size = ctx.wrdat_file.is_open() ?
+					       ctx.wrdat_file.size() : ctx.wrdat_content.size();
 					ctx.wrdat_offset = strtoul(&ptr[1], nullptr, 0);
-					if (ctx.wrdat_offset > ctx.wrdat_content.size()) {
+					if (ctx.wrdat_offset > wrdat_size) {
 						mlog(LV_ERR, "E-1758");
-						ctx.wrdat_active = false;
-						ctx.wrdat_content = {};
+						imap_parser_wrdat_clear(ctx);
 						return IMAP_RETRIEVE_ERROR;
 					}
-					ctx.literal_len = std::min(static_cast<size_t>(strtoul(&ptr1[1], nullptr, 0)),
-					                  ctx.wrdat_content.size() - ctx.wrdat_offset);
+					ctx.literal_len = std::min(static_cast<uint64_t>(strtoul(&ptr1[1], nullptr, 0)),
+					                  wrdat_size - ctx.wrdat_offset);
 					pcontext->current_len = 0;
 					pcontext->write_length += sprintf(&pcontext->write_buff[pcontext->write_length], "{%u}\r\n", pcontext->literal_len);
 					len = MAX_LINE_LENGTH - pcontext->write_length;
 					if (len > pcontext->literal_len)
 						len = pcontext->literal_len;
-					memcpy(&ctx.write_buff[ctx.write_length], &ctx.wrdat_content[ctx.wrdat_offset], len);
-					ctx.wrdat_offset += len;
+					if (!imap_parser_wrdat_copy(ctx, &ctx.write_buff[ctx.write_length], len)) {
+						imap_parser_wrdat_clear(ctx);
+						return IMAP_RETRIEVE_ERROR;
+					}
 					pcontext->current_len += len;
 					pcontext->write_length += len;
 					if (pcontext->literal_len == len) {
-						ctx.wrdat_active = false;
-						ctx.wrdat_content = {};
+						imap_parser_wrdat_clear(ctx);
 						pcontext->literal_len = 0;
 						pcontext->current_len = 0;
 					}
@@ -1026,8 +1068,7 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 			} else {
 				*ptr = '\0';
 				*ptr1 = '\0';
-				ctx.wrdat_active = false;
-				ctx.wrdat_content = {};
+				imap_parser_wrdat_clear(ctx);
 				try {
 					auto eml_path = pcontext->maildir + "/tmp/imap.rfc822/"s + (last_line + 10);
 					auto fd = ctx.io_actor.find(eml_path);
@@ -1045,8 +1086,7 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 					ctx.wrdat_offset = strtoul(&ptr[1], nullptr, 0);
 					if (ctx.wrdat_offset > ctx.wrdat_content.size()) {
 						mlog(LV_ERR, "E-1757");
-						ctx.wrdat_active = false;
-						ctx.wrdat_content = {};
+						imap_parser_wrdat_clear(ctx);
 						return IMAP_RETRIEVE_ERROR;
 					}
 					ctx.literal_len = std::min(static_cast<size_t>(strtoul(&ptr1[1], nullptr, 0)),
@@ -1056,13 +1096,11 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 					len = MAX_LINE_LENGTH - pcontext->write_length;
 					if (len > pcontext->literal_len)
 						len = pcontext->literal_len;
-					memcpy(&ctx.write_buff[ctx.write_length], &ctx.wrdat_content[ctx.wrdat_offset], len);
-					ctx.wrdat_offset += len;
+					imap_parser_wrdat_copy(ctx, &ctx.write_buff[ctx.write_length], len);
 					pcontext->current_len += len;
 					pcontext->write_length += len;
 					if (pcontext->literal_len == len) {
-						ctx.wrdat_active = false;
-						ctx.wrdat_content = {};
+						imap_parser_wrdat_clear(ctx);
 						pcontext->literal_len = 0;
 						pcontext->current_len = 0;
 					}
@@ -1237,6 +1275,21 @@ void imap_parser_event_expunge(const char *user, const char *folder, unsigned in
 static void imap_parser_echo_expunges(imap_context &ctx, STREAM *stream,
     const std::vector<unsigned int> &exp_list) try
 {
+	if (ctx.b_qresync) {
+		/* RFC 7162 §3.2.10: VANISHED replaces EXPUNGE */
+		imap_seq_list uid_list;
+		for (auto uid : exp_list)
+			if (ctx.contents.get_itemx(uid) != nullptr)
+				uid_list.insert(uid);
+		if (uid_list.size() == 0)
+			return;
+		auto buf = "* VANISHED " + icp_seq_format(uid_list) + "\r\n";
+		if (stream == nullptr)
+			ctx.connection.write(buf.c_str(), buf.size());
+		else
+			stream->write(buf.c_str(), buf.size());
+		return;
+	}
 	std::vector<unsigned int> seqid_list;
 	for (auto uid : exp_list) {
 		auto item = ctx.contents.get_itemx(uid);
@@ -1294,9 +1347,10 @@ void imap_parser_echo_modify(imap_context *pcontext, STREAM *pstream)
 		if (item == nullptr)
 			continue;
 		unsigned int flag_bits = 0;
+		uint64_t modseq = 0;
 		if (midb_agent::get_flags(pcontext->maildir,
 		    pcontext->selected_folder, item->mid, &flag_bits,
-		    &err) != MIDB_RESULT_OK)
+		    &err, &modseq) != MIDB_RESULT_OK)
 			continue;
 		auto outlen = gx_snprintf(buff, std::size(buff), "* %d FETCH (FLAGS (", item->id);
 		b_first = false;
@@ -1333,7 +1387,14 @@ void imap_parser_echo_modify(imap_context *pcontext, STREAM *pstream)
 				buff[outlen++] = ' ';
 			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, "\\Draft");
 		}
-		outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, "))\r\n");
+		buff[outlen++] = ')';
+		if (pcontext->b_qresync)
+			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen,
+			          " UID %u", static_cast<unsigned int>(item->uid));
+		if (pcontext->b_condstore)
+			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen,
+			          " MODSEQ (%llu)", static_cast<unsigned long long>(modseq));
+		outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, ")\r\n");
 		if (pstream == nullptr)
 			pcontext->connection.write(buff, outlen);
 		else if (pstream->write(buff, outlen) != STREAM_WRITE_OK)
@@ -1360,6 +1421,7 @@ static int imap_parser_dispatch_cmd2(int argc, char **argv,
 		{"COPY", icp_copy},
 		{"CREATE", icp_create},
 		{"DELETE", icp_delete},
+		{"ENABLE", icp_enable},
 		{"EXAMINE", icp_examine},
 		{"EXPUNGE", icp_expunge},
 		{"FETCH", icp_fetch},
@@ -1454,8 +1516,8 @@ static void imap_parser_context_clear(imap_context *pcontext)
 	pcontext->connection.reset();
 	pcontext->proto_stat = iproto_stat::none;
 	pcontext->sched_stat = isched_stat::none;
-	ctx.wrdat_active = false;
-	ctx.wrdat_content = {};
+	imap_parser_wrdat_clear(ctx);
+	ctx.io_actor.clear();
 	pcontext->mid.clear();
 	pcontext->write_buff = nullptr;
 	pcontext->write_length = 0;
@@ -1463,6 +1525,8 @@ static void imap_parser_context_clear(imap_context *pcontext)
 	pcontext->selected_time = 0;
 	pcontext->selected_folder.clear();
 	pcontext->b_readonly = false;
+	pcontext->b_condstore = false;
+	pcontext->b_qresync = false;
 	pcontext->tag_string[0] = '\0';
 	pcontext->command_len = 0;
 	pcontext->command_buffer[0] = '\0';
@@ -32,7 +32,6 @@
 #include <gromox/config_file.hpp>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
-#include <gromox/json.hpp>
 #include <gromox/list_file.hpp>
 #include <gromox/midb.hpp>
 #include <gromox/midb_agent.hpp>
@@ -407,7 +406,7 @@ int list_mail(const char *path, const std::string &folder,
 				temp_line[line_pos] = '\0';
 				try {
 					auto parts = gx_split(temp_line, ' ');
-					if (parts.size() != 5)
+					if (parts.size() < 5)
 						throw 0;
 					MSG_UNIT msg{std::move(parts[1])};
 					msg.size = strtoul(parts[4].c_str(), nullptr, 0);
@@ -622,6 +621,36 @@ int search_uid(const char *path, const std::string &folder,
 	return MIDB_LOCAL_ENOMEM;
 }
 
+int vanished_uid(const char *path, const std::string &folder, uint64_t since,
+    std::string &uid_set, int *perrno) try
+{
+	auto pback = get_connection(path);
+	if (pback == nullptr)
+		return MIDB_NO_SERVER;
+	auto cbufsize = g_midb_command_buffer_size.load();
+	auto buff   = std::make_unique<char[]>(cbufsize);
+	auto length = gx_snprintf(buff.get(), cbufsize, "P-VNSH %s %s %llu\r\n",
+	              path, folder.c_str(), static_cast<unsigned long long>(since));
+	auto ret = rw_command(pback->sockd, buff.get(), length, cbufsize);
+	if (ret != 0)
+		return ret;
+	if (strncmp(buff.get(), "TRUE", 4) == 0) {
+		pback.reset();
+		if (buff[4] == ' ')
+			uid_set.assign(&buff[5]);
+		else
+			uid_set.clear();
+		return MIDB_RESULT_OK;
+	} else if (strncmp(buff.get(), "FALSE ", 6) == 0) {
+		pback.reset();
+		*perrno = strtol(&buff[6], nullptr, 0);
+		return MIDB_RESULT_ERROR;
+	}
+	return MIDB_RDWR_ERROR;
+} catch (const std::bad_alloc &) {
+	return MIDB_LOCAL_ENOMEM;
+}
+
 int get_uid(const char *path, const std::string &folder,
     const std::string &mid_string, unsigned int *puid)
 {
@@ -648,11 +677,12 @@ int get_uid(const char *path, const std::string &folder,
 
 int summary_folder(const char *path, const std::string &folder, size_t *pexists,
     size_t *precent, size_t *punseen, uint32_t *puidvalid, uint32_t *puidnext,
-    int *perrno)
+    uint64_t *phighestmodseq, int *perrno)
 {
 	char buff[1024];
 	size_t exists, recent, unseen;
 	unsigned long uidvalid, uidnext;
+	unsigned long long modseq = 0;
 
 	auto pback = get_connection(path);
 	if (pback == nullptr)
@@ -670,8 +700,9 @@ int summary_folder(const char *path, const std::string &folder, size_t *pexists,
 		return MIDB_RDWR_ERROR;
 	}
 
-	if (sscanf(buff, "TRUE %zu %zu %zu %lu %lu", &exists,
-	    &recent, &unseen, &uidvalid, &uidnext) != 5) {
+	/* highestmodseq is absent from older midb */
+	if (sscanf(buff, "TRUE %zu %zu %zu %lu %lu %llu", &exists,
+	    &recent, &unseen, &uidvalid, &uidnext, &modseq) < 5) {
 		*perrno = -1;
 		pback.reset();
 		return MIDB_RESULT_ERROR;
@@ -686,6 +717,8 @@ int summary_folder(const char *path, const std::string &folder, size_t *pexists,
 		*puidvalid = uidvalid;
 	if (puidnext != nullptr)
 		*puidnext = uidnext;
+	if (phighestmodseq != nullptr)
+		*phighestmodseq = modseq;
 	pback.reset();
 	return MIDB_RESULT_OK;
 }
@@ -1139,40 +1172,40 @@ static std::string flagbits_to_s(unsigned int v)
 	return s;
 }
 
-static bool get_digest_string(const Json::Value &jv, const char *tag, std::string &buff)
-{
-	if (jv.type() != Json::ValueType::objectValue || !jv.isMember(tag))
-		return false;
-	buff = jv[tag].asString();
-	return true;
-}
+/* midb keeps lines with the optional renderings below 512K */
+static constexpr size_t DTLB_LINE_MAX = 1024 * 1024;
 
-static bool get_digest_integer(const Json::Value &jv, const char *tag, int &i)
+/**
+ * Parse one P-DTLB line,
+ * "- <midstr> <uid> <flags> <modseq> <digest> [<body> <bs> <env>]".
+ * Returns false on malformed input; @m.mid stays empty if midb had no digest.
+ */
+static bool dtlb_parse(std::string_view line, const char *charset, MITEM &m) try
 {
-	if (jv.type() != Json::ValueType::objectValue || !jv.isMember(tag))
+	std::vector<std::string_view> f;
+	while (!line.empty()) {
+		auto sp = line.find(' ');
+		f.push_back(line.substr(0, sp));
+		line.remove_prefix(sp == line.npos ? line.size() : sp + 1);
+	}
+	if ((f.size() != 6 && f.size() != 9) || f[0] != "-")
 		return false;
-	i = jv[tag].asUInt();
+	if (f[5] == "-")
+		return true;
+	m.mid = f[1];
+	m.uid = strtol(std::string(f[2]).c_str(), nullptr, 0);
+	m.flag_bits = FLAG_LOADED | s_to_flagbits(f[3]);
+	m.modseq = strtoull(std::string(f[4]).c_str(), nullptr, 0);
+	m.digest = base64_decode(f[5]);
+	if (f.size() == 9 && charset != nullptr) {
+		m.imapcset = charset;
+		m.imapbody = base64_decode(f[6]);
+		m.imapbs   = base64_decode(f[7]);
+		m.imapenv  = base64_decode(f[8]);
+	}
 	return true;
-}
-
-static unsigned int di_to_flagbits(const Json::Value &jv)
-{
-	unsigned int fl = 0, v;
-	if (jv.type() != Json::ValueType::objectValue)
-		return fl;
-	if (jv.isMember("replied") && (v = jv["replied"].asUInt()) != 0)
-		fl |= FLAG_ANSWERED;
-	if (jv.isMember("unsent") && (v = jv["unsent"].asUInt()) != 0)
-		fl |= FLAG_DRAFT;
-	if (jv.isMember("flag") && (v = jv["flag"].asUInt()) != 0)
-		fl |= FLAG_FLAGGED;
-	if (jv.isMember("deleted") && (v = jv["deleted"].asUInt()) != 0)
-		fl |= FLAG_DELETED;
-	if (jv.isMember("read") && (v = jv["read"].asUInt()) != 0)
-		fl |= FLAG_SEEN;
-	if (jv.isMember("recent") && (v = jv["recent"].asUInt()) != 0)
-		fl |= FLAG_RECENT;
-	return fl;
+} catch (const std::bad_alloc &) {
+	return false;
 }
 
 int list_deleted(const char *path, const std::string &folder, XARRAY *pxarray,
@@ -1302,7 +1335,8 @@ int list_deleted(const char *path, const std::string &folder, XARRAY *pxarray,
 }
 
 int fetch_simple_uid(const char *path, const std::string &folder,
-    const imap_seq_list &list, XARRAY *pxarray, int *perrno)
+    const imap_seq_list &list, XARRAY *pxarray, int *perrno,
+    uint64_t changedsince)
 {
 	int lines;
 	int count;
@@ -1325,8 +1359,12 @@ int fetch_simple_uid(const char *path, const std::string &folder,
 	
 	for (const auto &seq : list) {
 		auto pseq = &seq;
-		auto length = gx_snprintf(buff, std::size(buff), "P-SIMU %s %s %d %d\r\n",
-		              path, folder.c_str(), pseq->lo, pseq->hi);
+		auto length = changedsince == 0 ?
+		              gx_snprintf(buff, std::size(buff), "P-SIMU %s %s %d %d\r\n",
+		              path, folder.c_str(), pseq->lo, pseq->hi) :
+		              gx_snprintf(buff, std::size(buff), "P-SIMU %s %s %d %d %llu\r\n",
+		              path, folder.c_str(), pseq->lo, pseq->hi,
+		              static_cast<unsigned long long>(changedsince));
 		if (write(pback->sockd, buff, length) != length)
 			return MIDB_RDWR_ERROR;
 		
@@ -1395,6 +1433,11 @@ int fetch_simple_uid(const char *path, const std::string &folder,
 									} catch (const std::bad_alloc &) {
 										b_format_error = TRUE;
 									}
+									/* "<flags> <size> <modseq>" */
+									auto ms = strrchr(pspace2, ' ');
+									auto sz = strchr(pspace2, ' ');
+									if (ms != nullptr && ms != sz)
+										pitem->modseq = strtoull(ms + 1, nullptr, 0);
 									pitem->flag_bits = s_to_flagbits(pspace2);
 								}
 							} else {
@@ -1439,19 +1482,17 @@ int fetch_simple_uid(const char *path, const std::string &folder,
 }
 
 int fetch_detail_uid(const char *path, const std::string &folder,
-    const imap_seq_list &list, XARRAY *pxarray, int *perrno) try
+    const imap_seq_list &list, const char *charset, XARRAY *pxarray,
+    int *perrno) try
 {
 	int lines;
 	int count;
 	int offset;
 	int last_pos;
 	int read_len;
-	int line_pos;
-	int temp_len;
-	char *pspace;
 	int tv_msec;
 	char buff[64*1025];
-	char temp_line[257*1024];
+	std::string line;
 	BOOL b_format_error;
 	struct pollfd pfd_read;
 
@@ -1464,8 +1505,11 @@ int fetch_detail_uid(const char *path, const std::string &folder,
 	
 	for (const auto &seq : list) {
 		auto pseq = &seq;
-		auto length = gx_snprintf(buff, std::size(buff), "P-DTLU %s %s %d %d\r\n", path,
-		              folder.c_str(), pseq->lo, pseq->hi);
+		auto length = charset == nullptr || *charset == '\0' ?
+		              gx_snprintf(buff, std::size(buff), "P-DTLB %s %s %d %d\r\n", path,
+		              folder.c_str(), pseq->lo, pseq->hi) :
+		              gx_snprintf(buff, std::size(buff), "P-DTLB %s %s %d %d %s\r\n", path,
+		              folder.c_str(), pseq->lo, pseq->hi, charset);
 		if (write(pback->sockd, buff, length) != length)
 			return MIDB_RDWR_ERROR;
 		
@@ -1495,7 +1539,7 @@ int fetch_detail_uid(const char *path, const std::string &folder,
 						if (lines < 0)
 							return MIDB_RDWR_ERROR;
 						last_pos = i + 2;
-						line_pos = 0;
+						line.clear();
 						break;
 					} else if (0 == strncmp(buff, "FALSE ", 6)) {
 						pback.reset();
@@ -1514,28 +1558,17 @@ int fetch_detail_uid(const char *path, const std::string &folder,
 				if ('\r' == buff[i] && i < offset - 1 && '\n' == buff[i + 1]) {
 					count ++;
 				} else if ('\n' == buff[i] && '\r' == buff[i - 1]) {
-					pspace = strchr(temp_line, ' ');
-					temp_len = pspace == nullptr ? 0 :
-					           line_pos - (pspace + 1 - temp_line);
 					MITEM mitem;
-					if (pspace == nullptr ||
-					    !json_from_str(std::string_view(&pspace[1], temp_len), mitem.digest)) {
+					if (!dtlb_parse(line, charset, mitem)) {
 						b_format_error = TRUE;
-					} else if (get_digest_string(mitem.digest, "file", mitem.mid) &&
-					    get_digest_integer(mitem.digest, "uid", mitem.uid)) {
-						*pspace++ = '\0';
+					} else if (!mitem.mid.empty()) {
 						auto mitem_uid = mitem.uid;
-						if (pxarray->append(std::move(mitem), mitem_uid) >= 0) {
-							auto num = pxarray->get_capacity();
-							assert(num > 0);
-							auto pitem = pxarray->get_item(num - 1);
-							pitem->flag_bits = FLAG_LOADED | di_to_flagbits(pitem->digest);
-						}
+						pxarray->append(std::move(mitem), mitem_uid);
 					}
-					line_pos = 0;
+					line.clear();
 				} else if (buff[i] != '\r' || i != offset - 1) {
-					temp_line[line_pos++] = buff[i];
-					if (line_pos >= 257 * 1024)
+					line += buff[i];
+					if (line.size() >= DTLB_LINE_MAX)
 						return MIDB_RDWR_ERROR;
 				}
 			}
@@ -1656,9 +1689,42 @@ int unset_flags(const char *path, const std::string &folder,
 	}
 	return MIDB_RDWR_ERROR;
 }
+
+/**
+ * Apply flags (@op: '+', '-' or '=') unless the message's modseq has gone
+ * above @unchangedsince; midb checks and updates in one step. *@modified
+ * is set if it refused.
+ */
+int store_flags(const char *path, const std::string &folder,
+    const std::string &mid_string, char op, unsigned int flag_bits,
+    uint64_t unchangedsince, bool *modified, int *perrno)
+{
+	char buff[1024];
+	auto pback = get_connection(path);
+	if (pback == nullptr)
+		return MIDB_NO_SERVER;
+	auto flags_string = flagbits_to_s(flag_bits);
+	auto length = gx_snprintf(buff, std::size(buff), "P-CSFL %s %s %s %c (%s) %llu\r\n",
+	              path, folder.c_str(), mid_string.c_str(), op,
+	              flags_string.c_str(), static_cast<unsigned long long>(unchangedsince));
+	auto ret = rw_command(pback->sockd, buff, length, std::size(buff));
+	if (ret != 0)
+		return ret;
+	if (0 == strncmp(buff, "TRUE", 4)) {
+		pback.reset();
+		*modified = strncmp(buff, "TRUE MODIFIED", 13) == 0;
+		return MIDB_RESULT_OK;
+	} else if (0 == strncmp(buff, "FALSE ", 6)) {
+		pback.reset();
+		*perrno = strtol(buff + 6, nullptr, 0);
+		return MIDB_RESULT_ERROR;
+	}
+	return MIDB_RDWR_ERROR;
+}
 	
 int get_flags(const char *path, const std::string &folder,
-    const std::string &mid_string, unsigned int *pflag_bits, int *perrno)
+    const std::string &mid_string, unsigned int *pflag_bits, int *perrno,
+    uint64_t *pmodseq)
 {
 	char buff[1024];
 
@@ -1675,6 +1741,11 @@ int get_flags(const char *path, const std::string &folder,
 		*pflag_bits = 0;
 		if (buff[4] == ' ')
 			*pflag_bits = s_to_flagbits(buff + 5);
+		if (pmodseq != nullptr) {
+			auto p = strchr(buff, ')');
+			*pmodseq = p != nullptr && p[1] == ' ' ?
+			           strtoull(&p[2], nullptr, 0) : 0;
+		}
 		return MIDB_RESULT_OK;
 	} else if (0 == strncmp(buff, "FALSE ", 6)) {
 		pback.reset();
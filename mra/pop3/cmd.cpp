@@ -318,11 +318,9 @@ int cmdh_retr(std::vector<std::string> &&argv, pop3_context *pcontext)
 	auto punit = sa_get_item(pcontext->msg_array, n - 1);
 	std::string eml_path;
 	ctx.wrdat_active = false;
-	ctx.wrdat_content.clear();
 	xrpc_build_env();
 	auto cl_0 = make_scope_exit(xrpc_free_env);
-	if (!exmdb_client::imapfile_read(ctx.maildir, "eml", punit->file_name,
-	    &ctx.wrdat_content)) {
+	if (!ctx.wrdat_file.open(ctx.maildir, "eml", punit->file_name.c_str())) {
 		mlog(LV_ERR, "E-1469: imapfile_read %s/eml/%s failed",
 			ctx.maildir, punit->file_name.c_str());
 		return 1709;
@@ -378,11 +376,9 @@ int cmdh_top(std::vector<std::string> &&argv, pop3_context *pcontext)
 	auto punit = &pcontext->msg_array.at(n - 1);
 	std::string eml_path;
 	ctx.wrdat_active = false;
-	ctx.wrdat_content.clear();
 	xrpc_build_env();
 	auto cl_0 = make_scope_exit(xrpc_free_env);
-	if (!exmdb_client::imapfile_read(ctx.maildir, "eml", punit->file_name,
-	    &ctx.wrdat_content))
+	if (!ctx.wrdat_file.open(ctx.maildir, "eml", punit->file_name.c_str()))
 		return 1709;
 	ctx.wrdat_active = true;
 	ctx.wrdat_offset = 0;
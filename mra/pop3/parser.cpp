@@ -25,6 +25,7 @@
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
 #include <gromox/mail_func.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/threads_pool.hpp>
 #include <gromox/util.hpp>
 #include "pop3.hpp"
@@ -416,7 +417,7 @@ tproc_status pop3_parser_process(schedule_context *vcontext)
  ERROR_TRANSPROT:
 	pcontext->connection.write("\r\n.\r\n", 5);
 	ctx.wrdat_active = false;
-	ctx.wrdat_content.clear();
+	ctx.wrdat_file.close();
 	pcontext->stream.clear();
 	pcontext->write_length = 0;
 	pcontext->write_offset = 0;
@@ -425,7 +426,7 @@ tproc_status pop3_parser_process(schedule_context *vcontext)
 
  END_TRANSPORT:
 	ctx.wrdat_active = false;
-	ctx.wrdat_content.clear();
+	ctx.wrdat_file.close();
 	pcontext->connection.reset();
 	pop3_parser_context_clear(pcontext);
 	return tproc_status::close;
@@ -445,6 +446,8 @@ int pop3_parser_retrieve(pop3_context *pcontext)
 		return POP3_RETRIEVE_TERM;
 
 	STREAM temp_stream;
+	xrpc_build_env();
+	auto cl_0 = make_scope_exit(xrpc_free_env);
 	while (temp_stream.get_total_length() < g_retrieving_size) {
 		size = STREAM_BLOCK_SIZE;
 		void *pbuff = temp_stream.get_write_buf(&size);
@@ -452,13 +455,19 @@ int pop3_parser_retrieve(pop3_context *pcontext)
 			pop3_parser_log_info(pcontext, LV_WARN, "out of memory");
 			return POP3_RETRIEVE_ERROR;
 		}
-		size = std::min(static_cast<size_t>(size), ctx.wrdat_content.size() - ctx.wrdat_offset);
-		memcpy(pbuff, &ctx.wrdat_content[ctx.wrdat_offset], size);
+		size = std::min(static_cast<uint64_t>(size), ctx.wrdat_file.size() - ctx.wrdat_offset);
+		if (!ctx.wrdat_file.read(pbuff, size, ctx.wrdat_offset)) {
+			pop3_parser_log_info(pcontext, LV_WARN, "message read failed at offset %llu",
+				static_cast<unsigned long long>(ctx.wrdat_offset));
+			ctx.wrdat_active = false;
+			ctx.wrdat_file.close();
+			return POP3_RETRIEVE_ERROR;
+		}
 		ctx.wrdat_offset += size;
 		temp_stream.fwd_write_ptr(size);
-		if (ctx.wrdat_offset >= ctx.wrdat_content.size()) {
+		if (ctx.wrdat_offset >= ctx.wrdat_file.size()) {
 			ctx.wrdat_active = false;
-			ctx.wrdat_content.clear();
+			ctx.wrdat_file.close();
 			break;
 		}
 	}
@@ -506,7 +515,7 @@ int pop3_parser_retrieve(pop3_context *pcontext)
 			}
 			pcontext->stream.write(".\r\n", 3);
 			ctx.wrdat_active = false;
-			ctx.wrdat_content.clear();
+			ctx.wrdat_file.close();
 			b_stop = TRUE;
 			break;
 		}
@@ -608,7 +617,7 @@ static void pop3_parser_context_clear(pop3_context *pcontext)
 	auto &ctx = *pcontext;
 	pcontext->connection.reset();
 	ctx.wrdat_active = false;
-	ctx.wrdat_content.clear();
+	ctx.wrdat_file.close();
 	pcontext->delmsg_list.clear();
 	pcontext->msg_array.clear();
 	pcontext->stream.clear();
@@ -8,6 +8,7 @@
 #include <gromox/clock.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/contexts_pool.hpp>
+#include <gromox/exmdb_client.hpp>
 #include <gromox/generic_connection.hpp>
 #include <gromox/midb_agent.hpp>
 #include <gromox/stream.hpp>
@@ -42,8 +43,9 @@ struct pop3_context final : public schedule_context {
 	char read_buffer[1024]{};
 	size_t read_offset{};
 	char *write_buff = nullptr;
-	std::string wrdat_content;
-	size_t write_length = 0, write_offset = 0, wrdat_offset = 0;
+	gromox::imapfile_reader wrdat_file; /* message being RETR'd/TOP'd */
+	size_t write_length = 0, write_offset = 0;
+	uint64_t wrdat_offset = 0;
 	bool wrdat_active = false;
 	BOOL data_stat = false, list_stat = false;
 	int until_line = 0x7FFFFFFF, cur_line = -1;
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Measures delivery throughput into one mailbox with many concurrent
+ * deliver_message callers. Run it once with exmdb_group_commit=no and once
+ * with =yes in exmdb_provider.cfg (restart the server in between) to compare
+ * one WAL fsync per delivery with shared ones. The server's "report" output
+ * afterwards shows how many syncs the deliveries needed.
+ *
+ * delivbench [-t threads] [-n messages_per_thread] -u account storedir
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <libHX/option.h>
+#include <gromox/defs.h>
+#include <gromox/element_data.hpp>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/paths.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+
+static unsigned int g_threads = 16, g_msgs = 200;
+static char *g_account;
+static constexpr struct HXoption g_options_table[] = {
+	{nullptr, 'n', HXTYPE_UINT, &g_msgs, nullptr, nullptr, 0, "Messages per thread (default: 200)", "N"},
+	{nullptr, 't', HXTYPE_UINT, &g_threads, nullptr, nullptr, 0, "Number of delivering threads (default: 16)", "N"},
+	{nullptr, 'u', HXTYPE_STRING, &g_account, nullptr, nullptr, 0, "Recipient account (owner of storedir)", "USER"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static bool deliver_one(const char *dir, unsigned int thr, unsigned int seq)
+{
+	std::unique_ptr<MESSAGE_CONTENT, mc_delete> ctnt(message_content_init());
+	if (ctnt == nullptr)
+		return false;
+	char subject[48];
+	snprintf(subject, std::size(subject), "delivbench %u/%u", thr, seq);
+	auto dtime = rop_util_current_nttime();
+	auto &props = ctnt->proplist;
+	if (props.set(PR_MESSAGE_CLASS, "IPM.Note") != 0 ||
+	    props.set(PR_SUBJECT, subject) != 0 ||
+	    props.set(PR_BODY, "Lorem ipsum dolor sit amet.") != 0 ||
+	    props.set(PR_MESSAGE_DELIVERY_TIME, &dtime) != 0)
+		return false;
+	uint64_t folder_id = 0, msg_id = 0;
+	uint32_t result = 0;
+	return exmdb_client::deliver_message(dir, ENVELOPE_FROM_NULL, g_account,
+	       CP_UTF8, DELIVERY_DO_NOTIF, ctnt.get(), "", &folder_id, &msg_id,
+	       &result) &&
+	       static_cast<deliver_message_result>(result) == deliver_message_result::result_ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (argc != 2 || g_account == nullptr || g_threads == 0 || g_msgs == 0) {
+		fprintf(stderr, "Usage: %s [options] -u account storedir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto dir = argv[1];
+	exmdb_client_init(g_threads, 0);
+	auto cl_1 = make_scope_exit(exmdb_client_stop);
+	if (exmdb_client_run(PKGSYSCONFDIR) != 0)
+		return EXIT_FAILURE;
+
+	std::vector<std::vector<uint64_t>> lat(g_threads);
+	std::vector<std::thread> thr;
+	std::atomic<unsigned int> fails{0};
+	auto t_start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < g_threads; ++i)
+		thr.emplace_back([&, i]() {
+			lat[i].reserve(g_msgs);
+			for (unsigned int j = 0; j < g_msgs; ++j) {
+				auto t0 = std::chrono::steady_clock::now();
+				if (!deliver_one(dir, i, j))
+					++fails;
+				auto t1 = std::chrono::steady_clock::now();
+				lat[i].push_back(std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count());
+			}
+		});
+	for (auto &t : thr)
+		t.join();
+	auto t_end = std::chrono::steady_clock::now();
+
+	std::vector<uint64_t> all;
+	for (const auto &v : lat)
+		all.insert(all.end(), v.begin(), v.end());
+	std::sort(all.begin(), all.end());
+	double secs = std::chrono::duration<double>(t_end - t_start).count();
+	printf("threads=%u messages=%zu fail=%u p50=%luµs p99=%luµs rate=%.0f/s\n",
+	       g_threads, all.size(), fails.load(),
+	       static_cast<unsigned long>(all[all.size() / 2]),
+	       static_cast<unsigned long>(all[all.size() * 99 / 100]),
+	       all.size() / secs);
+	return fails == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
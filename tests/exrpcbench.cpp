@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Measures exmdb RPC latency with many concurrent callers, once over classic
+ * connections (one request per connection at a time) and once over
+ * multiplexed connections (EXMDB_PROTO_MUX).
+ *
+ * With -i, that many additional connections are opened and left idle for the
+ * duration of the run, to see how the server copes with a large idle
+ * population. With -p, the server's thread count and RSS are reported.
+ *
+ * exrpcbench [-t threads] [-n calls_per_thread] [-m mux_connections]
+ *            [-i idle_connections] [-H host] [-P port] [-p server_pid] storedir
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <libHX/io.h>
+#include <libHX/option.h>
+#include <libHX/socket.h>
+#include <libHX/string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/paths.h>
+#include <gromox/process.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+
+static unsigned int g_threads = 64, g_calls = 1000, g_mux = 2, g_idle;
+static unsigned int g_port = 5000, g_srv_pid;
+static char *g_host;
+static constexpr struct HXoption g_options_table[] = {
+	{nullptr, 'H', HXTYPE_STRING, &g_host, nullptr, nullptr, 0, "Server address for idle connections (default: ::1)", "HOST"},
+	{nullptr, 'P', HXTYPE_UINT, &g_port, nullptr, nullptr, 0, "Server port for idle connections (default: 5000)", "PORT"},
+	{nullptr, 'i', HXTYPE_UINT, &g_idle, nullptr, nullptr, 0, "Number of idle connections to hold open", "N"},
+	{nullptr, 'm', HXTYPE_UINT, &g_mux, nullptr, nullptr, 0, "Number of mux connections (default: 2)", "N"},
+	{nullptr, 'n', HXTYPE_UINT, &g_calls, nullptr, nullptr, 0, "Calls per thread (default: 1000)", "N"},
+	{nullptr, 'p', HXTYPE_UINT, &g_srv_pid, nullptr, nullptr, 0, "PID of the exmdb server, for resource reporting", "PID"},
+	{nullptr, 't', HXTYPE_UINT, &g_threads, nullptr, nullptr, 0, "Number of busy calling threads (default: 64)", "N"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static unsigned int count_sockets()
+{
+	auto dh = opendir("/proc/self/fd");
+	if (dh == nullptr)
+		return 0;
+	unsigned int n = 0;
+	for (auto de = readdir(dh); de != nullptr; de = readdir(dh)) {
+		struct stat sb;
+		if (fstatat(dirfd(dh), de->d_name, &sb, 0) == 0 && S_ISSOCK(sb.st_mode))
+			++n;
+	}
+	closedir(dh);
+	return n;
+}
+
+/**
+ * Open a connection and complete the connect handshake, then leave it be.
+ * Returns the socket, or -1.
+ */
+static int idle_connect()
+{
+	auto fd = HX_inet_connect(g_host != nullptr ? g_host : "::1", g_port, 0);
+	if (fd < 0)
+		return -1;
+	exreq_connect q;
+	char empty[1]{};
+	char rid[32];
+	snprintf(rid, std::size(rid), "exrpcbench:%d", getpid());
+	q.call_id = exmdb_callid::connect;
+	q.dir = empty;
+	q.prefix = empty;
+	q.remote_id = rid;
+	q.b_private = false;
+	BINARY bin{};
+	if (exmdb_ext_push_request(&q, &bin) != pack_result::ok) {
+		close(fd);
+		return -1;
+	}
+	auto wr = HXio_fullwrite(fd, bin.pb, bin.cb);
+	free(bin.pb);
+	uint8_t resp[5];
+	if (wr != static_cast<ssize_t>(bin.cb) ||
+	    HXio_fullread(fd, resp, std::size(resp)) != static_cast<ssize_t>(std::size(resp)) ||
+	    resp[0] != static_cast<uint8_t>(exmdb_response::success)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Thread count and resident size of the server process */
+static void server_usage(unsigned int &threads, unsigned long &rss_kb)
+{
+	threads = 0;
+	rss_kb = 0;
+	if (g_srv_pid == 0)
+		return;
+	char path[64], line[128];
+	snprintf(path, std::size(path), "/proc/%u/status", g_srv_pid);
+	auto fp = fopen(path, "r");
+	if (fp == nullptr)
+		return;
+	while (fgets(line, std::size(line), fp) != nullptr) {
+		if (strncmp(line, "Threads:", 8) == 0)
+			threads = strtoul(&line[8], nullptr, 0);
+		else if (strncmp(line, "VmRSS:", 6) == 0)
+			rss_kb = strtoul(&line[6], nullptr, 0);
+	}
+	fclose(fp);
+}
+
+static int run_mode(const char *dir, unsigned int nthr, unsigned int ncalls,
+    unsigned int mux)
+{
+	exmdb_client_init(nthr, 0);
+	exmdb_client_set_mux_connections(mux);
+	auto cl_0 = make_scope_exit(exmdb_client_stop);
+	if (exmdb_client_run(PKGSYSCONFDIR) != 0)
+		return EXIT_FAILURE;
+
+	std::vector<int> idle_fds;
+	auto cl_1 = make_scope_exit([&]() {
+		for (auto fd : idle_fds)
+			close(fd);
+	});
+	for (unsigned int i = 0; i < g_idle; ++i) {
+		auto fd = idle_connect();
+		if (fd < 0) {
+			fprintf(stderr, "Idle connection %u failed; continuing with %zu\n",
+			        i, idle_fds.size());
+			break;
+		}
+		idle_fds.push_back(fd);
+	}
+
+	std::vector<std::vector<uint64_t>> lat(nthr);
+	std::vector<std::thread> thr;
+	unsigned int peak_socks = 0;
+	std::atomic<unsigned int> fails{0}, running{nthr};
+	auto t_start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < nthr; ++i)
+		thr.emplace_back([&, i]() {
+			lat[i].reserve(ncalls);
+			for (unsigned int j = 0; j < ncalls; ++j) {
+				auto t0 = std::chrono::steady_clock::now();
+				if (!exmdb_client::ping_store(dir))
+					++fails;
+				auto t1 = std::chrono::steady_clock::now();
+				lat[i].push_back(std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count());
+			}
+			--running;
+		});
+	unsigned int srv_thr = 0, peak_thr = 0;
+	unsigned long srv_rss = 0, peak_rss = 0;
+	while (running > 0) {
+		peak_socks = std::max(peak_socks, count_sockets());
+		server_usage(srv_thr, srv_rss);
+		peak_thr = std::max(peak_thr, srv_thr);
+		peak_rss = std::max(peak_rss, srv_rss);
+		usleep(10000);
+	}
+	for (auto &t : thr)
+		t.join();
+	auto t_end = std::chrono::steady_clock::now();
+
+	std::vector<uint64_t> all;
+	for (const auto &v : lat)
+		all.insert(all.end(), v.begin(), v.end());
+	std::sort(all.begin(), all.end());
+	if (all.size() == 0)
+		return EXIT_FAILURE;
+	double secs = std::chrono::duration<double>(t_end - t_start).count();
+	printf("%-8s threads=%u idle=%zu calls=%zu fail=%u sockets(peak)=%u "
+	       "p50=%luµs p99=%luµs max=%luµs rate=%.0f/s\n",
+	       mux == 0 ? "classic" : "mux", nthr, idle_fds.size(), all.size(),
+	       fails.load(), peak_socks,
+	       static_cast<unsigned long>(all[all.size() / 2]),
+	       static_cast<unsigned long>(all[all.size() * 99 / 100]),
+	       static_cast<unsigned long>(all.back()), all.size() / secs);
+	if (g_srv_pid != 0)
+		printf("%-8s server threads(peak)=%u rss(peak)=%lukB\n", "",
+		       peak_thr, peak_rss);
+	return fails == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s [options] storedir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto dir = argv[1];
+	if (g_idle > 0)
+		filedes_limit_bump(g_idle + 4 * g_threads + 64);
+	int ret = EXIT_SUCCESS;
+	/* Each mode in a fresh process so that connection pools do not mix. */
+	for (auto mux : {0U, g_mux}) {
+		auto pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		} else if (pid == 0) {
+			return run_mode(dir, g_threads, g_calls, mux);
+		}
+		int status = 0;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+	}
+	return ret;
+}
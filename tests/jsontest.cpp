@@ -3,6 +3,7 @@
 // This file is part of Gromox.
 #include <cstdio>
 #include <cstring>
+#include <string>
 #include <json/value.h>
 #include <gromox/json.hpp>
 #include <gromox/mjson.hpp>
@@ -88,6 +89,37 @@ static int t_extparse(const char *s)
 	return EXIT_SUCCESS;
 }
 
+static int t_binparse(const char *s)
+{
+	Json::Value json, json2;
+	std::string bin;
+	if (!json_from_str(s, json) || !mjson_digest_pack(json, bin) ||
+	    !mjson_digest_is_binary(bin))
+		return EXIT_FAILURE;
+	if (!mjson_digest_unpack(bin, json2) || json != json2) {
+		fprintf(stderr, "binary digest roundtrip failed\n");
+		return EXIT_FAILURE;
+	}
+	MJSON m1, m2;
+	if (!m1.load_from_json(json) || !m2.load_from_digest(bin) ||
+	    m1.subject != m2.subject || m1.from != m2.from ||
+	    m1.size != m2.size || m1.charset != m2.charset) {
+		fprintf(stderr, "load_from_digest failed\n");
+		return EXIT_FAILURE;
+	}
+	std::string sa, sb;
+	mjson_io io;
+	if (m1.fetch_structure(io, "utf-8", true, sa) < 0 ||
+	    m2.fetch_structure(io, "utf-8", true, sb) < 0 || sa != sb) {
+		fprintf(stderr, "structures differ\n");
+		return EXIT_FAILURE;
+	}
+	bin[bin.size()/2] ^= 0xff;
+	bin.resize(bin.size() - 1);
+	m2.load_from_digest(bin); /* must not crash */
+	return EXIT_SUCCESS;
+}
+
 int main()
 {
 	MJSON_MIME m1, m2;
@@ -98,6 +130,9 @@ int main()
 		return EXIT_FAILURE;
 	if (t_extparse(tdata2) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
+	if (t_binparse(tdata1) != EXIT_SUCCESS ||
+	    t_binparse(tdata2) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 	if (t_digest() != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
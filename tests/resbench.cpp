@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Times content table loads with restrictions of various shapes. Run it
+ * once with exmdb_compile_restrictions=no and once with =yes in
+ * exmdb_provider.cfg (reload the server in between; the setting applies to
+ * newly loaded tables) to compare the interpreter with compiled plans.
+ *
+ * With -g, that many synthetic messages are first written into the folder,
+ * e.g. -g 100000 to obtain a 100k-message store.
+ *
+ * resbench [-g count] [-f folder_id] [-n rounds] storedir
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <libHX/option.h>
+#include <gromox/element_data.hpp>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/paths.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+
+static unsigned int g_generate, g_rounds = 5;
+static unsigned long long g_folder = PRIVATE_FID_INBOX;
+static constexpr struct HXoption g_options_table[] = {
+	{nullptr, 'f', HXTYPE_ULLONG, &g_folder, nullptr, nullptr, 0, "Folder to work in (default: inbox)", "ID"},
+	{nullptr, 'g', HXTYPE_UINT, &g_generate, nullptr, nullptr, 0, "Write this many synthetic messages first", "N"},
+	{nullptr, 'n', HXTYPE_UINT, &g_rounds, nullptr, nullptr, 0, "Table loads per restriction (default: 5)", "N"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+/* Delivery times are spaced one minute apart from here */
+static constexpr uint64_t base_nttime = 133000000000000000ULL;
+
+static int generate(const char *dir, uint64_t folder_id, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; ++i) {
+		std::unique_ptr<MESSAGE_CONTENT, mc_delete> ctnt(message_content_init());
+		if (ctnt == nullptr)
+			return -1;
+		char subject[32];
+		snprintf(subject, std::size(subject), "resbench %u", i);
+		uint32_t importance = i % 3, flag_status = 2;
+		uint64_t dtime = base_nttime + 600000000ULL * i;
+		auto &props = ctnt->proplist;
+		if (props.set(PR_MESSAGE_CLASS, "IPM.Note") != 0 ||
+		    props.set(PR_SUBJECT, subject) != 0 ||
+		    props.set(PR_IMPORTANCE, &importance) != 0 ||
+		    props.set(PR_MESSAGE_DELIVERY_TIME, &dtime) != 0 ||
+		    (i % 10 == 0 && props.set(PR_FLAG_STATUS, &flag_status) != 0))
+			return -1;
+		ec_error_t e_result = ecRpcFailed;
+		if (!exmdb_client::write_message(dir, CP_UTF8, folder_id,
+		    ctnt.get(), &e_result) || e_result != ecSuccess) {
+			fprintf(stderr, "write_message failed at #%u\n", i);
+			return -1;
+		}
+		if (i % 10000 == 9999)
+			fprintf(stderr, "%u messages written\n", i + 1);
+	}
+	return 0;
+}
+
+static int measure(const char *dir, uint64_t folder_id, const char *name,
+    const RESTRICTION *res)
+{
+	std::vector<double> ms;
+	uint32_t rows = 0;
+	for (unsigned int r = 0; r < g_rounds; ++r) {
+		uint32_t table_id = 0;
+		auto t0 = std::chrono::steady_clock::now();
+		if (!exmdb_client::load_content_table(dir, CP_UTF8, folder_id,
+		    nullptr, TABLE_FLAG_NONOTIFICATIONS, res, nullptr,
+		    &table_id, &rows)) {
+			fprintf(stderr, "%s: load_content_table failed\n", name);
+			return -1;
+		}
+		auto t1 = std::chrono::steady_clock::now();
+		exmdb_client::unload_table(dir, table_id);
+		ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	std::sort(ms.begin(), ms.end());
+	printf("%-14s rows=%-7u min=%.1fms median=%.1fms\n", name, rows,
+	       ms.front(), ms[ms.size() / 2]);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (argc != 2 || g_rounds == 0) {
+		fprintf(stderr, "Usage: %s [options] storedir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto dir = argv[1];
+	exmdb_client_init(1, 0);
+	auto cl_1 = make_scope_exit(exmdb_client_stop);
+	if (exmdb_client_run(PKGSYSCONFDIR) != 0)
+		return EXIT_FAILURE;
+	auto folder_id = rop_util_make_eid_ex(1, g_folder);
+	if (g_generate > 0 && generate(dir, folder_id, g_generate) != 0)
+		return EXIT_FAILURE;
+
+	/* Scalar test, fully pushed down */
+	uint32_t imp_high = IMPORTANCE_HIGH;
+	RESTRICTION_PROPERTY rp_imp = {RELOP_EQ, PR_IMPORTANCE, {PR_IMPORTANCE, &imp_high}};
+	RESTRICTION r_imp = {RES_PROPERTY, {&rp_imp}};
+
+	/* Pushed-down range plus a substring test that is not */
+	uint64_t dt_mid = base_nttime + 600000000ULL * (g_generate / 2);
+	RESTRICTION_PROPERTY rp_dt = {RELOP_GE, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, &dt_mid}};
+	RESTRICTION_CONTENT rc_7 = {FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT, {PR_SUBJECT, deconst("7")}};
+	RESTRICTION r_mix[] = {{RES_PROPERTY, {&rp_dt}}, {RES_CONTENT, {&rc_7}}};
+	RESTRICTION_AND_OR ra_mix = {std::size(r_mix), r_mix};
+	RESTRICTION r_and = {RES_AND, {&ra_mix}};
+
+	/* Same property tested several times */
+	RESTRICTION_CONTENT rc_a = {FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT, {PR_SUBJECT, deconst("11")}};
+	RESTRICTION_CONTENT rc_b = {FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT, {PR_SUBJECT, deconst("22")}};
+	RESTRICTION_CONTENT rc_c = {FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT, {PR_SUBJECT, deconst("33")}};
+	RESTRICTION r_ors[] = {{RES_CONTENT, {&rc_a}}, {RES_CONTENT, {&rc_b}}, {RES_CONTENT, {&rc_c}}};
+	RESTRICTION_AND_OR ra_or = {std::size(r_ors), r_ors};
+	RESTRICTION r_or = {RES_OR, {&ra_or}};
+
+	/* Flagged messages */
+	RESTRICTION_EXIST re_flag = {PR_FLAG_STATUS};
+	RESTRICTION_BITMASK rb_flag = {BMR_NEZ, PR_FLAG_STATUS, 2};
+	RESTRICTION r_flg[] = {{RES_EXIST, {&re_flag}}, {RES_BITMASK, {&rb_flag}}};
+	RESTRICTION_AND_OR ra_flg = {std::size(r_flg), r_flg};
+	RESTRICTION r_flag = {RES_AND, {&ra_flg}};
+
+	if (measure(dir, folder_id, "none", nullptr) != 0 ||
+	    measure(dir, folder_id, "property", &r_imp) != 0 ||
+	    measure(dir, folder_id, "and-mixed", &r_and) != 0 ||
+	    measure(dir, folder_id, "or-content", &r_or) != 0 ||
+	    measure(dir, folder_id, "exist-bitmask", &r_flag) != 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
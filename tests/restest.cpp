@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Checks that compiled restriction plans (res_plan) select exactly the same
+ * messages as the interpreter (cu_eval_msg_restriction). A small store is
+ * built in memory; every restriction is then evaluated per message with
+ * both, and once more the way a bulk scan does it (prefilter in SQL, the
+ * remainder of the plan on the rows it lets through).
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/mapitags.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "../exch/exmdb/db_engine.hpp"
+
+using namespace gromox;
+using LLU = unsigned long long;
+
+static constexpr uint64_t t_folder = 0x100, t_count = 240;
+static constexpr uint64_t base_nttime = 133000000000000000ULL;
+
+static int t_populate(sqlite3 *db)
+{
+	if (dbop_sqlite_create(db, sqlite_kind::pvt, 0) != 0)
+		return -1;
+	auto stm = gx_sql_prep(db, "INSERT INTO folders (folder_id, parent_id,"
+	           " change_number, cur_eid, max_eid) VALUES (?, NULL, 1, 1, 1)");
+	if (stm == nullptr)
+		return -1;
+	stm.bind_int64(1, t_folder);
+	if (stm.step() != SQLITE_DONE)
+		return -1;
+	auto mst = gx_sql_prep(db, "INSERT INTO messages (message_id, parent_fid,"
+	           " is_associated, change_number, read_state, message_size)"
+	           " VALUES (?,?,?,?,?,?)");
+	auto pst = gx_sql_prep(db, "INSERT INTO message_properties"
+	           " (message_id, proptag, propval) VALUES (?,?,?)");
+	if (mst == nullptr || pst == nullptr)
+		return -1;
+	auto prop = [&](uint64_t mid, uint32_t tag, auto &&bind) {
+		pst.bind_int64(1, mid);
+		pst.bind_int64(2, tag);
+		bind();
+		auto ok = pst.step() == SQLITE_DONE;
+		pst.reset();
+		return ok;
+	};
+	for (uint64_t i = 0; i < t_count; ++i) {
+		auto mid = 0x1000 + i;
+		mst.bind_int64(1, mid);
+		mst.bind_int64(2, t_folder);
+		mst.bind_int64(3, i % 17 == 0);
+		mst.bind_int64(4, 0x2000 + i);
+		mst.bind_int64(5, i % 2);
+		mst.bind_int64(6, 500 + 37 * i);
+		if (mst.step() != SQLITE_DONE)
+			return -1;
+		mst.reset();
+		auto subject = fmt::format("restest {} {}", i, i % 3 == 0 ? "Report" : "note");
+		/* Some times have the high bit set to exercise unsigned compares */
+		uint64_t dtime = i % 11 == 0 ? 0x8000000000000000ULL + i :
+		                 base_nttime + 600000000ULL * i;
+		if (!prop(mid, PR_NORMALIZED_SUBJECT, [&]() { pst.bind_text(3, subject); }) ||
+		    !prop(mid, PR_MESSAGE_DELIVERY_TIME, [&]() { pst.bind_int64(3, dtime); }) ||
+		    (i % 4 != 0 && !prop(mid, PR_IMPORTANCE, [&]() { pst.bind_int64(3, i % 3); })) ||
+		    (i % 5 == 0 && !prop(mid, PR_FLAG_STATUS, [&]() { pst.bind_int64(3, i % 10 == 0 ? 2 : 1); })) ||
+		    (i % 6 == 0 && !prop(mid, PR_SENSITIVITY, [&]() { pst.bind_int64(3, i % 4); })) ||
+		    (i % 7 == 0 && !prop(mid, PR_READ_RECEIPT_REQUESTED, [&]() { pst.bind_int64(3, i % 2); })) ||
+		    (i % 9 == 0 && !prop(mid, PR_SEARCH_KEY, [&]() { pst.bind_blob(3, &i, sizeof(i)); })) ||
+		    (i % 8 != 0 && !prop(mid, PR_MESSAGE_CLASS, [&]() { pst.bind_text(3, "IPM.Note.Custom"); })))
+			return -1;
+	}
+	return 0;
+}
+
+/* Compare plan and interpreter for @r on all messages of the fixture. */
+static int t_compare(sqlite3 *db, const char *name, const RESTRICTION &r)
+{
+	auto plan = res_plan::compile(&r);
+	if (plan == nullptr) {
+		printf("%s: compile failed\n", name);
+		return -1;
+	}
+	std::set<uint64_t> want, got, bulk;
+	for (uint64_t mid = 0x1000; mid < 0x1000 + t_count; ++mid) {
+		if (cu_eval_msg_restriction(db, CP_UTF8, mid, &r))
+			want.insert(mid);
+		if (plan->eval(db, CP_UTF8, mid))
+			got.insert(mid);
+	}
+	std::string q = fmt::format("SELECT message_id FROM messages"
+	                " WHERE parent_fid={}", t_folder);
+	if (!plan->prefilter().empty())
+		q = "SELECT x.message_id FROM (" + q + ") AS x WHERE " + plan->prefilter();
+	auto stm = gx_sql_prep(db, q.c_str());
+	if (stm == nullptr) {
+		printf("%s: bad prefilter: %s\n", name, plan->prefilter().c_str());
+		return -1;
+	}
+	while (stm.step() == SQLITE_ROW) {
+		auto mid = stm.col_uint64(0);
+		if (plan->eval(db, CP_UTF8, mid, !plan->prefilter().empty()))
+			bulk.insert(mid);
+	}
+	printf("%-16s %3zu matches%s\n", name, want.size(),
+	       plan->prefilter().empty() ? "" : " (prefiltered)");
+	if (got != want || bulk != want) {
+		printf("%s: interpreter %zu, plan %zu, bulk %zu matches\n",
+		       name, want.size(), got.size(), bulk.size());
+		for (auto mid : want)
+			if (got.count(mid) == 0 || bulk.count(mid) == 0)
+				printf("\tmissing %llxh\n", LLU{mid});
+		for (auto mid : got)
+			if (want.count(mid) == 0)
+				printf("\textra %llxh\n", LLU{mid});
+		for (auto mid : bulk)
+			if (want.count(mid) == 0)
+				printf("\textra (bulk) %llxh\n", LLU{mid});
+		return -1;
+	}
+	return 0;
+}
+
+int main()
+{
+	if (sqlite3_initialize() != SQLITE_OK)
+		return EXIT_FAILURE;
+	auto cl_0 = make_scope_exit(sqlite3_shutdown);
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK)
+		return EXIT_FAILURE;
+	auto cl_1 = make_scope_exit([&]() { sqlite3_close(db); });
+	if (t_populate(db) != 0) {
+		printf("could not build the fixture store\n");
+		return EXIT_FAILURE;
+	}
+	exmdb_server::build_env(EM_PRIVATE, "/nonexistent");
+	auto cl_2 = make_scope_exit(exmdb_server::free_env);
+
+	uint32_t imp_high = IMPORTANCE_HIGH, imp_norm = IMPORTANCE_NORMAL, size_k = 4000;
+	uint64_t dt_mid = base_nttime + 600000000ULL * (t_count / 2);
+	uint64_t dt_hi = 0x8000000000000000ULL + 100;
+	uint8_t yes = 1;
+	RESTRICTION_PROPERTY rp_imp_eq = {RELOP_EQ, PR_IMPORTANCE, {PR_IMPORTANCE, &imp_high}};
+	RESTRICTION_PROPERTY rp_imp_ne = {RELOP_NE, PR_IMPORTANCE, {PR_IMPORTANCE, &imp_high}};
+	RESTRICTION_PROPERTY rp_imp_lt = {RELOP_LT, PR_IMPORTANCE, {PR_IMPORTANCE, &imp_norm}};
+	RESTRICTION_PROPERTY rp_imp_ge = {RELOP_GE, PR_IMPORTANCE, {PR_IMPORTANCE, &imp_norm}};
+	RESTRICTION_PROPERTY rp_dt_ge = {RELOP_GE, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, &dt_mid}};
+	RESTRICTION_PROPERTY rp_dt_lt = {RELOP_LT, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, &dt_hi}};
+	RESTRICTION_PROPERTY rp_dt_gt = {RELOP_GT, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, &dt_hi}};
+	RESTRICTION_PROPERTY rp_rrq = {RELOP_EQ, PR_READ_RECEIPT_REQUESTED, {PR_READ_RECEIPT_REQUESTED, &yes}};
+	RESTRICTION_PROPERTY rp_size = {RELOP_GT, PR_MESSAGE_SIZE, {PR_MESSAGE_SIZE, &size_k}};
+	RESTRICTION_PROPERTY rp_read = {RELOP_EQ, PR_READ, {PR_READ, &yes}};
+	RESTRICTION_PROPERTY rp_assoc = {RELOP_NE, PR_ASSOCIATED, {PR_ASSOCIATED, &yes}};
+	RESTRICTION_BITMASK rb_nez = {BMR_NEZ, PR_FLAG_STATUS, 2};
+	RESTRICTION_BITMASK rb_eqz = {BMR_EQZ, PR_FLAG_STATUS, 2};
+	RESTRICTION_BITMASK rb_flags = {BMR_NEZ, PR_MESSAGE_FLAGS, MSGFLAG_READ};
+	RESTRICTION_EXIST re_flag = {PR_FLAG_STATUS};
+	RESTRICTION_EXIST re_skey = {PR_SEARCH_KEY};
+	RESTRICTION_EXIST re_svreid = {PR_INSTANCE_SVREID};
+	RESTRICTION_EXIST re_msize = {PR_MESSAGE_SIZE};
+	RESTRICTION_EXIST re_mid = {PidTagMid};
+	RESTRICTION_CONTENT rc_report = {FL_SUBSTRING | FL_IGNORECASE, PR_SUBJECT, {PR_SUBJECT, deconst("report")}};
+	RESTRICTION_CONTENT rc_1 = {FL_SUBSTRING, PR_SUBJECT, {PR_SUBJECT, deconst("1")}};
+	RESTRICTION_CONTENT rc_2 = {FL_SUBSTRING, PR_SUBJECT, {PR_SUBJECT, deconst("22")}};
+	RESTRICTION_CONTENT rc_cls = {FL_FULLSTRING, PR_MESSAGE_CLASS, {PR_MESSAGE_CLASS, deconst("IPM.Note")}};
+	RESTRICTION_SIZE rs_subj = {RELOP_GT, PR_SUBJECT, 30};
+	RESTRICTION_PROPCOMPARE rpc_imp = {RELOP_GT, PR_IMPORTANCE, PR_SENSITIVITY};
+
+	RESTRICTION r_flag = {RES_BITMASK, {&rb_nez}};
+	RESTRICTION_NOT rn_flag = {r_flag};
+	RESTRICTION r_and1[] = {{RES_PROPERTY, {&rp_dt_ge}}, {RES_CONTENT, {&rc_report}}};
+	RESTRICTION r_and2[] = {{RES_EXIST, {&re_flag}}, {RES_BITMASK, {&rb_eqz}}, {RES_PROPERTY, {&rp_imp_ne}}};
+	RESTRICTION r_or1[] = {{RES_CONTENT, {&rc_1}}, {RES_CONTENT, {&rc_2}}, {RES_PROPERTY, {&rp_imp_eq}}};
+	RESTRICTION r_or2[] = {{RES_NOT, {&rn_flag}}, {RES_EXIST, {&re_skey}}};
+	RESTRICTION_AND_OR ra_and1 = {std::size(r_and1), r_and1};
+	RESTRICTION_AND_OR ra_and2 = {std::size(r_and2), r_and2};
+	RESTRICTION_AND_OR ra_or1 = {std::size(r_or1), r_or1};
+	RESTRICTION_AND_OR ra_or2 = {std::size(r_or2), r_or2};
+
+	const struct {
+		const char *name;
+		RESTRICTION r;
+	} cases[] = {
+		{"imp-eq", {RES_PROPERTY, {&rp_imp_eq}}},
+		{"imp-ne", {RES_PROPERTY, {&rp_imp_ne}}},
+		{"imp-lt", {RES_PROPERTY, {&rp_imp_lt}}},
+		{"imp-ge", {RES_PROPERTY, {&rp_imp_ge}}},
+		{"dtime-ge", {RES_PROPERTY, {&rp_dt_ge}}},
+		{"dtime-lt-hibit", {RES_PROPERTY, {&rp_dt_lt}}},
+		{"dtime-gt-hibit", {RES_PROPERTY, {&rp_dt_gt}}},
+		{"rrq-bool", {RES_PROPERTY, {&rp_rrq}}},
+		{"size-gt", {RES_PROPERTY, {&rp_size}}},
+		{"read", {RES_PROPERTY, {&rp_read}}},
+		{"not-assoc", {RES_PROPERTY, {&rp_assoc}}},
+		{"bm-nez", {RES_BITMASK, {&rb_nez}}},
+		{"bm-eqz", {RES_BITMASK, {&rb_eqz}}},
+		{"bm-msgflags", {RES_BITMASK, {&rb_flags}}},
+		{"exist-flag", {RES_EXIST, {&re_flag}}},
+		{"exist-binary", {RES_EXIST, {&re_skey}}},
+		{"exist-svreid", {RES_EXIST, {&re_svreid}}},
+		{"exist-msize", {RES_EXIST, {&re_msize}}},
+		{"exist-mid", {RES_EXIST, {&re_mid}}},
+		{"content", {RES_CONTENT, {&rc_report}}},
+		{"class-synth", {RES_CONTENT, {&rc_cls}}},
+		{"size-subject", {RES_SIZE, {&rs_subj}}},
+		{"propcompare", {RES_PROPCOMPARE, {&rpc_imp}}},
+		{"not-bitmask", {RES_NOT, {&rn_flag}}},
+		{"and-mixed", {RES_AND, {&ra_and1}}},
+		{"and-pushed", {RES_AND, {&ra_and2}}},
+		{"or-mixed", {RES_OR, {&ra_or1}}},
+		{"or-not", {RES_OR, {&ra_or2}}},
+	};
+	int ret = EXIT_SUCCESS;
+	for (const auto &c : cases)
+		if (t_compare(db, c.name, c.r) != 0)
+			ret = EXIT_FAILURE;
+	return ret;
+}
@@ -90,6 +90,9 @@ static ssize_t ck_indices_present(sqlite3 *db)
 		"message_properties.proptag_propval_index4",
 		"message_properties.message_property_index4",
 		"message_properties.mid_properties_index4",
+		"message_tombstones.fid_tombstones_index18",
+		"messages.parent_readcn_index18",
+		"messages.parent_cn_index18",
 		"messages.parent_read_assoc_index8",
 		"messages.parent_assoc_index8",
 		"messages.assoc_index8",
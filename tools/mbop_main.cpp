@@ -2,6 +2,8 @@
 // SPDX-FileCopyrightText: 2022-2024 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
@@ -9,6 +11,7 @@
 #include <future>
 #include <semaphore>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #include <libHX/io.h>
@@ -387,6 +390,51 @@ static int main(int argc, char **argv)
 
 }
 
+namespace backup {
+
+static char *g_rate_str;
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'r', HXTYPE_STRING, &g_rate_str, nullptr, nullptr, 0, "Limit the transfer to this many bytes per second", "SIZE"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_PARAM;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "mbop/backup: refusing to write an archive to a terminal\n");
+		return EXIT_PARAM;
+	}
+	uint64_t rate = g_rate_str != nullptr ? HX_strtoull_unit(g_rate_str, nullptr, 1024) : 0;
+	uint64_t session = 0;
+	auto next_ok = std::chrono::steady_clock::now();
+	do {
+		std::string data;
+		if (!exmdb_client::backup_read(g_storedir, session, rate,
+		    &session, &data)) {
+			fprintf(stderr, "mbop/backup: backup_read RPC failed\n");
+			return EXIT_FAILURE;
+		}
+		if (HXio_fullwrite(STDOUT_FILENO, data.data(), data.size()) < 0) {
+			fprintf(stderr, "mbop/backup: write: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (rate > 0 && session != 0) {
+			/* Pace without accumulating credit from a slow disk */
+			next_ok = std::max(next_ok, std::chrono::steady_clock::now() - std::chrono::seconds(1)) +
+			          std::chrono::microseconds(data.size() * 1000000 / rate);
+			std::this_thread::sleep_until(next_ok);
+		}
+	} while (session != 0);
+	return EXIT_SUCCESS;
+}
+
+}
+
 namespace set_locale {
 
 static const char *g_language;
@@ -533,11 +581,11 @@ static int cmd_parser(int, char **);
 
 static void command_overview()
 {
-	fprintf(stderr, "Commands:\n\tclear-photo clear-profile clear-rwz delmsg "
+	fprintf(stderr, "Commands:\n\tbackup cache-stats clear-photo clear-profile clear-rwz delmsg "
 		"echo-maildir echo-username "
-		"emptyfld get-freebusy get-photo get-websettings "
+		"emptyfld fts-rebuild get-freebusy get-photo get-websettings "
 		"get-websettings-persistent "
-		"get-websettings-recipients ping "
+		"get-websettings-recipients hotprops-disable hotprops-enable ping "
 		"purge-datafiles purge-softdelete recalc-sizes set-locale "
 		"set-photo set-websettings set-websettings-persistent "
 		"set-websettings-recipients unload vacuum\n");
@@ -599,6 +647,19 @@ static bool recalc_sizes(const char *dir)
 	return true;
 }
 
+static bool cache_stats(const char *dir)
+{
+	uint64_t mem = 0, hits = 0, misses = 0;
+	if (!exmdb_client::store_cache_stats(dir, &mem, &hits, &misses))
+		return false;
+	using LLU = unsigned long long;
+	auto total = hits + misses;
+	printf("Memory: %llu bytes\n", LLU{mem});
+	printf("Page cache: %llu hits, %llu misses (%.1f%% hit ratio)\n",
+	       LLU{hits}, LLU{misses}, total > 0 ? 100.0 * hits / total : 0.0);
+	return true;
+}
+
 static int main(int argc, char **argv)
 {
 	bool ok = false;
@@ -608,6 +669,12 @@ static int main(int argc, char **argv)
 	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
 	if (strcmp(argv[0], "purge-datafiles") == 0)
 		ok = exmdb_client::purge_datafiles(g_storedir);
+	else if (strcmp(argv[0], "fts-rebuild") == 0)
+		ok = exmdb_client::fts_rebuild(g_storedir);
+	else if (strcmp(argv[0], "hotprops-enable") == 0)
+		ok = exmdb_client::hotprops_setup(g_storedir, HOTPROPS_ENABLE);
+	else if (strcmp(argv[0], "hotprops-disable") == 0)
+		ok = exmdb_client::hotprops_setup(g_storedir, 0);
 	else if (strcmp(argv[0], "echo-username") == 0) {
 		printf("%s\n", g_storedir);
 		ok = true;
@@ -622,6 +689,8 @@ static int main(int argc, char **argv)
 		ok = exmdb_client::vacuum(g_storedir);
 	else if (strcmp(argv[0], "recalc-sizes") == 0)
 		ok = recalc_sizes(g_storedir);
+	else if (strcmp(argv[0], "cache-stats") == 0)
+		ok = cache_stats(g_storedir);
 	else {
 		fprintf(stderr, "Unrecognized subcommand \"%s\"\n", argv[0]);
 		return EXIT_PARAM;
@@ -1098,6 +1167,8 @@ static int cmd_parser(int argc, char **argv)
 		return EXIT_FAILURE;
 	if (strcmp(argv[0], "(") == 0)
 		return parens_parser(argc, argv);
+	else if (strcmp(argv[0], "backup") == 0)
+		return backup::main(argc, argv);
 	else if (strcmp(argv[0], "delmsg") == 0)
 		return delmsg::main(argc, argv);
 	else if (strcmp(argv[0], "emptyfld") == 0)